@@ -121,6 +121,12 @@ class CoreExport Channel : public Extensible
 	bool IsModeSet(ModeHandler& mode) { return IsModeSet(&mode); }
 	bool IsModeSet(ChanModeReference& mode);
 
+	/** Check if any of a set of modes is set on this channel
+	 * @param mask The ids of the modes to check for
+	 * @return True if at least one of the modes is set
+	 */
+	bool IsAnyModeSet(const std::bitset<ModeParser::MODEID_MAX>& mask) const { return (modes & mask).any(); }
+
 	/** Returns the parameter for a custom mode on a channel.
 	  * @param mode The mode character you wish to query
 	  *
@@ -281,6 +281,25 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
  private:
 	typedef std::vector<std::pair<SerializedInfo, SerializedMessage> > SerializedList;
 
+	/** Identifies the serialized form of the message which is sent to users with a specific tag profile. */
+	struct ProfileInfo
+	{
+		const Serializer* serializer;
+		intptr_t tagprofile;
+
+		/** Index of the serialized message in serlist. */
+		size_t index;
+	};
+	typedef std::vector<ProfileInfo> ProfileList;
+
+	/** Whether the tag selection for a user only depends on their tag profile. */
+	enum ProfileState
+	{
+		PROFILE_UNKNOWN,
+		PROFILE_YES,
+		PROFILE_NO
+	};
+
 	ParamList params;
 	TagMap tags;
 	std::string command;
@@ -288,6 +307,18 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 	mutable SerializedList serlist;
 	bool sideeffect;
 
+	/** Serialized forms of this message for each tag profile it has been sent to. */
+	ProfileList proflist;
+
+	/** Whether all tags on this message come from providers which only look at the tag profile of the user. */
+	ProfileState profilestate;
+
+	/** Find or create the serialized form of the message matching a SerializedInfo.
+	 * @param serializeinfo Information about which exact serialized form of the message is the caller asking for.
+	 * @return Index of the serialized message in serlist.
+	 */
+	size_t GetSerializedIndex(const SerializedInfo& serializeinfo) const;
+
  protected:
 	/** Set command string.
 	 * @param cmd Command string to set.
@@ -310,6 +341,7 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 		, command(cmd ? cmd : std::string())
 		, msginit_done(false)
 		, sideeffect(false)
+		, profilestate(PROFILE_UNKNOWN)
 	{
 		params.reserve(8);
 		serlist.reserve(8);
@@ -327,6 +359,7 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 		, command(cmd ? cmd : std::string())
 		, msginit_done(false)
 		, sideeffect(false)
+		, profilestate(PROFILE_UNKNOWN)
 	{
 		params.reserve(8);
 		serlist.reserve(8);
@@ -397,6 +430,7 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 	void AddTag(const std::string& tagname, MessageTagProvider* tagprov, const std::string& val, void* tagdata = NULL)
 	{
 		tags.insert(std::make_pair(tagname, MessageTagData(tagprov, val, tagdata)));
+		InvalidateCache();
 	}
 
 	/** Add all tags in a TagMap to the tags in this message. Existing tags will not be overwritten.
@@ -405,6 +439,7 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 	void AddTags(const ClientProtocol::TagMap& newtags)
 	{
 		tags.insert(newtags.begin(), newtags.end());
+		InvalidateCache();
 	}
 
 	/** Get the message in a serialized form.
@@ -432,6 +467,8 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 	void InvalidateCache()
 	{
 		serlist.clear();
+		proflist.clear();
+		profilestate = PROFILE_UNKNOWN;
 	}
 
 	void CopyAll()
@@ -571,6 +608,17 @@ class ClientProtocol::MessageTagProvider : public Events::ModuleEventListener
 	 * @return True if the tag should be sent to the user, false otherwise.
 	 */
 	virtual bool ShouldSendTag(LocalUser* user, const MessageTagData& tagdata) = 0;
+
+	/** Determines whether ShouldSendTag() only depends on the tag profile of the user (i.e. on which
+	 * capabilities they have enabled) and has no side effects. If all tags of a message come from
+	 * providers which return true here the message is only serialized once per tag profile instead
+	 * of once per user. The default implementation returns false.
+	 * @return True if ShouldSendTag() only depends on LocalUser::tagprofile, false otherwise.
+	 */
+	virtual bool UsesTagProfile() const
+	{
+		return false;
+	}
 };
 
 /** Base class for client protocol event hooks.
@@ -723,7 +771,8 @@ class CoreExport ClientProtocol::Serializer : public DataProvider
 	/** Parse a protocol message from wire format.
 	 * @param user Source of the message.
 	 * @param line Raw protocol message.
-	 * @param parseoutput Output of the parser.
+	 * @param parseoutput Output of the parser. This may still contain the output of an earlier call, all of which
+	 * must be replaced. Parameter strings can be assigned to instead of being recreated to reuse their storage.
 	 * @return True if the message was parsed successfully into parseoutput and should be processed, false to drop the message.
 	 */
 	virtual bool Parse(LocalUser* user, const std::string& line, ParseOutput& parseoutput) = 0;
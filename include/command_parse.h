@@ -22,6 +22,8 @@
 
 #pragma once
 
+#include "perfecthash.h"
+
 /** This class handles command management and parsing.
  * It allows you to add and remove commands from the map,
  * call command handlers by name, and chop up comma seperated
@@ -44,6 +46,22 @@ class CoreExport CommandParser
 	 */
 	CommandMap cmdlist;
 
+	/** The commands in cmdlist keyed by their exact name so that the uppercase command
+	 * names sent by clients can be found with a single probe.
+	 */
+	insp::perfect_hash_map<Command*> fastcmdlist;
+
+	/** Whether cmdlist has changed since fastcmdlist was last built. */
+	bool fastcmdlistdirty;
+
+	/** The parser output which is reused for every line that is not processed while another
+	 * line is already being processed, so that parsing a line does not have to allocate.
+	 */
+	ClientProtocol::ParseOutput parsebuffer;
+
+	/** The number of lines which are currently being processed. */
+	unsigned int parsedepth;
+
  public:
 	/** Default constructor.
 	 */
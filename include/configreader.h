@@ -201,6 +201,84 @@ class CoreExport OperInfo : public refcountbase
 	void init();
 };
 
+/** Indexes the connect classes on the ports and hosts they allow so that LocalUser::SetClass()
+ * only has to check the classes which can match a user.
+ *
+ * Classes are grouped into one bucket per port which is listed in a port restriction and a
+ * bucket for classes without a port restriction. Within a bucket classes which allow any host
+ * are always candidates, classes with a CIDR range are looked up for each prefix length in use,
+ * classes with a host or IP address that does not contain wildcards are looked up by the
+ * folded address and all other classes are matched one by one. The candidates are returned in
+ * configuration order so that the first one which passes the remaining checks is the same class
+ * a linear walk would have picked. Named classes are never candidates. Only modules which
+ * implement OnForceConnectClass make LocalUser::SetClass() check every class.
+ */
+class CoreExport ConnectClassIndex
+{
+	/** The classes which are selected for a port. Values are positions in ServerConfig::Classes. */
+	struct Bucket
+	{
+		typedef TR1NS::unordered_multimap<std::string, size_t, TR1NS::hash<std::string> > HostMap;
+
+		/** Classes which allow any host. */
+		std::vector<size_t> any;
+
+		/** Classes with a host or IP address that does not contain wildcards, keyed by the folded mask. */
+		HostMap hosts;
+
+		/** Classes with a CIDR range as their host mask. */
+		irc::sockets::cidr_index<size_t> ranges;
+
+		/** Classes with any other host mask which have to be matched one by one. */
+		std::vector<size_t> unindexed;
+
+		/** Adds the classes in this bucket which can match a user to a list. */
+		void Find(LocalUser* user, const std::vector<ConnectClass*>& classes, const unsigned char* map, std::vector<size_t>& out) const;
+	};
+
+	/** The classes which have been indexed. */
+	std::vector<ConnectClass*> classes;
+
+	/** Classes which do not have a port restriction. */
+	Bucket anyport;
+
+	/** Classes which have a port restriction, keyed by port. */
+	std::map<int, Bucket> ports;
+
+	/** Classes keyed by name. */
+	std::map<std::string, ConnectClass*> names;
+
+	/** The case map which the index was built with. */
+	const unsigned char* map;
+
+	/** The value of national_case_insensitive_generation when the index was built or 0 if it has not been built yet. */
+	unsigned long casemapgen;
+
+	/** Adds a class to a bucket. */
+	void Add(Bucket& bucket, size_t pos);
+
+	/** Builds the index of a list of connect classes. */
+	void Build(const std::vector<reference<ConnectClass> >& list);
+
+ public:
+	ConnectClassIndex();
+
+	/** Finds the connect classes which a user may be placed into based on their port and host.
+	 * The index is built the first time it is used and rebuilt if the case map has changed.
+	 * @param user The user to find classes for.
+	 * @param list The connect classes in configuration order.
+	 * @param out The list to add the classes to. The classes are added in configuration order.
+	 */
+	void Find(LocalUser* user, const std::vector<reference<ConnectClass> >& list, std::vector<ConnectClass*>& out);
+
+	/** Finds a connect class by name.
+	 * @param name The name of the class.
+	 * @param list The connect classes in configuration order.
+	 * @return The class with the given name or NULL if there is none.
+	 */
+	ConnectClass* Find(const std::string& name, const std::vector<reference<ConnectClass> >& list);
+};
+
 /** This class holds the bulk of the runtime configuration for the ircd.
  * It allows for reading new config values, accessing configuration files,
  * and storage of the configuration data needed to run the ircd, such as
@@ -368,6 +446,9 @@ class CoreExport ServerConfig
 	/** The number of seconds that the server clock can skip by before server operators are warned. */
 	time_t TimeSkipWarn;
 
+	/** Whether the time spent dispatching each module hook is measured for /STATS h. */
+	bool ProfileHooks;
+
 	/** True if we're going to hide ban reasons for non-opers (e.g. G-lines,
 	 * K-lines, Z-lines)
 	 */
@@ -388,6 +469,10 @@ class CoreExport ServerConfig
 	 */
 	ClassVector Classes;
 
+	/** Index of Classes which is used to choose the class of connecting users.
+	 */
+	ConnectClassIndex ClassIndex;
+
 	/** Default channel modes
 	 */
 	std::string DefaultModes;
@@ -163,6 +163,10 @@ class CoreExport CommandBase : public ServiceProvider
 	 */
 	unsigned long use_count;
 
+	/** The total time in microseconds spent in the handler of this command.
+	 */
+	uint64_t use_time;
+
 	/** True if the command can be issued before registering
 	 */
 	bool works_before_reg;
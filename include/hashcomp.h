@@ -54,6 +54,12 @@
  */
 CoreExport extern unsigned const char *national_case_insensitive_map;
 
+/** Incremented whenever national_case_insensitive_map is replaced or the table it points to is
+ * modified. Anything which is built with the case map can compare this to find out whether it
+ * has to be rebuilt as comparing the pointer does not notice tables which are modified in place.
+ */
+CoreExport extern unsigned long national_case_insensitive_generation;
+
 /** A mapping of uppercase to lowercase, including scandinavian
  * 'oddities' as specified by RFC1459, e.g. { -> [, and | -> \
  */
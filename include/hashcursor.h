@@ -0,0 +1,121 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <vector>
+
+namespace insp
+{
+
+/** A position in a walk over an unordered map which can be resumed after the map has been
+ * modified, without having to copy the keys of the entries which have not been visited yet.
+ *
+ * The map is walked one bucket at a time so the position is just the index of the next
+ * bucket. If the map is rehashed while the walk is paused the buckets which have been
+ * visited no longer hold the entries which have been visited, so the cursor remembers the
+ * bucket counts it has walked over and skips the entries which it visited under one of
+ * them. An entry is only visited once as long as its key does not change; callers which
+ * allow keys to change can use visited() to find out whether an entry has to be skipped
+ * or visited separately. Entries which are added during the walk may or may not be visited.
+ */
+template <typename Map>
+class hash_cursor
+{
+	/** A bucket count which the map had and the number of buckets visited while it had it. */
+	typedef std::pair<size_t, size_t> Layout;
+
+	/** The layouts which the map had before it was rehashed during the walk. */
+	std::vector<Layout> previous;
+
+	/** The bucket count of the map when the last step of the walk was taken. */
+	size_t buckets;
+
+	/** The index of the next bucket to visit. */
+	size_t position;
+
+	/** Determines whether a hash was in a visited bucket of a layout. */
+	static bool InLayout(size_t hash, const Layout& layout)
+	{
+		return (hash % layout.first) < layout.second;
+	}
+
+	/** Determines whether a hash was in a visited bucket before the map was last rehashed. */
+	bool InPrevious(size_t hash) const
+	{
+		for (typename std::vector<Layout>::const_iterator i = previous.begin(); i != previous.end(); ++i)
+		{
+			if (InLayout(hash, *i))
+				return true;
+		}
+		return false;
+	}
+
+ public:
+	hash_cursor()
+		: buckets(0)
+		, position(0)
+	{
+	}
+
+	/** Determines whether the entry with the specified key has been visited.
+	 * @param map The map which is being walked.
+	 * @param key The key to check.
+	 * @return True if an entry with this key would already have been visited; otherwise, false.
+	 */
+	bool visited(const Map& map, const typename Map::key_type& key) const
+	{
+		const size_t hash = map.hash_function()(key);
+		return (buckets && InLayout(hash, Layout(buckets, position))) || InPrevious(hash);
+	}
+
+	/** Visits the entries in the next buckets of a map. The entries of a bucket are always
+	 * visited together so the walk can stop before the visitor has seen all of them.
+	 * @param map The map to walk.
+	 * @param visitor Called with each mapped value which has not been visited yet. Returns
+	 *                false if the walk should be paused once the current bucket is done.
+	 * @return True if the walk is finished; otherwise, false.
+	 */
+	template <typename Visitor>
+	bool step(const Map& map, Visitor& visitor)
+	{
+		if (map.bucket_count() != buckets)
+		{
+			if (position)
+				previous.push_back(Layout(buckets, position));
+			buckets = map.bucket_count();
+			position = 0;
+		}
+
+		bool more = true;
+		while (more && position < buckets)
+		{
+			for (typename Map::const_local_iterator i = map.begin(position); i != map.end(position); ++i)
+			{
+				if (!previous.empty() && InPrevious(map.hash_function()(i->first)))
+					continue;
+
+				if (!visitor(i->second))
+					more = false;
+			}
+			position++;
+		}
+		return position >= buckets;
+	}
+};
+
+}
@@ -51,6 +51,7 @@
 
 #include "intrusive_list.h"
 #include "flat_map.h"
+#include "shared_string.h"
 #include "compat.h"
 #include "aligned_storage.h"
 #include "typedefs.h"
@@ -89,7 +90,6 @@ struct fakederef
 #include "logger.h"
 #include "usermanager.h"
 #include "socket.h"
-#include "command_parse.h"
 #include "mode.h"
 #include "socketengine.h"
 #include "snomasks.h"
@@ -97,6 +97,7 @@ struct fakederef
 #include "message.h"
 #include "modules.h"
 #include "clientprotocol.h"
+#include "command_parse.h"
 #include "threadengine.h"
 #include "configreader.h"
 #include "inspstring.h"
@@ -145,6 +146,33 @@ class serverstats
 	/** Total bytes of data received
 	 */
 	unsigned long Recv;
+	/** Number of socket reads which filled the read buffer
+	 */
+	unsigned long FullReads;
+	/** Number of times the read size of a socket was increased
+	 */
+	unsigned long ReadGrows;
+	/** Number of times the read size of a socket was decreased
+	 */
+	unsigned long ReadShrinks;
+	/** Number of local users visited by the last background user pass
+	 */
+	unsigned long BackgroundUsers;
+	/** Time taken by the last background user pass in microseconds
+	 */
+	unsigned long BackgroundTime;
+	/** Longest time taken by a background user pass in microseconds
+	 */
+	unsigned long BackgroundTimeMax;
+	/** Number of times a connect class has been chosen for a local user
+	 */
+	unsigned long ClassSelections;
+	/** Total time spent choosing connect classes in microseconds
+	 */
+	unsigned long ClassSelectionTime;
+	/** Longest time taken to choose a connect class in microseconds
+	 */
+	unsigned long ClassSelectionTimeMax;
 #ifdef _WIN32
 	/** Cpu usage at last sample
 	*/
@@ -167,7 +195,10 @@ class serverstats
 	 */
 	serverstats()
 		: Accept(0), Refused(0), Unknown(0), Collisions(0), Dns(0),
-		DnsGood(0), DnsBad(0), Connects(0), Sent(0), Recv(0)
+		DnsGood(0), DnsBad(0), Connects(0), Sent(0), Recv(0),
+		FullReads(0), ReadGrows(0), ReadShrinks(0),
+		BackgroundUsers(0), BackgroundTime(0), BackgroundTimeMax(0),
+		ClassSelections(0), ClassSelectionTime(0), ClassSelectionTimeMax(0)
 	{
 	}
 };
@@ -551,6 +582,11 @@ class CoreExport InspIRCd
 	 */
 	void Cleanup();
 
+	/** Retrieves the value of a monotonic clock in microseconds for timing how long something takes.
+	 * Unlike Time() this is not cached so it should only be used to measure durations.
+	 */
+	static uint64_t GetMicroseconds();
+
 	/** Return a time_t as a human-readable string.
 	 * @param format The format to retrieve the date/time in. See `man 3 strftime`
 	 * for more information. If NULL, "%a %b %d %T %Y" is assumed.
@@ -580,6 +616,12 @@ class CoreExport InspIRCd
 		return this->ReadBuffer;
 	}
 
+	/** Retrieves the size of the buffer returned by GetReadBuffer(). */
+	size_t GetReadBufferSize() const
+	{
+		return sizeof(this->ReadBuffer);
+	}
+
 	ClientProtocol::RFCEvents& GetRFCEvents() { return rfcevents; }
 };
 
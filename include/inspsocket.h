@@ -113,9 +113,10 @@ class CoreExport StreamSocket : public EventHandler
 	class SendQueue
 	{
 	 public:
-		/** One element of the queue, a continuous buffer
+		/** One element of the queue, a continuous buffer which may be shared with
+		 * the send queues of other sockets.
 		 */
-		typedef std::string Element;
+		typedef insp::shared_string Element;
 
 		/** Sequence container of buffers in the queue
 		 */
@@ -173,7 +174,7 @@ class CoreExport StreamSocket : public EventHandler
 		void erase_front(Element::size_type n)
 		{
 			nbytes -= n;
-			data.front().erase(0, n);
+			data.front().erase_front(n);
 		}
 
 		/** Insert a new buffer at the beginning of the queue
@@ -243,6 +244,18 @@ class CoreExport StreamSocket : public EventHandler
 	/** Error - if nonempty, the socket is dead, and this is the reason. */
 	std::string error;
 
+	/** The position in the recvq of the first line which has not been retrieved by
+	 * GetNextLine() yet. Lines are only erased from the recvq in one go once there
+	 * are none left so retrieving many lines does not move the recvq each time.
+	 */
+	std::string::size_type nextline;
+
+	/** The number of bytes to request from the next read or 0 to use the configured
+	 * network buffer size. Grows while reads keep filling the buffer and shrinks again
+	 * once they stop, see GetReadSize().
+	 */
+	size_t readsize;
+
 	/** Check if the socket has an error set, if yes, call OnError
 	 * @param err Error to pass to OnError()
 	 */
@@ -252,12 +265,6 @@ class CoreExport StreamSocket : public EventHandler
 	 */
 	void DoRead();
 
-	/** Send as much data contained in a SendQueue object as possible.
-	 * All data which successfully sent will be removed from the SendQueue.
-	 * @param sq SendQueue to flush
-	 */
-	void FlushSendQ(SendQueue& sq);
-
 	/** Read incoming data into a receive queue.
 	 * @param rq Receive queue to put incoming data into
 	 * @return < 0 on error or close, 0 if no new data is ready (but the socket is still connected), > 0 if data was read from the socket and put into the recvq
@@ -289,6 +296,8 @@ class CoreExport StreamSocket : public EventHandler
 		: closeonempty(false)
 		, closing(false)
 		, iohook(NULL)
+		, nextline(0)
+		, readsize(0)
 		, type(sstype)
 	{
 	}
@@ -300,6 +309,14 @@ class CoreExport StreamSocket : public EventHandler
 	 */
 	void DoWrite();
 
+	/** Send as much data contained in a SendQueue object as possible.
+	 * All data which successfully sent will be removed from the SendQueue.
+	 * This can be used by IOHooks which no longer need to change the data
+	 * written to the socket, e.g. once the kernel has taken over encryption.
+	 * @param sq SendQueue to flush
+	 */
+	void FlushSendQ(SendQueue& sq);
+
 	/** Called by the socket engine on a read event
 	 */
 	void OnEventHandlerRead() CXX11_OVERRIDE;
@@ -334,15 +351,32 @@ class CoreExport StreamSocket : public EventHandler
 	/** Send the given data out the socket, either now or when writes unblock
 	 */
 	void WriteData(const std::string& data);
+
+	/** Send the given shared buffer out the socket, either now or when writes unblock.
+	 * The buffer is queued without copying its contents.
+	 */
+	void WriteData(const SendQueue::Element& data);
 	/** Convenience function: read a line from the socket
+	 * The lines which have been read are removed from the recvq when this returns false,
+	 * so callers which access the recvq directly should read lines until that happens.
 	 * @param line The line read
 	 * @param delim The line delimiter
 	 * @return true if a line was read
 	 */
 	bool GetNextLine(std::string& line, char delim = '\n');
+	/** Retrieves the number of bytes which will be requested by the next read from this socket.
+	 * This starts at the configured network buffer size and doubles every time a read fills
+	 * the buffer, up to the size of the shared read buffer, so busy sockets such as server
+	 * links drain in fewer iterations of the main loop.
+	 */
+	size_t GetReadSize() const;
+
 	/** Useful for implementing sendq exceeded */
 	size_t getSendQSize() const;
 
+	/** Retrieves the number of bytes in the recvq which have not been processed yet. */
+	size_t getRecvQSize() const { return recvq.length() - nextline; }
+
 	SendQueue& GetSendQ() { return sendq; }
 
 	/**
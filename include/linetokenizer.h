@@ -0,0 +1,115 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstring>
+
+namespace insp
+{
+	class line_tokenizer;
+}
+
+/** Splits an IRC line into \<middle> and \<trailing> tokens in the same way as
+ * irc::tokenstream but without copying the line or the tokens. Tokens are returned
+ * as a pointer into the line and a length so the line must outlive the tokenizer.
+ */
+class insp::line_tokenizer
+{
+	/** The first character of the line. */
+	const char* const message;
+
+	/** The number of characters in the line. */
+	size_t length;
+
+	/** The current position within the line. */
+	size_t position;
+
+ public:
+	/** Creates a tokenizer for part of a line.
+	 * @param data The first character to tokenize.
+	 * @param len The number of characters to tokenize.
+	 */
+	line_tokenizer(const char* data, size_t len)
+		: message(data)
+		, length(len)
+		, position(0)
+	{
+	}
+
+	/** Retrieves the first character of the line. */
+	const char* data() const { return message; }
+
+	/** Retrieves the number of characters in the line. */
+	size_t size() const { return length; }
+
+	/** Shortens the line. Has no effect if the line is already shorter.
+	 * @param len The maximum number of characters in the line.
+	 */
+	void truncate(size_t len)
+	{
+		if (len < length)
+			length = len;
+	}
+
+	/** Retrieves the next \<middle> token.
+	 * @param token Set to the first character of the token.
+	 * @param len Set to the number of characters in the token.
+	 * @return True if a token was retrieved, false if there are no tokens left.
+	 */
+	bool get_middle(const char*& token, size_t& len)
+	{
+		if (position >= length)
+			return false;
+
+		token = message + position;
+		const char* separator = static_cast<const char*>(memchr(token, ' ', length - position));
+		if (!separator)
+		{
+			len = length - position;
+			position = length;
+			return true;
+		}
+
+		len = separator - token;
+		position += len;
+		while (position < length && message[position] == ' ')
+			position++;
+		return true;
+	}
+
+	/** Retrieves the next \<middle> or \<trailing> token.
+	 * @param token Set to the first character of the token.
+	 * @param len Set to the number of characters in the token.
+	 * @return True if a token was retrieved, false if there are no tokens left.
+	 */
+	bool get_trailing(const char*& token, size_t& len)
+	{
+		if (position >= length)
+			return false;
+
+		if (message[position] == ':')
+		{
+			token = message + position + 1;
+			len = length - position - 1;
+			position = length;
+			return true;
+		}
+
+		return get_middle(token, len);
+	}
+};
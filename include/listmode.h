@@ -19,6 +19,10 @@
 
 #pragma once
 
+#include "wildcard.h"
+
+class BanIndex;
+
 /** The base class for list modes, should be inherited.
  */
 class CoreExport ListModeBase : public ModeHandler
@@ -46,7 +50,17 @@ class CoreExport ListModeBase : public ModeHandler
 		ModeList list;
 		int maxitems;
 
-		ChanData() : maxitems(-1) { }
+		/** Changes whenever the list changes, see GetGeneration(). */
+		unsigned long generation;
+
+		/** The index of the list or NULL if it has not been built since the list last changed. */
+		BanIndex* index;
+
+		ChanData();
+		~ChanData();
+
+		/** Must be called whenever the list is changed. */
+		void Changed();
 	};
 
 	/** The number of items a listmode's list may contain
@@ -139,6 +153,20 @@ class CoreExport ListModeBase : public ModeHandler
 	 */
 	ModeList* GetList(Channel* channel);
 
+	/** Retrieves a number which changes whenever the list of the given channel changes. This
+	 * can be used to cache the results of matching users against the list.
+	 * @param channel Channel to get the generation of the list of
+	 * @return The generation of the list or 0 if the channel does not have a list
+	 */
+	unsigned long GetGeneration(Channel* channel);
+
+	/** Retrieves an index of the nick!user@host masks on the list of the given channel. The
+	 * index is built the first time it is needed after the list has changed.
+	 * @param channel Channel to get the index for
+	 * @return The index of the list or NULL if the channel does not have a list
+	 */
+	const BanIndex* GetBanIndex(Channel* channel);
+
 	/** Display the list for this mode
 	 * See mode.h
 	 * @param user The user to send the list to
@@ -223,3 +251,95 @@ inline ListModeBase::ModeList* ListModeBase::GetList(Channel* channel)
 
 	return &cd->list;
 }
+
+inline unsigned long ListModeBase::GetGeneration(Channel* channel)
+{
+	ChanData* cd = extItem.get(channel);
+	if (!cd)
+		return 0;
+
+	return cd->generation;
+}
+
+/** An index of the nick!user@host masks on a list which can tell whether any of them matches
+ * a user without checking every mask one by one. The masks are grouped by their host part:
+ * host parts without wildcards are looked up in a hash map, CIDR ranges are looked up for
+ * each prefix length in use and only host parts with wildcards are checked in turn. The
+ * nick!user part of every mask is compiled with insp::wildcard_mask.
+ *
+ * Matching a user against the index gives the same result as calling Channel::CheckBan()
+ * on every nick!user@host mask when no module implements OnCheckBan. Extbans never match
+ * the index, they are kept in a separate list so that they can be passed to OnCheckBan.
+ */
+class CoreExport BanIndex
+{
+	/** A nick!user@host mask on the list. */
+	struct Entry
+	{
+		/** The nick!user part of the mask. */
+		insp::wildcard_mask nickident;
+
+		/** The host part of the mask. Only used if the host part contains wildcards. */
+		insp::wildcard_mask host;
+	};
+
+	typedef TR1NS::unordered_multimap<std::string, size_t, TR1NS::hash<std::string> > HostMap;
+
+	/** The case map the index was built with. */
+	const unsigned char* map;
+
+	/** The value of national_case_insensitive_generation when the index was built. */
+	unsigned long casemapgen;
+
+	/** The masks on the list which can match users. */
+	std::vector<Entry> entries;
+
+	/** Entries with a host part that does not contain wildcards, keyed by the folded host part. */
+	HostMap hosts;
+
+	/** Entries with a CIDR range as their host part. */
+	irc::sockets::cidr_index<size_t> ranges;
+
+	/** Entries with a host part that contains wildcards. */
+	std::vector<size_t> wildcards;
+
+	/** Masks with more than one '@' which are matched the same way as Channel::CheckBan() does. */
+	std::vector<std::string> unindexed;
+
+	/** The extbans on the list. */
+	std::vector<std::string> extbans;
+
+	/** Folds a string with the case map of the index. */
+	std::string Fold(const std::string& str) const;
+
+	/** Determines whether any of the entries with a host part without wildcards match a user. */
+	bool MatchHost(const std::string& host, const std::string& nickident) const;
+
+ public:
+	/** Builds an index of a list.
+	 * @param list The list to index.
+	 * @param casemap The case map to compare characters with.
+	 */
+	BanIndex(const ListModeBase::ModeList& list, const unsigned char* casemap);
+
+	/** Determines whether the case map has been changed since the index was built. */
+	bool IsStale() const { return casemapgen != national_case_insensitive_generation; }
+
+	/** Determines whether any of the masks in the index match a user.
+	 * @param user The user to match against.
+	 * @return True if a mask matches the user; otherwise, false.
+	 */
+	bool Matches(User* user) const;
+
+	/** Determines whether any of the masks in the index match a nick!user and a host.
+	 * CIDR ranges are not checked. This is used by modules which give users another
+	 * host that they can be banned by (e.g. an unused cloak).
+	 * @param nickident The nick!user to match against.
+	 * @param host The host to match against.
+	 * @return True if a mask matches the nick!user and host; otherwise, false.
+	 */
+	bool Matches(const std::string& nickident, const std::string& host) const;
+
+	/** Retrieves the extbans on the list. */
+	const std::vector<std::string>& GetExtBans() const { return extbans; }
+};
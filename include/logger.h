@@ -49,11 +49,40 @@ class CoreExport FileWriter
 	 */
 	unsigned int writeops;
 
+	/** If non-empty then the strftime() pattern which the name of the log file is generated
+	 * from. The file is reopened whenever the pattern expands to a different name.
+	 */
+	std::string pattern;
+
+	/** The name of the currently open log file if pattern is not empty. */
+	std::string filename;
+
+	/** The number of lines which have been dropped since the last line was queued. */
+	unsigned long dropped;
+
+	/** Reopens the log file if the name it should have at the specified time has changed.
+	 * This is called from the log writer thread if it is enabled.
+	 */
+	void Rotate(time_t time);
+
+	friend class LogWriter;
+
  public:
 	/** The constructor takes an already opened logfile.
 	 */
 	FileWriter(FILE* logfile, unsigned int flushcount);
 
+	/** Opens a log file.
+	 * @param target The name of the log file. This may contain a strftime() pattern in which
+	 * case the file is reopened with a new name whenever the pattern expands to a different
+	 * name (e.g. at midnight if it contains the date).
+	 * @param flushcount The number of write operations after which the file is flushed.
+	 */
+	FileWriter(const std::string& target, unsigned int flushcount);
+
+	/** Determines whether the log file is open. */
+	bool IsOpen() const { return log != NULL; }
+
 	/** Write one or more preformatted log lines.
 	 * If the data cannot be written immediately,
 	 * this class will insert itself into the
@@ -63,12 +92,116 @@ class CoreExport FileWriter
 	 */
 	void WriteLogLine(const std::string &line);
 
+	/** Writes a log message. If the log writer thread is enabled then the message is queued
+	 * and formatted and written by that thread, otherwise it is written immediately.
+	 * @param time The time at which the message was logged.
+	 * @param type The type of the message.
+	 * @param msg The message.
+	 */
+	void Write(time_t time, const std::string& type, const std::string& msg);
+
 	/** Close the log file and cancel any events.
 	 */
 	virtual ~FileWriter();
 };
 
+/** Writes the messages logged to FileWriters from a background thread so that a slow disk
+ * can not stall the main loop.
+ *
+ * Messages are passed to the thread through a bounded single producer, single consumer
+ * ring buffer. Only the main thread may queue messages. If the ring buffer is full the
+ * message is dropped and a line saying how many messages were lost is written before the
+ * next message which could be queued. The thread formats the messages and writes all of
+ * the messages it finds queued in one go. Files are flushed as configured by their flush
+ * setting, the same as when the thread is not used.
+ */
+class CoreExport LogWriter
+{
+ public:
+	class Worker;
+
+ private:
+	/** A message which is waiting to be written. */
+	struct Entry
+	{
+		FileWriter* file;
+		time_t time;
+		std::string type;
+		std::string msg;
+	};
+
+	/** The thread which writes the messages or NULL if it is not running. */
+	Worker* worker;
+
+	/** The ring buffer of messages. The size is always a power of two. */
+	std::vector<Entry> entries;
+
+	/** The number of messages which have ever been queued. Only written by the main thread. */
+	volatile unsigned long head;
+
+	/** The number of messages which have ever been written. Only written by the worker. */
+	volatile unsigned long tail;
 
+	/** The number of messages which have been fully written to their files. Only written by the worker. */
+	volatile unsigned long completed;
+
+	/** Whether the worker is waiting for messages to be queued. */
+	volatile unsigned long sleeping;
+
+	/** Used to wake up the worker when messages are queued. */
+	ThreadQueueData queued;
+
+	/** Used to wake up the main thread when the worker has written some messages. */
+	ThreadQueueData written;
+
+	/** The number of messages which have been written by the worker. */
+	volatile unsigned long linecount;
+
+	/** The number of batches of messages which have been written by the worker. */
+	volatile unsigned long batchcount;
+
+	/** The number of messages which have been dropped because the queue was full. */
+	unsigned long dropcount;
+
+	/** Writes all of the messages which are currently queued. Called by the worker. */
+	void WriteBatch();
+
+ public:
+	LogWriter();
+	~LogWriter();
+
+	/** Determines whether the log writer thread is running. */
+	bool IsEnabled() const { return worker != NULL; }
+
+	/** Starts the log writer thread.
+	 * @param queuesize The maximum number of messages which can be queued.
+	 */
+	void Start(size_t queuesize);
+
+	/** Writes all queued messages and stops the log writer thread. */
+	void Stop();
+
+	/** Waits until all queued messages have been written. */
+	void Flush();
+
+	/** Queues a message to be written to a file.
+	 * @param file The file to write the message to.
+	 * @param time The time at which the message was logged.
+	 * @param type The type of the message.
+	 * @param msg The message.
+	 * @return True if the message was queued or false if the queue is full.
+	 */
+	bool Queue(FileWriter* file, time_t time, const std::string& type, const std::string& msg);
+
+	/** Retrieves the number of messages which have been written by the thread. */
+	unsigned long GetLineCount() const { return linecount; }
+
+	/** Retrieves the number of batches the thread has written messages in. */
+	unsigned long GetBatchCount() const { return batchcount; }
+
+	/** Retrieves the number of messages which have been dropped because the queue was full. */
+	unsigned long GetDropCount() const { return dropcount; }
+};
 
 /*
  * New world logging!
@@ -142,10 +275,17 @@ class CoreExport LogManager : public fakederef<LogManager>
 	 */
 	FileLogMap FileLogs;
 
+	/** Writes to the FileWriters from a background thread if enabled.
+	 */
+	LogWriter Writer;
+
  public:
 	LogManager();
 	~LogManager();
 
+	/** Retrieves the log writer thread which FileWriters queue their messages to. */
+	LogWriter& GetWriter() { return Writer; }
+
 	/** Adds a FileWriter instance to LogManager, or increments the reference count of an existing instance.
 	 * Used for file-stream sharing for FileLogStreams.
 	 */
@@ -54,6 +54,16 @@ class CoreExport Membership : public Extensible, public insp::intrusive_list_nod
 	 */
 	Id id;
 
+	/** The ban list generation and user cache generation which the cached ban status of this member
+	 * is valid for. Only Channel::IsBanned() should use these fields.
+	 */
+	unsigned long bangeneration;
+	unsigned int banusergeneration;
+
+	/** Whether this member was banned when the cached ban status was determined.
+	 */
+	bool banned;
+
 	/** Converts a string to a Membership::Id
 	 * @param str The string to convert
 	 * @return Raw value of type Membership::Id
@@ -68,7 +78,14 @@ class CoreExport Membership : public Extensible, public insp::intrusive_list_nod
 	 * Call Channel::JoinUser() or ForceJoin() to make a user join a channel instead of constructing
 	 * Membership objects directly.
 	 */
-	Membership(User* u, Channel* c) : user(u), chan(c) {}
+	Membership(User* u, Channel* c)
+		: user(u)
+		, chan(c)
+		, bangeneration(0)
+		, banusergeneration(0)
+		, banned(false)
+	{
+	}
 
 	/** Check if this member has a given prefix mode set
 	 * @param pm Prefix mode to check
@@ -107,21 +107,29 @@ struct ModResult {
  * and numerical comparisons in preprocessor macros if they wish to support
  * multiple versions of InspIRCd in one file.
  */
-#define INSPIRCD_VERSION_API 8
+#define INSPIRCD_VERSION_API 12
 
 /**
  * This #define allows us to call a method in all
  * loaded modules in a readable simple way, e.g.:
  * 'FOREACH_MOD(OnConnect,(user));'
  */
-#define FOREACH_MOD(y,x) do { \
+#define FOREACH_MOD(y,x) FOREACH_MOD_FILTERED(y,(),x)
+
+/**
+ * Calls a method in all loaded modules except for those which have a HookFilter
+ * for it that does not match the given user and channel, e.g.:
+ * 'FOREACH_MOD_FILTERED(OnUserJoin, (memb->user, memb->chan), (memb, sync, created, excepts));'
+ */
+#define FOREACH_MOD_FILTERED(y,subject,x) do { \
+	ModuleManager::HookDispatch _dispatch(I_ ## y, HookSubject subject); \
 	const Module::List& _handlers = ServerInstance->Modules->EventHandlers[I_ ## y]; \
 	for (Module::List::const_reverse_iterator _i = _handlers.rbegin(), _next; _i != _handlers.rend(); _i = _next) \
 	{ \
 		_next = _i+1; \
 		try \
 		{ \
-			if (!(*_i)->dying) \
+			if (!(*_i)->dying && _dispatch.Accept(*_i)) \
 				(*_i)->y x ; \
 		} \
 		catch (CoreException& modexcept) \
@@ -137,15 +145,18 @@ struct ModResult {
  *
  * See src/channels.cpp for an example of use.
  */
-#define DO_EACH_HOOK(n,v,args) \
+#define DO_EACH_HOOK(n,v,args) DO_EACH_HOOK_FILTERED(n,(),v,args)
+
+#define DO_EACH_HOOK_FILTERED(n,subject,v,args) \
 do { \
+	ModuleManager::HookDispatch _dispatch(I_ ## n, HookSubject subject); \
 	const Module::List& _handlers = ServerInstance->Modules->EventHandlers[I_ ## n]; \
 	for (Module::List::const_reverse_iterator _i = _handlers.rbegin(), _next; _i != _handlers.rend(); _i = _next) \
 	{ \
 		_next = _i+1; \
 		try \
 		{ \
-			if (!(*_i)->dying) \
+			if (!(*_i)->dying && _dispatch.Accept(*_i)) \
 				v = (*_i)->n args;
 
 #define WHILE_EACH_HOOK(n) \
@@ -164,9 +175,18 @@ do { \
  * Example: ModResult result;
  * FIRST_MOD_RESULT(OnUserPreNick, result, (user, newnick))
  */
-#define FIRST_MOD_RESULT(n,v,args) do { \
+#define FIRST_MOD_RESULT(n,v,args) FIRST_MOD_RESULT_FILTERED(n,(),v,args)
+
+/**
+ * Module result iterator which skips modules that have a HookFilter for the
+ * hook which does not match the given user and channel.
+ *
+ * Example: ModResult result;
+ * FIRST_MOD_RESULT_FILTERED(OnUserPreJoin, (user, chan), result, (user, chan, cname, privs, key))
+ */
+#define FIRST_MOD_RESULT_FILTERED(n,subject,v,args) do { \
 	v = MOD_RES_PASSTHRU; \
-	DO_EACH_HOOK(n,v,args) \
+	DO_EACH_HOOK_FILTERED(n,subject,v,args) \
 	{ \
 		if (v != MOD_RES_PASSTHRU) \
 			break; \
@@ -227,13 +247,138 @@ enum Implementation
 	I_OnPostTopicChange, I_OnPostConnect, I_OnPostDeoper,
 	I_OnPreChangeRealName, I_OnUserRegister, I_OnChannelPreDelete, I_OnChannelDelete,
 	I_OnPostOper, I_OnPostCommand, I_OnPostJoin,
-	I_OnBuildNeighborList, I_OnGarbageCollect, I_OnSetConnectClass,
+	I_OnBuildNeighborList, I_OnGarbageCollect, I_OnCheckConnectClass, I_OnForceConnectClass,
 	I_OnUserMessage, I_OnPassCompare, I_OnNumeric,
 	I_OnPreRehash, I_OnModuleRehash, I_OnChangeIdent, I_OnSetUserIP,
 	I_OnServiceAdd, I_OnServiceDel, I_OnUserWrite,
 	I_END
 };
 
+/** The user and channel which an event is about. Either can be NULL if the event
+ * is not about a user or a channel.
+ */
+struct HookSubject
+{
+	/** The user which caused the event. */
+	User* const user;
+
+	/** The channel which the event happened on. */
+	Channel* const chan;
+
+	HookSubject(User* u = NULL, Channel* c = NULL)
+		: user(u)
+		, chan(c)
+	{
+	}
+};
+
+/** Describes which events a module wants to be called for so that the core can skip
+ * calling it for events that it would ignore anyway. A filter which has no conditions
+ * matches every event. Conditions which can not be checked because the event does not
+ * have a user or channel, e.g. a channel mode when a message is sent to a user, are
+ * treated as matching so modules must still check everything themselves.
+ */
+class CoreExport HookFilter
+{
+ public:
+	typedef std::bitset<ModeParser::MODEID_MAX> ModeMask;
+
+ private:
+	/** Whether only local users should be matched. */
+	bool localonly;
+
+	/** The channel modes which the channel must have at least one of. */
+	ModeMask chanmodes;
+
+	/** The user modes which the user must have at least one of. */
+	ModeMask usermodes;
+
+	/** The extensions which the user must have at least one of. */
+	std::vector<ExtensionItem*> userexts;
+
+	/** Adds a mode to a mask.
+	 * @param mask The mask to add the mode to.
+	 * @param mh The mode to add. This must be registered.
+	 */
+	static void AddMode(ModeMask& mask, ModeHandler* mh);
+
+ public:
+	HookFilter()
+		: localonly(false)
+	{
+	}
+
+	/** Only match events caused by local users. */
+	HookFilter& LocalUsers()
+	{
+		localonly = true;
+		return *this;
+	}
+
+	/** Only match events on channels which have this mode or another one given to this
+	 * method set. The mode must already be registered and should be owned by the module
+	 * which is using the filter.
+	 * @param mh The channel mode to check for.
+	 */
+	HookFilter& ChannelMode(ModeHandler* mh)
+	{
+		AddMode(chanmodes, mh);
+		return *this;
+	}
+
+	/** Only match events caused by users which have this mode or another one given to
+	 * this method set. The mode must already be registered and should be owned by the
+	 * module which is using the filter.
+	 * @param mh The user mode to check for.
+	 */
+	HookFilter& UserMode(ModeHandler* mh)
+	{
+		AddMode(usermodes, mh);
+		return *this;
+	}
+
+	/** Only match events caused by users which have this extension or another one given
+	 * to this method set.
+	 * @param item The extension to check for.
+	 */
+	HookFilter& UserExtension(ExtensionItem* item)
+	{
+		userexts.push_back(item);
+		return *this;
+	}
+
+	/** Determines whether an event should be passed to the module.
+	 * @param subject The user and channel which the event is about.
+	 * @return True if the module should be called; otherwise, false.
+	 */
+	bool Matches(const HookSubject& subject) const
+	{
+		if (subject.chan && chanmodes.any() && !subject.chan->IsAnyModeSet(chanmodes))
+			return false;
+
+		User* const user = subject.user;
+		if (!user)
+			return true;
+
+		if (localonly && !IS_LOCAL(user))
+			return false;
+
+		if (usermodes.any() && !user->IsAnyModeSet(usermodes))
+			return false;
+
+		if (userexts.empty())
+			return true;
+
+		const Extensible::ExtensibleStore& exts = user->GetExtList();
+		for (std::vector<ExtensionItem*>::const_iterator i = userexts.begin(); i != userexts.end(); ++i)
+		{
+			if (exts.find(*i) != exts.end())
+				return true;
+		}
+		return false;
+	}
+};
+
 /** Base class for all InspIRCd modules
  *  This class is the base class for InspIRCd modules. All modules must inherit from this class,
  *  its methods will be called when irc server events occur. class inherited from module must be
@@ -263,6 +408,11 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	bool dying;
 
+	/** The filters for each event or NULL for events which are not filtered.
+	 * Value is used by the ModuleManager internally, you should not modify it
+	 */
+	HookFilter* HookFilters[I_END];
+
 	/** Default constructor.
 	 * Creates a module class. Don't do any type of hook registration or checks
 	 * for other modules here; do that in init().
@@ -826,7 +976,13 @@ class CoreExport Module : public classbase, public usecountbase
 	virtual ModResult OnCheckChannelBan(User* user, Channel* chan);
 
 	/**
-	 * Checks for a user's match of a single ban
+	 * Checks for a user's match of a single ban.
+	 * When Channel::IsBanned() checks a user against the ban list this is only called for the
+	 * extbans on the list; plain nick!user@host masks are matched by the cached BanIndex of the
+	 * channel and never reach this hook. It is still called for every mask checked with
+	 * Channel::CheckBan() (e.g. ban exceptions). Modules which match plain masks against other
+	 * hosts of a user (e.g. an unused cloak) should do so in OnCheckChannelBan by looking them
+	 * up with BanIndex::Matches(nickident, host) on the index from ListModeBase::GetBanIndex().
 	 * @param user The user to check for match
 	 * @param chan The channel on which the match is being checked
 	 * @param mask The mask being checked
@@ -911,11 +1067,23 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	virtual void OnGarbageCollect();
 
-	/** Called when a user's connect class is being matched
+	/** Called when a user's connect class is being matched. This is only called for classes
+	 * which are not named-only classes and which allow the host and port of the user.
+	 * This replaces OnSetConnectClass which was called for every class. Modules which used
+	 * that to put users into a class they would not otherwise match must implement
+	 * OnForceConnectClass instead as returning MOD_RES_ALLOW from this can not do that.
 	 * @return MOD_RES_ALLOW to force the class to match, MOD_RES_DENY to forbid it, or
-	 * MOD_RES_PASSTHRU to allow normal matching (by host/port).
+	 * MOD_RES_PASSTHRU to allow normal matching (by limit/password).
+	 */
+	virtual ModResult OnCheckConnectClass(LocalUser* user, ConnectClass* myclass);
+
+	/** Called for every connect class, including named-only classes and classes which do not
+	 * allow the host or port of the user, when a user's connect class is being matched.
+	 * Implementing this makes every connect class be checked for every user so only modules
+	 * which need to put users into classes they would not otherwise match should do so.
+	 * @return MOD_RES_ALLOW to force the class to match or MOD_RES_PASSTHRU to allow normal matching.
 	 */
-	virtual ModResult OnSetConnectClass(LocalUser* user, ConnectClass* myclass);
+	virtual ModResult OnForceConnectClass(LocalUser* user, ConnectClass* myclass);
 
 	virtual ModResult OnNumeric(User* user, const Numeric::Numeric& numeric);
 
@@ -1000,11 +1168,71 @@ class CoreExport ModuleManager : public fakederef<ModuleManager>
  public:
 	typedef std::map<std::string, Module*> ModuleMap;
 
+	/** Statistics about calls to a hook. */
+	struct HookStats
+	{
+		/** The number of times the hook has been dispatched. */
+		unsigned long Dispatches;
+
+		/** The number of times a module has been called for the hook. */
+		unsigned long Calls;
+
+		/** The number of times a module has been skipped because of its HookFilter. */
+		unsigned long Skipped;
+
+		/** The total time spent dispatching the hook in microseconds. Only counted when
+		 * <performance:hookstats> is enabled.
+		 */
+		uint64_t Time;
+
+		HookStats() : Dispatches(0), Calls(0), Skipped(0), Time(0) { }
+	};
+
+	/** Keeps track of a single dispatch of a hook. Used by FOREACH_MOD and friends. */
+	class HookDispatch
+	{
+		/** The hook which is being dispatched. */
+		const Implementation hook;
+
+		/** The user and channel which the event is about. */
+		const HookSubject subject;
+
+		/** The statistics for the hook. */
+		HookStats& stats;
+
+		/** The time at which the dispatch started or 0 if it is not being timed. */
+		const uint64_t start;
+
+	 public:
+		HookDispatch(Implementation i, const HookSubject& subj);
+		~HookDispatch();
+
+		/** Determines whether a module should be called for this dispatch.
+		 * @param mod The module to check.
+		 * @return True if the module should be called; otherwise, false.
+		 */
+		bool Accept(const Module* mod)
+		{
+			const HookFilter* filter = mod->HookFilters[hook];
+			if (filter && !filter->Matches(subject))
+			{
+				stats.Skipped++;
+				return false;
+			}
+
+			stats.Calls++;
+			return true;
+		}
+	};
+
 	/** Event handler hooks.
 	 * This needs to be public to be used by FOREACH_MOD and friends.
 	 */
 	Module::List EventHandlers[I_END];
 
+	/** Statistics for each event handler hook. Shown in /STATS h. */
+	HookStats EventStats[I_END];
+
 	/** List of data services keyed by name */
 	std::multimap<std::string, ServiceProvider*, irc::insensitive_swo> DataProviders;
 
@@ -1079,6 +1307,21 @@ class CoreExport ModuleManager : public fakederef<ModuleManager>
 	 */
 	bool Detach(Implementation i, Module* mod);
 
+	/** Sets the filter which decides whether a module is called for an event.
+	 * Any filter which was already set for the event is replaced. Filters are
+	 * automatically removed when the module is unloaded.
+	 * @param mod The module to set the filter for.
+	 * @param i The event to set the filter for.
+	 * @param filter The filter to use.
+	 */
+	void SetHookFilter(Module* mod, Implementation i, const HookFilter& filter);
+
+	/** Retrieves the name of an event, e.g. "OnUserJoin".
+	 * @param i The event to retrieve the name of.
+	 * @return The name of the event.
+	 */
+	static const char* GetHookName(Implementation i);
+
 	/** Attach an array of events to a module
 	 * @param i Event types (array) to attach
 	 * @param mod Module to attach events to
@@ -35,6 +35,33 @@ namespace Cap
 		void FromInternal(Extensible* container, const std::string& value) CXX11_OVERRIDE;
 		std::string ToHuman(const Extensible* container, void* item) const CXX11_OVERRIDE;
 		std::string ToInternal(const Extensible* container, void* item) const CXX11_OVERRIDE;
+
+		/** Set the caps of a user and update their tag profile to match.
+		 * @param user User whose caps to set
+		 * @param caps New caps of the user
+		 */
+		void set(User* user, Ext caps)
+		{
+			LocalIntExt::set(user, caps);
+			LocalUser* const localuser = IS_LOCAL(user);
+			if (localuser)
+				localuser->tagprofile = caps;
+		}
+
+		void unset(User* user)
+		{
+			set(user, 0);
+		}
+
+		void free(Extensible* container, void* item) CXX11_OVERRIDE
+		{
+			// The caps of the user are gone so stop them sharing serialized messages
+			// with users who have caps which happen to use the same bits.
+			LocalUser* const localuser = IS_LOCAL(static_cast<User*>(container));
+			if (localuser)
+				localuser->tagprofile = 0;
+			LocalIntExt::free(container, item);
+		}
 	};
 
 	class Capability;
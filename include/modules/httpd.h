@@ -237,6 +237,23 @@ class HTTPRequest
 	}
 };
 
+/** Generates the body of a HTTP response a part at a time. This allows a large document
+ * to be sent while the connection drains instead of being built up front. The generator
+ * is called again each time the data it has produced so far has mostly been sent so it
+ * must be able to cope with anything it refers to changing between calls.
+ */
+class HTTPDocumentGenerator
+{
+ public:
+	virtual ~HTTPDocumentGenerator() { }
+
+	/** Generates the next part of the document.
+	 * @param out The string to append the next part of the document to.
+	 * @return True if there is more of the document to generate; false if the document is complete.
+	 */
+	virtual bool Generate(std::string& out) = 0;
+};
+
 /** If you want to reply to HTTP requests, you must return a HTTPDocumentResponse to
  * the httpd module via the HTTPdAPI.
  * When you initialize this class you initialize it with all components required to
@@ -251,6 +268,12 @@ class HTTPDocumentResponse
 	Module* const module;
 
 	std::stringstream* document;
+
+	/** The generator of the document if it is streamed or NULL if document is used.
+	 * The httpd module takes ownership of the generator.
+	 */
+	HTTPDocumentGenerator* generator;
+
 	unsigned int responsecode;
 
 	/** Any extra headers to include with the defaults
@@ -267,7 +290,20 @@ class HTTPDocumentResponse
 	 * based upon the response code.
 	 */
 	HTTPDocumentResponse(Module* mod, HTTPRequest& req, std::stringstream* doc, unsigned int response)
-		: module(mod), document(doc), responsecode(response), src(req)
+		: module(mod), document(doc), generator(NULL), responsecode(response), src(req)
+	{
+	}
+
+	/** Initialize a HTTPDocumentResponse with a document which is streamed to the client.
+	 * The response is sent without a Content-Length and the connection is closed once
+	 * the generator has finished.
+	 * @param mod A pointer to the module who responded to the request
+	 * @param req The request you obtained from the HTTPRequest at an earlier time
+	 * @param gen A generator for the document body allocated with new
+	 * @param response A valid HTTP/1.0 or HTTP/1.1 response code
+	 */
+	HTTPDocumentResponse(Module* mod, HTTPRequest& req, HTTPDocumentGenerator* gen, unsigned int response)
+		: module(mod), document(NULL), generator(gen), responsecode(response), src(req)
 	{
 	}
 };
@@ -76,6 +76,11 @@ class IRCv3::CapTag : public ClientProtocol::MessageTagProvider
 		return cap.get(user);
 	}
 
+	bool UsesTagProfile() const CXX11_OVERRIDE
+	{
+		return true;
+	}
+
 	void OnPopulateTags(ClientProtocol::Message& msg) CXX11_OVERRIDE
 	{
 		T& tag = static_cast<T&>(*this);
@@ -43,12 +43,33 @@ public:
 	}
 };
 
+/** A set of patterns which can all be matched against a string at once. */
+class RegexSet : public classbase
+{
+ public:
+	virtual ~RegexSet() { }
+
+	/** Finds the patterns in this set which match a string.
+	 * @param text The string to match.
+	 * @param matches The indices of the matching patterns are appended to this in ascending order.
+	 * @return True if the string was matched against the set; otherwise, false if the set can
+	 *         not currently be used and the patterns need to be matched one at a time instead.
+	 */
+	virtual bool Matches(const std::string& text, std::vector<size_t>& matches) = 0;
+};
+
 class RegexFactory : public DataProvider
 {
  public:
 	RegexFactory(Module* Creator, const std::string& Name) : DataProvider(Creator, Name) { }
 
 	virtual Regex* Create(const std::string& expr) = 0;
+
+	/** Creates a set of patterns which can all be matched against a string at once.
+	 * @param exprs The patterns to add to the set.
+	 * @return A new set or NULL if this engine does not support matching patterns in bulk.
+	 */
+	virtual RegexSet* CreateSet(const std::vector<std::string>& exprs) { return NULL; }
 };
 
 class RegexException : public ModuleException
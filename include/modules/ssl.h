@@ -168,7 +168,8 @@ class SSLIOHook : public IOHook
 		tmp.reserve(std::min(targetsize, sendq.bytes())+1);
 		do
 		{
-			tmp.append(sendq.front());
+			const StreamSocket::SendQueue::Element& elem = sendq.front();
+			tmp.append(elem.data(), elem.length());
 			sendq.pop_front();
 		}
 		while (!sendq.empty() && tmp.length() < targetsize);
@@ -225,6 +226,157 @@ class SSLIOHook : public IOHook
 	virtual bool GetServerName(std::string& out) const = 0;
 };
 
+/** Runs the expensive steps of SSL handshakes on a pool of worker threads so that
+ * a flood of new connections does not hold up the main thread.
+ *
+ * While a step is running on a worker the SSL module must leave the session and
+ * its buffers alone. Data is moved between the socket and the session by the main
+ * thread before and after each step so workers never touch a socket.
+ */
+class SSLHandshakePool
+{
+ public:
+	/** A step of a handshake. */
+	class Job
+	{
+	 public:
+		virtual ~Job() { }
+
+		/** Runs the step. Called on a worker thread so this must only use the session. */
+		virtual void Run() = 0;
+
+		/** Called on the main thread once Run() has returned. The job may delete itself. */
+		virtual void Finish() = 0;
+	};
+
+ private:
+	class Worker : public SocketThread
+	{
+		/** Jobs which are waiting to be run. */
+		std::deque<Job*> pending;
+
+		/** Jobs which have been run but not finished yet. */
+		std::deque<Job*> done;
+
+	 public:
+		void Add(Job* job)
+		{
+			LockQueue();
+			pending.push_back(job);
+			UnlockQueueWakeup();
+		}
+
+		void Run() CXX11_OVERRIDE
+		{
+			LockQueue();
+			while (!GetExitFlag())
+			{
+				if (pending.empty())
+				{
+					WaitForQueue();
+					continue;
+				}
+
+				Job* job = pending.front();
+				pending.pop_front();
+				UnlockQueue();
+				job->Run();
+				LockQueue();
+				done.push_back(job);
+				NotifyParent();
+			}
+			UnlockQueue();
+		}
+
+		void OnNotify() CXX11_OVERRIDE
+		{
+			std::deque<Job*> finished;
+			LockQueue();
+			finished.swap(done);
+			UnlockQueue();
+
+			for (std::deque<Job*>::iterator i = finished.begin(); i != finished.end(); ++i)
+				(*i)->Finish();
+		}
+
+		/** Stops the thread and finishes its jobs on the calling thread. */
+		void Stop()
+		{
+			join();
+
+			// Jobs which never reached the thread are run here instead.
+			while (!pending.empty())
+			{
+				Job* job = pending.front();
+				pending.pop_front();
+				job->Run();
+				done.push_back(job);
+			}
+			OnNotify();
+		}
+	};
+
+	/** The worker threads which are currently running. */
+	std::vector<Worker*> workers;
+
+	/** The index of the worker to give the next job to. */
+	size_t nextworker;
+
+ public:
+	SSLHandshakePool()
+		: nextworker(0)
+	{
+	}
+
+	~SSLHandshakePool()
+	{
+		SetThreadCount(0);
+	}
+
+	/** Determines whether the pool has any workers. */
+	bool IsEnabled() const { return !workers.empty(); }
+
+	/** Restarts the pool with a different number of workers. Jobs which have not
+	 * been finished yet are finished before this returns.
+	 * @param count The number of workers to start.
+	 */
+	void SetThreadCount(size_t count)
+	{
+		if (count == workers.size())
+			return;
+
+		// The pool must look empty while the old workers are finishing their jobs
+		// so that anything queued by Job::Finish() is run straight away.
+		std::vector<Worker*> stopping;
+		stopping.swap(workers);
+		for (std::vector<Worker*>::iterator i = stopping.begin(); i != stopping.end(); ++i)
+		{
+			(*i)->Stop();
+			delete *i;
+		}
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			Worker* worker = new Worker;
+			ServerInstance->Threads.Start(worker);
+			workers.push_back(worker);
+		}
+	}
+
+	/** Queues a job to be run on one of the workers.
+	 * @param job The job to run.
+	 * @return True if the job was queued; false if the pool has no workers.
+	 */
+	bool Queue(Job* job)
+	{
+		if (workers.empty())
+			return false;
+
+		workers[nextworker++ % workers.size()]->Add(job);
+		return true;
+	}
+};
+
 /** Helper functions for obtaining SSL client certificates and key fingerprints
  * from StreamSockets
  */
@@ -0,0 +1,184 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+namespace insp
+{
+	template <typename T> class perfect_hash_map;
+}
+
+/** A read-only map from strings to values which finds a key with a single probe.
+ *
+ * The keys are first hashed into buckets. Each bucket then gets a seed which sends
+ * all of its keys to empty slots of the table when they are hashed again with it, so
+ * a key can only ever be in one slot. Building the map is fairly slow so this is only
+ * suitable for maps which are looked up much more often than they change. Keys are
+ * compared exactly.
+ */
+template <typename T>
+class insp::perfect_hash_map
+{
+ public:
+	typedef std::pair<std::string, T> value_type;
+
+ private:
+	/** The keys and values in the order they were given. */
+	std::vector<value_type> entries;
+
+	/** The seed to hash the keys of each bucket with. */
+	std::vector<uint32_t> seeds;
+
+	/** The index in entries plus one of the key in each slot or zero for empty slots. */
+	std::vector<size_t> slots;
+
+	/** Hashes a key with FNV-1a starting from a seed. */
+	static uint32_t hash(const char* data, size_t length, uint32_t seed)
+	{
+		uint32_t result = 2166136261U ^ (seed * 16777619U);
+		for (size_t i = 0; i < length; ++i)
+		{
+			result ^= static_cast<unsigned char>(data[i]);
+			result *= 16777619U;
+		}
+
+		// Mix the high bits into the low ones as the table size is a power of two.
+		result ^= result >> 15;
+		result *= 0x2C1B3C6DU;
+		result ^= result >> 12;
+		return result;
+	}
+
+	/** Attempts to place all of the keys into a table of a given size.
+	 * @return True if every bucket was given a seed; otherwise, false.
+	 */
+	bool place(size_t tablesize)
+	{
+		// Roughly four keys per bucket keeps the seed search short.
+		const size_t bucketcount = entries.size() / 4 + 1;
+		std::vector<std::vector<size_t> > buckets(bucketcount);
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			const std::string& key = entries[i].first;
+			buckets[hash(key.data(), key.length(), 0) % bucketcount].push_back(i);
+		}
+
+		// The largest buckets are the hardest to place so they go first.
+		std::vector<std::pair<size_t, size_t> > order;
+		for (size_t i = 0; i < bucketcount; ++i)
+			order.push_back(std::make_pair(buckets[i].size(), i));
+		std::sort(order.rbegin(), order.rend());
+
+		seeds.assign(bucketcount, 0);
+		slots.assign(tablesize, 0);
+		std::vector<size_t> placed;
+		for (size_t i = 0; i < order.size(); ++i)
+		{
+			const std::vector<size_t>& bucket = buckets[order[i].second];
+			if (bucket.empty())
+				break;
+
+			bool found = false;
+			for (uint32_t seed = 1; seed < 1024 && !found; ++seed)
+			{
+				placed.clear();
+				for (std::vector<size_t>::const_iterator entry = bucket.begin(); entry != bucket.end(); ++entry)
+				{
+					const std::string& key = entries[*entry].first;
+					const size_t slot = hash(key.data(), key.length(), seed) & (tablesize - 1);
+					if (slots[slot] || std::find(placed.begin(), placed.end(), slot) != placed.end())
+						break;
+					placed.push_back(slot);
+				}
+
+				if (placed.size() != bucket.size())
+					continue;
+
+				for (size_t j = 0; j < bucket.size(); ++j)
+					slots[placed[j]] = bucket[j] + 1;
+				seeds[order[i].second] = seed;
+				found = true;
+			}
+
+			if (!found)
+				return false;
+		}
+		return true;
+	}
+
+ public:
+	/** Replaces the contents of the map.
+	 * @param items The keys and values to store. The keys must be unique.
+	 */
+	void build(const std::vector<value_type>& items)
+	{
+		entries = items;
+		seeds.clear();
+		slots.clear();
+		if (entries.empty())
+			return;
+
+		// Start with a table which is at least twice as large as the number of keys and
+		// grow it until every bucket can be placed, which almost always happens first time.
+		size_t tablesize = 1;
+		while (tablesize < entries.size() * 2)
+			tablesize <<= 1;
+		while (!place(tablesize))
+			tablesize <<= 1;
+	}
+
+	/** Finds the value for a key.
+	 * @param data The first character of the key.
+	 * @param length The number of characters in the key.
+	 * @return The value for the key or NULL if the key is not in the map.
+	 */
+	const T* find(const char* data, size_t length) const
+	{
+		if (slots.empty())
+			return NULL;
+
+		const uint32_t seed = seeds[hash(data, length, 0) % seeds.size()];
+		const size_t index = slots[hash(data, length, seed) & (slots.size() - 1)];
+		if (!index)
+			return NULL;
+
+		const value_type& entry = entries[index - 1];
+		if (entry.first.length() != length || memcmp(entry.first.data(), data, length))
+			return NULL;
+		return &entry.second;
+	}
+
+	/** Finds the value for a key.
+	 * @param key The key to find.
+	 * @return The value for the key or NULL if the key is not in the map.
+	 */
+	const T* find(const std::string& key) const
+	{
+		return find(key.data(), key.length());
+	}
+
+	/** Retrieves the number of keys in the map. */
+	size_t size() const { return entries.size(); }
+};
@@ -48,6 +48,12 @@ class CoreExport ProtocolInterface
 		unsigned int usercount;
 		unsigned int opercount;
 		unsigned int latencyms;
+
+		/** The number of bytes sent on the link to this server or 0 if it is not linked to us directly. */
+		uint64_t sentbytes;
+
+		/** The number of bytes received on the link from this server or 0 if it is not linked to us directly. */
+		uint64_t recvbytes;
 	};
 
 	typedef std::vector<ServerInfo> ServerList;
@@ -0,0 +1,172 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+namespace insp
+{
+	class shared_string;
+}
+
+/** An immutable, reference counted string.
+ *
+ * Copying a shared_string does not copy the characters it contains, all copies
+ * refer to the same allocation which is freed when the last copy is destroyed.
+ * This allows a line which is sent to many clients to be queued for all of them
+ * without copying it once per recipient.
+ *
+ * Each copy is a view of the shared characters which can be shrunk from the front
+ * with erase_front() without affecting the other copies.
+ *
+ * The reference count is not atomic. Copies must only be made or destroyed on the
+ * main thread; other threads may only read the characters of an existing copy.
+ */
+class insp::shared_string
+{
+	/** The shared part of the string. The characters follow it in the same allocation. */
+	struct block
+	{
+		/** The number of shared_string objects referring to this block. */
+		unsigned int refcount;
+
+		char* chars() { return reinterpret_cast<char*>(this + 1); }
+	};
+
+	/** The block holding the characters or NULL if the string is empty. */
+	block* blk;
+
+	/** The first character of this view of the string. */
+	const char* first;
+
+	/** The number of characters in this view of the string. */
+	size_t len;
+
+	/** Creates a new block containing the specified characters. */
+	void create(const char* str, size_t n)
+	{
+		if (!n)
+		{
+			blk = NULL;
+			first = NULL;
+			len = 0;
+			return;
+		}
+
+		void* mem = ::operator new(sizeof(block) + n);
+		blk = static_cast<block*>(mem);
+		blk->refcount = 1;
+		memcpy(blk->chars(), str, n);
+		first = blk->chars();
+		len = n;
+	}
+
+	/** Drops the reference this string holds to its block, if any. */
+	void release()
+	{
+		if (blk && !--blk->refcount)
+			::operator delete(blk);
+	}
+
+ public:
+	typedef const char* const_iterator;
+	typedef size_t size_type;
+
+	/** Creates an empty string. */
+	shared_string()
+		: blk(NULL)
+		, first(NULL)
+		, len(0)
+	{
+	}
+
+	/** Creates a string containing a copy of the specified characters. */
+	shared_string(const std::string& str)
+	{
+		create(str.data(), str.length());
+	}
+
+	/** Creates a string containing a copy of the specified characters. */
+	shared_string(const char* str, size_t n)
+	{
+		create(str, n);
+	}
+
+	shared_string(const shared_string& other)
+		: blk(other.blk)
+		, first(other.first)
+		, len(other.len)
+	{
+		if (blk)
+			blk->refcount++;
+	}
+
+	~shared_string()
+	{
+		release();
+	}
+
+	shared_string& operator=(const shared_string& other)
+	{
+		if (other.blk)
+			other.blk->refcount++;
+		release();
+		blk = other.blk;
+		first = other.first;
+		len = other.len;
+		return *this;
+	}
+
+	/** Retrieves a pointer to the characters of the string. Not null terminated. */
+	const char* data() const { return first; }
+
+	/** Retrieves the number of characters in the string. */
+	size_t length() const { return len; }
+
+	/** Retrieves the number of characters in the string. */
+	size_t size() const { return len; }
+
+	/** Determines whether the string is empty. */
+	bool empty() const { return (len == 0); }
+
+	const_iterator begin() const { return first; }
+	const_iterator end() const { return first + len; }
+
+	/** Retrieves the character at the specified position. */
+	char operator[](size_t pos) const { return first[pos]; }
+
+	/** Removes characters from the beginning of this view of the string.
+	 * @param n The number of characters to remove.
+	 */
+	void erase_front(size_t n)
+	{
+		first += n;
+		len -= n;
+	}
+
+	/** Retrieves a copy of the string as a std::string. */
+	std::string str() const { return std::string(first, len); }
+
+	/** Retrieves the number of strings sharing the characters of this string. */
+	unsigned int use_count() const { return (blk ? blk->refcount : 0); }
+
+	void swap(shared_string& other)
+	{
+		std::swap(blk, other.blk);
+		std::swap(first, other.first);
+		std::swap(len, other.len);
+	}
+};
@@ -99,6 +99,98 @@ namespace irc
 			std::string str() const;
 		};
 
+		/** Indexes values on a CIDR range so that the values with a range which contains an
+		 * address can be found without comparing the address against every range.
+		 *
+		 * Ranges are stored by their masked address so an address is masked to each prefix
+		 * length which is in use before being looked up. This is as fast as a radix tree for
+		 * the small number of prefix lengths which are used in practice.
+		 */
+		template <typename T>
+		class cidr_index
+		{
+			typedef std::multimap<cidr_mask, T> RangeMap;
+
+			/** The number of ranges of each address family and prefix length in the index. */
+			typedef std::map<std::pair<unsigned char, unsigned char>, size_t> PrefixMap;
+
+			/** The values in the index keyed by their range. */
+			RangeMap ranges;
+
+			/** The address families and prefix lengths which are used in ranges. */
+			PrefixMap prefixes;
+
+		 public:
+			/** Adds a value to the index.
+			 * @param range The range to add the value for.
+			 * @param value The value to add.
+			 * @return True if the value was added; false if the range is not an IPv4 or IPv6 range.
+			 */
+			bool add(const cidr_mask& range, const T& value)
+			{
+				if (range.type != AF_INET && range.type != AF_INET6)
+					return false;
+
+				ranges.insert(std::make_pair(range, value));
+				prefixes[std::make_pair(range.type, range.length)]++;
+				return true;
+			}
+
+			/** Removes a value from the index.
+			 * @param range The range the value was added for.
+			 * @param value The value to remove.
+			 * @return True if the value was removed; false if it was not in the index.
+			 */
+			bool remove(const cidr_mask& range, const T& value)
+			{
+				std::pair<typename RangeMap::iterator, typename RangeMap::iterator> entries = ranges.equal_range(range);
+				for (typename RangeMap::iterator i = entries.first; i != entries.second; ++i)
+				{
+					if (!(i->second == value))
+						continue;
+
+					ranges.erase(i);
+					typename PrefixMap::iterator prefix = prefixes.find(std::make_pair(range.type, range.length));
+					if (!--prefix->second)
+						prefixes.erase(prefix);
+					return true;
+				}
+				return false;
+			}
+
+			/** Adds the values with a range which contains an address to a list.
+			 * @param addr The address to look up.
+			 * @param values The list to add the values to.
+			 */
+			void find(const sockaddrs& addr, std::vector<T>& values) const
+			{
+				const unsigned char family = addr.family();
+				for (typename PrefixMap::const_iterator i = prefixes.lower_bound(std::make_pair(family, 0)); i != prefixes.end() && i->first.first == family; ++i)
+				{
+					const cidr_mask range(addr, i->first.second);
+					std::pair<typename RangeMap::const_iterator, typename RangeMap::const_iterator> entries = ranges.equal_range(range);
+					for (typename RangeMap::const_iterator j = entries.first; j != entries.second; ++j)
+						values.push_back(j->second);
+				}
+			}
+
+			/** Determines whether the index is empty. */
+			bool empty() const { return ranges.empty(); }
+
+			/** Removes all values from the index. */
+			void clear()
+			{
+				ranges.clear();
+				prefixes.clear();
+			}
+		};
+
+		/** Determines whether a mask is a CIDR range which MatchCIDR() will match addresses against.
+		 * @param mask The mask to check, without a username part.
+		 * @return True if the mask is a CIDR range; otherwise, false.
+		 */
+		CoreExport bool IsCIDRMask(const std::string& mask);
+
 		/** Match CIDR, including an optional username/nickname part.
 		 *
 		 * This function will compare a human-readable address (plus
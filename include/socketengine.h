@@ -314,6 +314,27 @@ public:
 	typedef WindowsIOVec IOVector;
 #endif
 
+	/** An iterator over the buffers of a send queue. */
+	typedef std::deque<insp::shared_string>::const_iterator BufferIterator;
+
+	/** The outcome of a call to ReleaseIO(). */
+	enum ReleaseResult
+	{
+		/** The socket has been released. */
+		RELEASE_DONE,
+
+		/** The engine is waiting for the I/O it started on the socket to finish. The handler
+		 * of the socket is sent a read event once it has and ReleaseIO() should be called again.
+		 */
+		RELEASE_PENDING,
+
+		/** The engine holds data for the socket which has not been read or sent yet so it keeps
+		 * performing the I/O on the socket, which must still be read from and written to using
+		 * this class.
+		 */
+		RELEASE_REFUSED
+	};
+
 	/** Constructor.
 	 * The constructor transparently initializes
 	 * the socket engine which the ircd is using.
@@ -462,6 +483,23 @@ public:
 	static int WriteV(EventHandler* fd, const iovec* iov, int count);
 #endif
 
+	/** Writes the buffers of a send queue to a socket.
+	 * Socket engines which perform the I/O on the socket themselves keep a reference to
+	 * the buffers instead of copying them until they have been sent.
+	 * @param fd EventHandler to send data with
+	 * @param begin The first buffer to write.
+	 * @param end The buffer after the last buffer to write.
+	 * @return The number of bytes written or -1 with errno set on error, like writev().
+	 */
+	static int WriteBuffers(EventHandler* fd, BufferIterator begin, BufferIterator end);
+
+	/** Retrieves the number of bytes which have been written to a socket and are held by
+	 * the socket engine because they have not been handed to the kernel yet.
+	 * @param fd The event handler of the socket.
+	 * @return The number of bytes which the socket engine holds for the socket.
+	 */
+	static size_t GetQueuedBytes(const EventHandler* fd);
+
 	/** Abstraction for BSD sockets recv(2).
 	 * This function should emulate its namesake system call exactly.
 	 * @param fd This version of the call takes an EventHandler instead of a bare file descriptor.
@@ -523,6 +561,16 @@ public:
 	 */
 	static int Shutdown(EventHandler* fd, int how);
 
+	/** Stops the socket engine from performing I/O on the socket itself. This must be
+	 * called before handing a socket to code which reads from or writes to it directly
+	 * instead of using the functions in this class (e.g. a library which owns the socket).
+	 * Data which has been written but not yet sent is handed to the kernel first. This never
+	 * blocks so the engine may have to wait for the I/O it started on the socket to finish.
+	 * @param fd The event handler whose socket should no longer be used by the engine.
+	 * @return Whether the socket has been released, see ReleaseResult.
+	 */
+	static ReleaseResult ReleaseIO(EventHandler* fd);
+
 	/** Abstraction for BSD sockets shutdown(2).
 	 * This function should emulate its namesake system call exactly.
 	 * @return This method should return exactly the same values as the system call it emulates.
@@ -31,10 +31,13 @@ class Module;
  * Timer, then insert your inherited class into the
  * queue using Server::AddTimer(). The Tick() method of
  * your object (which you have to override) will be called
- * at the given time.
+ * at the given time. Timers which need to trigger more
+ * often than once a second can use SetIntervalMS().
  */
-class CoreExport Timer
+class CoreExport Timer : public insp::intrusive_list_node<Timer>
 {
+	friend class TimerManager;
+
 	/** The triggering time
 	 */
 	time_t trigger;
@@ -43,10 +46,22 @@ class CoreExport Timer
 	 */
 	unsigned int secs;
 
+	/** Number of milliseconds between triggers or 0 if the timer has one-second resolution
+	 */
+	unsigned int msecs;
+
 	/** True if this is a repeating timer
 	 */
 	bool repeat;
 
+	/** The time in milliseconds at which the timer is due
+	 */
+	uint64_t expiry;
+
+	/** The timer wheel slot the timer is in or NULL if it is not scheduled
+	 */
+	insp::intrusive_list_tail<Timer>* slot;
+
  public:
 	/** Default constructor, initializes the triggering time
 	 * @param secs_from_now The number of seconds from now to trigger the timer
@@ -72,12 +87,20 @@ class CoreExport Timer
 	void SetTrigger(time_t nexttrigger)
 	{
 		trigger = nexttrigger;
+		expiry = static_cast<uint64_t>(nexttrigger) * 1000;
 	}
 
 	/** Sets the interval between two ticks.
 	 */
 	void SetInterval(unsigned int interval);
 
+	/** Sets the interval between two ticks in milliseconds. This gives the timer
+	 * sub-second resolution; it will tick as close to every interval milliseconds
+	 * as the socket engine allows instead of on the second.
+	 * @param interval The number of milliseconds between ticks. Must not be 0.
+	 */
+	void SetIntervalMS(unsigned int interval);
+
 	/** Called when the timer ticks.
 	 * You should override this method with some useful code to
 	 * handle the tick event.
@@ -101,6 +124,13 @@ class CoreExport Timer
 		return secs;
 	}
 
+	/** Returns the interval between ticks in milliseconds.
+	 */
+	unsigned int GetIntervalMS() const
+	{
+		return msecs ? msecs : secs * 1000;
+	}
+
 	/** Cancels the repeat state of a repeating timer.
 	 * If you call this method, then the next time your
 	 * timer ticks, it will be removed immediately after.
@@ -117,13 +147,73 @@ class CoreExport Timer
  */
 class CoreExport TimerManager
 {
-	typedef std::multimap<time_t, Timer*> TimerMap;
+	typedef insp::intrusive_list_tail<Timer> TimerList;
+
+	/** The number of bits of the due time which index the slots of the first wheel.
+	 */
+	static const unsigned int NearBits = 8;
+
+	/** The number of bits of the due time which index the slots of each of the other wheels.
+	 */
+	static const unsigned int FarBits = 6;
+
+	/** The number of wheels after the first one.
+	 */
+	static const unsigned int FarLevels = 4;
+
+	/** Timers due in the next 256 milliseconds, one slot per millisecond.
+	 */
+	TimerList nearwheel[1 << NearBits];
+
+	/** Timers due later on. Each slot of a wheel covers as much time as all of the slots
+	 * of the wheel before it. Timers are moved to the wheel below when their slot is reached.
+	 */
+	TimerList farwheels[FarLevels][1 << FarBits];
+
+	/** The number of timers in the near wheel.
+	 */
+	size_t nearcount;
+
+	/** The number of timers in all of the wheels.
+	 */
+	size_t total;
+
+	/** The number of timers with sub-second resolution.
+	 */
+	size_t precise;
+
+	/** The next millisecond to process. Timers due before this are processed on the next tick.
+	 */
+	uint64_t current;
+
+	/** Puts a timer into the right slot of the wheels for its due time.
+	 */
+	void Schedule(Timer* t);
 
-	/** A list of all pending timers
+	/** Removes all of the timers from a slot of one of the far wheels and schedules them again.
 	 */
-	TimerMap Timers;
+	void Cascade(unsigned int level, unsigned int index);
+
+	/** Calls the timers in a slot of the near wheel which are due.
+	 * @param list The slot to process.
+	 * @param tick The millisecond which the slot is being processed for.
+	 * @param TIME The current system time.
+	 */
+	void Expire(TimerList& list, uint64_t tick, time_t TIME);
+
+	/** Moves the wheels and every timer in them back to the specified time after the clock
+	 * has jumped backwards.
+	 * @param now The current time in milliseconds.
+	 */
+	void Rebase(uint64_t now);
+
+	/** Determines whether a list is one of the slots of the near wheel.
+	 */
+	bool IsNear(const TimerList* list) const;
 
  public:
+	TimerManager();
+
 	/** Tick all pending Timers
 	 * @param TIME the current system time
 	 */
@@ -138,4 +228,16 @@ class CoreExport TimerManager
 	 * @param T an Timer derived class to remove
 	 */
 	void DelTimer(Timer* T);
+
+	/** Retrieves the number of milliseconds the socket engine may wait for events before
+	 * TickTimers() has to be called again. This is one second unless there are timers
+	 * with sub-second resolution.
+	 */
+	int GetWaitTime() const;
+
+	/** Retrieves the number of timers which are currently scheduled. */
+	size_t GetTimerCount() const { return total; }
+
+	/** Retrieves the number of scheduled timers which have sub-second resolution. */
+	size_t GetPreciseTimerCount() const { return precise; }
 };
@@ -43,6 +43,7 @@ class ServerConfig;
 class ServerLimits;
 class Thread;
 class User;
+class UserManager;
 class XLine;
 class XLineManager;
 class XLineFactory;
@@ -60,7 +61,7 @@ namespace ClientProtocol
 
 	typedef std::vector<Message*> MessageList;
 	typedef std::vector<std::string> ParamList;
-	typedef std::string SerializedMessage;
+	typedef insp::shared_string SerializedMessage;
 
 	struct MessageTagData
 	{
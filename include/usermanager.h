@@ -43,6 +43,10 @@ class CoreExport UserManager : public fakederef<UserManager>
 	*/
 	typedef insp::intrusive_list<LocalUser> LocalList;
 
+	/** A list holding local users whose background checks are due in the same second
+	 */
+	typedef insp::intrusive_list<LocalUser, UserManager> BackgroundList;
+
  private:
 	/** Map of IP addresses for clone counting
 	 */
@@ -61,6 +65,28 @@ class CoreExport UserManager : public fakederef<UserManager>
 	 */
 	already_sent_t already_sent_id;
 
+	/** The number of seconds which the background check schedule covers. Users whose checks
+	 * are due further in the future than this wait in the slot of the second their checks are
+	 * due in modulo this and are skipped until they are actually due.
+	 */
+	static const unsigned int BackgroundSlots = 128;
+
+	/** Local users whose background checks are scheduled, indexed by the second in which they
+	 * are due modulo BackgroundSlots.
+	 */
+	BackgroundList background[BackgroundSlots];
+
+	/** The last second which background checks have been run for. */
+	time_t lastbackground;
+
+	/** Run the background checks for the users in a slot of the schedule.
+	 * @param list The slot to run the background checks for.
+	 * @param now The current time.
+	 * @param force If true then all users are checked regardless of when they are due.
+	 * @return The number of users which were checked.
+	 */
+	unsigned long ProcessBackground(BackgroundList& list, time_t now, bool force);
+
  public:
 	/** Constructor, initializes variables
 	 */
@@ -90,11 +116,22 @@ class CoreExport UserManager : public fakederef<UserManager>
 	/** The number of users on U-lined servers. */
 	unsigned int uline_count;
 
-	/** Perform background user events for all local users such as PING checks, registration timeouts,
+	/** Perform background user events for local users such as PING checks, registration timeouts,
 	 * penalty management and recvq processing for users who have data in their recvq due to throttling.
+	 * Only users whose checks have been scheduled for a second which has passed since the last call
+	 * are visited.
 	 */
 	void DoBackgroundUserStuff();
 
+	/** Schedule the background checks for a local user to run no later than the specified time.
+	 * This has to be called when something makes the checks for a user due earlier than they
+	 * were before, e.g. when a user gains a penalty outside of processing their own commands.
+	 * @param user The user to schedule the background checks for.
+	 * @param when The time at which the checks should be run. If the checks are already scheduled
+	 * to run before this time then nothing is changed.
+	 */
+	void ScheduleBackground(LocalUser* user, time_t when);
+
 	/** Handle a client connection.
 	 * Creates a new LocalUser object, inserts it into the appropriate containers,
 	 * initializes it as not yet registered, and adds it to the socket engine.
@@ -244,6 +244,11 @@ class CoreExport User : public Extensible
 	 */
 	std::string cachedip;
 
+	/** Incremented by InvalidateCache() so that results which depend on the nick, ident,
+	 * hosts or IP address of the user can be cached elsewhere.
+	 */
+	unsigned int cachegeneration;
+
 	/** If set then the hostname which is displayed to users. */
 	std::string displayhost;
 
@@ -409,6 +414,11 @@ class CoreExport User : public Extensible
 	 */
 	void InvalidateCache();
 
+	/** Retrieves a number which changes whenever InvalidateCache() is called.
+	 * @return The current cache generation of the user.
+	 */
+	unsigned int GetCacheGeneration() const { return cachegeneration; }
+
 	/** Returns whether this user is currently away or not. If true,
 	 * further information can be found in User::awaymsg and User::awaytime
 	 * @return True if the user is away, false otherwise
@@ -443,6 +453,12 @@ class CoreExport User : public Extensible
 	bool IsModeSet(const ModeHandler& mh) const { return IsModeSet(&mh); }
 	bool IsModeSet(UserModeReference& moderef) const;
 
+	/** Returns true if any of a set of modes is set
+	 * @param mask The ids of the user modes
+	 * @return True if at least one of the modes is set
+	 */
+	bool IsAnyModeSet(const std::bitset<ModeParser::MODEID_MAX>& mask) const { return (modes & mask).any(); }
+
 	/** Set a specific usermode to on or off
 	 * @param mh The user mode
 	 * @param value On or off setting of the mode
@@ -697,15 +713,16 @@ class CoreExport UserIOHandler : public StreamSocket
 	{
 	}
 	void OnDataReady() CXX11_OVERRIDE;
+	void OnEventHandlerWrite() CXX11_OVERRIDE;
 	bool OnSetEndPoint(const irc::sockets::sockaddrs& local, const irc::sockets::sockaddrs& remote) CXX11_OVERRIDE;
 	void OnError(BufferedSocketError error) CXX11_OVERRIDE;
 
 	/** Adds to the user's write buffer.
 	 * You may add any amount of text up to this users sendq value, if you exceed the
 	 * sendq value, the user will be removed, and further buffer adds will be dropped.
-	 * @param data The data to add to the write buffer
+	 * @param data The data to add to the write buffer, shared with any other users it is sent to
 	 */
-	void AddWriteBuf(const std::string &data);
+	void AddWriteBuf(const StreamSocket::SendQueue::Element& data);
 
 	/** Swaps the internals of this UserIOHandler with another one.
 	 * @param other A UserIOHandler to swap internals with.
@@ -715,8 +732,18 @@ class CoreExport UserIOHandler : public StreamSocket
 
 typedef unsigned int already_sent_t;
 
-class CoreExport LocalUser : public User, public insp::intrusive_list_node<LocalUser>
+class CoreExport LocalUser : public User, public insp::intrusive_list_node<LocalUser>, public insp::intrusive_list_node<LocalUser, UserManager>
 {
+	friend class UserManager;
+
+	/** The time at which the background checks for this user are next due or 0 if they are not scheduled.
+	 */
+	time_t nextcheck;
+
+	/** The list in UserManager which this user is waiting in until nextcheck or NULL if they are not scheduled.
+	 */
+	insp::intrusive_list<LocalUser, UserManager>* checkslot;
+
 	/** Add a serialized message to the send queue of the user.
 	 * @param serialized Bytes to add.
 	 */
@@ -745,6 +772,13 @@ class CoreExport LocalUser : public User, public insp::intrusive_list_node<Local
 	 */
 	ClientProtocol::Serializer* serializer;
 
+	/** Identifies the set of message tags this user can receive. This is the set of capabilities the
+	 * user has enabled and is maintained by the cap module. Users with the same tag profile get the
+	 * same serialized form of a message if all of its tags come from providers which only look at
+	 * the profile, see ClientProtocol::MessageTagProvider::UsesTagProfile().
+	 */
+	intptr_t tagprofile;
+
 	/** Stats counter for bytes inbound
 	 */
 	unsigned int bytes_in;
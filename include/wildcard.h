@@ -0,0 +1,399 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+// The vector kernels are selected at compile time. SSE2 is part of the x86-64
+// baseline so it is always available there; AVX2 is only used when the compiler
+// has been told that the target supports it (e.g. with -march=native).
+#if defined __AVX2__
+# include <immintrin.h>
+# define INSP_WILDCARD_AVX2
+# define INSP_WILDCARD_SSE2
+#elif defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define INSP_WILDCARD_SSE2
+#endif
+
+#if defined INSP_WILDCARD_SSE2 && defined _MSC_VER
+# include <intrin.h>
+#endif
+
+namespace insp
+{
+	class wildcard_mask;
+
+namespace detail
+{
+#ifdef INSP_WILDCARD_SSE2
+	/** Retrieves the index of the lowest set bit in a non-zero value. */
+	inline unsigned int wildcard_lowest_bit(unsigned int bits)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward(&index, bits);
+		return index;
+#else
+		return __builtin_ctz(bits);
+#endif
+	}
+#endif
+
+	/** Finds the first character in a range which is equal to either of two characters.
+	 * @param first The start of the range to search.
+	 * @param last The end of the range to search.
+	 * @param c1 The first character to search for.
+	 * @param c2 The second character to search for. May be the same as c1.
+	 * @return The position of the first matching character or last if there is none.
+	 */
+	inline const unsigned char* wildcard_find(const unsigned char* first, const unsigned char* last, unsigned char c1, unsigned char c2)
+	{
+#ifdef INSP_WILDCARD_AVX2
+		if (last - first >= 32)
+		{
+			const __m256i needle1 = _mm256_set1_epi8(static_cast<char>(c1));
+			const __m256i needle2 = _mm256_set1_epi8(static_cast<char>(c2));
+			for (; last - first >= 32; first += 32)
+			{
+				const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+				const __m256i found = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, needle1), _mm256_cmpeq_epi8(chunk, needle2));
+				const unsigned int bits = static_cast<unsigned int>(_mm256_movemask_epi8(found));
+				if (bits)
+					return first + wildcard_lowest_bit(bits);
+			}
+		}
+#endif
+
+#ifdef INSP_WILDCARD_SSE2
+		if (last - first >= 16)
+		{
+			const __m128i needle1 = _mm_set1_epi8(static_cast<char>(c1));
+			const __m128i needle2 = _mm_set1_epi8(static_cast<char>(c2));
+			for (; last - first >= 16; first += 16)
+			{
+				const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+				const __m128i found = _mm_or_si128(_mm_cmpeq_epi8(chunk, needle1), _mm_cmpeq_epi8(chunk, needle2));
+				const unsigned int bits = static_cast<unsigned int>(_mm_movemask_epi8(found));
+				if (bits)
+					return first + wildcard_lowest_bit(bits);
+			}
+		}
+#endif
+
+		for (; first != last; ++first)
+		{
+			if (*first == c1 || *first == c2)
+				return first;
+		}
+		return last;
+	}
+}
+}
+
+/** A wildcard mask which has been compiled for matching against many strings.
+ *
+ * The mask is split at each '*' into segments of literal characters and '?'
+ * wildcards. The first segment is anchored to the start of the string unless the
+ * mask starts with '*' and the last one is anchored to the end unless the mask
+ * ends with '*'. The remaining segments are found with a leftmost search which
+ * looks for one of the raw characters which fold to the first literal character
+ * of the segment. When there are at most two such characters (which is the case
+ * for letters in all of the built in case maps) the search uses SSE2 or AVX2.
+ *
+ * Matching a compiled mask gives the same results as match_reference() which is
+ * the scalar matcher used by InspIRCd::Match().
+ */
+class insp::wildcard_mask
+{
+	/** A run of characters between two '*' wildcards. */
+	struct segment
+	{
+		/** The position of the segment within the mask. */
+		size_t pos;
+
+		/** The length of the segment. */
+		size_t len;
+
+		/** The position of the first non-'?' character in the segment or npos if there is none. */
+		size_t anchor;
+
+		/** The raw characters which fold to the anchor character if vector is true. */
+		unsigned char first;
+		unsigned char second;
+
+		/** Whether the anchor can be searched for with wildcard_find(). */
+		bool vector;
+	};
+
+	/** The mask this was compiled from, up to the first NUL character. */
+	std::string mask;
+
+	/** The case map used to compare characters. */
+	const unsigned char* map;
+
+	/** The segments of the mask. Empty if the mask only consists of '*' characters. */
+	std::vector<segment> segments;
+
+	/** Whether the mask starts with a '*' character. */
+	bool leading;
+
+	/** Whether the mask ends with a '*' character. */
+	bool trailing;
+
+	/** The shortest length a string must have to match this mask. */
+	size_t minlength;
+
+	/** Determines whether a segment matches a string at the specified position. The string must
+	 * contain at least seg.len characters from that position.
+	 */
+	bool compare(const segment& seg, const unsigned char* str) const
+	{
+		const unsigned char* wild = reinterpret_cast<const unsigned char*>(mask.data()) + seg.pos;
+		for (size_t i = 0; i < seg.len; ++i)
+		{
+			if ((wild[i] != '?') && (map[wild[i]] != map[str[i]]))
+				return false;
+		}
+		return true;
+	}
+
+	/** Finds the leftmost position in a range where a segment matches.
+	 * @return The position of the match or NULL if the segment does not match.
+	 */
+	const unsigned char* find(const segment& seg, const unsigned char* first, const unsigned char* last) const
+	{
+		if (static_cast<size_t>(last - first) < seg.len)
+			return NULL;
+
+		// A segment without any literal characters matches anywhere.
+		if (seg.anchor == std::string::npos)
+			return first;
+
+		const unsigned char* const anchorlast = last - seg.len + seg.anchor + 1;
+		const unsigned char anchorchar = map[static_cast<unsigned char>(mask[seg.pos + seg.anchor])];
+		for (const unsigned char* pos = first + seg.anchor; pos != anchorlast; ++pos)
+		{
+			if (seg.vector)
+			{
+				pos = detail::wildcard_find(pos, anchorlast, seg.first, seg.second);
+				if (pos == anchorlast)
+					break;
+			}
+			else if (map[*pos] != anchorchar)
+				continue;
+
+			const unsigned char* const candidate = pos - seg.anchor;
+			if (compare(seg, candidate))
+				return candidate;
+		}
+		return NULL;
+	}
+
+ public:
+	/** Creates a mask which only matches the empty string. */
+	wildcard_mask()
+		: map(NULL)
+		, leading(false)
+		, trailing(false)
+		, minlength(0)
+	{
+	}
+
+	/** Creates a compiled mask.
+	 * @param wild The mask to compile.
+	 * @param casemap The case map to compare characters with.
+	 */
+	wildcard_mask(const std::string& wild, const unsigned char* casemap)
+	{
+		compile(wild, casemap);
+	}
+
+	/** Replaces this mask with a newly compiled one.
+	 * @param wild The mask to compile.
+	 * @param casemap The case map to compare characters with.
+	 */
+	void compile(const std::string& wild, const unsigned char* casemap)
+	{
+		mask.assign(wild.c_str());
+		map = casemap;
+		segments.clear();
+		leading = (!mask.empty() && mask[0] == '*');
+		trailing = (!mask.empty() && mask[mask.length() - 1] == '*');
+		minlength = 0;
+
+		for (size_t start = 0; start < mask.length(); )
+		{
+			size_t end = mask.find('*', start);
+			if (end == std::string::npos)
+				end = mask.length();
+
+			if (end != start)
+			{
+				segment seg;
+				seg.pos = start;
+				seg.len = end - start;
+				seg.anchor = mask.find_first_not_of('?', start);
+				if (seg.anchor >= end)
+					seg.anchor = std::string::npos;
+				else
+					seg.anchor -= start;
+
+				// Find the raw characters which fold to the anchor character.
+				unsigned int found = 0;
+				if (seg.anchor != std::string::npos)
+				{
+					const unsigned char folded = map[static_cast<unsigned char>(mask[start + seg.anchor])];
+					for (unsigned int chr = 0; chr < 256; ++chr)
+					{
+						if (map[chr] != folded)
+							continue;
+
+						if (found++ == 0)
+							seg.first = seg.second = chr;
+						else
+							seg.second = chr;
+					}
+				}
+				seg.vector = (found && found <= 2);
+
+				segments.push_back(seg);
+				minlength += seg.len;
+			}
+			start = end + 1;
+		}
+	}
+
+	/** Determines whether a string matches this mask.
+	 * @param data The characters of the string to match.
+	 * @param length The number of characters in the string.
+	 * @return True if the string matches; otherwise, false.
+	 */
+	bool match(const char* data, size_t length) const
+	{
+		if (segments.empty())
+			return (leading || !length);
+
+		if (length < minlength)
+			return false;
+
+		const unsigned char* str = reinterpret_cast<const unsigned char*>(data);
+		const unsigned char* end = str + length;
+		std::vector<segment>::const_iterator first = segments.begin();
+		std::vector<segment>::const_iterator last = segments.end();
+
+		if (!leading)
+		{
+			if (!compare(*first, str))
+				return false;
+
+			if (segments.size() == 1 && !trailing)
+				return (length == first->len);
+
+			str += first->len;
+			++first;
+		}
+
+		if (!trailing)
+		{
+			--last;
+			if (static_cast<size_t>(end - str) < last->len)
+				return false;
+
+			end -= last->len;
+			if (!compare(*last, end))
+				return false;
+		}
+
+		for (; first != last; ++first)
+		{
+			str = find(*first, str, end);
+			if (!str)
+				return false;
+
+			str += first->len;
+		}
+		return true;
+	}
+
+	/** Determines whether a string matches this mask.
+	 * @param str The string to match. Characters after the first NUL are considered too.
+	 * @return True if the string matches; otherwise, false.
+	 */
+	bool match(const std::string& str) const { return match(str.data(), str.length()); }
+
+	/** Retrieves the mask this was compiled from. */
+	const std::string& str() const { return mask; }
+
+	/** Matches a string against a mask without compiling it first. This is the reference
+	 * implementation which compiled masks must agree with.
+	 * @param str The NUL terminated string to match.
+	 * @param wild The NUL terminated mask to match against.
+	 * @param map The case map to compare characters with.
+	 * @return True if the string matches; otherwise, false.
+	 */
+	static bool match_reference(const unsigned char* str, const unsigned char* wild, const unsigned char* map)
+	{
+		const unsigned char* cp = NULL;
+		const unsigned char* mp = NULL;
+
+		while ((*str) && (*wild != '*'))
+		{
+			if ((map[*wild] != map[*str]) && (*wild != '?'))
+			{
+				return false;
+			}
+			wild++;
+			str++;
+		}
+
+		while (*str)
+		{
+			if (*wild == '*')
+			{
+				if (!*++wild)
+				{
+					return true;
+				}
+				mp = wild;
+				cp = str+1;
+			}
+			else
+				if ((map[*wild] == map[*str]) || (*wild == '?'))
+				{
+					wild++;
+					str++;
+				}
+				else
+				{
+					wild = mp;
+					str = cp++;
+				}
+
+		}
+
+		while (*wild == '*')
+		{
+			wild++;
+		}
+
+		return !*wild;
+	}
+};
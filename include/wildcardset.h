@@ -0,0 +1,316 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#pragma once
+
+#include <algorithm>
+#include <queue>
+
+#include "wildcard.h"
+
+namespace insp
+{
+	class literal_set;
+	class wildcard_set;
+}
+
+/** Finds which of a set of literal strings occur within a string in a single pass
+ * using the Aho-Corasick algorithm. Characters are folded with a case map before
+ * they are compared.
+ */
+class insp::literal_set
+{
+	/** A node in the trie of literals. */
+	struct state
+	{
+		/** The transitions out of this state sorted by character. */
+		std::vector<std::pair<unsigned char, unsigned int> > edges;
+
+		/** The state for the longest proper suffix of this state which is also in the trie. */
+		unsigned int fail;
+
+		/** The indices of the literals which end at this state, including those which end at its suffixes. */
+		std::vector<size_t> outputs;
+
+		state()
+			: fail(0)
+		{
+		}
+	};
+
+	/** The states of the automaton. The first state is the root. */
+	std::vector<state> states;
+
+	/** The transitions out of the root state for every character. */
+	unsigned int root[256];
+
+	/** The case map used to fold characters. */
+	const unsigned char* map;
+
+	/** Retrieves the transition out of a state for a folded character or zero if there is none. */
+	unsigned int next(unsigned int from, unsigned char chr) const
+	{
+		const std::vector<std::pair<unsigned char, unsigned int> >& edges = states[from].edges;
+		std::vector<std::pair<unsigned char, unsigned int> >::const_iterator it = std::lower_bound(edges.begin(), edges.end(), std::make_pair(chr, 0U));
+		if (it == edges.end() || it->first != chr)
+			return 0;
+		return it->second;
+	}
+
+ public:
+	/** Creates a set which does not contain any literals. */
+	literal_set()
+		: states(1)
+		, map(NULL)
+	{
+		std::fill(root, root + 256, 0);
+	}
+
+	/** Replaces the literals in this set.
+	 * @param literals The literals to search for. Empty literals are ignored.
+	 * @param casemap The case map to fold characters with.
+	 */
+	void compile(const std::vector<std::string>& literals, const unsigned char* casemap)
+	{
+		map = casemap;
+		states.assign(1, state());
+
+		for (size_t index = 0; index < literals.size(); ++index)
+		{
+			const std::string& literal = literals[index];
+			if (literal.empty())
+				continue;
+
+			unsigned int current = 0;
+			for (std::string::const_iterator c = literal.begin(); c != literal.end(); ++c)
+			{
+				const unsigned char chr = map[static_cast<unsigned char>(*c)];
+				unsigned int target = next(current, chr);
+				if (!target)
+				{
+					target = states.size();
+					states.push_back(state());
+
+					std::vector<std::pair<unsigned char, unsigned int> >& edges = states[current].edges;
+					const std::pair<unsigned char, unsigned int> edge(chr, target);
+					edges.insert(std::lower_bound(edges.begin(), edges.end(), edge), edge);
+				}
+				current = target;
+			}
+			states[current].outputs.push_back(index);
+		}
+
+		// Work out the failure transitions breadth first so that the failure state
+		// of a state has always been finished before the state itself.
+		std::queue<unsigned int> pending;
+		pending.push(0);
+		while (!pending.empty())
+		{
+			const unsigned int current = pending.front();
+			pending.pop();
+
+			for (size_t i = 0; i < states[current].edges.size(); ++i)
+			{
+				const unsigned char chr = states[current].edges[i].first;
+				const unsigned int target = states[current].edges[i].second;
+				if (current)
+				{
+					unsigned int fail = states[current].fail;
+					while (fail && !next(fail, chr))
+						fail = states[fail].fail;
+					states[target].fail = next(fail, chr);
+
+					const std::vector<size_t>& inherited = states[states[target].fail].outputs;
+					states[target].outputs.insert(states[target].outputs.end(), inherited.begin(), inherited.end());
+				}
+				pending.push(target);
+			}
+		}
+
+		for (unsigned int chr = 0; chr < 256; ++chr)
+			root[chr] = next(0, map[chr]);
+	}
+
+	/** Finds the literals which occur within a string.
+	 * @param data The characters of the string to search.
+	 * @param length The number of characters in the string.
+	 * @param visitor A function object which is called with the index of a literal every
+	 *                time it is found. It may be called more than once for the same literal.
+	 */
+	template <typename Visitor>
+	void find(const char* data, size_t length, Visitor& visitor) const
+	{
+		if (!map)
+			return;
+
+		unsigned int current = 0;
+		for (size_t i = 0; i < length; ++i)
+		{
+			const unsigned char chr = static_cast<unsigned char>(data[i]);
+			while (current)
+			{
+				const unsigned int target = next(current, map[chr]);
+				if (target)
+				{
+					current = target;
+					break;
+				}
+				current = states[current].fail;
+			}
+
+			if (!current)
+				current = root[chr];
+
+			const std::vector<size_t>& outputs = states[current].outputs;
+			for (std::vector<size_t>::const_iterator output = outputs.begin(); output != outputs.end(); ++output)
+				visitor(*output);
+		}
+	}
+
+	/** Retrieves the number of states in the automaton. */
+	size_t size() const { return states.size(); }
+};
+
+/** A set of wildcard masks which can all be matched against a string at once.
+ *
+ * The longest run of literal characters in each mask is added to a literal_set and
+ * a mask is only matched in full when its literal occurs within the string. Masks
+ * without any literal characters are always matched in full.
+ */
+class insp::wildcard_set
+{
+	/** Records the masks whose literal has been found and matches them against the string. */
+	struct visitor
+	{
+		wildcard_set& set;
+		const std::string& str;
+		std::vector<size_t>& matches;
+
+		visitor(wildcard_set& Set, const std::string& Str, std::vector<size_t>& Matches)
+			: set(Set)
+			, str(Str)
+			, matches(Matches)
+		{
+		}
+
+		void operator()(size_t index)
+		{
+			if (set.checked[index] == set.generation)
+				return;
+
+			set.checked[index] = set.generation;
+			if (set.masks[index].match(str))
+				matches.push_back(index);
+		}
+	};
+
+	/** The compiled masks in the order they were given. */
+	std::vector<wildcard_mask> masks;
+
+	/** The longest literal of each mask. */
+	literal_set literals;
+
+	/** The indices of the masks which do not contain a literal. */
+	std::vector<size_t> unanchored;
+
+	/** The generation each mask was last matched in. Used to match every mask at most once. */
+	std::vector<unsigned int> checked;
+
+	/** The current generation. */
+	unsigned int generation;
+
+	/** The case map used to compare characters. */
+	const unsigned char* map;
+
+ public:
+	/** Creates a set which does not contain any masks. */
+	wildcard_set()
+		: generation(0)
+		, map(NULL)
+	{
+	}
+
+	/** Replaces the masks in this set.
+	 * @param wilds The masks to match against.
+	 * @param casemap The case map to compare characters with.
+	 */
+	void compile(const std::vector<std::string>& wilds, const unsigned char* casemap)
+	{
+		map = casemap;
+		masks.clear();
+		unanchored.clear();
+
+		std::vector<std::string> longest;
+		for (size_t index = 0; index < wilds.size(); ++index)
+		{
+			masks.push_back(wildcard_mask(wilds[index], casemap));
+
+			const std::string& mask = masks.back().str();
+			size_t bestpos = 0;
+			size_t bestlen = 0;
+			for (size_t start = 0; start < mask.length(); )
+			{
+				size_t end = mask.find_first_of("*?", start);
+				if (end == std::string::npos)
+					end = mask.length();
+
+				if (end - start > bestlen)
+				{
+					bestpos = start;
+					bestlen = end - start;
+				}
+				start = end + 1;
+			}
+
+			longest.push_back(mask.substr(bestpos, bestlen));
+			if (!bestlen)
+				unanchored.push_back(index);
+		}
+
+		literals.compile(longest, casemap);
+		checked.assign(masks.size(), 0);
+		generation = 0;
+	}
+
+	/** Finds the masks which match a string.
+	 * @param str The string to match. Characters after the first NUL are considered too.
+	 * @param matches The indices of the matching masks are appended to this in ascending order.
+	 */
+	void match(const std::string& str, std::vector<size_t>& matches)
+	{
+		if (++generation == 0)
+		{
+			std::fill(checked.begin(), checked.end(), 0);
+			generation = 1;
+		}
+
+		const size_t first = matches.size();
+		visitor check(*this, str, matches);
+		for (std::vector<size_t>::const_iterator index = unanchored.begin(); index != unanchored.end(); ++index)
+			check(*index);
+
+		literals.find(str.data(), str.length(), check);
+		std::sort(matches.begin() + first, matches.end());
+	}
+
+	/** Retrieves the case map which this set was compiled with. */
+	const unsigned char* casemap() const { return map; }
+
+	/** Retrieves the number of masks in this set. */
+	size_t size() const { return masks.size(); }
+};
@@ -116,6 +116,15 @@ class CoreExport XLine : public classbase
 	 */
 	virtual const std::string& Displayable() = 0;
 
+	/** Retrieves the mask which this line matches against the real hostname
+	 * and IP address of users. The XLineManager uses this to index lines so
+	 * that it only has to call Matches() on the lines which can match a user.
+	 * A line must never match a user whose real hostname and IP address do
+	 * not match this mask.
+	 * @return The host mask or NULL if this line is not matched on the host.
+	 */
+	virtual const std::string* GetHostMask() { return NULL; }
+
 	/** Called when the xline has just been added.
 	 */
 	virtual void OnAdd() { }
@@ -186,6 +195,8 @@ class CoreExport KLine : public XLine
 
 	const std::string& Displayable() CXX11_OVERRIDE;
 
+	const std::string* GetHostMask() CXX11_OVERRIDE { return &hostmask; }
+
 	bool IsBurstable() CXX11_OVERRIDE;
 
 	/** Ident mask (ident part only)
@@ -232,6 +243,8 @@ class CoreExport GLine : public XLine
 
 	const std::string& Displayable() CXX11_OVERRIDE;
 
+	const std::string* GetHostMask() CXX11_OVERRIDE { return &hostmask; }
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -276,6 +289,8 @@ class CoreExport ELine : public XLine
 
 	const std::string& Displayable() CXX11_OVERRIDE;
 
+	const std::string* GetHostMask() CXX11_OVERRIDE { return &hostmask; }
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -317,6 +332,8 @@ class CoreExport ZLine : public XLine
 
 	const std::string& Displayable() CXX11_OVERRIDE;
 
+	const std::string* GetHostMask() CXX11_OVERRIDE { return &ipaddr; }
+
 	/** IP mask (no ident part)
 	 */
 	std::string ipaddr;
@@ -399,6 +416,58 @@ class CoreExport XLineFactory
 	virtual ~XLineFactory() { }
 };
 
+/** Indexes the lines of one type on their host mask so that users can be checked
+ * against them without calling Matches() on every line.
+ *
+ * Lines with a CIDR range as their host mask are stored by range and lines with a
+ * host mask that does not contain any wildcards are stored by the lowercased mask.
+ * All other lines (including those which do not have a host mask at all) are kept
+ * in a set which has to be checked in full. The index only narrows the lines down
+ * to those which can match, callers still need to call Matches() on them.
+ *
+ * Every line is given a sequence number when it is added so that the lines which
+ * can match are always returned in the order they were added in.
+ */
+class CoreExport XLineIndex
+{
+ public:
+	/** A line and the sequence number it was added to the index with. */
+	typedef std::pair<unsigned long, XLine*> Entry;
+
+	/** A list of lines ordered by sequence number. */
+	typedef std::vector<Entry> EntryList;
+
+ private:
+	typedef TR1NS::unordered_multimap<std::string, Entry, TR1NS::hash<std::string> > HostMap;
+	typedef TR1NS::unordered_map<XLine*, unsigned long> SequenceMap;
+
+	/** The sequence number of every line in the index. */
+	SequenceMap sequences;
+
+	/** Lines with a host mask which does not contain any wildcards, keyed by the lowercased mask. */
+	HostMap hosts;
+
+	/** Lines with a CIDR range as their host mask. */
+	irc::sockets::cidr_index<Entry> ranges;
+
+	/** Lines which are not indexed, ordered by sequence number. */
+	std::set<Entry> unindexed;
+
+ public:
+	/** Adds a line to the index. */
+	void Add(XLine* line);
+
+	/** Removes a line from the index. */
+	void Remove(XLine* line);
+
+	/** Finds the lines which may match a user.
+	 * @param user The user to find lines for.
+	 * @param lines The list to add the lines to, in the order they were added to the index.
+	 * Lines which are not indexed are always added.
+	 */
+	void Find(User* user, EntryList& lines) const;
+};
+
 /** XLineManager is a class used to manage G-lines, K-lines, E-lines, Z-lines and Q-lines,
  * or any other line created by a module. It also manages XLineFactory classes which
  * can generate a specialized XLine for use by another module.
@@ -421,6 +490,18 @@ class CoreExport XLineManager
 	 */
 	XLineContainer lookup_lines;
 
+	/** Indexes of the lines in lookup_lines by type. */
+	std::map<std::string, XLineIndex> line_indexes;
+
+	/** Finds the first line in an index which matches a user.
+	 * @param index The index to search.
+	 * @param user The user to match against.
+	 * @param expired If non-NULL then the masks of lines which were found to have
+	 * expired are added to this. Expired lines are never returned.
+	 * @return The matching line or NULL if there is no match.
+	 */
+	XLine* FindLine(const XLineIndex& index, User* user, std::vector<std::string>* expired);
+
  public:
 
 	/** Constructor
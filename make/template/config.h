@@ -55,4 +55,7 @@
 /*** Whether the eventfd() function was available at compile time. */
  %define HAS_EVENTFD
 
+/*** Whether the socket engine performs socket I/O itself. */
+ %define HAS_SOCKETENGINE_IO
+
 #endif
@@ -0,0 +1,31 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+// We only check that the headers are new enough here. Whether the running
+// kernel supports io_uring is checked at runtime and if it doesn't then the
+// socket engine falls back to epoll.
+int main() {
+	io_uring_params params = io_uring_params();
+	io_uring_getevents_arg arg = io_uring_getevents_arg();
+	unsigned int features = IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	unsigned int flags = IORING_POLL_ADD_MULTI | IORING_CQE_F_MORE;
+	long syscalls = __NR_io_uring_setup + __NR_io_uring_enter;
+	return (params.flags + arg.pad + features + flags + syscalls) ? 0 : 1;
+}
@@ -210,7 +210,7 @@ Channel* Channel::JoinUser(LocalUser* user, std::string cname, bool override, co
 		{
 			// Ask the modules whether they're ok with the join, pass NULL as Channel* as the channel is yet to be created
 			ModResult MOD_RESULT;
-			FIRST_MOD_RESULT(OnUserPreJoin, MOD_RESULT, (user, NULL, cname, privs, key));
+			FIRST_MOD_RESULT_FILTERED(OnUserPreJoin, (user), MOD_RESULT, (user, NULL, cname, privs, key));
 			if (MOD_RESULT == MOD_RES_DENY)
 				return NULL; // A module wasn't happy with the join, abort
 		}
@@ -228,7 +228,7 @@ Channel* Channel::JoinUser(LocalUser* user, std::string cname, bool override, co
 		if (override == false)
 		{
 			ModResult MOD_RESULT;
-			FIRST_MOD_RESULT(OnUserPreJoin, MOD_RESULT, (user, chan, cname, privs, key));
+			FIRST_MOD_RESULT_FILTERED(OnUserPreJoin, (user, chan), MOD_RESULT, (user, chan, cname, privs, key));
 
 			// A module explicitly denied the join and (hopefully) generated a message
 			// describing the situation, so we may stop here without sending anything
@@ -289,12 +289,12 @@ Membership* Channel::ForceJoin(User* user, const std::string* privs, bool bursti
 
 	// Tell modules about this join, they have the chance now to populate except_list with users we won't send the JOIN (and possibly MODE) to
 	CUList except_list;
-	FOREACH_MOD(OnUserJoin, (memb, bursting, created_by_local, except_list));
+	FOREACH_MOD_FILTERED(OnUserJoin, (user, this), (memb, bursting, created_by_local, except_list));
 
 	ClientProtocol::Events::Join joinevent(memb);
 	this->Write(joinevent, 0, except_list);
 
-	FOREACH_MOD(OnPostJoin, (memb));
+	FOREACH_MOD_FILTERED(OnPostJoin, (user, this), (memb));
 	return memb;
 }
 
@@ -310,12 +310,39 @@ bool Channel::IsBanned(User* user)
 	if (!banlm)
 		return false;
 
-	const ListModeBase::ModeList* bans = banlm->GetList(this);
-	if (bans)
+	const BanIndex* index = banlm->GetBanIndex(this);
+	if (!index)
+		return false;
+
+	// The result for a member is cached until either the ban list or the user changes.
+	Membership* memb = GetUser(user);
+	if (!memb)
+	{
+		if (index->Matches(user))
+			return true;
+	}
+	else
+	{
+		const unsigned long generation = banlm->GetGeneration(this);
+		if ((memb->bangeneration != generation) || (memb->banusergeneration != user->GetCacheGeneration()))
+		{
+			memb->banned = index->Matches(user);
+			memb->bangeneration = generation;
+			memb->banusergeneration = user->GetCacheGeneration();
+		}
+
+		if (memb->banned)
+			return true;
+	}
+
+	// Extbans can only be matched by modules which implement OnCheckBan. They can depend
+	// on anything about the user so they are checked one at a time and never cached.
+	if (!ServerInstance->Modules->EventHandlers[I_OnCheckBan].empty())
 	{
-		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); it++)
+		const std::vector<std::string>& extbans = index->GetExtBans();
+		for (std::vector<std::string>::const_iterator i = extbans.begin(); i != extbans.end(); ++i)
 		{
-			if (CheckBan(user, it->mask))
+			if (CheckBan(user, *i))
 				return true;
 		}
 	}
@@ -389,7 +416,7 @@ bool Channel::PartUser(User* user, std::string& reason)
 
 	Membership* memb = membiter->second;
 	CUList except_list;
-	FOREACH_MOD(OnUserPart, (memb, reason, except_list));
+	FOREACH_MOD_FILTERED(OnUserPart, (user, this), (memb, reason, except_list));
 
 	ClientProtocol::Messages::Part partmsg(memb, reason);
 	Write(ServerInstance->GetRFCEvents().part, partmsg, 0, except_list);
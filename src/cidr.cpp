@@ -63,10 +63,7 @@ bool irc::sockets::MatchCIDR(const std::string &address, const std::string &cidr
 		cidr_copy.assign(cidr_mask);
 	}
 
-	const std::string::size_type per_pos = cidr_copy.rfind('/');
-	if ((per_pos == std::string::npos) || (per_pos == cidr_copy.length()-1)
-		|| (cidr_copy.find_first_not_of("0123456789", per_pos+1) != std::string::npos)
-		|| (cidr_copy.find_first_not_of("0123456789abcdefABCDEF.:") < per_pos))
+	if (!IsCIDRMask(cidr_copy))
 	{
 		// The CIDR mask is invalid
 		return false;
@@ -84,3 +81,13 @@ bool irc::sockets::MatchCIDR(const std::string &address, const std::string &cidr
 
 	return mask == mask2;
 }
+
+bool irc::sockets::IsCIDRMask(const std::string& mask)
+{
+	const std::string::size_type pos = mask.rfind('/');
+	if ((pos == std::string::npos) || (pos == mask.length() - 1))
+		return false;
+
+	return (mask.find_first_not_of("0123456789", pos + 1) == std::string::npos)
+		&& (mask.find_first_not_of("0123456789abcdefABCDEF.:") >= pos);
+}
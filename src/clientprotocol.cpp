@@ -65,22 +65,58 @@ const ClientProtocol::SerializedMessage& ClientProtocol::Serializer::SerializeFo
 		msg.msginit_done = true;
 		FOREACH_MOD_CUSTOM(evprov, MessageTagProvider, OnPopulateTags, (msg));
 	}
-	return msg.GetSerialized(Message::SerializedInfo(this, MakeTagWhitelist(user, msg.GetTags())));
+
+	if (msg.profilestate == Message::PROFILE_UNKNOWN)
+	{
+		msg.profilestate = Message::PROFILE_YES;
+		for (TagMap::const_iterator i = msg.GetTags().begin(); i != msg.GetTags().end(); ++i)
+		{
+			if (!i->second.tagprov->UsesTagProfile())
+			{
+				msg.profilestate = Message::PROFILE_NO;
+				break;
+			}
+		}
+	}
+
+	if (msg.profilestate == Message::PROFILE_NO)
+		return msg.GetSerialized(Message::SerializedInfo(this, MakeTagWhitelist(user, msg.GetTags())));
+
+	// Every user with the same tag profile gets the same tags so only build the tag
+	// selection for the first user with each profile.
+	for (Message::ProfileList::const_iterator i = msg.proflist.begin(); i != msg.proflist.end(); ++i)
+	{
+		const Message::ProfileInfo& info = *i;
+		if ((info.serializer == this) && (info.tagprofile == user->tagprofile))
+			return msg.serlist[info.index].second;
+	}
+
+	Message::ProfileInfo info;
+	info.serializer = this;
+	info.tagprofile = user->tagprofile;
+	info.index = msg.GetSerializedIndex(Message::SerializedInfo(this, MakeTagWhitelist(user, msg.GetTags())));
+	msg.proflist.push_back(info);
+	return msg.serlist[info.index].second;
 }
 
 const ClientProtocol::SerializedMessage& ClientProtocol::Message::GetSerialized(const SerializedInfo& serializeinfo) const
+{
+	return serlist[GetSerializedIndex(serializeinfo)].second;
+}
+
+size_t ClientProtocol::Message::GetSerializedIndex(const SerializedInfo& serializeinfo) const
 {
 	// First check if the serialized line they're asking for is in the cache
-	for (SerializedList::const_iterator i = serlist.begin(); i != serlist.end(); ++i)
+	for (size_t i = 0; i < serlist.size(); ++i)
 	{
-		const SerializedInfo& curr = i->first;
+		const SerializedInfo& curr = serlist[i].first;
 		if (curr == serializeinfo)
-			return i->second;
+			return i;
 	}
 
 	// Not cached, generate it and put it in the cache for later use
 	serlist.push_back(std::make_pair(serializeinfo, serializeinfo.serializer->Serialize(*this, serializeinfo.tagwl)));
-	return serlist.back().second;
+	return serlist.size() - 1;
 }
 
 void ClientProtocol::Event::GetMessagesForUser(LocalUser* user, MessageList& messagelist)
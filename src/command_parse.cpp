@@ -110,6 +110,18 @@ bool CommandParser::LoopCall(User* user, Command* handler, const CommandBase::Pa
 
 Command* CommandParser::GetHandler(const std::string &commandname)
 {
+	if (fastcmdlistdirty)
+	{
+		std::vector<insp::perfect_hash_map<Command*>::value_type> commands(cmdlist.begin(), cmdlist.end());
+		fastcmdlist.build(commands);
+		fastcmdlistdirty = false;
+	}
+
+	// Clients almost always send command names in the same case as they were registered.
+	Command* const* fastcmd = fastcmdlist.find(commandname);
+	if (fastcmd)
+		return *fastcmd;
+
 	CommandMap::iterator n = cmdlist.find(commandname);
 	if (n != cmdlist.end())
 		return n->second;
@@ -296,7 +308,9 @@ void CommandParser::ProcessCommand(LocalUser* user, std::string& command, Comman
 		/*
 		 * WARNING: be careful, the user may be deleted soon
 		 */
+		const uint64_t start = InspIRCd::GetMicroseconds();
 		CmdResult result = handler->Handle(user, command_p);
+		handler->use_time += InspIRCd::GetMicroseconds() - start;
 
 		FOREACH_MOD(OnPostCommand, (handler, command_p, user, result, false));
 	}
@@ -306,7 +320,10 @@ void CommandParser::RemoveCommand(Command* x)
 {
 	CommandMap::iterator n = cmdlist.find(x->name);
 	if (n != cmdlist.end() && n->second == x)
+	{
 		cmdlist.erase(n);
+		fastcmdlistdirty = true;
+	}
 }
 
 CommandBase::CommandBase(Module* mod, const std::string& cmd, unsigned int minpara, unsigned int maxpara)
@@ -315,6 +332,7 @@ CommandBase::CommandBase(Module* mod, const std::string& cmd, unsigned int minpa
 	, min_params(minpara)
 	, max_params(maxpara)
 	, use_count(0)
+	, use_time(0)
 	, works_before_reg(false)
 	, allow_empty_last_param(true)
 	, Penalty(1)
@@ -353,15 +371,26 @@ void Command::RegisterService()
 
 void CommandParser::ProcessBuffer(LocalUser* user, const std::string& buffer)
 {
-	ClientProtocol::ParseOutput parseoutput;
+	// Handlers can process other lines (e.g. m_passforward) so only the outermost
+	// line can use the shared buffer.
+	ClientProtocol::ParseOutput localbuffer;
+	ClientProtocol::ParseOutput& parseoutput = (parsedepth ? localbuffer : parsebuffer);
 	if (!user->serializer->Parse(user, buffer, parseoutput))
 		return;
 
 	std::string& command = parseoutput.cmd;
 	std::transform(command.begin(), command.end(), command.begin(), ::toupper);
 
-	CommandBase::Params parameters(parseoutput.params, parseoutput.tags);
+	// The parameters are swapped in and out of the parser output instead of being
+	// copied so that their storage can be reused for the next line.
+	CommandBase::Params parameters(ClientProtocol::ParamList(), parseoutput.tags);
+	parameters.swap(parseoutput.params);
+
+	parsedepth++;
 	ProcessCommand(user, command, parameters);
+	parsedepth--;
+
+	parameters.swap(parseoutput.params);
 }
 
 bool CommandParser::AddCommand(Command *f)
@@ -370,12 +399,15 @@ bool CommandParser::AddCommand(Command *f)
 	if (cmdlist.find(f->name) == cmdlist.end())
 	{
 		cmdlist[f->name] = f;
+		fastcmdlistdirty = true;
 		return true;
 	}
 	return false;
 }
 
 CommandParser::CommandParser()
+	: fastcmdlistdirty(false)
+	, parsedepth(0)
 {
 }
 
@@ -62,6 +62,7 @@ ServerConfig::ServerConfig()
 	: EmptyTag(CreateEmptyTag())
 	, Limits(EmptyTag)
 	, Paths(EmptyTag)
+	, ProfileHooks(false)
 	, RawLog(false)
 	, NoSnoticeStack(false)
 {
@@ -319,6 +320,146 @@ void ServerConfig::CrossCheckConnectBlocks(ServerConfig* current)
 	}
 }
 
+ConnectClassIndex::ConnectClassIndex()
+	: map(NULL)
+	, casemapgen(0)
+{
+}
+
+void ConnectClassIndex::Add(Bucket& bucket, size_t pos)
+{
+	const std::string& host = classes[pos]->GetHost();
+	if (!host.empty() && host.find_first_not_of('*') == std::string::npos)
+	{
+		bucket.any.push_back(pos);
+		return;
+	}
+
+	// Masks which contain a username part are matched by irc::sockets::MatchCIDR() in
+	// a special way so they are left to the slow path along with wildcard masks.
+	if (!host.empty() && host.find_first_of("*?@") == std::string::npos)
+	{
+		std::string folded(host);
+		for (std::string::iterator i = folded.begin(); i != folded.end(); ++i)
+			*i = map[static_cast<unsigned char>(*i)];
+
+		if (!irc::sockets::IsCIDRMask(host))
+		{
+			bucket.hosts.insert(std::make_pair(folded, pos));
+			return;
+		}
+
+		if (bucket.ranges.add(irc::sockets::cidr_mask(host), pos))
+		{
+			// The mask is also compared against the host and IP address as a string.
+			bucket.hosts.insert(std::make_pair(folded, pos));
+			return;
+		}
+	}
+
+	bucket.unindexed.push_back(pos);
+}
+
+void ConnectClassIndex::Build(const std::vector<reference<ConnectClass> >& list)
+{
+	classes.assign(list.begin(), list.end());
+	anyport = Bucket();
+	ports.clear();
+	names.clear();
+	map = national_case_insensitive_map;
+	casemapgen = national_case_insensitive_generation;
+
+	for (size_t pos = 0; pos < classes.size(); ++pos)
+	{
+		ConnectClass* c = classes[pos];
+		names[c->name] = c;
+		if (c->type == CC_NAMED)
+			continue;
+
+		if (c->ports.empty())
+		{
+			Add(anyport, pos);
+			continue;
+		}
+
+		for (insp::flat_set<int>::const_iterator i = c->ports.begin(); i != c->ports.end(); ++i)
+			Add(ports[*i], pos);
+	}
+}
+
+void ConnectClassIndex::Bucket::Find(LocalUser* user, const std::vector<ConnectClass*>& classes, const unsigned char* map, std::vector<size_t>& out) const
+{
+	out.insert(out.end(), any.begin(), any.end());
+
+	const std::string& ipaddr = user->GetIPString();
+	const std::string& realhost = user->GetRealHost();
+	const bool hostisip = (realhost == ipaddr);
+
+	if (!hosts.empty())
+	{
+		std::string folded(ipaddr);
+		for (size_t j = 0; j < 2; ++j)
+		{
+			for (std::string::iterator i = folded.begin(); i != folded.end(); ++i)
+				*i = map[static_cast<unsigned char>(*i)];
+
+			std::pair<HostMap::const_iterator, HostMap::const_iterator> matches = hosts.equal_range(folded);
+			for (HostMap::const_iterator i = matches.first; i != matches.second; ++i)
+				out.push_back(i->second);
+
+			if (hostisip)
+				break;
+			folded = realhost;
+		}
+	}
+
+	if (!ranges.empty())
+	{
+		ranges.find(user->client_sa, out);
+
+		// The real hostname is also matched against ranges if it is an IP address.
+		irc::sockets::sockaddrs addr;
+		if (!hostisip && irc::sockets::aptosa(realhost, 0, addr))
+			ranges.find(addr, out);
+	}
+
+	for (std::vector<size_t>::const_iterator i = unindexed.begin(); i != unindexed.end(); ++i)
+	{
+		const std::string& host = classes[*i]->GetHost();
+		if (InspIRCd::MatchCIDR(ipaddr, host, map) || InspIRCd::MatchCIDR(realhost, host, map))
+			out.push_back(*i);
+	}
+}
+
+void ConnectClassIndex::Find(LocalUser* user, const std::vector<reference<ConnectClass> >& list, std::vector<ConnectClass*>& out)
+{
+	if (casemapgen != national_case_insensitive_generation)
+		Build(list);
+
+	std::vector<size_t> found;
+	anyport.Find(user, classes, map, found);
+
+	std::map<int, Bucket>::const_iterator bucket = ports.find(user->server_sa.port());
+	if (bucket != ports.end())
+		bucket->second.Find(user, classes, map, found);
+
+	// A class can be found more than once if it matches both the address and the hostname.
+	std::sort(found.begin(), found.end());
+	found.erase(std::unique(found.begin(), found.end()), found.end());
+
+	for (std::vector<size_t>::const_iterator i = found.begin(); i != found.end(); ++i)
+		out.push_back(classes[*i]);
+}
+
+ConnectClass* ConnectClassIndex::Find(const std::string& name, const std::vector<reference<ConnectClass> >& list)
+{
+	if (casemapgen != national_case_insensitive_generation)
+		Build(list);
+
+	std::map<std::string, ConnectClass*>::const_iterator i = names.find(name);
+	return (i != names.end() ? i->second : NULL);
+}
+
 static std::string GetServerName()
 {
 #ifndef _WIN32
@@ -356,6 +497,7 @@ void ServerConfig::Fill()
 			national_case_insensitive_map = rfc_case_insensitive_map;
 		else
 			throw CoreException("<options:casemapping> must be set to 'ascii', or 'rfc1459'");
+		national_case_insensitive_generation++;
 	}
 	else
 	{
@@ -377,6 +519,7 @@ void ServerConfig::Fill()
 	CCOnConnect = ConfValue("performance")->getBool("clonesonconnect", true);
 	MaxConn = ConfValue("performance")->getUInt("somaxconn", SOMAXCONN);
 	TimeSkipWarn = ConfValue("performance")->getDuration("timeskipwarn", 2, 0, 30);
+	ProfileHooks = ConfValue("performance")->getBool("hookstats");
 	XLineMessage = options->getString("xlinemessage", options->getString("moronbanner", "You're banned!"));
 	ServerDesc = server->getString("description", "Configure Me");
 	Network = server->getString("network", "Network");
@@ -19,15 +19,123 @@
 
 
 #include "inspircd.h"
+#include "hashcursor.h"
+#include "wildcard.h"
+
+/** The maximum number of channels which are looked at for a LIST request before the
+ * rest of the request is left for later so that one request can not stall the server.
+ */
+static const size_t MaxChannelsPerPass = 2000;
+
+/** The number of milliseconds between attempts to continue unfinished LIST requests. */
+static const unsigned int ResumeInterval = 20;
+
+/** A LIST request which has not been fully answered yet. */
+struct ListRequest
+{
+	/** The user who sent the request. */
+	LocalUser* const user;
+
+	// C: Searching based on creation time, via the "C<val" and "C>val" modifiers
+	// to search for a channel creation time that is lower or higher than val
+	// respectively.
+	time_t mincreationtime;
+	time_t maxcreationtime;
+
+	// M: Searching based on mask.
+	// N: Searching based on !mask.
+	bool match_name_topic;
+	bool match_inverted;
+	insp::wildcard_mask match;
+
+	// T: Searching based on topic time, via the "T<val" and "T>val" modifiers to
+	// search for a topic time that is lower or higher than val respectively.
+	time_t mintopictime;
+	time_t maxtopictime;
+
+	// U: Searching based on user count within the channel, via the "<val" and
+	// ">val" modifiers to search for a channel that has less than or more than
+	// val users respectively.
+	size_t minusers;
+	size_t maxusers;
+
+	/** The position of the request in the channel list. */
+	insp::hash_cursor<chan_hash> cursor;
+
+	ListRequest(LocalUser* source)
+		: user(source)
+		, mincreationtime(0)
+		, maxcreationtime(0)
+		, match_name_topic(false)
+		, match_inverted(false)
+		, mintopictime(0)
+		, maxtopictime(0)
+		, minusers(0)
+		, maxusers(0)
+	{
+	}
+};
 
 /** Handle /LIST.
  */
 class CommandList : public Command
 {
  private:
+	/** Continues unfinished LIST requests once the sendq of their source has drained. */
+	class ResumeTimer : public Timer
+	{
+		CommandList& cmd;
+
+	 public:
+		ResumeTimer(CommandList& parent)
+			: Timer(0)
+			, cmd(parent)
+		{
+		}
+
+		bool Tick(time_t) CXX11_OVERRIDE
+		{
+			cmd.ResumeRequests();
+			return true;
+		}
+	};
+
 	ChanModeReference secretmode;
 	ChanModeReference privatemode;
 
+	/** The LIST requests which are waiting for the sendq of their source to drain. */
+	std::vector<ListRequest*> pending;
+
+	/** Ticks while there are pending LIST requests. */
+	ResumeTimer timer;
+
+	/** Looks at the channels of the channel list for a request until enough have been
+	 * looked at or the sendq of the source fills up.
+	 */
+	class ChannelVisitor
+	{
+		CommandList& cmd;
+		ListRequest* const request;
+		const bool has_privs;
+		size_t count;
+
+	 public:
+		ChannelVisitor(CommandList& parent, ListRequest* req)
+			: cmd(parent)
+			, request(req)
+			, has_privs(req->user->HasPrivPermission("channels/auspex"))
+			, count(0)
+		{
+		}
+
+		bool operator()(Channel* chan)
+		{
+			cmd.ListChannel(request->user, *request, chan, has_privs);
+			return (++count < MaxChannelsPerPass) && !IsBusy(request->user);
+		}
+	};
+	friend class ChannelVisitor;
+
 	/** Parses the creation time or topic set time out of a LIST parameter.
 	 * @param value The parameter containing a minute count.
 	 * @return The UNIX time at \p value minutes ago.
@@ -40,6 +148,27 @@ class CommandList : public Command
 		return ServerInstance->Time() - (minutes * 60);
 	}
 
+	/** Determines whether the sendq of a user is too full to send them more LIST replies. */
+	static bool IsBusy(LocalUser* user)
+	{
+		return user && user->eh.getSendQSize() >= user->MyClass->GetSendqSoftMax();
+	}
+
+	/** Sends the LIST reply for a channel to a user if it matches their request. */
+	void ListChannel(User* user, const ListRequest& request, Channel* chan, bool has_privs);
+
+	/** Sends the LIST replies for the channels of a pending request until the sendq of
+	 * the source fills up or too many channels have been looked at.
+	 * @return True if the request has been finished; otherwise, false.
+	 */
+	bool ContinueRequest(ListRequest* request);
+
+	/** Finishes all LIST requests by a user which are still pending.
+	 * @param user The user whose requests should be finished.
+	 * @param sendend Whether to send the end of list numeric to the user.
+	 */
+	void FinishRequests(LocalUser* user, bool sendend);
+
  public:
 	/** Constructor for list.
 	 */
@@ -47,11 +176,26 @@ class CommandList : public Command
 		: Command(parent,"LIST", 0, 0)
 		, secretmode(creator, "secret")
 		, privatemode(creator, "private")
+		, timer(*this)
 	{
 		allow_empty_last_param = false;
 		Penalty = 5;
 	}
 
+	~CommandList()
+	{
+		stdalgo::delete_all(pending);
+	}
+
+	/** Continues the pending LIST requests of every user whose sendq has drained. */
+	void ResumeRequests();
+
+	/** Forgets the pending LIST requests of a user who is disconnecting. */
+	void RemoveUser(LocalUser* user)
+	{
+		FinishRequests(user, false);
+	}
+
 	/** Handle command.
 	 * @param parameters The parameters to the command
 	 * @param user The user issuing the command
@@ -60,134 +204,183 @@ class CommandList : public Command
 	CmdResult Handle(User* user, const Params& parameters) CXX11_OVERRIDE;
 };
 
+void CommandList::ListChannel(User* user, const ListRequest& request, Channel* chan, bool has_privs)
+{
+	// Check the user count if a search has been specified.
+	const size_t users = chan->GetUserCounter();
+	if ((request.minusers && users <= request.minusers) || (request.maxusers && users >= request.maxusers))
+		return;
 
-/** Handle /LIST
- */
-CmdResult CommandList::Handle(User* user, const Params& parameters)
+	// Check the creation ts if a search has been specified.
+	const time_t creationtime = chan->age;
+	if ((request.mincreationtime && creationtime <= request.mincreationtime) || (request.maxcreationtime && creationtime >= request.maxcreationtime))
+		return;
+
+	// Check the topic ts if a search has been specified.
+	const time_t topictime = chan->topicset;
+	if ((request.mintopictime && (!topictime || topictime <= request.mintopictime)) || (request.maxtopictime && (!topictime || topictime >= request.maxtopictime)))
+		return;
+
+	// Attempt to match a glob pattern.
+	if (request.match_name_topic)
+	{
+		bool matches = request.match.match(chan->name) || request.match.match(chan->topic);
+
+		// The user specified an match that we did not match.
+		if (!matches && !request.match_inverted)
+			return;
+
+		// The user specified an inverted match that we did match.
+		if (matches && request.match_inverted)
+			return;
+	}
+
+	// if the channel is not private/secret, OR the user is on the channel anyway
+	bool n = (has_privs || chan->HasUser(user));
+
+	// If we're not in the channel and +s is set on it, we want to ignore it
+	if ((n) || (!chan->IsModeSet(secretmode)))
+	{
+		if ((!n) && (chan->IsModeSet(privatemode)))
+		{
+			// Channel is private (+p) and user is outside/not privileged
+			user->WriteNumeric(RPL_LIST, '*', users, "");
+		}
+		else
+		{
+			/* User is in the channel/privileged, channel is not +s */
+			user->WriteNumeric(RPL_LIST, chan->name, users, InspIRCd::Format("[+%s] %s", chan->ChanModes(n), chan->topic.c_str()));
+		}
+	}
+}
+
+bool CommandList::ContinueRequest(ListRequest* request)
 {
-	// C: Searching based on creation time, via the "C<val" and "C>val" modifiers
-	// to search for a channel creation time that is lower or higher than val
-	// respectively.
-	time_t mincreationtime = 0;
-	time_t maxcreationtime = 0;
+	ChannelVisitor visitor(*this, request);
+	if (!request->cursor.step(ServerInstance->GetChans(), visitor))
+		return false;
 
-	// M: Searching based on mask.
-	// N: Searching based on !mask.
-	bool match_name_topic = false;
-	bool match_inverted = false;
-	const char* match = NULL;
+	request->user->WriteNumeric(RPL_LISTEND, "End of channel list.");
+	return true;
+}
 
-	// T: Searching based on topic time, via the "T<val" and "T>val" modifiers to
-	// search for a topic time that is lower or higher than val respectively.
-	time_t mintopictime = 0;
-	time_t maxtopictime = 0;
+void CommandList::FinishRequests(LocalUser* user, bool sendend)
+{
+	for (std::vector<ListRequest*>::iterator i = pending.begin(); i != pending.end(); )
+	{
+		ListRequest* request = *i;
+		if (request->user != user)
+		{
+			++i;
+			continue;
+		}
 
-	// U: Searching based on user count within the channel, via the "<val" and
-	// ">val" modifiers to search for a channel that has less than or more than
-	// val users respectively.
-	size_t minusers = 0;
-	size_t maxusers = 0;
+		if (sendend)
+			user->WriteNumeric(RPL_LISTEND, "End of channel list.");
+		delete request;
+		i = pending.erase(i);
+	}
+}
 
+void CommandList::ResumeRequests()
+{
+	for (std::vector<ListRequest*>::iterator i = pending.begin(); i != pending.end(); )
+	{
+		ListRequest* request = *i;
+		if (IsBusy(request->user) || !ContinueRequest(request))
+		{
+			++i;
+			continue;
+		}
+
+		delete request;
+		i = pending.erase(i);
+	}
+
+	if (!pending.empty())
+		timer.SetIntervalMS(ResumeInterval);
+}
+
+/** Handle /LIST
+ */
+CmdResult CommandList::Handle(User* user, const Params& parameters)
+{
+	LocalUser* const luser = IS_LOCAL(user);
+	ListRequest* request = new ListRequest(luser);
 	for (Params::const_iterator iter = parameters.begin(); iter != parameters.end(); ++iter)
 	{
 		const std::string& constraint = *iter;
 		if (constraint[0] == '<')
 		{
-			maxusers = ConvToNum<size_t>(constraint.c_str() + 1);
+			request->maxusers = ConvToNum<size_t>(constraint.c_str() + 1);
 		}
 		else if (constraint[0] == '>')
 		{
-			minusers = ConvToNum<size_t>(constraint.c_str() + 1);
+			request->minusers = ConvToNum<size_t>(constraint.c_str() + 1);
 		}
 		else if (!constraint.compare(0, 2, "C<", 2) || !constraint.compare(0, 2, "c<", 2))
 		{
-			mincreationtime = ParseMinutes(constraint);
+			request->mincreationtime = ParseMinutes(constraint);
 		}
 		else if (!constraint.compare(0, 2, "C>", 2) || !constraint.compare(0, 2, "c>", 2))
 		{
-			maxcreationtime = ParseMinutes(constraint);
+			request->maxcreationtime = ParseMinutes(constraint);
 		}
 		else if (!constraint.compare(0, 2, "T<", 2) || !constraint.compare(0, 2, "t<", 2))
 		{
-			mintopictime = ParseMinutes(constraint);
+			request->mintopictime = ParseMinutes(constraint);
 		}
 		else if (!constraint.compare(0, 2, "T>", 2) || !constraint.compare(0, 2, "t>", 2))
 		{
-			maxtopictime = ParseMinutes(constraint);
+			request->maxtopictime = ParseMinutes(constraint);
 		}
 		else
 		{
 			// If the glob is prefixed with ! it is inverted.
-			match = constraint.c_str();
-			if (match[0] == '!')
+			const char* glob = constraint.c_str();
+			if (glob[0] == '!')
 			{
-				match_inverted = true;
-				match += 1;
+				request->match_inverted = true;
+				glob += 1;
 			}
 
 			// Ensure that the user didn't just run "LIST !".
-			if (match[0])
-				match_name_topic = true;
+			if (glob[0])
+			{
+				request->match.compile(glob, national_case_insensitive_map);
+				request->match_name_topic = true;
+			}
 		}
 	}
 
-	const bool has_privs = user->HasPrivPermission("channels/auspex");
+	// A user only gets one channel list at a time.
+	if (luser)
+		FinishRequests(luser, true);
 
 	user->WriteNumeric(RPL_LISTSTART, "Channel", "Users Name");
-	const chan_hash& chans = ServerInstance->GetChans();
-	for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+	if (!luser)
 	{
-		Channel* const chan = i->second;
-
-		// Check the user count if a search has been specified.
-		const size_t users = chan->GetUserCounter();
-		if ((minusers && users <= minusers) || (maxusers && users >= maxusers))
-			continue;
-
-		// Check the creation ts if a search has been specified.
-		const time_t creationtime = chan->age;
-		if ((mincreationtime && creationtime <= mincreationtime) || (maxcreationtime && creationtime >= maxcreationtime))
-			continue;
-
-		// Check the topic ts if a search has been specified.
-		const time_t topictime = chan->topicset;
-		if ((mintopictime && (!topictime || topictime <= mintopictime)) || (maxtopictime && (!topictime || topictime >= maxtopictime)))
-			continue;
+		const bool has_privs = user->HasPrivPermission("channels/auspex");
+		const chan_hash& chans = ServerInstance->GetChans();
+		for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+			ListChannel(user, *request, i->second, has_privs);
+		user->WriteNumeric(RPL_LISTEND, "End of channel list.");
 
-		// Attempt to match a glob pattern.
-		if (match_name_topic)
-		{
-			bool matches = InspIRCd::Match(chan->name, match) || InspIRCd::Match(chan->topic, match);
-
-			// The user specified an match that we did not match.
-			if (!matches && !match_inverted)
-				continue;
-
-			// The user specified an inverted match that we did match.
-			if (matches && match_inverted)
-				continue;
-		}
-
-		// if the channel is not private/secret, OR the user is on the channel anyway
-		bool n = (has_privs || chan->HasUser(user));
+		delete request;
+		return CMD_SUCCESS;
+	}
 
-		// If we're not in the channel and +s is set on it, we want to ignore it
-		if ((n) || (!chan->IsModeSet(secretmode)))
-		{
-			if ((!n) && (chan->IsModeSet(privatemode)))
-			{
-				// Channel is private (+p) and user is outside/not privileged
-				user->WriteNumeric(RPL_LIST, '*', users, "");
-			}
-			else
-			{
-				/* User is in the channel/privileged, channel is not +s */
-				user->WriteNumeric(RPL_LIST, chan->name, users, InspIRCd::Format("[+%s] %s", chan->ChanModes(n), chan->topic.c_str()));
-			}
-		}
+	// Local users get the rest of the list once their sendq has drained. The request
+	// keeps its position in the channel list so that it can carry on from there.
+	if (!IsBusy(luser) && ContinueRequest(request))
+	{
+		delete request;
+		return CMD_SUCCESS;
 	}
-	user->WriteNumeric(RPL_LISTEND, "End of channel list.");
 
+	if (pending.empty())
+		timer.SetIntervalMS(ResumeInterval);
+	pending.push_back(request);
 	return CMD_SUCCESS;
 }
 
@@ -202,6 +395,11 @@ class CoreModList : public Module
 	{
 	}
 
+	void OnUserDisconnect(LocalUser* user) CXX11_OVERRIDE
+	{
+		cmd.RemoveUser(user);
+	}
+
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
 	{
 		tokens["ELIST"] = "CMNTU";
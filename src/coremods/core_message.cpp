@@ -97,11 +97,16 @@ public:
 
 namespace
 {
+	Channel* GetTargetChannel(const MessageTarget& msgtarget)
+	{
+		return msgtarget.type == MessageTarget::TYPE_CHANNEL ? msgtarget.Get<Channel>() : NULL;
+	}
+
 	bool FirePreEvents(User* source, MessageTarget& msgtarget, MessageDetails& msgdetails)
 	{
 		// Inform modules that a message wants to be sent.
 		ModResult modres;
-		FIRST_MOD_RESULT(OnUserPreMessage, modres, (source, msgtarget, msgdetails));
+		FIRST_MOD_RESULT_FILTERED(OnUserPreMessage, (source, GetTargetChannel(msgtarget)), modres, (source, msgtarget, msgdetails));
 		if (modres == MOD_RES_DENY)
 		{
 			// Inform modules that a module blocked the mssage.
@@ -117,7 +122,7 @@ namespace
 		}
 
 		// Inform modules that a message is about to be sent.
-		FOREACH_MOD(OnUserMessage, (source, msgtarget, msgdetails));
+		FOREACH_MOD_FILTERED(OnUserMessage, (source, GetTargetChannel(msgtarget)), (source, msgtarget, msgdetails));
 		return true;
 	}
 
@@ -129,7 +134,7 @@ namespace
 			lsource->idle_lastmsg = ServerInstance->Time();
 
 		// Inform modules that a message was sent.
-		FOREACH_MOD(OnUserPostMessage, (source, msgtarget, msgdetails));
+		FOREACH_MOD_FILTERED(OnUserPostMessage, (source, GetTargetChannel(msgtarget)), (source, msgtarget, msgdetails));
 		return CMD_SUCCESS;
 	}
 }
@@ -18,6 +18,7 @@
 
 
 #include "inspircd.h"
+#include "linetokenizer.h"
 
 enum
 {
@@ -43,7 +44,7 @@ class RFCSerializer : public ClientProtocol::Serializer
 	}
 
  	bool Parse(LocalUser* user, const std::string& line, ClientProtocol::ParseOutput& parseoutput) CXX11_OVERRIDE;
-	ClientProtocol::SerializedMessage Serialize(const ClientProtocol::Message& msg, const ClientProtocol::TagSelection& tagwl) const CXX11_OVERRIDE;
+	std::string Serialize(const ClientProtocol::Message& msg, const ClientProtocol::TagSelection& tagwl) const CXX11_OVERRIDE;
 };
 
 bool RFCSerializer::Parse(LocalUser* user, const std::string& line, ClientProtocol::ParseOutput& parseoutput)
@@ -56,21 +57,33 @@ bool RFCSerializer::Parse(LocalUser* user, const std::string& line, ClientProtoc
 		return false;
 	}
 
-	// Work out how long the message can actually be.
-	size_t maxline = ServerInstance->Config->Limits.MaxLine - start - 2;
+	// Work out how long the message can actually be. The leading spaces count against
+	// the limit but at least the first character of the message is always kept.
+	const size_t maxrfc = ServerInstance->Config->Limits.MaxLine - 2;
+	size_t maxline = (start < maxrfc ? maxrfc - start : 1);
 	if (line[start] == '@')
 		maxline += MAX_CLIENT_MESSAGE_TAG_LENGTH + 1;
 
-	irc::tokenstream tokens(line, start, maxline);
-	ServerInstance->Logs->Log("USERINPUT", LOG_RAWIO, "C[%s] I %s", user->uuid.c_str(), tokens.GetMessage().c_str());
+	// The tokens are read straight out of the line and only copied into the parser
+	// output, which may still hold the strings from an earlier line for reuse.
+	insp::line_tokenizer tokens(line.data() + start, std::min(line.length() - start, maxline));
+	ServerInstance->Logs->Log("USERINPUT", LOG_RAWIO, "C[%s] I %.*s", user->uuid.c_str(), static_cast<int>(tokens.size()), tokens.data());
 
-	// This will always exist because of the check at the start of the function.
-	std::string token;
-	tokens.GetMiddle(token);
+	// Try to read the tags, prefix or command name.
+	const char* token;
+	size_t length;
+	if (!tokens.get_middle(token, length))
+	{
+		// Discourage the user from flooding the server.
+		user->CommandFloodPenalty += 2000;
+		return false;
+	}
+
+	parseoutput.tags.clear();
 	if (token[0] == '@')
 	{
 		// Check that the client tags fit within the client tag space.
-		if (token.length() > MAX_CLIENT_MESSAGE_TAG_LENGTH)
+		if (length > MAX_CLIENT_MESSAGE_TAG_LENGTH)
 		{
 			user->WriteNumeric(ERR_INPUTTOOLONG, "Input line was too long");
 			user->CommandFloodPenalty += 2000;
@@ -78,34 +91,33 @@ bool RFCSerializer::Parse(LocalUser* user, const std::string& line, ClientProtoc
 		}
 
 		// Truncate the RFC part of the message if it is too long.
-		size_t maxrfcline = token.length() + ServerInstance->Config->Limits.MaxLine - 1;
-		if (tokens.GetMessage().length() > maxrfcline)
-			tokens.GetMessage().erase(maxrfcline);
+		tokens.truncate(length + ServerInstance->Config->Limits.MaxLine - 1);
 
 		// Line begins with message tags, parse them.
+		std::string tag;
 		std::string tagval;
-		irc::sepstream ss(token.substr(1), ';');
-		while (ss.GetToken(token))
+		irc::sepstream ss(std::string(token + 1, length - 1), ';');
+		while (ss.GetToken(tag))
 		{
 			// Two or more tags with the same key must not be sent, but if a client violates that we accept
 			// the first occurence of duplicate tags and ignore all later occurences.
 			//
 			// Another option is to reject the message entirely but there is no standard way of doing that.
-			const std::string::size_type p = token.find('=');
+			const std::string::size_type p = tag.find('=');
 			if (p != std::string::npos)
 			{
 				// Tag has a value
-				tagval.assign(token, p+1, std::string::npos);
-				token.erase(p);
+				tagval.assign(tag, p+1, std::string::npos);
+				tag.erase(p);
 			}
 			else
 				tagval.clear();
 
-			HandleTag(user, token, tagval, parseoutput.tags);
+			HandleTag(user, tag, tagval, parseoutput.tags);
 		}
 
 		// Try to read the prefix or command name.
-		if (!tokens.GetMiddle(token))
+		if (!tokens.get_middle(token, length))
 		{
 			// Discourage the user from flooding the server.
 			user->CommandFloodPenalty += 2000;
@@ -121,7 +133,7 @@ bool RFCSerializer::Parse(LocalUser* user, const std::string& line, ClientProtoc
 		// ignores it so we will copy them.
 
 		// Try to read the command name.
-		if (!tokens.GetMiddle(token))
+		if (!tokens.get_middle(token, length))
 		{
 			// Discourage the user from flooding the server.
 			user->CommandFloodPenalty += 2000;
@@ -129,12 +141,21 @@ bool RFCSerializer::Parse(LocalUser* user, const std::string& line, ClientProtoc
 		}
 	}
 
-	parseoutput.cmd.assign(token);
+	parseoutput.cmd.assign(token, length);
 
 	// Build the parameter map. We intentionally do not respect the RFC 1459
 	// thirteen parameter limit here.
-	while (tokens.GetTrailing(token))
-		parseoutput.params.push_back(token);
+	ClientProtocol::ParamList& params = parseoutput.params;
+	size_t count = 0;
+	while (tokens.get_trailing(token, length))
+	{
+		if (count < params.size())
+			params[count].assign(token, length);
+		else
+			params.push_back(std::string(token, length));
+		count++;
+	}
+	params.erase(params.begin() + count, params.end());
 
 	return true;
 }
@@ -184,7 +205,7 @@ void RFCSerializer::SerializeTags(const ClientProtocol::TagMap& tags, const Clie
 		line.push_back(' ');
 }
 
-ClientProtocol::SerializedMessage RFCSerializer::Serialize(const ClientProtocol::Message& msg, const ClientProtocol::TagSelection& tagwl) const
+std::string RFCSerializer::Serialize(const ClientProtocol::Message& msg, const ClientProtocol::TagSelection& tagwl) const
 {
 	std::string line;
 	SerializeTags(msg.GetTags(), tagwl, line);
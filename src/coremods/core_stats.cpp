@@ -212,6 +212,24 @@ void CommandStats::DoStats(Stats::Context& stats)
 			break;
 		}
 
+		/* stats h (list how often each module hook has been dispatched) */
+		case 'h':
+		{
+			for (size_t i = 0; i != I_END; ++i)
+			{
+				const ModuleManager::HookStats& hookstats = ServerInstance->Modules->EventStats[i];
+				if (!hookstats.Dispatches)
+					continue;
+
+				std::string line = InspIRCd::Format("%s dispatches %lu calls %lu skipped %lu", ModuleManager::GetHookName(static_cast<Implementation>(i)),
+					hookstats.Dispatches, hookstats.Calls, hookstats.Skipped);
+				if (ServerInstance->Config->ProfileHooks)
+					line.append(" took " + ConvToStr(hookstats.Time) + "us");
+				stats.AddRow(249, line);
+			}
+		}
+		break;
+
 		/* stats m (list number of times each command has been used, plus bytecount) */
 		case 'm':
 		{
@@ -314,6 +332,11 @@ void CommandStats::DoStats(Stats::Context& stats)
 			stats.AddRow(249, "connection count "+ConvToStr(ServerInstance->stats.Connects));
 			stats.AddRow(249, InspIRCd::Format("bytes sent %5.2fK recv %5.2fK",
 				ServerInstance->stats.Sent / 1024.0, ServerInstance->stats.Recv / 1024.0));
+			stats.AddRow(249, "full reads "+ConvToStr(ServerInstance->stats.FullReads)+" read size increases "+ConvToStr(ServerInstance->stats.ReadGrows)+" decreases "+ConvToStr(ServerInstance->stats.ReadShrinks));
+			stats.AddRow(249, "background users "+ConvToStr(ServerInstance->stats.BackgroundUsers)+" took "+ConvToStr(ServerInstance->stats.BackgroundTime)+"us (max "+ConvToStr(ServerInstance->stats.BackgroundTimeMax)+"us)");
+			stats.AddRow(249, "connect class selections "+ConvToStr(ServerInstance->stats.ClassSelections)+" took "+ConvToStr(ServerInstance->stats.ClassSelectionTime)+"us (max "+ConvToStr(ServerInstance->stats.ClassSelectionTimeMax)+"us)");
+			const LogWriter& logwriter = ServerInstance->Logs->GetWriter();
+			stats.AddRow(249, "log thread "+std::string(logwriter.IsEnabled() ? "on" : "off")+" lines "+ConvToStr(logwriter.GetLineCount())+" batches "+ConvToStr(logwriter.GetBatchCount())+" dropped "+ConvToStr(logwriter.GetDropCount()));
 		}
 		break;
 
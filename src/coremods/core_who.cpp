@@ -23,6 +23,8 @@
 #include "inspircd.h"
 #include "modules/account.h"
 #include "modules/who.h"
+#include "hashcursor.h"
+#include "wildcard.h"
 
 enum
 {
@@ -39,6 +41,12 @@ static const char who_field_order[] = "cuhsnf";
 
 struct WhoData : public Who::Request
 {
+	/** The matchtext compiled for matching with the ASCII case map. */
+	insp::wildcard_mask asciimask;
+
+	/** The matchtext compiled for matching with the national case map. */
+	insp::wildcard_mask nationalmask;
+
 	bool GetFieldIndex(char flag, size_t& out) const CXX11_OVERRIDE
 	{
 		if (!whox)
@@ -71,6 +79,10 @@ struct WhoData : public Who::Request
 		if (matchtext == "0")
 			matchtext = "*";
 
+		// The matchtext is compared against every visible user so compile it once up front.
+		asciimask.compile(matchtext, ascii_case_insensitive_map);
+		nationalmask.compile(matchtext, national_case_insensitive_map);
+
 		// Fuzzy matches are when the source has not specified a specific user.
 		fuzzy_match = (parameters.size() > 1) || (matchtext.find_first_of("*?.") != std::string::npos);
 
@@ -105,15 +117,579 @@ struct WhoData : public Who::Request
 	}
 };
 
+/** Indexes on the fields of registered users which WHO consults to narrow down the users
+ * it has to match a request against. Every user who could match a request is returned
+ * but so may users who do not, so the candidates still have to be matched in full.
+ *
+ * Entries are only ever added to the indexes. When a user changes a field or quits the
+ * old entries are left in place and counted as stale, and the indexes are rebuilt once
+ * there are more stale entries than live ones. Candidates which are not indexed users
+ * any more are dropped before they are returned.
+ */
+class WhoIndex
+{
+ private:
+	/** The fields of a user which are indexed. */
+	enum Field
+	{
+		FIELD_NICK,
+		FIELD_HOST,
+		FIELD_IDENT,
+		FIELD_REALNAME,
+		FIELD_ACCOUNT,
+		FIELD_SERVER,
+		FIELD_ADDRESS,
+		FIELD_COUNT
+	};
+
+	/** The number of fields which are indexed by their trigrams. */
+	static const size_t TrigramFields = FIELD_REALNAME + 1;
+
+	typedef std::vector<User*> UserList;
+	typedef TR1NS::unordered_map<uint32_t, UserList> TrigramMap;
+	typedef std::map<irc::sockets::cidr_mask, UserList> AddressMap;
+
+	/** The number of entries each field of an indexed user has in the indexes. */
+	struct IndexedUser
+	{
+		size_t entries[FIELD_COUNT];
+	};
+
+	/** The users who are indexed. */
+	TR1NS::unordered_map<User*, IndexedUser> users;
+
+	/** The users who have a nick, host (real or displayed), ident or real name containing a trigram. */
+	TrigramMap trigrams[TrigramFields];
+
+	/** The users who are logged into an account. */
+	std::map<std::string, UserList> accounts;
+
+	/** The users on each server. */
+	std::map<std::string, UserList> servers;
+
+	/** The users connecting from each address. */
+	AddressMap addresses;
+
+	/** The number of entries which belong to indexed users. */
+	size_t live;
+
+	/** The number of entries which belong to old field values or users who have quit. */
+	size_t stale;
+
+	/** Whether the indexes are maintained. */
+	bool enabled;
+
+	/** Determines whether a character is indexed as part of a trigram. Only characters
+	 * which compare the same with every case map are indexed.
+	 */
+	static bool IsTrigramChar(unsigned char chr)
+	{
+		return (chr < 0x80 && isalnum(chr)) || chr == '-' || chr == '.' || chr == '_';
+	}
+
+	/** Finds the trigrams of indexed characters in a string.
+	 * @param str The string to find the trigrams in. If this is a glob pattern then
+	 *            trigrams which contain a wildcard character are skipped.
+	 * @param out The vector to append the sorted unique trigrams to.
+	 */
+	static void GetTrigrams(const std::string& str, std::vector<uint32_t>& out)
+	{
+		const size_t first = out.size();
+		for (size_t i = 2; i < str.length(); ++i)
+		{
+			const unsigned char a = str[i - 2];
+			const unsigned char b = str[i - 1];
+			const unsigned char c = str[i];
+			if (IsTrigramChar(a) && IsTrigramChar(b) && IsTrigramChar(c))
+			{
+				const unsigned char* map = ascii_case_insensitive_map;
+				out.push_back((map[a] << 16) | (map[b] << 8) | map[c]);
+			}
+		}
+
+		std::sort(out.begin() + first, out.end());
+		out.erase(std::unique(out.begin() + first, out.end()), out.end());
+	}
+
+	/** Determines whether an address entry is within a CIDR range. */
+	static bool InRange(const irc::sockets::cidr_mask& range, const irc::sockets::cidr_mask& address)
+	{
+		if (address.type != range.type)
+			return false;
+
+		const size_t bytes = range.length / 8;
+		if (memcmp(address.bits, range.bits, bytes))
+			return false;
+
+		const unsigned char bitmask = (0xFF00 >> (range.length & 7)) & 0xFF;
+		return !bitmask || (address.bits[bytes] & bitmask) == range.bits[bytes];
+	}
+
+	/** Replaces the entries of a field of an indexed user. */
+	void SetEntries(IndexedUser& entry, Field field, size_t count)
+	{
+		stale += entry.entries[field];
+		live += count - entry.entries[field];
+		entry.entries[field] = count;
+	}
+
+	/** Indexes the trigrams of one or two strings as a field of a user. */
+	void IndexTrigrams(User* user, Field field, const std::string& str, const std::string& extra = std::string())
+	{
+		TR1NS::unordered_map<User*, IndexedUser>::iterator it = users.find(user);
+		if (it == users.end())
+			return;
+
+		std::vector<uint32_t> found;
+		GetTrigrams(str, found);
+		if (!extra.empty())
+		{
+			GetTrigrams(extra, found);
+			std::sort(found.begin(), found.end());
+			found.erase(std::unique(found.begin(), found.end()), found.end());
+		}
+
+		TrigramMap& map = trigrams[field];
+		for (std::vector<uint32_t>::const_iterator i = found.begin(); i != found.end(); ++i)
+			map[*i].push_back(user);
+		SetEntries(it->second, field, found.size());
+	}
+
+	/** Indexes the account a user is logged into. */
+	void IndexAccount(User* user, const std::string& account)
+	{
+		TR1NS::unordered_map<User*, IndexedUser>::iterator it = users.find(user);
+		if (it == users.end())
+			return;
+
+		if (!account.empty())
+			accounts[account].push_back(user);
+		SetEntries(it->second, FIELD_ACCOUNT, account.empty() ? 0 : 1);
+	}
+
+	/** Indexes the address a user is connecting from. */
+	void IndexAddress(User* user)
+	{
+		TR1NS::unordered_map<User*, IndexedUser>::iterator it = users.find(user);
+		if (it == users.end())
+			return;
+
+		addresses[irc::sockets::cidr_mask(user->client_sa, 128)].push_back(user);
+		SetEntries(it->second, FIELD_ADDRESS, 1);
+	}
+
+	/** Appends the users who may have a field containing all of the given trigrams.
+	 * @return True if the users were found; otherwise, false if there were no trigrams.
+	 */
+	bool FindTrigrams(Field field, const std::vector<uint32_t>& found, UserList& out) const
+	{
+		if (found.empty())
+			return false;
+
+		// Any user who has all of the trigrams is in the smallest list.
+		const UserList* best = NULL;
+		for (std::vector<uint32_t>::const_iterator i = found.begin(); i != found.end(); ++i)
+		{
+			TrigramMap::const_iterator it = trigrams[field].find(*i);
+			if (it == trigrams[field].end())
+				return true;
+
+			if (!best || it->second.size() < best->size())
+				best = &it->second;
+		}
+
+		out.insert(out.end(), best->begin(), best->end());
+		return true;
+	}
+
+	/** Appends the users who may be on a server matching a request.
+	 * @return True if the users were found; otherwise, false if every user matches.
+	 */
+	bool FindServers(LocalUser* source, const WhoData& data, UserList& out) const
+	{
+		// If the source can not see server names then every user is on the same server.
+		const std::string& hideserver = ServerInstance->Config->HideServer;
+		if (!hideserver.empty() && (!source->HasPrivPermission("servers/auspex") || !data.flags['x']))
+			return !data.asciimask.match(hideserver);
+
+		for (std::map<std::string, UserList>::const_iterator i = servers.begin(); i != servers.end(); ++i)
+		{
+			if (data.asciimask.match(i->first))
+				out.insert(out.end(), i->second.begin(), i->second.end());
+		}
+		return true;
+	}
+
+	/** Appends the users who may have an IP address matching a request.
+	 * @return True if the users were found; otherwise, false if the request can not be
+	 *         answered from the address index.
+	 */
+	bool FindAddresses(const std::string& matchtext, UserList& out) const
+	{
+		// This mirrors MatchCIDR() which ignores the username part of a mask when the
+		// address being matched does not have one.
+		const std::string::size_type atpos = matchtext.rfind('@');
+		const std::string cidr = atpos == std::string::npos ? matchtext : matchtext.substr(atpos + 1);
+
+		irc::sockets::cidr_mask range;
+		if (irc::sockets::IsCIDRMask(cidr))
+		{
+			range = irc::sockets::cidr_mask(cidr);
+		}
+		else if (matchtext.find_first_of("@/") != std::string::npos)
+		{
+			// The mask can neither match as a CIDR range nor as a glob as IP
+			// addresses never contain these characters.
+			return true;
+		}
+		else if (matchtext.find_first_of("*?") != std::string::npos)
+		{
+			// The glob may match any number of addresses.
+			return false;
+		}
+		else
+		{
+			// The glob can only match a single address.
+			irc::sockets::sockaddrs sa;
+			if (!irc::sockets::aptosa(matchtext, 0, sa))
+				return true;
+			range = irc::sockets::cidr_mask(sa, 128);
+		}
+
+		// Addresses are ordered by their bits so the ones in range are next to each other.
+		irc::sockets::cidr_mask start = range;
+		start.length = (range.type == AF_INET ? 32 : 128);
+		for (AddressMap::const_iterator i = addresses.lower_bound(start); i != addresses.end() && InRange(range, i->first); ++i)
+			out.insert(out.end(), i->second.begin(), i->second.end());
+		return true;
+	}
+
+	/** Rebuilds the indexes without any stale entries. */
+	void Rebuild()
+	{
+		std::vector<User*> indexed;
+		for (TR1NS::unordered_map<User*, IndexedUser>::const_iterator i = users.begin(); i != users.end(); ++i)
+			indexed.push_back(i->first);
+
+		Clear();
+		for (std::vector<User*>::const_iterator i = indexed.begin(); i != indexed.end(); ++i)
+			AddUser(*i);
+	}
+
+	/** Rebuilds the indexes if they contain more stale entries than live ones. */
+	void CheckStale()
+	{
+		if (stale > 1024 && stale > live)
+			Rebuild();
+	}
+
+	/** Removes all users from the indexes. */
+	void Clear()
+	{
+		users.clear();
+		for (size_t i = 0; i < TrigramFields; ++i)
+			trigrams[i].clear();
+		accounts.clear();
+		servers.clear();
+		addresses.clear();
+		live = 0;
+		stale = 0;
+	}
+
+ public:
+	WhoIndex()
+		: live(0)
+		, stale(0)
+		, enabled(false)
+	{
+	}
+
+	/** Starts or stops maintaining the indexes. */
+	void SetEnabled(bool enable)
+	{
+		if (enable == enabled)
+			return;
+
+		enabled = enable;
+		Clear();
+		if (!enabled)
+			return;
+
+		const user_hash& allusers = ServerInstance->Users->GetUsers();
+		for (user_hash::const_iterator i = allusers.begin(); i != allusers.end(); ++i)
+		{
+			if (!i->second->quitting)
+				AddUser(i->second);
+		}
+	}
+
+	/** Adds a user who has finished registering to the indexes. */
+	void AddUser(User* user)
+	{
+		if (!enabled || user->registered != REG_ALL || users.count(user))
+			return;
+
+		IndexedUser& entry = users[user];
+		std::fill(entry.entries, entry.entries + FIELD_COUNT, 0);
+
+		IndexTrigrams(user, FIELD_NICK, user->nick);
+		IndexTrigrams(user, FIELD_HOST, user->GetRealHost(), user->GetDisplayedHost());
+		IndexTrigrams(user, FIELD_IDENT, user->ident);
+		IndexTrigrams(user, FIELD_REALNAME, user->GetRealName());
+		IndexAddress(user);
+
+		const AccountExtItem* accountext = GetAccountExtItem();
+		const std::string* account = accountext ? accountext->get(user) : NULL;
+		if (account)
+			IndexAccount(user, *account);
+
+		servers[user->server->GetName()].push_back(user);
+		SetEntries(entry, FIELD_SERVER, 1);
+	}
+
+	/** Removes a user who is quitting from the indexes. */
+	void RemoveUser(User* user)
+	{
+		TR1NS::unordered_map<User*, IndexedUser>::iterator it = users.find(user);
+		if (it == users.end())
+			return;
+
+		for (size_t i = 0; i < FIELD_COUNT; ++i)
+			SetEntries(it->second, static_cast<Field>(i), 0);
+		users.erase(it);
+		CheckStale();
+	}
+
+	void ChangeNick(User* user)
+	{
+		IndexTrigrams(user, FIELD_NICK, user->nick);
+		CheckStale();
+	}
+
+	void ChangeDisplayedHost(User* user, const std::string& newhost)
+	{
+		IndexTrigrams(user, FIELD_HOST, user->GetRealHost(), newhost);
+		CheckStale();
+	}
+
+	void ChangeIdent(User* user, const std::string& newident)
+	{
+		IndexTrigrams(user, FIELD_IDENT, newident);
+		CheckStale();
+	}
+
+	void ChangeRealName(User* user, const std::string& newrealname)
+	{
+		IndexTrigrams(user, FIELD_REALNAME, newrealname);
+		CheckStale();
+	}
+
+	void ChangeAccount(User* user, const std::string& newaccount)
+	{
+		IndexAccount(user, newaccount);
+		CheckStale();
+	}
+
+	void ChangeAddress(User* user)
+	{
+		// The real host of the user is reset to their IP address too.
+		IndexAddress(user);
+		IndexTrigrams(user, FIELD_HOST, user->GetRealHost(), user->GetDisplayedHost());
+		CheckStale();
+	}
+
+	/** Finds the users who may match a WHO request which is not for a channel.
+	 * @param source The user who sent the request.
+	 * @param data The request.
+	 * @param out The vector to store the users in.
+	 * @return True if the users were found; otherwise, false if the request can not be
+	 *         answered from the indexes and every user has to be matched against it.
+	 */
+	bool Find(LocalUser* source, const WhoData& data, UserList& out) const
+	{
+		if (!enabled)
+			return false;
+
+		std::vector<uint32_t> found;
+		GetTrigrams(data.matchtext, found);
+
+		// The flags are checked in the same order as MatchUser() does.
+		bool narrowed;
+		if (data.flags['A'])
+			narrowed = false;
+		else if (data.flags['a'])
+		{
+			for (std::map<std::string, UserList>::const_iterator i = accounts.begin(); i != accounts.end(); ++i)
+			{
+				if (data.nationalmask.match(i->first))
+					out.insert(out.end(), i->second.begin(), i->second.end());
+			}
+			narrowed = true;
+		}
+		else if (data.flags['h'])
+			narrowed = FindTrigrams(FIELD_HOST, found, out);
+		else if (data.flags['i'])
+			narrowed = FindAddresses(data.matchtext, out);
+		else if (data.flags['m'])
+			narrowed = false;
+		else if (data.flags['n'])
+			narrowed = FindTrigrams(FIELD_NICK, found, out);
+		else if (data.flags['p'])
+			narrowed = false;
+		else if (data.flags['r'])
+			narrowed = FindTrigrams(FIELD_REALNAME, found, out);
+		else if (data.flags['s'])
+			narrowed = FindServers(source, data, out);
+		else if (data.flags['t'])
+			narrowed = false;
+		else if (data.flags['u'])
+			narrowed = FindTrigrams(FIELD_IDENT, found, out);
+		else
+		{
+			narrowed = FindTrigrams(FIELD_HOST, found, out)
+				&& FindServers(source, data, out)
+				&& FindTrigrams(FIELD_REALNAME, found, out)
+				&& FindTrigrams(FIELD_NICK, found, out);
+		}
+
+		if (!narrowed)
+		{
+			out.clear();
+			return false;
+		}
+
+		// Remove duplicates and stale entries.
+		std::sort(out.begin(), out.end());
+		out.erase(std::unique(out.begin(), out.end()), out.end());
+		for (UserList::iterator i = out.begin(); i != out.end(); )
+		{
+			if (users.count(*i))
+				++i;
+			else
+				i = out.erase(i);
+		}
+		return true;
+	}
+};
+
+/** The maximum number of users which are looked at for a WHO request before the rest
+ * of the request is left for later so that one request can not stall the server.
+ */
+static const size_t MaxUsersPerPass = 1000;
+
+/** The number of milliseconds between attempts to continue unfinished WHO requests. */
+static const unsigned int ResumeInterval = 20;
+
+/** A WHO request which has not been fully answered yet. */
+struct WhoRequest
+{
+	/** The user who sent the request. */
+	LocalUser* const user;
+
+	/** The parameters of the request. */
+	const std::vector<std::string> parameters;
+
+	/** The parsed request. */
+	WhoData data;
+
+	/** Whether the request has been started. A request is queued without being started
+	 * if the source already has a request which has not been fully answered yet.
+	 */
+	bool started;
+
+	/** Whether the request walks the global user list with cursor. */
+	bool walking;
+
+	/** The position of the request in the global user list. */
+	insp::hash_cursor<user_hash> cursor;
+
+	/** The UUIDs of the users who have to be looked at separately. These are the rest of
+	 * a narrowed down list of users and the users who have been moved into the part of the
+	 * global user list which has already been walked by a nick change. Users are looked
+	 * up by UUID when the request is continued as they may have quit since.
+	 */
+	std::vector<std::string> remaining;
+
+	/** The index in remaining of the next user to look at. */
+	size_t position;
+
+	/** The UUIDs of the users who have been moved into the part of the global user list
+	 * which has not been walked yet by a nick change after they were looked at.
+	 */
+	std::set<std::string> skip;
+
+	WhoRequest(LocalUser* source, const CommandBase::Params& params)
+		: user(source)
+		, parameters(params)
+		, data(params)
+		, started(false)
+		, walking(false)
+		, position(0)
+	{
+	}
+};
+
 class CommandWho : public SplitCommand
 {
  private:
+	/** Continues unfinished WHO requests once the sendq of their source has drained. */
+	class ResumeTimer : public Timer
+	{
+		CommandWho& cmd;
+
+	 public:
+		ResumeTimer(CommandWho& parent)
+			: Timer(0)
+			, cmd(parent)
+		{
+		}
+
+		bool Tick(time_t) CXX11_OVERRIDE
+		{
+			cmd.ResumeRequests();
+			return true;
+		}
+	};
+
 	ChanModeReference secretmode;
 	ChanModeReference privatemode;
 	UserModeReference hidechansmode;
 	UserModeReference invisiblemode;
 	Events::ModuleEventProvider whoevprov;
 
+	/** The WHO requests which are waiting for the sendq of their source to drain. */
+	std::vector<WhoRequest*> pending;
+
+	/** Ticks while there are pending WHO requests. */
+	ResumeTimer timer;
+
+	/** Users matching a query which are found with the index. Reused between requests. */
+	std::vector<User*> candidates;
+
+	/** Looks at the users of the global user list for a request until enough have been looked at. */
+	class UserVisitor
+	{
+		CommandWho& cmd;
+		WhoRequest* const request;
+		size_t count;
+
+	 public:
+		UserVisitor(CommandWho& parent, WhoRequest* req)
+			: cmd(parent)
+			, request(req)
+			, count(0)
+		{
+		}
+
+		bool operator()(User* user)
+		{
+			if (!user->quitting && (request->skip.empty() || !request->skip.count(user->uuid)))
+				cmd.WhoUser(request->user, request->parameters, user, request->data);
+			return (++count < MaxUsersPerPass);
+		}
+	};
+	friend class UserVisitor;
+
 	/** Determines whether a user can view the users of a channel. */
 	bool CanView(Channel* chan, User* user)
 	{
@@ -157,9 +733,37 @@ class CommandWho : public SplitCommand
 	template<typename T>
 	static User* GetUser(T& t);
 
-	/** Performs a WHO request on a list of users. */
+	/** Adds the WHO reply for a user to a request if it matches. */
+	void WhoUser(LocalUser* source, const std::vector<std::string>& parameters, User* user, WhoData& data);
+
+	/** Performs a WHO request on a list of users. If too many users have to be looked at
+	 * the UUIDs of the rest are stored in the request so that it can be continued later.
+	 * @return True if the request has been finished; otherwise, false.
+	 */
 	template<typename T>
-	void WhoUsers(LocalUser* source, const std::vector<std::string>& parameters, const T& users, WhoData& data);
+	bool WhoUsers(WhoRequest* request, const T& users);
+
+	/** Starts looking at the users which may match a request.
+	 * @return True if the request has been finished; otherwise, false.
+	 */
+	bool StartRequest(WhoRequest* request);
+
+	/** Looks at the next users of a pending request.
+	 * @return True if the request has been finished; otherwise, false.
+	 */
+	bool ContinueRequest(WhoRequest* request);
+
+	/** Sends the results of a request which have been found so far to its source.
+	 * @param request The request to send the results of.
+	 * @param finished Whether the request has been finished.
+	 */
+	void SendResults(WhoRequest* request, bool finished);
+
+	/** Determines whether the sendq of a user is too full to send them more WHO replies. */
+	static bool IsBusy(LocalUser* user)
+	{
+		return user->eh.getSendQSize() >= user->MyClass->GetSendqSoftMax();
+	}
 
  public:
 	CommandWho(Module* parent)
@@ -169,11 +773,33 @@ class CommandWho : public SplitCommand
 		, hidechansmode(parent, "hidechans")
 		, invisiblemode(parent, "invisible")
 		, whoevprov(parent, "event/who")
+		, timer(*this)
 	{
 		allow_empty_last_param = false;
 		syntax = "<server>|<nick>|<channel>|<realname>|<host>|0 [[Aafhilmnoprstux][%acdfhilnorstu] <server>|<nick>|<channel>|<realname>|<host>|0]";
 	}
 
+	~CommandWho()
+	{
+		stdalgo::delete_all(pending);
+	}
+
+	/** The indexes used to find the users who may match a request. */
+	WhoIndex index;
+
+	/** Continues the pending WHO requests of every user whose sendq has drained. */
+	void ResumeRequests();
+
+	/** Keeps the requests which are walking the global user list from skipping a user or
+	 * looking at them twice when they are moved around the list by a nick change.
+	 * @param user The user who changed their nick.
+	 * @param oldnick The nick of the user before the change.
+	 */
+	void ChangeNick(User* user, const std::string& oldnick);
+
+	/** Drops the pending WHO requests of a user who is disconnecting. */
+	void RemoveRequests(LocalUser* user);
+
 	/** Sends a WHO reply to a user. */
 	void SendWhoLine(LocalUser* user, const std::vector<std::string>& parameters, Membership* memb, User* u, WhoData& data);
 
@@ -181,7 +807,6 @@ class CommandWho : public SplitCommand
 };
 
 template<> User* CommandWho::GetUser(UserManager::OperList::const_iterator& t) { return *t; }
-template<> User* CommandWho::GetUser(user_hash::const_iterator& t) { return t->second; }
 
 bool CommandWho::MatchChannel(LocalUser* source, Membership* memb, WhoData& data)
 {
@@ -235,26 +860,26 @@ bool CommandWho::MatchUser(LocalUser* source, User* user, WhoData& data)
 	// The source wants to match against users' away messages.
 	bool match = false;
 	if (data.flags['A'])
-		match = user->IsAway() && InspIRCd::Match(user->awaymsg, data.matchtext, ascii_case_insensitive_map);
+		match = user->IsAway() && data.asciimask.match(user->awaymsg);
 
 	// The source wants to match against users' account names.
 	else if (data.flags['a'])
 	{
 		const AccountExtItem* accountext = GetAccountExtItem();
 		const std::string* account = accountext ? accountext->get(user) : NULL;
-		match = account && InspIRCd::Match(*account, data.matchtext);
+		match = account && data.nationalmask.match(*account);
 	}
 
 	// The source wants to match against users' hostnames.
 	else if (data.flags['h'])
 	{
 		const std::string host = user->GetHost(source_can_see_target && data.flags['x']);
-		match = InspIRCd::Match(host, data.matchtext, ascii_case_insensitive_map);
+		match = data.asciimask.match(host);
 	}
 
 	// The source wants to match against users' IP addresses.
 	else if (data.flags['i'])
-		match = source_can_see_target && InspIRCd::MatchCIDR(user->GetIPString(), data.matchtext, ascii_case_insensitive_map);
+		match = source_can_see_target && (irc::sockets::MatchCIDR(user->GetIPString(), data.matchtext, true) || data.asciimask.match(user->GetIPString()));
 
 	// The source wants to match against users' modes.
 	else if (data.flags['m'])
@@ -291,7 +916,7 @@ bool CommandWho::MatchUser(LocalUser* source, User* user, WhoData& data)
 
 	// The source wants to match against users' nicks.
 	else if (data.flags['n'])
-		match = InspIRCd::Match(user->nick, data.matchtext);
+		match = data.nationalmask.match(user->nick);
 
 	// The source wants to match against users' connection ports.
 	else if (data.flags['p'])
@@ -313,13 +938,13 @@ bool CommandWho::MatchUser(LocalUser* source, User* user, WhoData& data)
 
 	// The source wants to match against users' real names.
 	else if (data.flags['r'])
-		match = InspIRCd::Match(user->GetRealName(), data.matchtext, ascii_case_insensitive_map);
+		match = data.asciimask.match(user->GetRealName());
 
 	else if (data.flags['s'])
 	{
 		bool show_real_server_name = ServerInstance->Config->HideServer.empty() || (source->HasPrivPermission("servers/auspex") && data.flags['x']);
 		const std::string server = show_real_server_name ? user->server->GetName() : ServerInstance->Config->HideServer;
-		match = InspIRCd::Match(server, data.matchtext, ascii_case_insensitive_map);
+		match = data.asciimask.match(server);
 	}
 
 	// The source wants to match against users' connection times.
@@ -332,27 +957,27 @@ bool CommandWho::MatchUser(LocalUser* source, User* user, WhoData& data)
 
 	// The source wants to match against users' idents.
 	else if (data.flags['u'])
-		match = InspIRCd::Match(user->ident, data.matchtext, ascii_case_insensitive_map);
+		match = data.asciimask.match(user->ident);
 
 	// The <name> passed to WHO is matched against users' host, server,
 	// real name and nickname if the channel <name> cannot be found.
 	else
 	{
 		const std::string host = user->GetHost(source_can_see_target && data.flags['x']);
-		match = InspIRCd::Match(host, data.matchtext, ascii_case_insensitive_map);
+		match = data.asciimask.match(host);
 
 		if (!match)
 		{
 			bool show_real_server_name = ServerInstance->Config->HideServer.empty() || (source->HasPrivPermission("servers/auspex") && data.flags['x']);
 			const std::string server = show_real_server_name ? user->server->GetName() : ServerInstance->Config->HideServer;
-			match = InspIRCd::Match(server, data.matchtext, ascii_case_insensitive_map);
+			match = data.asciimask.match(server);
 		}
 
 		if (!match)
-			match = InspIRCd::Match(user->GetRealName(), data.matchtext, ascii_case_insensitive_map);
+			match = data.asciimask.match(user->GetRealName());
 
 		if (!match)
-			match = InspIRCd::Match(user->nick, data.matchtext);
+			match = data.nationalmask.match(user->nick);
 	}
 
 	return match;
@@ -382,26 +1007,166 @@ void CommandWho::WhoChannel(LocalUser* source, const std::vector<std::string>& p
 	}
 }
 
+void CommandWho::WhoUser(LocalUser* source, const std::vector<std::string>& parameters, User* user, WhoData& data)
+{
+	// Only show users in response to a fuzzy WHO if we can see them normally.
+	bool can_see_normally = user == source || source->SharesChannelWith(user) || !user->IsModeSet(invisiblemode);
+	if (data.fuzzy_match && !can_see_normally && !source->HasPrivPermission("users/auspex"))
+		return;
+
+	// Skip the user if it doesn't match the query.
+	if (!MatchUser(source, user, data))
+		return;
+
+	SendWhoLine(source, parameters, NULL, user, data);
+}
+
 template<typename T>
-void CommandWho::WhoUsers(LocalUser* source, const std::vector<std::string>& parameters, const T& users, WhoData& data)
+bool CommandWho::WhoUsers(WhoRequest* request, const T& users)
 {
+	size_t count = 0;
 	for (typename T::const_iterator iter = users.begin(); iter != users.end(); ++iter)
 	{
-		User* user = GetUser(iter);
+		// The UUIDs of the users who have not been looked at yet are copied as the
+		// user list may be changed by the time the request is continued.
+		if (++count > MaxUsersPerPass)
+		{
+			for (; iter != users.end(); ++iter)
+				request->remaining.push_back(GetUser(iter)->uuid);
+			return false;
+		}
+
+		WhoUser(request->user, request->parameters, GetUser(iter), request->data);
+	}
+	return true;
+}
+
+bool CommandWho::StartRequest(WhoRequest* request)
+{
+	request->started = true;
+	LocalUser* user = request->user;
+	WhoData& data = request->data;
 
-		// Only show users in response to a fuzzy WHO if we can see them normally.
-		bool can_see_normally = user == source || source->SharesChannelWith(user) || !user->IsModeSet(invisiblemode);
-		if (data.fuzzy_match && !can_see_normally && !source->HasPrivPermission("users/auspex"))
+	// Is the source running a WHO on a channel?
+	Channel* chan = ServerInstance->FindChan(data.matchtext);
+	if (chan)
+	{
+		WhoChannel(user, request->parameters, chan, data);
+		return true;
+	}
+
+	// If we only want to match against opers we only have to iterate the oper list.
+	if (data.flags['o'])
+		return WhoUsers(request, ServerInstance->Users->all_opers);
+
+	// Otherwise we have to walk the global user list unless the indexes can narrow
+	// down the users who may match.
+	candidates.clear();
+	if (index.Find(user, data, candidates))
+		return WhoUsers(request, candidates);
+
+	request->walking = true;
+	return ContinueRequest(request);
+}
+
+bool CommandWho::ContinueRequest(WhoRequest* request)
+{
+	bool walked = true;
+	if (request->walking)
+	{
+		UserVisitor visitor(*this, request);
+		walked = request->cursor.step(ServerInstance->Users->GetUsers(), visitor);
+	}
+
+	const size_t end = std::min(request->remaining.size(), request->position + MaxUsersPerPass);
+	while (request->position < end)
+	{
+		User* user = ServerInstance->FindUUID(request->remaining[request->position++]);
+		if (user && !user->quitting)
+			WhoUser(request->user, request->parameters, user, request->data);
+	}
+	return walked && request->position >= request->remaining.size();
+}
+
+void CommandWho::ChangeNick(User* user, const std::string& oldnick)
+{
+	const user_hash& users = ServerInstance->Users->GetUsers();
+	for (std::vector<WhoRequest*>::const_iterator i = pending.begin(); i != pending.end(); ++i)
+	{
+		WhoRequest* request = *i;
+		if (!request->walking)
 			continue;
 
-		// Skip the user if it doesn't match the query.
-		if (!MatchUser(source, user, data))
+		const bool before = request->cursor.visited(users, oldnick);
+		const bool after = request->cursor.visited(users, user->nick);
+		if (before && !after)
+			request->skip.insert(user->uuid);
+		else if (!before && after && !request->skip.erase(user->uuid))
+			request->remaining.push_back(user->uuid);
+	}
+}
+
+void CommandWho::SendResults(WhoRequest* request, bool finished)
+{
+	LocalUser* user = request->user;
+	WhoData& data = request->data;
+	for (std::vector<Numeric::Numeric>::const_iterator n = data.results.begin(); n != data.results.end(); ++n)
+		user->WriteNumeric(*n);
+
+	if (finished)
+		user->WriteNumeric(RPL_ENDOFWHO, (data.matchtext.empty() ? "*" : data.matchtext.c_str()), "End of /WHO list.");
+
+	// Penalize the source a bit for large queries with one unit of penalty per 200 results.
+	user->CommandFloodPenalty += data.results.size() * 5;
+	data.results.clear();
+}
+
+void CommandWho::RemoveRequests(LocalUser* user)
+{
+	for (std::vector<WhoRequest*>::iterator i = pending.begin(); i != pending.end(); )
+	{
+		WhoRequest* request = *i;
+		if (request->user != user)
+		{
+			++i;
 			continue;
+		}
 
-		SendWhoLine(source, parameters, NULL, user, data);
+		delete request;
+		i = pending.erase(i);
 	}
 }
 
+void CommandWho::ResumeRequests()
+{
+	// Requests are answered in the order they were received in so only the oldest
+	// pending request of each user is continued.
+	std::set<LocalUser*> seen;
+	for (std::vector<WhoRequest*>::iterator i = pending.begin(); i != pending.end(); )
+	{
+		WhoRequest* request = *i;
+		if (!seen.insert(request->user).second || IsBusy(request->user))
+		{
+			++i;
+			continue;
+		}
+
+		const bool finished = request->started ? ContinueRequest(request) : StartRequest(request);
+		SendResults(request, finished);
+		if (!finished)
+		{
+			++i;
+			continue;
+		}
+
+		delete request;
+		i = pending.erase(i);
+	}
+
+	if (!pending.empty())
+		timer.SetIntervalMS(ResumeInterval);
+}
+
 void CommandWho::SendWhoLine(LocalUser* source, const std::vector<std::string>& parameters, Membership* memb, User* user, WhoData& data)
 {
 	if (!memb)
@@ -550,40 +1315,102 @@ void CommandWho::SendWhoLine(LocalUser* source, const std::vector<std::string>&
 
 CmdResult CommandWho::HandleLocal(LocalUser* user, const Params& parameters)
 {
-	WhoData data(parameters);
-
-	// Is the source running a WHO on a channel?
-	Channel* chan = ServerInstance->FindChan(data.matchtext);
-	if (chan)
-		WhoChannel(user, parameters, chan, data);
-
-	// If we only want to match against opers we only have to iterate the oper list.
-	else if (data.flags['o'])
-		WhoUsers(user, parameters, ServerInstance->Users->all_opers, data);
-
-	// Otherwise we have to use the global user list.
-	else
-		WhoUsers(user, parameters, ServerInstance->Users->GetUsers(), data);
+	WhoRequest* request = new WhoRequest(user, parameters);
+
+	// Replies to earlier requests have to be sent before the replies to this one so if
+	// the source has a request which has not been fully answered yet this one is queued
+	// behind it. Otherwise the results are sent to the source now and large requests are
+	// continued once the sendq of the source has drained.
+	bool queued = false;
+	for (std::vector<WhoRequest*>::const_iterator i = pending.begin(); i != pending.end(); ++i)
+	{
+		if ((*i)->user == user)
+		{
+			queued = true;
+			break;
+		}
+	}
 
-	// Send the results to the source.
-	for (std::vector<Numeric::Numeric>::const_iterator n = data.results.begin(); n != data.results.end(); ++n)
-		user->WriteNumeric(*n);
-	user->WriteNumeric(RPL_ENDOFWHO, (data.matchtext.empty() ? "*" : data.matchtext.c_str()), "End of /WHO list.");
+	if (!queued)
+	{
+		const bool finished = StartRequest(request);
+		SendResults(request, finished);
+		if (finished)
+		{
+			delete request;
+			return CMD_SUCCESS;
+		}
+	}
 
-	// Penalize the source a bit for large queries with one unit of penalty per 200 results.
-	user->CommandFloodPenalty += data.results.size() * 5;
+	if (pending.empty())
+		timer.SetIntervalMS(ResumeInterval);
+	pending.push_back(request);
 	return CMD_SUCCESS;
 }
 
-class CoreModWho : public Module
+class CoreModWho
+	: public Module
+	, public AccountEventListener
 {
  private:
 	CommandWho cmd;
 
  public:
 	CoreModWho()
-		: cmd(this)
+		: AccountEventListener(this)
+		, cmd(this)
+	{
+	}
+
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		cmd.index.SetEnabled(ServerInstance->Config->ConfValue("performance")->getBool("whoindex"));
+	}
+
+	void OnPostConnect(User* user) CXX11_OVERRIDE
+	{
+		cmd.index.AddUser(user);
+	}
+
+	void OnUserQuit(User* user, const std::string& message, const std::string& oper_message) CXX11_OVERRIDE
+	{
+		cmd.index.RemoveUser(user);
+	}
+
+	void OnUserPostNick(User* user, const std::string& oldnick) CXX11_OVERRIDE
+	{
+		cmd.index.ChangeNick(user);
+		cmd.ChangeNick(user, oldnick);
+	}
+
+	void OnChangeHost(User* user, const std::string& newhost) CXX11_OVERRIDE
+	{
+		cmd.index.ChangeDisplayedHost(user, newhost);
+	}
+
+	void OnChangeIdent(User* user, const std::string& newident) CXX11_OVERRIDE
+	{
+		cmd.index.ChangeIdent(user, newident);
+	}
+
+	void OnChangeRealName(User* user, const std::string& real) CXX11_OVERRIDE
+	{
+		cmd.index.ChangeRealName(user, real);
+	}
+
+	void OnSetUserIP(LocalUser* user) CXX11_OVERRIDE
+	{
+		cmd.index.ChangeAddress(user);
+	}
+
+	void OnAccountChange(User* user, const std::string& newaccount) CXX11_OVERRIDE
+	{
+		cmd.index.ChangeAccount(user, newaccount);
+	}
+
+	void OnUserDisconnect(LocalUser* user) CXX11_OVERRIDE
 	{
+		cmd.RemoveRequests(user);
 	}
 
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
@@ -35,19 +35,10 @@ FileLogStream::~FileLogStream()
 
 void FileLogStream::OnLog(LogLevel loglevel, const std::string &type, const std::string &text)
 {
-	static std::string TIMESTR;
-	static time_t LAST = 0;
-
 	if (loglevel < this->loglvl)
 	{
 		return;
 	}
 
-	if (ServerInstance->Time() != LAST)
-	{
-		TIMESTR = InspIRCd::TimeString(ServerInstance->Time());
-		LAST = ServerInstance->Time();
-	}
-
-	this->f->WriteLogLine(TIMESTR + " " + type + ": " + text + "\n");
+	this->f->Write(ServerInstance->Time(), type, text);
 }
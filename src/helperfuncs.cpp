@@ -478,6 +478,24 @@ std::string InspIRCd::Format(const char* formatString, ...)
 	return ret;
 }
 
+uint64_t InspIRCd::GetMicroseconds()
+{
+#if defined HAS_CLOCK_GETTIME
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#elif defined _WIN32
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	const LONGLONG frequency = ServerInstance->stats.QPFrequency.QuadPart;
+	return (counter.QuadPart / frequency) * 1000000 + (counter.QuadPart % frequency) * 1000000 / frequency;
+#else
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+#endif
+}
+
 std::string InspIRCd::TimeString(time_t curtime, const char* format, bool utc)
 {
 #ifdef _WIN32
@@ -57,6 +57,11 @@ InspIRCd* ServerInstance = NULL;
  */
 unsigned const char *national_case_insensitive_map = rfc_case_insensitive_map;
 
+/** Incremented whenever national_case_insensitive_map is replaced or the table it points to is
+ * modified.
+ */
+unsigned long national_case_insensitive_generation = 1;
+
 
 /* Moved from exitcodes.h -- due to duplicate symbols -- Burlex
  * XXX this is a bit ugly. -- w00t
@@ -699,6 +704,11 @@ void InspIRCd::Run()
 				SNO->FlushSnotices();
 			}
 		}
+		else if (Timers.GetPreciseTimerCount())
+		{
+			// Timers with sub-second resolution can be due at any time.
+			Timers.TickTimers(TIME.tv_sec);
+		}
 
 		/* Call the socket engine to wait on the active
 		 * file descriptors. The socket engine has everything's
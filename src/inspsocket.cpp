@@ -134,11 +134,19 @@ CullResult StreamSocket::cull()
 
 bool StreamSocket::GetNextLine(std::string& line, char delim)
 {
-	std::string::size_type i = recvq.find(delim);
+	// The recvq may have been modified directly since the last call.
+	if (nextline > recvq.length())
+		nextline = 0;
+
+	std::string::size_type i = recvq.find(delim, nextline);
 	if (i == std::string::npos)
+	{
+		recvq.erase(0, nextline);
+		nextline = 0;
 		return false;
-	line.assign(recvq, 0, i);
-	recvq.erase(0, i + 1);
+	}
+	line.assign(recvq, nextline, i - nextline);
+	nextline = i + 1;
 	return true;
 }
 
@@ -176,14 +184,29 @@ void StreamSocket::DoRead()
 int StreamSocket::ReadToRecvQ(std::string& rq)
 {
 		char* ReadBuffer = ServerInstance->GetReadBuffer();
-		int n = SocketEngine::Recv(this, ReadBuffer, ServerInstance->Config->NetBufferSize, 0);
-		if (n == ServerInstance->Config->NetBufferSize)
+		const size_t size = GetReadSize();
+		int n = SocketEngine::Recv(this, ReadBuffer, size, 0);
+		if (n == (int)size)
 		{
+			// The read filled the buffer so there is probably more data waiting,
+			// ask for more at once next time.
+			ServerInstance->stats.FullReads++;
+			if (size < ServerInstance->GetReadBufferSize())
+			{
+				readsize = std::min(size * 2, ServerInstance->GetReadBufferSize());
+				ServerInstance->stats.ReadGrows++;
+			}
 			SocketEngine::ChangeEventMask(this, FD_WANT_FAST_READ | FD_ADD_TRIAL_READ);
 			rq.append(ReadBuffer, n);
 		}
 		else if (n > 0)
 		{
+			// Give back the extra space once the socket has quietened down.
+			if (n < (int)(size / 4) && size > (size_t)ServerInstance->Config->NetBufferSize)
+			{
+				readsize = size / 2;
+				ServerInstance->stats.ReadShrinks++;
+			}
 			SocketEngine::ChangeEventMask(this, FD_WANT_FAST_READ);
 			rq.append(ReadBuffer, n);
 		}
@@ -212,6 +235,12 @@ int StreamSocket::ReadToRecvQ(std::string& rq)
 	return n;
 }
 
+size_t StreamSocket::GetReadSize() const
+{
+	const size_t minsize = ServerInstance->Config->NetBufferSize;
+	return std::min(std::max(readsize, minsize), ServerInstance->GetReadBufferSize());
+}
+
 /* Don't try to prepare huge blobs of data to send to a blocked socket */
 static const int MYIOV_MAX = IOV_MAX < 128 ? IOV_MAX : 128;
 
@@ -283,19 +312,10 @@ void StreamSocket::FlushSendQ(SendQueue& sq)
 			}
 
 			int rv_max = 0;
-			int rv;
-			{
-				SocketEngine::IOVector iovecs[MYIOV_MAX];
-				size_t j = 0;
-				for (SendQueue::const_iterator i = sq.begin(), end = i+bufcount; i != end; ++i, j++)
-				{
-					const SendQueue::Element& elem = *i;
-					iovecs[j].iov_base = const_cast<char*>(elem.data());
-					iovecs[j].iov_len = elem.length();
-					rv_max += iovecs[j].iov_len;
-				}
-				rv = SocketEngine::WriteV(this, iovecs, bufcount);
-			}
+			const SendQueue::const_iterator last = sq.begin() + bufcount;
+			for (SendQueue::const_iterator i = sq.begin(); i != last; ++i)
+				rv_max += i->length();
+			int rv = SocketEngine::WriteBuffers(this, sq.begin(), last);
 
 			if (rv == (int)sq.bytes())
 			{
@@ -377,6 +397,20 @@ void StreamSocket::WriteData(const std::string &data)
 	SocketEngine::ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
 }
 
+void StreamSocket::WriteData(const SendQueue::Element& data)
+{
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to write data to dead socket: %.*s",
+			(int)data.length(), data.data());
+		return;
+	}
+
+	sendq.push_back(data);
+
+	SocketEngine::ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
+}
+
 bool SocketTimeout::Tick(time_t)
 {
 	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "SocketTimeout::Tick");
@@ -528,7 +562,8 @@ void StreamSocket::AddIOHook(IOHook* newhook)
 
 size_t StreamSocket::getSendQSize() const
 {
-	size_t ret = sendq.bytes();
+	// Data held by the socket engine has not been sent yet either.
+	size_t ret = sendq.bytes() + SocketEngine::GetQueuedBytes(this);
 	IOHook* curr = GetIOHook();
 	while (curr)
 	{
@@ -553,5 +588,7 @@ void StreamSocket::SwapInternals(StreamSocket& other)
 	std::swap(error, other.error);
 	std::swap(iohook, other.iohook);
 	std::swap(recvq, other.recvq);
+	std::swap(nextline, other.nextline);
+	std::swap(readsize, other.readsize);
 	std::swap(sendq, other.sendq);
 }
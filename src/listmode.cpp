@@ -19,6 +19,33 @@
 #include "inspircd.h"
 #include "listmode.h"
 
+namespace
+{
+	/** The generation which was last given to a list. This is shared between all lists so
+	 * that a list which is recreated never reuses the generation of the list it replaced.
+	 */
+	unsigned long lastgeneration = 0;
+}
+
+ListModeBase::ChanData::ChanData()
+	: maxitems(-1)
+	, generation(++lastgeneration)
+	, index(NULL)
+{
+}
+
+ListModeBase::ChanData::~ChanData()
+{
+	delete index;
+}
+
+void ListModeBase::ChanData::Changed()
+{
+	delete index;
+	index = NULL;
+	generation = ++lastgeneration;
+}
+
 ListModeBase::ListModeBase(Module* Creator, const std::string& Name, char modechar, const std::string& eolstr, unsigned int lnum, unsigned int eolnum, bool autotidy)
 	: ModeHandler(Creator, Name, modechar, PARAM_ALWAYS, MODETYPE_CHANNEL, MC_LIST)
 	, listnumeric(lnum)
@@ -30,6 +57,23 @@ ListModeBase::ListModeBase(Module* Creator, const std::string& Name, char modech
 	list = true;
 }
 
+const BanIndex* ListModeBase::GetBanIndex(Channel* channel)
+{
+	ChanData* cd = extItem.get(channel);
+	if (!cd)
+		return NULL;
+
+	// The index has to be rebuilt if the case map has been replaced or modified in place (e.g. on
+	// a rehash of m_nationalchars or m_codepage) since it was built. Any results which were cached
+	// with the old case map are stale too.
+	if ((cd->index) && (cd->index->IsStale()))
+		cd->Changed();
+
+	if (!cd->index)
+		cd->index = new BanIndex(cd->list, national_case_insensitive_map);
+	return cd->index;
+}
+
 void ListModeBase::DisplayList(User* user, Channel* channel)
 {
 	ChanData* cd = extItem.get(channel);
@@ -202,6 +246,7 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 		{
 			// And now add the mask onto the list...
 			cd->list.push_back(ListItem(parameter, source->nick, ServerInstance->Time()));
+			cd->Changed();
 			return MODEACTION_ALLOW;
 		}
 		else
@@ -220,6 +265,7 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 				if (parameter == it->mask)
 				{
 					stdalgo::vector::swaperase(cd->list, it);
+					cd->Changed();
 					return MODEACTION_ALLOW;
 				}
 			}
@@ -255,3 +301,145 @@ void ListModeBase::TellNotSet(User* source, Channel* channel, std::string& param
 {
 	source->WriteNumeric(ERR_LISTMODENOTSET, channel->name, parameter, mode, InspIRCd::Format("Channel %s list does not contain %s", name.c_str(), parameter.c_str()));
 }
+
+BanIndex::BanIndex(const ListModeBase::ModeList& list, const unsigned char* casemap)
+	: map(casemap)
+	, casemapgen(national_case_insensitive_generation)
+{
+	for (ListModeBase::ModeList::const_iterator i = list.begin(); i != list.end(); ++i)
+	{
+		// Extbans can only be matched by modules which implement OnCheckBan.
+		const std::string& mask = i->mask;
+		if (mask.length() <= 2)
+			continue;
+
+		if (mask[1] == ':')
+		{
+			extbans.push_back(mask);
+			continue;
+		}
+
+		const std::string::size_type at = mask.find('@');
+		if (at == std::string::npos)
+			continue;
+
+		// If the host part contains another '@' then irc::sockets::MatchCIDR() treats the
+		// part before it as a username so these masks are matched the slow way.
+		const std::string host(mask, at + 1);
+		if (host.find('@') != std::string::npos)
+		{
+			unindexed.push_back(mask);
+			continue;
+		}
+
+		Entry entry;
+		entry.nickident.compile(mask.substr(0, at), map);
+
+		const size_t id = entries.size();
+		if (host.find_first_of("*?") == std::string::npos)
+		{
+			hosts.insert(std::make_pair(Fold(host), id));
+			if (irc::sockets::IsCIDRMask(host))
+				ranges.add(irc::sockets::cidr_mask(host), id);
+		}
+		else
+		{
+			entry.host.compile(host, map);
+			wildcards.push_back(id);
+		}
+		entries.push_back(entry);
+	}
+}
+
+std::string BanIndex::Fold(const std::string& str) const
+{
+	std::string folded(str);
+	for (std::string::iterator i = folded.begin(); i != folded.end(); ++i)
+		*i = map[static_cast<unsigned char>(*i)];
+	return folded;
+}
+
+bool BanIndex::MatchHost(const std::string& host, const std::string& nickident) const
+{
+	std::pair<HostMap::const_iterator, HostMap::const_iterator> matches = hosts.equal_range(Fold(host));
+	for (HostMap::const_iterator i = matches.first; i != matches.second; ++i)
+	{
+		if (entries[i->second].nickident.match(nickident))
+			return true;
+	}
+	return false;
+}
+
+bool BanIndex::Matches(User* user) const
+{
+	const std::string nickident = user->nick + "!" + user->ident;
+	const std::string& realhost = user->GetRealHost();
+	const std::string& displayhost = user->GetDisplayedHost();
+	const std::string& ipaddr = user->GetIPString();
+
+	if (!hosts.empty())
+	{
+		if (MatchHost(realhost, nickident))
+			return true;
+
+		if ((displayhost != realhost) && (MatchHost(displayhost, nickident)))
+			return true;
+
+		if ((ipaddr != realhost) && (ipaddr != displayhost) && (MatchHost(ipaddr, nickident)))
+			return true;
+	}
+
+	if (!ranges.empty())
+	{
+		std::vector<size_t> matches;
+		ranges.find(user->client_sa, matches);
+		for (std::vector<size_t>::const_iterator i = matches.begin(); i != matches.end(); ++i)
+		{
+			if (entries[*i].nickident.match(nickident))
+				return true;
+		}
+	}
+
+	for (std::vector<size_t>::const_iterator i = wildcards.begin(); i != wildcards.end(); ++i)
+	{
+		const Entry& entry = entries[*i];
+		if (!entry.nickident.match(nickident))
+			continue;
+
+		if (entry.host.match(realhost) || entry.host.match(displayhost) || entry.host.match(ipaddr))
+			return true;
+	}
+
+	for (std::vector<std::string>::const_iterator i = unindexed.begin(); i != unindexed.end(); ++i)
+	{
+		const std::string::size_type at = i->find('@');
+		if (!InspIRCd::Match(nickident, i->substr(0, at), map))
+			continue;
+
+		const std::string host(*i, at + 1);
+		if (InspIRCd::Match(realhost, host, map) || InspIRCd::Match(displayhost, host, map) || InspIRCd::MatchCIDR(ipaddr, host, map))
+			return true;
+	}
+	return false;
+}
+
+bool BanIndex::Matches(const std::string& nickident, const std::string& host) const
+{
+	if (!hosts.empty() && MatchHost(host, nickident))
+		return true;
+
+	for (std::vector<size_t>::const_iterator i = wildcards.begin(); i != wildcards.end(); ++i)
+	{
+		const Entry& entry = entries[*i];
+		if (entry.nickident.match(nickident) && entry.host.match(host))
+			return true;
+	}
+
+	for (std::vector<std::string>::const_iterator i = unindexed.begin(); i != unindexed.end(); ++i)
+	{
+		const std::string::size_type at = i->find('@');
+		if (InspIRCd::Match(nickident, i->substr(0, at), map) && InspIRCd::Match(host, i->substr(at + 1), map))
+			return true;
+	}
+	return false;
+}
@@ -49,6 +49,308 @@
  *
  */
 
+namespace
+{
+	/** The format of the timestamp at the start of each log line. */
+	const char TimeFormat[] = "%a %b %d %Y %H:%M:%S";
+
+	/** Atomically reads a counter with a full memory barrier. */
+	inline unsigned long AtomicLoad(volatile unsigned long* counter)
+	{
+#ifdef _WIN32
+		return InterlockedExchangeAdd(reinterpret_cast<volatile LONG*>(counter), 0);
+#else
+		return __sync_fetch_and_add(counter, 0);
+#endif
+	}
+
+	/** Atomically writes a counter with a full memory barrier. */
+	inline void AtomicStore(volatile unsigned long* counter, unsigned long value)
+	{
+#ifdef _WIN32
+		InterlockedExchange(reinterpret_cast<volatile LONG*>(counter), value);
+#else
+		__sync_lock_test_and_set(counter, value);
+		__sync_synchronize();
+#endif
+	}
+
+	/** Converts a time to the local time in a way which is safe to use from any thread. */
+	bool LocalTime(time_t time, struct tm& result)
+	{
+#ifdef _WIN32
+		return localtime_s(&result, &time) == 0;
+#else
+		return localtime_r(&time, &result) != NULL;
+#endif
+	}
+
+	/** Caches the timestamp for the current second so that it only has to be formatted once. */
+	class TimeCache
+	{
+		time_t last;
+		std::string str;
+
+	 public:
+		TimeCache()
+			: last(0)
+		{
+		}
+
+		const std::string& Get(time_t time)
+		{
+			if (time != last || str.empty())
+			{
+				struct tm timeinfo;
+				char buffer[64];
+				if (LocalTime(time, timeinfo) && strftime(buffer, sizeof(buffer), TimeFormat, &timeinfo))
+					str.assign(buffer);
+				else
+					str.assign("???");
+				last = time;
+			}
+			return str;
+		}
+	};
+
+	/** Formats a log message into a line and appends it to a buffer. */
+	void FormatLine(std::string& buffer, const std::string& timestr, const std::string& type, const std::string& msg)
+	{
+		buffer.append(timestr).push_back(' ');
+		buffer.append(type).append(": ").append(msg).push_back('\n');
+	}
+
+	/** Expands the strftime() pattern of a log file name. */
+	std::string ExpandTarget(const std::string& target, time_t time)
+	{
+		struct tm timeinfo;
+#ifdef _WIN32
+		if (gmtime_s(&timeinfo, &time) != 0)
+			return target;
+#else
+		if (!gmtime_r(&time, &timeinfo))
+			return target;
+#endif
+
+		char realtarget[256];
+		if (!strftime(realtarget, sizeof(realtarget), target.c_str(), &timeinfo))
+			return target;
+		return realtarget;
+	}
+}
+
+class LogWriter::Worker CXX11_FINAL : public Thread
+{
+	/** The log writer which this worker belongs to. */
+	LogWriter& writer;
+
+ public:
+	/** The timestamp of the messages being written. */
+	TimeCache timestr;
+
+	/** The lines being written to a file in the current batch. */
+	struct Buffer
+	{
+		/** The file the lines are written to. */
+		FileWriter* file;
+
+		/** The formatted lines. */
+		std::string data;
+
+		/** The number of lines. */
+		unsigned int lines;
+
+		Buffer(FileWriter* f)
+			: file(f)
+			, lines(0)
+		{
+		}
+	};
+
+	/** The lines being written to each file in the current batch. */
+	std::vector<Buffer> buffers;
+
+	Worker(LogWriter& w)
+		: writer(w)
+	{
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		for (;;)
+		{
+			writer.queued.Lock();
+			while (AtomicLoad(&writer.tail) == AtomicLoad(&writer.head) && !GetExitFlag())
+			{
+				// The main thread only takes the lock to wake us up if it sees this
+				// flag after it has queued a message so it must be set before the
+				// queue is checked for the last time.
+				AtomicStore(&writer.sleeping, 1);
+				if (AtomicLoad(&writer.tail) != AtomicLoad(&writer.head))
+					break;
+				writer.queued.Wait();
+			}
+			AtomicStore(&writer.sleeping, 0);
+			writer.queued.Unlock();
+
+			if (AtomicLoad(&writer.tail) == AtomicLoad(&writer.head))
+				break; // Asked to exit and everything has been written.
+
+			writer.WriteBatch();
+		}
+	}
+
+	void SetExitFlag() CXX11_OVERRIDE
+	{
+		writer.queued.Lock();
+		Thread::SetExitFlag();
+		writer.queued.Wakeup();
+		writer.queued.Unlock();
+	}
+};
+
+LogWriter::LogWriter()
+	: worker(NULL)
+	, head(0)
+	, tail(0)
+	, completed(0)
+	, sleeping(0)
+	, linecount(0)
+	, batchcount(0)
+	, dropcount(0)
+{
+}
+
+LogWriter::~LogWriter()
+{
+	Stop();
+}
+
+void LogWriter::Start(size_t queuesize)
+{
+	if (worker)
+		return;
+
+	size_t size = 16;
+	while (size < queuesize)
+		size *= 2;
+
+	entries.resize(size);
+	head = tail = completed = 0;
+
+	worker = new Worker(*this);
+	try
+	{
+		ServerInstance->Threads.Start(worker);
+	}
+	catch (CoreException& ex)
+	{
+		delete worker;
+		worker = NULL;
+		ServerInstance->Logs->Log("LOG", LOG_DEFAULT, "Unable to start the log writer thread: %s", ex.GetReason().c_str());
+	}
+}
+
+void LogWriter::Stop()
+{
+	if (!worker)
+		return;
+
+	// The worker writes everything which is still queued before exiting.
+	worker->join();
+	delete worker;
+	worker = NULL;
+
+	std::vector<Entry>().swap(entries);
+}
+
+void LogWriter::Flush()
+{
+	if (!worker)
+		return;
+
+	written.Lock();
+	while (AtomicLoad(&completed) != head)
+		written.Wait();
+	written.Unlock();
+}
+
+bool LogWriter::Queue(FileWriter* file, time_t time, const std::string& type, const std::string& msg)
+{
+	const unsigned long pos = head;
+	if (pos - AtomicLoad(&tail) >= entries.size())
+	{
+		dropcount++;
+		return false;
+	}
+
+	// Assigning to the existing strings lets them reuse their buffers.
+	Entry& entry = entries[pos & (entries.size() - 1)];
+	entry.file = file;
+	entry.time = time;
+	entry.type.assign(type);
+	entry.msg.assign(msg);
+	AtomicStore(&head, pos + 1);
+
+	if (AtomicLoad(&sleeping))
+	{
+		queued.Lock();
+		queued.Wakeup();
+		queued.Unlock();
+	}
+	return true;
+}
+
+void LogWriter::WriteBatch()
+{
+	const unsigned long first = tail;
+	const unsigned long last = AtomicLoad(&head);
+	time_t lasttime = 0;
+
+	for (unsigned long pos = first; pos != last; ++pos)
+	{
+		const Entry& entry = entries[pos & (entries.size() - 1)];
+
+		std::vector<Worker::Buffer>::iterator buffer = worker->buffers.begin();
+		while (buffer != worker->buffers.end() && buffer->file != entry.file)
+			++buffer;
+		if (buffer == worker->buffers.end())
+			buffer = worker->buffers.insert(buffer, Worker::Buffer(entry.file));
+
+		FormatLine(buffer->data, worker->timestr.Get(entry.time), entry.type, entry.msg);
+		buffer->lines++;
+		lasttime = entry.time;
+	}
+
+	// The messages have been copied out of the queue so their slots can be reused.
+	AtomicStore(&tail, last);
+
+	for (std::vector<Worker::Buffer>::iterator i = worker->buffers.begin(); i != worker->buffers.end(); ++i)
+	{
+		FileWriter* file = i->file;
+		file->Rotate(lasttime);
+		if (file->log)
+		{
+			fwrite(i->data.data(), 1, i->data.length(), file->log);
+
+			// Flush as often as WriteLogLine() would have for the same number of lines.
+			const unsigned int pending = file->writeops % file->flush;
+			file->writeops += i->lines;
+			if (pending + i->lines >= file->flush)
+				fflush(file->log);
+		}
+	}
+	worker->buffers.clear();
+
+	linecount += (last - first);
+	batchcount++;
+
+	written.Lock();
+	AtomicStore(&completed, last);
+	written.Wakeup();
+	written.Unlock();
+}
+
 const char LogStream::LogHeader[] =
 	"Log started for " INSPIRCD_VERSION " (" MODULE_INIT_STR ")";
 
@@ -71,6 +373,11 @@ void LogManager::OpenFileLogs()
 	/* Skip rest of logfile opening if we are running -nolog. */
 	if (!ServerInstance->Config->cmdline.writelog)
 		return;
+
+	ConfigTag* performance = ServerInstance->Config->ConfValue("performance");
+	if (performance->getBool("logthread"))
+		Writer.Start(performance->getUInt("logqueue", 4096, 16, 1048576));
+
 	std::map<std::string, FileWriter*> logmap;
 	ConfigTagList tags = ServerInstance->Config->ConfTags("log");
 	for(ConfigIter i = tags.first; i != tags.second; ++i)
@@ -114,12 +421,7 @@ void LogManager::OpenFileLogs()
 		std::map<std::string, FileWriter*>::iterator fwi = logmap.find(target);
 		if (fwi == logmap.end())
 		{
-			char realtarget[256];
-			time_t time = ServerInstance->Time();
-			struct tm *mytime = gmtime(&time);
-			strftime(realtarget, sizeof(realtarget), target.c_str(), mytime);
-			FILE* f = fopen(realtarget, "a");
-			fw = new FileWriter(f, tag->getUInt("flush", 20, 1, UINT_MAX));
+			fw = new FileWriter(target, tag->getUInt("flush", 20, 1, UINT_MAX));
 			logmap.insert(std::make_pair(target, fw));
 		}
 		else
@@ -137,6 +439,9 @@ void LogManager::CloseLogs()
 	if (ServerInstance->Config && ServerInstance->Config->cmdline.forcedebug)
 		return;
 
+	// Write any queued messages before the files they are for are closed.
+	Writer.Stop();
+
 	LogStreams.clear();
 	GlobalLogStreams.clear();
 
@@ -312,7 +617,45 @@ FileWriter::FileWriter(FILE* logfile, unsigned int flushcount)
 	: log(logfile)
 	, flush(flushcount)
 	, writeops(0)
+	, dropped(0)
+{
+}
+
+FileWriter::FileWriter(const std::string& target, unsigned int flushcount)
+	: flush(flushcount)
+	, writeops(0)
+	, dropped(0)
+{
+	const std::string realtarget = ExpandTarget(target, ServerInstance->Time());
+	log = fopen(realtarget.c_str(), "a");
+	if (realtarget != target)
+	{
+		pattern = target;
+		filename = realtarget;
+	}
+}
+
+void FileWriter::Rotate(time_t time)
 {
+	if (pattern.empty())
+		return;
+
+	const std::string newname = ExpandTarget(pattern, time);
+	if (newname == filename)
+		return;
+
+	// Keep writing to the old file if the new one can not be opened.
+	FILE* newlog = fopen(newname.c_str(), "a");
+	if (!newlog)
+		return;
+
+	if (log)
+	{
+		fflush(log);
+		fclose(log);
+	}
+	log = newlog;
+	filename = newname;
 }
 
 void FileWriter::WriteLogLine(const std::string &line)
@@ -329,8 +672,40 @@ void FileWriter::WriteLogLine(const std::string &line)
 	}
 }
 
+void FileWriter::Write(time_t time, const std::string& type, const std::string& msg)
+{
+	LogWriter& writer = ServerInstance->Logs->GetWriter();
+	if (writer.IsEnabled())
+	{
+		if (dropped)
+		{
+			const std::string notice = InspIRCd::Format("%lu log messages were dropped because the log queue was full", dropped);
+			if (!writer.Queue(this, time, "LOG", notice))
+			{
+				dropped++;
+				return;
+			}
+			dropped = 0;
+		}
+
+		if (!writer.Queue(this, time, type, msg))
+			dropped++;
+		return;
+	}
+
+	Rotate(time);
+
+	static TimeCache timestr;
+	std::string line;
+	FormatLine(line, timestr.Get(time), type, msg);
+	WriteLogLine(line);
+}
+
 FileWriter::~FileWriter()
 {
+	// The log writer thread may still have messages queued for this file.
+	ServerInstance->Logs->GetWriter().Flush();
+
 	if (log)
 	{
 		fflush(log);
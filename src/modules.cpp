@@ -54,6 +54,8 @@ Module::Module()
 	: ModuleDLLManager(NULL)
 	, dying(false)
 {
+	for (size_t i = 0; i != I_END; ++i)
+		HookFilters[i] = NULL;
 }
 
 CullResult Module::cull()
@@ -63,6 +65,8 @@ CullResult Module::cull()
 
 Module::~Module()
 {
+	for (size_t i = 0; i != I_END; ++i)
+		delete HookFilters[i];
 }
 
 void Module::DetachEvent(Implementation i)
@@ -132,7 +136,8 @@ ModResult	Module::OnChannelPreDelete(Channel*) { DetachEvent(I_OnChannelPreDelet
 void		Module::OnChannelDelete(Channel*) { DetachEvent(I_OnChannelDelete); }
 void		Module::OnBuildNeighborList(User*, IncludeChanList&, std::map<User*,bool>&) { DetachEvent(I_OnBuildNeighborList); }
 void		Module::OnGarbageCollect() { DetachEvent(I_OnGarbageCollect); }
-ModResult	Module::OnSetConnectClass(LocalUser* user, ConnectClass* myclass) { DetachEvent(I_OnSetConnectClass); return MOD_RES_PASSTHRU; }
+ModResult	Module::OnCheckConnectClass(LocalUser* user, ConnectClass* myclass) { DetachEvent(I_OnCheckConnectClass); return MOD_RES_PASSTHRU; }
+ModResult	Module::OnForceConnectClass(LocalUser* user, ConnectClass* myclass) { DetachEvent(I_OnForceConnectClass); return MOD_RES_PASSTHRU; }
 void 		Module::OnUserMessage(User*, const MessageTarget&, const MessageDetails&) { DetachEvent(I_OnUserMessage); }
 ModResult	Module::OnNumeric(User*, const Numeric::Numeric&) { DetachEvent(I_OnNumeric); return MOD_RES_PASSTHRU; }
 ModResult   Module::OnAcceptConnection(int, ListenSocket*, irc::sockets::sockaddrs*, irc::sockets::sockaddrs*) { DetachEvent(I_OnAcceptConnection); return MOD_RES_PASSTHRU; }
@@ -156,6 +161,28 @@ void ServiceProvider::DisableAutoRegister()
 		stdalgo::erase(*ServerInstance->Modules->NewServices, this);
 }
 
+void HookFilter::AddMode(ModeMask& mask, ModeHandler* mh)
+{
+	if (mh->GetId() == ModeParser::MODEID_MAX)
+		throw ModuleException("Mode " + mh->name + " can not be used in a hook filter as it is not registered");
+	mask.set(mh->GetId());
+}
+
+ModuleManager::HookDispatch::HookDispatch(Implementation i, const HookSubject& subj)
+	: hook(i)
+	, subject(subj)
+	, stats(ServerInstance->Modules->EventStats[i])
+	, start(ServerInstance->Config->ProfileHooks ? InspIRCd::GetMicroseconds() : 0)
+{
+	stats.Dispatches++;
+}
+
+ModuleManager::HookDispatch::~HookDispatch()
+{
+	if (start)
+		stats.Time += InspIRCd::GetMicroseconds() - start;
+}
+
 ModuleManager::ModuleManager()
 {
 }
@@ -178,6 +205,33 @@ bool ModuleManager::Detach(Implementation i, Module* mod)
 	return stdalgo::erase(EventHandlers[i], mod);
 }
 
+void ModuleManager::SetHookFilter(Module* mod, Implementation i, const HookFilter& filter)
+{
+	delete mod->HookFilters[i];
+	mod->HookFilters[i] = new HookFilter(filter);
+}
+
+const char* ModuleManager::GetHookName(Implementation i)
+{
+	static const char* const names[] = {
+		"OnUserConnect", "OnUserPreQuit", "OnUserQuit", "OnUserDisconnect", "OnUserJoin", "OnUserPart",
+		"OnSendSnotice", "OnUserPreJoin", "OnUserPreKick", "OnUserKick", "OnOper", "OnUserPreInvite",
+		"OnUserInvite", "OnUserPreMessage", "OnUserPreNick", "OnUserPostMessage", "OnUserMessageBlocked",
+		"OnMode", "OnShutdown", "OnDecodeMetaData", "OnAcceptConnection", "OnUserInit", "OnUserPostInit",
+		"OnChangeHost", "OnChangeRealName", "OnAddLine", "OnDelLine", "OnExpireLine", "OnUserPostNick",
+		"OnPreMode", "On005Numeric", "OnKill", "OnLoadModule", "OnUnloadModule", "OnBackgroundTimer",
+		"OnPreCommand", "OnCheckReady", "OnCheckInvite", "OnRawMode", "OnCheckKey", "OnCheckLimit",
+		"OnCheckBan", "OnCheckChannelBan", "OnExtBanCheck", "OnPreChangeHost", "OnPreTopicChange",
+		"OnConnectionFail", "OnPostTopicChange", "OnPostConnect", "OnPostDeoper", "OnPreChangeRealName",
+		"OnUserRegister", "OnChannelPreDelete", "OnChannelDelete", "OnPostOper", "OnPostCommand",
+		"OnPostJoin", "OnBuildNeighborList", "OnGarbageCollect", "OnCheckConnectClass",
+		"OnForceConnectClass", "OnUserMessage",
+		"OnPassCompare", "OnNumeric", "OnPreRehash", "OnModuleRehash", "OnChangeIdent", "OnSetUserIP",
+		"OnServiceAdd", "OnServiceDel", "OnUserWrite"
+	};
+	return i < I_END ? names[i] : "<unknown>";
+}
+
 void ModuleManager::Attach(Implementation* i, Module* mod, size_t sz)
 {
 	for (size_t n = 0; n < sz; ++n)
@@ -28,6 +28,7 @@
 
 #include "inspircd.h"
 #include "modules/regex.h"
+#include "wildcardset.h"
 
 #ifdef __GNUC__
 # pragma GCC diagnostic push
@@ -43,6 +44,7 @@
 #endif
 
 #include <re2/re2.h>
+#include <re2/filtered_re2.h>
 
 #ifdef __GNUC__
 # pragma GCC diagnostic pop
@@ -67,6 +69,83 @@ class RE2Regex : public Regex
 	}
 };
 
+class RE2RegexSet : public RegexSet
+{
+	/** Records the atoms which are found in a string. */
+	struct AtomVisitor
+	{
+		std::vector<int>& found;
+		AtomVisitor(std::vector<int>& Found) : found(Found) { }
+		void operator()(size_t atom) { found.push_back(atom); }
+	};
+
+	/** The regexes along with the literal strings which must occur in a string for them to match. */
+	re2::FilteredRE2 regexes;
+
+	/** Finds the ASCII atoms which occur in a string. */
+	insp::literal_set atoms;
+
+	/** The indices of the atoms which can not be searched for in a case insensitive way
+	 * with the ASCII case map. These are always treated as if they had been found.
+	 */
+	std::vector<int> unsearchable;
+
+	/** The atoms which have been found in the string currently being matched. */
+	std::vector<int> found;
+
+	/** The regexes which might match the string currently being matched. */
+	std::vector<int> potentials;
+
+ public:
+	RE2RegexSet(const std::vector<std::string>& exprs)
+		: regexes(3)
+	{
+		for (std::vector<std::string>::const_iterator i = exprs.begin(); i != exprs.end(); ++i)
+		{
+			int id;
+			if (regexes.Add(*i, RE2::Quiet, &id) != RE2::NoError)
+				throw RegexException(*i, "unable to add the regex to a set");
+		}
+
+		std::vector<std::string> atomlist;
+		regexes.Compile(&atomlist);
+
+		// The atoms have been lower cased by RE2 which only matches our case map for ASCII.
+		for (size_t i = 0; i < atomlist.size(); ++i)
+		{
+			for (std::string::const_iterator c = atomlist[i].begin(); c != atomlist[i].end(); ++c)
+			{
+				if (static_cast<unsigned char>(*c) >= 0x80)
+				{
+					unsearchable.push_back(i);
+					atomlist[i].clear();
+					break;
+				}
+			}
+		}
+		atoms.compile(atomlist, ascii_case_insensitive_map);
+	}
+
+	bool Matches(const std::string& text, std::vector<size_t>& matches) CXX11_OVERRIDE
+	{
+		found.assign(unsearchable.begin(), unsearchable.end());
+		AtomVisitor visitor(found);
+		atoms.find(text.data(), text.length(), visitor);
+		std::sort(found.begin(), found.end());
+		found.erase(std::unique(found.begin(), found.end()), found.end());
+
+		potentials.clear();
+		regexes.AllPotentials(found, &potentials);
+		std::sort(potentials.begin(), potentials.end());
+		for (std::vector<int>::const_iterator i = potentials.begin(); i != potentials.end(); ++i)
+		{
+			if (RE2::FullMatch(text, regexes.GetRE2(*i)))
+				matches.push_back(*i);
+		}
+		return true;
+	}
+};
+
 class RE2Factory : public RegexFactory
 {
  public:
@@ -75,6 +154,11 @@ class RE2Factory : public RegexFactory
 	{
 		return new RE2Regex(expr);
 	}
+
+	RegexSet* CreateSet(const std::vector<std::string>& exprs) CXX11_OVERRIDE
+	{
+		return new RE2RegexSet(exprs);
+	}
 };
 
 class ModuleRegexRE2 : public Module
@@ -34,6 +34,7 @@
 #include "inspircd.h"
 #include "iohook.h"
 #include "modules/ssl.h"
+#include "modules/stats.h"
 
 #ifdef __GNUC__
 # pragma GCC diagnostic push
@@ -54,6 +55,8 @@
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/dh.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 
 #ifdef __GNUC__
 # pragma GCC diagnostic pop
@@ -87,10 +90,27 @@
 # define INSPIRCD_OPENSSL_OPAQUE_BIO
 #endif
 
+// OpenSSL 3.0 deprecates HMAC_CTX in favour of EVP_MAC_CTX for session ticket keys.
+#if !defined LIBRESSL_VERSION_NUMBER && OPENSSL_VERSION_NUMBER >= 0x30000000L
+# include <openssl/core_names.h>
+# define INSPIRCD_OPENSSL_EVP_MAC
+typedef EVP_MAC_CTX TicketMACContext;
+#else
+typedef HMAC_CTX TicketMACContext;
+#endif
+
+// Kernel TLS needs OpenSSL 3.0 and is only worth using on Linux.
+#if defined __linux__ && defined SSL_OP_ENABLE_KTLS
+# define INSPIRCD_OPENSSL_KTLS
+#endif
+
 enum issl_status { ISSL_NONE, ISSL_HANDSHAKING, ISSL_OPEN };
 
 static bool SelfSigned = false;
 static int exdataindex;
+static int jobexdataindex;
+static int ctxexdataindex;
+static SSLHandshakePool handshakepool;
 
 char* get_error()
 {
@@ -99,6 +119,7 @@ char* get_error()
 
 static int OnVerify(int preverify_ok, X509_STORE_CTX* ctx);
 static void StaticSSLInfoCallback(const SSL* ssl, int where, int rc);
+static int StaticTicketKeyCallback(SSL* ssl, unsigned char* keyname, unsigned char* iv, EVP_CIPHER_CTX* cipherctx, TicketMACContext* macctx, int enc);
 
 namespace OpenSSL
 {
@@ -138,6 +159,149 @@ namespace OpenSSL
 		}
 	};
 
+	/** Encrypts and decrypts session tickets with keys which are replaced regularly.
+	 * Tickets issued with the previous key are still accepted until it is replaced
+	 * again but clients which use them are given a new ticket.
+	 */
+	class TicketKeys
+	{
+		struct Key
+		{
+			unsigned char name[16];
+			unsigned char aeskey[32];
+			unsigned char hmackey[32];
+			time_t created;
+		};
+
+		/** The key used for new tickets and the key it replaced. */
+		Key keys[2];
+
+		/** The number of keys in keys which have been generated. */
+		unsigned int count;
+
+		/** The number of seconds after which the current key is replaced. */
+		const time_t rotation;
+
+		/** Held while the keys are used as handshakes can run on several threads. */
+		Mutex lock;
+
+		void Rotate()
+		{
+			if (count)
+				keys[1] = keys[0];
+
+			Key& key = keys[0];
+			if ((RAND_bytes(key.name, sizeof(key.name)) != 1) || (RAND_bytes(key.aeskey, sizeof(key.aeskey)) != 1) || (RAND_bytes(key.hmackey, sizeof(key.hmackey)) != 1))
+				throw Exception("Unable to generate a session ticket key");
+
+			key.created = ServerInstance->Time();
+			count = std::min(count + 1, 2U);
+		}
+
+		static bool InitMAC(TicketMACContext* macctx, const Key& key)
+		{
+#ifdef INSPIRCD_OPENSSL_EVP_MAC
+			char digest[] = "SHA256";
+			OSSL_PARAM params[3];
+			params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, const_cast<unsigned char*>(key.hmackey), sizeof(key.hmackey));
+			params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0);
+			params[2] = OSSL_PARAM_construct_end();
+			return EVP_MAC_CTX_set_params(macctx, params) == 1;
+#else
+			return HMAC_Init_ex(macctx, key.hmackey, sizeof(key.hmackey), EVP_sha256(), NULL) == 1;
+#endif
+		}
+
+		/** Does the work of Process() with the lock held. */
+		int ProcessLocked(unsigned char* keyname, unsigned char* iv, EVP_CIPHER_CTX* cipherctx, TicketMACContext* macctx, int enc, std::string& error)
+		{
+			if (enc)
+			{
+				if (!count || keys[0].created + rotation <= ServerInstance->Time())
+				{
+					// This may be running on a handshake thread so the error is left to the caller to log.
+					try
+					{
+						Rotate();
+					}
+					catch (Exception& ex)
+					{
+						error = ex.GetReason();
+						return -1;
+					}
+				}
+
+				const Key& key = keys[0];
+				if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+					return -1;
+
+				memcpy(keyname, key.name, sizeof(key.name));
+				if (EVP_EncryptInit_ex(cipherctx, EVP_aes_256_cbc(), NULL, key.aeskey, iv) != 1 || !InitMAC(macctx, key))
+					return -1;
+				return 1;
+			}
+
+			for (unsigned int i = 0; i < count; ++i)
+			{
+				const Key& key = keys[i];
+				if (memcmp(keyname, key.name, sizeof(key.name)))
+					continue;
+
+				if (EVP_DecryptInit_ex(cipherctx, EVP_aes_256_cbc(), NULL, key.aeskey, iv) != 1 || !InitMAC(macctx, key))
+					return -1;
+
+				// Tickets issued with the previous key are renewed.
+				return i ? 2 : 1;
+			}
+
+			// The key has been rotated out so a full handshake is needed.
+			return 0;
+		}
+
+	 public:
+		TicketKeys(time_t rotationtime)
+			: count(0)
+			, rotation(rotationtime)
+		{
+		}
+
+		/** Sets up the encryption of a new ticket or the decryption of an existing one.
+		 * @param error Set to the reason if a new key could not be generated.
+		 * @return The return value expected by OpenSSL from a ticket key callback.
+		 */
+		int Process(unsigned char* keyname, unsigned char* iv, EVP_CIPHER_CTX* cipherctx, TicketMACContext* macctx, int enc, std::string& error)
+		{
+			lock.Lock();
+			int ret = ProcessLocked(keyname, iv, cipherctx, macctx, enc, error);
+			lock.Unlock();
+			return ret;
+		}
+	};
+
+	/** The buffers which the BIO of a session reads from and writes to. */
+	struct Transport
+	{
+		/** The socket which the session is for. */
+		StreamSocket* const sock;
+
+		/** Whether a handshake thread has the session. If so then the socket must not be
+		 * touched and the BIO only uses the buffers below.
+		 */
+		bool buffered;
+
+		/** Data read from the socket which the session has not consumed yet. */
+		std::string recvq;
+
+		/** Data written by the session which has not been sent to the socket yet. */
+		std::string sendq;
+
+		Transport(StreamSocket* socket)
+			: sock(socket)
+			, buffered(false)
+		{
+		}
+	};
+
 	class Context
 	{
 		SSL_CTX* const ctx;
@@ -278,11 +442,48 @@ namespace OpenSSL
 			return SSL_CTX_clear_options(ctx, clearoptions);
 		}
 
+		/** Stores a pointer which can be retrieved from the sessions of this context. */
+		void SetAppData(void* data)
+		{
+			SSL_CTX_set_ex_data(ctx, ctxexdataindex, data);
+		}
+
 		void SetVerifyCert()
 		{
 			SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE, OnVerify);
 		}
 
+		/** Allows clients to resume their sessions with session tickets. This must be
+		 * called after the context options have been set.
+		 * @param idcontext The session id context which resumed sessions must match.
+		 * @param timeout The number of seconds for which a session can be resumed.
+		 */
+		void EnableSessionTickets(const std::string& idcontext, long timeout)
+		{
+			SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+			SSL_CTX_set_session_id_context(ctx, reinterpret_cast<const unsigned char*>(idcontext.data()), std::min<size_t>(idcontext.length(), SSL_MAX_SID_CTX_LENGTH));
+			SSL_CTX_set_timeout(ctx, timeout);
+#if !defined LIBRESSL_VERSION_NUMBER && OPENSSL_VERSION_NUMBER >= 0x10101000L
+			// TLSv1.3 sends two tickets by default but clients only use one per connection.
+			SSL_CTX_set_num_tickets(ctx, 1);
+#endif
+#ifdef INSPIRCD_OPENSSL_EVP_MAC
+			SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, StaticTicketKeyCallback);
+#else
+			SSL_CTX_set_tlsext_ticket_key_cb(ctx, StaticTicketKeyCallback);
+#endif
+		}
+
+#ifdef INSPIRCD_OPENSSL_KTLS
+		/** Allows OpenSSL to hand encryption over to the kernel after the handshake. This
+		 * must be called after the context options have been set.
+		 */
+		void EnableKTLS()
+		{
+			SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+		}
+#endif
+
 		SSL* CreateServerSession()
 		{
 			SSL* sess = SSL_new(ctx);
@@ -329,6 +530,14 @@ namespace OpenSSL
 		 */
 		const unsigned int outrecsize;
 
+		/** Keys for encrypting session tickets
+		 */
+		TicketKeys ticketkeys;
+
+		/** True if the kernel should encrypt connections after the handshake
+		 */
+		bool ktls;
+
 		static int error_callback(const char* str, size_t len, void* u)
 		{
 			Profile* profile = reinterpret_cast<Profile*>(u);
@@ -377,6 +586,30 @@ namespace OpenSSL
 		}
 
 	 public:
+		/** Counters for the connections which have used this profile. */
+		struct Statistics
+		{
+			/** The number of handshakes which needed a full key exchange. */
+			unsigned long Handshakes;
+
+			/** The number of handshakes which resumed an earlier session. */
+			unsigned long Resumptions;
+
+			/** The number of handshakes which failed. */
+			unsigned long Failures;
+
+			/** The number of connections which were handed over to kernel TLS. */
+			unsigned long KernelTLS;
+
+			/** The number of handshakes which were run on the handshake threads. */
+			unsigned long Threaded;
+
+			Statistics() : Handshakes(0), Resumptions(0), Failures(0), KernelTLS(0), Threaded(0) { }
+		};
+
+		/** Counters for this profile. */
+		Statistics stats;
+
 		Profile(const std::string& profilename, ConfigTag* tag)
 			: name(profilename)
 			, dh(ServerInstance->Config->Paths.PrependConfig(tag->getString("dhfile", "dhparams.pem")))
@@ -384,10 +617,16 @@ namespace OpenSSL
 			, clictx(SSL_CTX_new(SSLv23_client_method()))
 			, allowrenego(tag->getBool("renegotiation")) // Disallow by default
 			, outrecsize(tag->getUInt("outrecsize", 2048, 512, 16384))
+			, ticketkeys(tag->getDuration("ticketkeyrotation", 12*60*60, 60))
+			, ktls(tag->getBool("ktls"))
 		{
 			if ((!ctx.SetDH(dh)) || (!clictx.SetDH(dh)))
 				throw Exception("Couldn't set DH parameters");
 
+			// Callbacks which can run on a handshake thread find the profile through the context.
+			ctx.SetAppData(this);
+			clictx.SetAppData(this);
+
 			std::string hash = tag->getString("hash", "md5");
 			digest = EVP_get_digestbyname(hash.c_str());
 			if (digest == NULL)
@@ -412,6 +651,21 @@ namespace OpenSSL
 			SetContextOptions("server", tag, ctx);
 			SetContextOptions("client", tag, clictx);
 
+			// Session tickets are only issued to clients; we do not keep sessions for outgoing links.
+			if (tag->getBool("sessiontickets"))
+				ctx.EnableSessionTickets(name, tag->getDuration("sessiontimeout", 60*60, 60, 7*24*60*60));
+
+			if (ktls)
+			{
+#ifdef INSPIRCD_OPENSSL_KTLS
+				ctx.EnableKTLS();
+				clictx.EnableKTLS();
+#else
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Kernel TLS is not supported on this system, ignoring <sslprofile:ktls> for %s", name.c_str());
+				ktls = false;
+#endif
+			}
+
 			/* Load our keys and certificates
 			 * NOTE: OpenSSL's error logging API sucks, don't blame us for this clusterfuck.
 			 */
@@ -454,6 +708,8 @@ namespace OpenSSL
 		const EVP_MD* GetDigest() { return digest; }
 		bool AllowRenegotiation() const { return allowrenego; }
 		unsigned int GetOutgoingRecordSize() const { return outrecsize; }
+		TicketKeys& GetTicketKeys() { return ticketkeys; }
+		bool UseKernelTLS() const { return ktls; }
 	};
 
 	namespace BIOMethod
@@ -526,11 +782,71 @@ static int OnVerify(int preverify_ok, X509_STORE_CTX *ctx)
 	 */
 	int ve = X509_STORE_CTX_get_error(ctx);
 
-	SelfSigned = (ve == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT);
+	// A handshake thread leaves this to CheckHandshake() which uses the result saved in the session.
+	SSL* ssl = static_cast<SSL*>(X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx()));
+	if (SSL_get_ex_data(ssl, exdataindex))
+		SelfSigned = (ve == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT);
 
 	return 1;
 }
 
+class OpenSSLIOHook;
+
+/** Runs one step of a handshake on a handshake thread. */
+class OpenSSLHandshakeJob : public SSLHandshakePool::Job
+{
+	/** The hook which started the step or NULL if it has been closed since. */
+	OpenSSLIOHook* hook;
+
+	/** The session to run the handshake of. */
+	SSL* const sess;
+
+	/** The buffers used by the BIO of the session. */
+	OpenSSL::Transport* const transport;
+
+	/** Keeps the profile of the session alive until the step has finished. */
+	reference<IOHookProvider> prov;
+
+ public:
+	/** The value returned by SSL_do_handshake(). */
+	int result;
+
+	/** The error for result if it is negative. */
+	int error;
+
+	/** The (where, rc) pairs the info callback was called with during the step. */
+	std::vector<std::pair<int, int> > infoevents;
+
+	/** The errors which happened while processing session tickets during the step. */
+	std::vector<std::string> ticketerrors;
+
+	OpenSSLHandshakeJob(OpenSSLIOHook* iohook, SSL* session, OpenSSL::Transport* trans, IOHookProvider* hookprov)
+		: hook(iohook)
+		, sess(session)
+		, transport(trans)
+		, prov(hookprov)
+		, result(0)
+		, error(SSL_ERROR_NONE)
+	{
+	}
+
+	/** Hands the session over to the job which frees it once the step has finished. */
+	void Abandon()
+	{
+		hook = NULL;
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		ERR_clear_error();
+		result = SSL_do_handshake(sess);
+		if (result < 0)
+			error = SSL_get_error(sess, result);
+	}
+
+	void Finish() CXX11_OVERRIDE;
+};
+
 class OpenSSLIOHook : public SSLIOHook
 {
  private:
@@ -538,15 +854,174 @@ class OpenSSLIOHook : public SSLIOHook
 	issl_status status;
 	bool data_to_write;
 
+	/** The socket which this hook is attached to. */
+	StreamSocket* const stream;
+
+	/** Whether the kernel encrypts data written to the socket. */
+	bool ktlssend;
+
+	/** The buffers used by the BIO of the session or NULL if OpenSSL uses the socket itself. */
+	OpenSSL::Transport* transport;
+
+	/** The handshake step which is running on a handshake thread, if any. */
+	OpenSSLHandshakeJob* job;
+
+	/** Whether any part of the handshake has been run on a handshake thread. */
+	bool threaded;
+
+	/** Whether the session has been connected to the socket. */
+	bool attached;
+
+	/** Connects the session to the socket. OpenSSL uses the socket itself when the profile
+	 * uses kernel TLS and the socket engine releases it, otherwise it uses a BIO which goes
+	 * through the socket engine.
+	 * @return True if the session has been connected or false if the socket engine has not
+	 * finished with the socket yet, in which case it sends a read event once it has.
+	 */
+	bool AttachSession(StreamSocket* user)
+	{
+#ifdef INSPIRCD_OPENSSL_KTLS
+		// The socket engine refuses to release the socket if it holds data which OpenSSL
+		// would never see (e.g. a ClientHello sent straight after STARTTLS).
+		if (GetProfile().UseKernelTLS())
+		{
+			switch (SocketEngine::ReleaseIO(user))
+			{
+				case SocketEngine::RELEASE_DONE:
+					SSL_set_fd(sess, user->GetFd());
+					return true;
+
+				case SocketEngine::RELEASE_PENDING:
+					SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+					return false;
+
+				case SocketEngine::RELEASE_REFUSED:
+					break;
+			}
+		}
+#endif
+
+		// Create BIO instance and store a pointer to the transport in it which will be used by the read and write functions
+#ifdef INSPIRCD_OPENSSL_OPAQUE_BIO
+		BIO* bio = BIO_new(biomethods);
+#else
+		BIO* bio = BIO_new(&biomethods);
+#endif
+		transport = new OpenSSL::Transport(user);
+		BIO_set_data(bio, transport);
+		SSL_set_bio(sess, bio, bio);
+		return true;
+	}
+
+	/** Sends the data which was written by the session during a step on a handshake thread.
+	 * @return 1 if everything was sent, 0 if the socket blocked, -1 on error.
+	 */
+	int FlushTransport(StreamSocket* user)
+	{
+		while (!transport->sendq.empty())
+		{
+			int ret = SocketEngine::Send(user, transport->sendq.data(), transport->sendq.size(), 0);
+			if (ret > 0)
+			{
+				transport->sendq.erase(0, ret);
+			}
+			else if ((ret < 0) && (SocketEngine::IgnoreError()))
+			{
+				SocketEngine::ChangeEventMask(user, FD_WANT_NO_READ | FD_WANT_SINGLE_WRITE);
+				return 0;
+			}
+			else
+			{
+				return -1;
+			}
+		}
+		return 1;
+	}
+
+	// Returns 1 if handshake succeeded, 0 if it is still in progress, -1 if it failed
+	int ThreadedHandshake(StreamSocket* user)
+	{
+		if (SSL_is_init_finished(sess))
+			return CheckHandshake(user, 1, SSL_ERROR_NONE);
+
+		// Read whatever the peer has sent since the last step.
+		char* buffer = ServerInstance->GetReadBuffer();
+		int ret = SocketEngine::Recv(user, buffer, ServerInstance->Config->NetBufferSize, 0);
+		if (ret > 0)
+		{
+			transport->recvq.append(buffer, ret);
+		}
+		else if ((ret == 0) || (!SocketEngine::IgnoreError()))
+		{
+			GetProfile().stats.Failures++;
+			CloseSession();
+			return -1;
+		}
+
+		status = ISSL_HANDSHAKING;
+
+		// Unless we are starting an outgoing connection nothing can happen until the peer sends more.
+		if ((transport->recvq.empty()) && (SSL_is_server(sess) || !SSL_in_before(sess)))
+		{
+			SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
+			return 0;
+		}
+
+		// The socket is left alone until the step has finished.
+		threaded = true;
+		transport->buffered = true;
+		// Callbacks are recorded by the job and replayed by OnHandshakeStep().
+		job = new OpenSSLHandshakeJob(this, sess, transport, prov);
+		SSL_set_ex_data(sess, exdataindex, NULL);
+		SSL_set_ex_data(sess, jobexdataindex, job);
+		SocketEngine::ChangeEventMask(user, FD_WANT_NO_READ | FD_WANT_NO_WRITE);
+		handshakepool.Queue(job);
+		return 0;
+	}
+
 	// Returns 1 if handshake succeeded, 0 if it is still in progress, -1 if it failed
 	int Handshake(StreamSocket* user)
 	{
+		if (!attached)
+		{
+			if (!AttachSession(user))
+			{
+				status = ISSL_HANDSHAKING;
+				return 0;
+			}
+			attached = true;
+		}
+
+		if (transport)
+		{
+			// A handshake thread has the session.
+			if (job)
+				return 0;
+
+			// Anything written during the last step on a handshake thread goes first.
+			int ret = FlushTransport(user);
+			if (ret < 0)
+			{
+				GetProfile().stats.Failures++;
+				CloseSession();
+			}
+			if (ret <= 0)
+				return ret;
+
+			if (handshakepool.IsEnabled())
+				return ThreadedHandshake(user);
+		}
+
 		ERR_clear_error();
 		int ret = SSL_do_handshake(sess);
+		return CheckHandshake(user, ret, (ret < 0) ? SSL_get_error(sess, ret) : SSL_ERROR_NONE);
+	}
+
+	// Returns 1 if handshake succeeded, 0 if it is still in progress, -1 if it failed
+	int CheckHandshake(StreamSocket* user, int ret, int err)
+	{
 		if (ret < 0)
 		{
-			int err = SSL_get_error(sess, ret);
-
 			if (err == SSL_ERROR_WANT_READ)
 			{
 				SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
@@ -561,6 +1036,7 @@ class OpenSSLIOHook : public SSLIOHook
 			}
 			else
 			{
+				GetProfile().stats.Failures++;
 				CloseSession();
 				return -1;
 			}
@@ -568,16 +1044,44 @@ class OpenSSLIOHook : public SSLIOHook
 		else if (ret > 0)
 		{
 			// Handshake complete.
+			OpenSSL::Profile::Statistics& stats = GetProfile().stats;
+			const bool resumed = SSL_session_reused(sess);
+			if (resumed || threaded)
+			{
+				// OnVerify is not called when resuming and does not save the result when it is
+				// called on a handshake thread so use the result saved in the session.
+				SelfSigned = (SSL_get_verify_result(sess) == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT);
+			}
+
+			if (resumed)
+				stats.Resumptions++;
+			else
+				stats.Handshakes++;
+
+			if (threaded)
+				stats.Threaded++;
+
 			VerifyCertificate();
 
 			status = ISSL_OPEN;
 
-			SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE | FD_ADD_TRIAL_WRITE);
+#ifdef INSPIRCD_OPENSSL_KTLS
+			if (GetProfile().UseKernelTLS())
+			{
+				ktlssend = BIO_get_ktls_send(SSL_get_wbio(sess));
+				if (ktlssend)
+					stats.KernelTLS++;
+			}
+#endif
+
+			// Data which arrived along with the end of a threaded handshake may be waiting in the transport.
+			SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE | FD_ADD_TRIAL_WRITE | (threaded ? FD_ADD_TRIAL_READ : 0));
 
 			return 1;
 		}
 		else if (ret == 0)
 		{
+			GetProfile().stats.Failures++;
 			CloseSession();
 		}
 		return -1;
@@ -585,12 +1089,23 @@ class OpenSSLIOHook : public SSLIOHook
 
 	void CloseSession()
 	{
+		if (job)
+		{
+			// The session is still in use by a handshake thread so the job frees it.
+			job->Abandon();
+			job = NULL;
+			sess = NULL;
+			transport = NULL;
+		}
+
 		if (sess)
 		{
 			SSL_shutdown(sess);
 			SSL_free(sess);
 		}
 		sess = NULL;
+		delete transport;
+		transport = NULL;
 		certificate = NULL;
 		status = ISSL_NONE;
 	}
@@ -663,9 +1178,7 @@ class OpenSSLIOHook : public SSLIOHook
 			// The other side is trying to renegotiate, kill the connection and change status
 			// to ISSL_NONE so CheckRenego() closes the session
 			status = ISSL_NONE;
-			BIO* bio = SSL_get_rbio(sess);
-			EventHandler* eh = static_cast<StreamSocket*>(BIO_get_data(bio));
-			SocketEngine::Shutdown(eh, 2);
+			SocketEngine::Shutdown(stream, 2);
 		}
 	}
 
@@ -704,16 +1217,14 @@ class OpenSSLIOHook : public SSLIOHook
 		, sess(session)
 		, status(ISSL_NONE)
 		, data_to_write(false)
+		, stream(sock)
+		, ktlssend(false)
+		, transport(NULL)
+		, job(NULL)
+		, threaded(false)
+		, attached(false)
 	{
-		// Create BIO instance and store a pointer to the socket in it which will be used by the read and write functions
-#ifdef INSPIRCD_OPENSSL_OPAQUE_BIO
-		BIO* bio = BIO_new(biomethods);
-#else
-		BIO* bio = BIO_new(&biomethods);
-#endif
-		BIO_set_data(bio, sock);
-		SSL_set_bio(sess, bio, bio);
-
+		// The session is connected to the socket by the first step of the handshake.
 		SSL_set_ex_data(sess, exdataindex, this);
 		sock->AddIOHook(this);
 		Handshake(sock);
@@ -791,6 +1302,17 @@ class OpenSSLIOHook : public SSLIOHook
 		if (prepret <= 0)
 			return prepret;
 
+#ifdef INSPIRCD_OPENSSL_KTLS
+		if (ktlssend)
+		{
+			// The kernel encrypts everything written to the socket so the sendq can be written as is.
+			user->FlushSendQ(sendq);
+			if (!user->getError().empty())
+				return -1;
+			return sendq.empty() ? 1 : 0;
+		}
+#endif
+
 		data_to_write = true;
 
 		// Session is ready for transferring application data
@@ -857,6 +1379,10 @@ class OpenSSLIOHook : public SSLIOHook
 
 	bool GetServerName(std::string& out) const CXX11_OVERRIDE
 	{
+		// The session can not be used while a handshake thread has it.
+		if (job)
+			return false;
+
 		const char* name = SSL_get_servername(sess, TLSEXT_NAMETYPE_host_name);
 		if (!name)
 			return false;
@@ -865,21 +1391,98 @@ class OpenSSLIOHook : public SSLIOHook
 		return true;
 	}
 
+	/** Called when a step of the handshake has finished on a handshake thread. */
+	void OnHandshakeStep(OpenSSLHandshakeJob* step)
+	{
+		job = NULL;
+		transport->buffered = false;
+		SSL_set_ex_data(sess, jobexdataindex, NULL);
+		SSL_set_ex_data(sess, exdataindex, this);
+
+		for (std::vector<std::string>::const_iterator i = step->ticketerrors.begin(); i != step->ticketerrors.end(); ++i)
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Session %p: %s", (void*)sess, i->c_str());
+
+		for (std::vector<std::pair<int, int> >::const_iterator i = step->infoevents.begin(); i != step->infoevents.end(); ++i)
+			SSLInfoCallback(i->first, i->second);
+
+		int ret;
+		if ((step->result > 0) || (step->error == SSL_ERROR_WANT_READ))
+		{
+			ret = Handshake(stream);
+		}
+		else
+		{
+			// Let the peer know why the handshake failed.
+			FlushTransport(stream);
+			ret = CheckHandshake(stream, step->result, step->error);
+		}
+
+		// This is not called from a socket event so errors have to be reported from a read.
+		if (ret < 0)
+			SocketEngine::ChangeEventMask(stream, FD_WANT_POLL_READ | FD_ADD_TRIAL_READ);
+	}
+
 	bool IsHandshakeDone() const { return (status == ISSL_OPEN); }
 	OpenSSL::Profile& GetProfile();
 };
 
+void OpenSSLHandshakeJob::Finish()
+{
+	if (hook)
+	{
+		hook->OnHandshakeStep(this);
+	}
+	else
+	{
+		SSL_free(sess);
+		delete transport;
+	}
+	delete this;
+}
+
 static void StaticSSLInfoCallback(const SSL* ssl, int where, int rc)
 {
 	OpenSSLIOHook* hook = static_cast<OpenSSLIOHook*>(SSL_get_ex_data(ssl, exdataindex));
-	hook->SSLInfoCallback(where, rc);
+	if (hook)
+	{
+		hook->SSLInfoCallback(where, rc);
+		return;
+	}
+
+	// The hook can't be used while a handshake thread has the session.
+	OpenSSLHandshakeJob* job = static_cast<OpenSSLHandshakeJob*>(SSL_get_ex_data(ssl, jobexdataindex));
+	if (job)
+		job->infoevents.push_back(std::make_pair(where, rc));
+}
+
+static int StaticTicketKeyCallback(SSL* ssl, unsigned char* keyname, unsigned char* iv, EVP_CIPHER_CTX* cipherctx, TicketMACContext* macctx, int enc)
+{
+	OpenSSL::Profile* profile = static_cast<OpenSSL::Profile*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ctxexdataindex));
+	std::string error;
+	int ret = profile->GetTicketKeys().Process(keyname, iv, cipherctx, macctx, enc, error);
+	if (!error.empty())
+	{
+		OpenSSLHandshakeJob* job = static_cast<OpenSSLHandshakeJob*>(SSL_get_ex_data(ssl, jobexdataindex));
+		if (job)
+			job->ticketerrors.push_back(error);
+		else
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Session %p: %s", (void*)ssl, error.c_str());
+	}
+	return ret;
 }
 
 static int OpenSSL::BIOMethod::write(BIO* bio, const char* buffer, int size)
 {
 	BIO_clear_retry_flags(bio);
 
-	StreamSocket* sock = static_cast<StreamSocket*>(BIO_get_data(bio));
+	OpenSSL::Transport* transport = static_cast<OpenSSL::Transport*>(BIO_get_data(bio));
+	if (transport->buffered)
+	{
+		transport->sendq.append(buffer, size);
+		return size;
+	}
+
+	StreamSocket* sock = transport->sock;
 	if (sock->GetEventMask() & FD_WRITE_WILL_BLOCK)
 	{
 		// Writes blocked earlier, don't retry syscall
@@ -902,7 +1505,23 @@ static int OpenSSL::BIOMethod::read(BIO* bio, char* buffer, int size)
 {
 	BIO_clear_retry_flags(bio);
 
-	StreamSocket* sock = static_cast<StreamSocket*>(BIO_get_data(bio));
+	// Data which was read while a handshake thread had the session is used first.
+	OpenSSL::Transport* transport = static_cast<OpenSSL::Transport*>(BIO_get_data(bio));
+	if (!transport->recvq.empty())
+	{
+		int ret = std::min<int>(size, transport->recvq.size());
+		memcpy(buffer, transport->recvq.data(), ret);
+		transport->recvq.erase(0, ret);
+		return ret;
+	}
+
+	if (transport->buffered)
+	{
+		BIO_set_retry_read(bio);
+		return -1;
+	}
+
+	StreamSocket* sock = transport->sock;
 	if (sock->GetEventMask() & FD_READ_WILL_BLOCK)
 	{
 		// Reads blocked earlier, don't retry syscall
@@ -957,7 +1576,7 @@ OpenSSL::Profile& OpenSSLIOHook::GetProfile()
 	return static_cast<OpenSSLIOHookProvider*>(hookprov)->GetProfile();
 }
 
-class ModuleSSLOpenSSL : public Module
+class ModuleSSLOpenSSL : public Module, public Stats::EventListener
 {
 	typedef std::vector<reference<OpenSSLIOHookProvider> > ProfileList;
 
@@ -1021,15 +1640,20 @@ class ModuleSSLOpenSSL : public Module
 
  public:
 	ModuleSSLOpenSSL()
+		: Stats::EventListener(this)
 	{
 		// Initialize OpenSSL
 		OPENSSL_init_ssl(0, NULL);
 #ifdef INSPIRCD_OPENSSL_OPAQUE_BIO
 		biomethods = OpenSSL::BIOMethod::alloc();
+#endif
 	}
 
 	~ModuleSSLOpenSSL()
 	{
+		// Finish any handshake steps which are still running before the BIO method goes away.
+		handshakepool.SetThreadCount(0);
+#ifdef INSPIRCD_OPENSSL_OPAQUE_BIO
 		BIO_meth_free(biomethods);
 #endif
 	}
@@ -1044,9 +1668,31 @@ class ModuleSSLOpenSSL : public Module
 		if (exdataindex < 0)
 			throw ModuleException("Failed to register application specific data");
 
+		jobexdataindex = SSL_get_ex_new_index(0, exdatastr, NULL, NULL, NULL);
+		if (jobexdataindex < 0)
+			throw ModuleException("Failed to register application specific data");
+
+		ctxexdataindex = SSL_CTX_get_ex_new_index(0, exdatastr, NULL, NULL, NULL);
+		if (ctxexdataindex < 0)
+			throw ModuleException("Failed to register application specific data");
+
 		ReadProfiles();
 	}
 
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		unsigned long threads = ServerInstance->Config->ConfValue("performance")->getUInt("sslthreads", 0, 0, 64);
+#ifndef INSPIRCD_OPENSSL_OPAQUE_BIO
+		// Sessions can only be shared between threads safely with OpenSSL 1.1 or newer.
+		if (threads)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "SSL handshake threads need OpenSSL 1.1 or newer, ignoring <performance:sslthreads>");
+			threads = 0;
+		}
+#endif
+		handshakepool.SetThreadCount(threads);
+	}
+
 	void OnModuleRehash(User* user, const std::string &param) CXX11_OVERRIDE
 	{
 		if (!irc::equals(param, "ssl"))
@@ -1086,6 +1732,21 @@ class ModuleSSLOpenSSL : public Module
 		return MOD_RES_PASSTHRU;
 	}
 
+	ModResult OnStats(Stats::Context& stats) CXX11_OVERRIDE
+	{
+		if (stats.GetSymbol() != 't')
+			return MOD_RES_PASSTHRU;
+
+		for (ProfileList::const_iterator i = profiles.begin(); i != profiles.end(); ++i)
+		{
+			OpenSSL::Profile& profile = (*i)->GetProfile();
+			const OpenSSL::Profile::Statistics& pstats = profile.stats;
+			stats.AddRow(249, InspIRCd::Format("openssl %s handshakes %lu resumed %lu failed %lu ktls %lu threaded %lu", profile.GetName().c_str(),
+				pstats.Handshakes, pstats.Resumptions, pstats.Failures, pstats.KernelTLS, pstats.Threaded));
+		}
+		return MOD_RES_PASSTHRU;
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Provides SSL support via OpenSSL", VF_VENDOR);
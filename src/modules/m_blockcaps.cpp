@@ -39,6 +39,12 @@ public:
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		// The extban can block caps without +B being set so only remote users can be skipped.
+		ServerInstance->Modules->SetHookFilter(this, I_OnUserPreMessage, HookFilter().LocalUsers());
+	}
+
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
 	{
 		tokens["EXTBAN"].push_back('B');
@@ -54,6 +54,11 @@ class BotTag : public ClientProtocol::MessageTagProvider
 	{
 		return ctctagcap.get(user);
 	}
+
+	bool UsesTagProfile() const CXX11_OVERRIDE
+	{
+		return true;
+	}
 };
 
 class ModuleBotMode : public Module, public Whois::EventListener
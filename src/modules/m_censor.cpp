@@ -40,6 +40,12 @@ class ModuleCensor : public Module
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		// Only channels with +G set are censored; messages to users are checked for +G themselves.
+		ServerInstance->Modules->SetHookFilter(this, I_OnUserPreMessage, HookFilter().LocalUsers().ChannelMode(&cc));
+	}
+
 	// format of a config entry is <badword text="shit" replace="poo">
 	ModResult OnUserPreMessage(User* user, const MessageTarget& target, MessageDetails& details) CXX11_OVERRIDE
 	{
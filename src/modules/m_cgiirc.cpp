@@ -323,7 +323,7 @@ class ModuleCgiIRC
 		cmd.notify = ServerInstance->Config->ConfValue("cgiirc")->getBool("opernotice", true);
 	}
 
-	ModResult OnSetConnectClass(LocalUser* user, ConnectClass* myclass) CXX11_OVERRIDE
+	ModResult OnCheckConnectClass(LocalUser* user, ConnectClass* myclass) CXX11_OVERRIDE
 	{
 		// If <connect:webirc> is not set then we have nothing to do.
 		const std::string webirc = myclass->config->getString("webirc");
@@ -24,6 +24,7 @@
 
 
 #include "inspircd.h"
+#include "listmode.h"
 #include "modules/hash.h"
 
 enum CloakMode
@@ -185,11 +186,13 @@ class ModuleCloaking : public Module
 	CommandCloak ck;
 	std::vector<CloakInfo> cloaks;
 	dynamic_reference<HashProvider> Hash;
+	ChanModeReference banmode;
 
 	ModuleCloaking()
 		: cu(this)
 		, ck(this)
 		, Hash(this, "hash/md5")
+		, banmode(this, "ban")
 	{
 	}
 
@@ -361,10 +364,42 @@ class ModuleCloaking : public Module
 		return MOD_RES_PASSTHRU;
 	}
 
+	ModResult OnCheckChannelBan(User* user, Channel* chan) CXX11_OVERRIDE
+	{
+		// Channel::IsBanned() only passes extbans to OnCheckBan so the unused cloaks
+		// are looked up in the ban index of the channel instead.
+		LocalUser* lu = IS_LOCAL(user);
+		ListModeBase* banlm = static_cast<ListModeBase*>(*banmode);
+		if (!lu || !banlm)
+			return MOD_RES_PASSTHRU;
+
+		const BanIndex* index = banlm->GetBanIndex(chan);
+		if (!index)
+			return MOD_RES_PASSTHRU;
+
+		// Force the creation of cloaks if not already set.
+		OnUserConnect(lu);
+
+		// If the user has no cloaks (i.e. UNIX socket) then we do nothing here.
+		CloakList* cloaklist = cu.ext.get(user);
+		if (!cloaklist || cloaklist->empty())
+			return MOD_RES_PASSTHRU;
+
+		const std::string nickident = user->nick + "!" + user->ident;
+		for (CloakList::const_iterator iter = cloaklist->begin(); iter != cloaklist->end(); ++iter)
+		{
+			const std::string& cloak = *iter;
+			if (cloak != user->GetDisplayedHost() && index->Matches(nickident, cloak))
+				return MOD_RES_DENY;
+		}
+		return MOD_RES_PASSTHRU;
+	}
+
 	void Prioritize() CXX11_OVERRIDE
 	{
 		/* Needs to be after m_banexception etc. */
 		ServerInstance->Modules->SetPriority(this, I_OnCheckBan, PRIORITY_LAST);
+		ServerInstance->Modules->SetPriority(this, I_OnCheckChannelBan, PRIORITY_LAST);
 	}
 
 	// this unsets umode +x on every host change. If we are actually doing a +x
@@ -93,6 +93,8 @@ class ModuleCodepage
 		if (!memcmp(prevmap, national_case_insensitive_map, UCHAR_MAX))
 			return;
 
+		national_case_insensitive_generation++;
+
 		RehashHashmap(ServerInstance->Users.clientlist);
 		RehashHashmap(ServerInstance->Users.uuidlist);
 		RehashHashmap(ServerInstance->chanlist);
@@ -113,6 +115,8 @@ class ModuleCodepage
 
 		ServerInstance->Config->CaseMapping = origcasemapname;
 		national_case_insensitive_map = origcasemap;
+		// Anything built with our table must stop using it even if the restored table is identical.
+		national_case_insensitive_generation++;
 		CheckRehash(casemap);
 
 		ServerInstance->ISupport.Build();
@@ -422,7 +422,7 @@ class ModuleDNSBL : public Module, public Stats::EventListener
 		}
 	}
 
-	ModResult OnSetConnectClass(LocalUser* user, ConnectClass* myclass) CXX11_OVERRIDE
+	ModResult OnCheckConnectClass(LocalUser* user, ConnectClass* myclass) CXX11_OVERRIDE
 	{
 		std::string dnsbl;
 		if (!myclass->config->readString("dnsbl", dnsbl))
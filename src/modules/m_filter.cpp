@@ -180,11 +180,37 @@ class ModuleFilter
 {
 	typedef insp::flat_set<std::string, irc::insensitive_swo> ExemptTargetSet;
 
+	/** The filters which are matched against the same text, compiled into a single set. */
+	struct FilterSet
+	{
+		/** The set of filter patterns or NULL if there are no filters in this set. */
+		RegexSet* regexes;
+
+		/** The index in the filter list of each pattern in the set. */
+		std::vector<size_t> indices;
+
+		FilterSet() : regexes(NULL) { }
+	};
+
 	bool initing;
 	bool notifyuser;
 	bool warnonselfmsg;
 	RegexFactory* factory;
+
+	/** The filters which match against the original text and those which match against the
+	 * text with formatting codes stripped. Only valid if setsvalid is true.
+	 */
+	FilterSet filtersets[2];
+
+	/** Whether the filter sets have been built since the filter list was last changed. */
+	bool setsvalid;
+
+	/** Whether the regex engine supports matching filters in bulk. */
+	bool usesets;
+
 	void FreeFilters();
+	void FreeFilterSets();
+	void BuildFilterSets();
 
  public:
 	CommandFilter filtcommand;
@@ -338,6 +364,8 @@ ModuleFilter::ModuleFilter()
 	: ServerProtocol::SyncEventListener(this)
 	, Stats::EventListener(this)
 	, initing(true)
+	, setsvalid(false)
+	, usesets(false)
 	, filtcommand(this)
 	, RegexEngine(this, "regex")
 {
@@ -360,6 +388,54 @@ void ModuleFilter::FreeFilters()
 		delete i->regex;
 
 	filters.clear();
+	FreeFilterSets();
+}
+
+void ModuleFilter::FreeFilterSets()
+{
+	for (size_t i = 0; i < 2; ++i)
+	{
+		delete filtersets[i].regexes;
+		filtersets[i].regexes = NULL;
+		filtersets[i].indices.clear();
+	}
+	setsvalid = false;
+}
+
+void ModuleFilter::BuildFilterSets()
+{
+	FreeFilterSets();
+	setsvalid = true;
+	usesets = false;
+	if (!RegexEngine)
+		return;
+
+	std::vector<std::string> patterns[2];
+	for (size_t i = 0; i < filters.size(); ++i)
+	{
+		const size_t set = filters[i].flag_strip_color ? 1 : 0;
+		patterns[set].push_back(filters[i].freeform);
+		filtersets[set].indices.push_back(i);
+	}
+
+	usesets = true;
+	for (size_t i = 0; i < 2; ++i)
+	{
+		if (patterns[i].empty())
+			continue;
+
+		try
+		{
+			filtersets[i].regexes = RegexEngine->CreateSet(patterns[i]);
+		}
+		catch (ModuleException& e)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to match filters in bulk, falling back to matching them individually: %s", e.GetReason().c_str());
+		}
+
+		if (!filtersets[i].regexes)
+			usesets = false;
+	}
 }
 
 ModResult ModuleFilter::OnUserPreMessage(User* user, const MessageTarget& msgtarget, MessageDetails& details)
@@ -744,6 +820,45 @@ FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int
 	static std::string stripped_text;
 	stripped_text.clear();
 
+	if (!setsvalid)
+		BuildFilterSets();
+
+	if (usesets)
+	{
+		// Find the first filter which matches and applies to the user, in the same order as
+		// they would be checked individually.
+		static std::vector<size_t> matches;
+		size_t first = filters.size();
+		bool matched = true;
+		for (size_t i = 0; matched && i < 2; ++i)
+		{
+			const FilterSet& set = filtersets[i];
+			if (!set.regexes)
+				continue;
+
+			if (i && stripped_text.empty())
+			{
+				stripped_text = text;
+				InspIRCd::StripColor(stripped_text);
+			}
+
+			matches.clear();
+			matched = set.regexes->Matches(i ? stripped_text : text, matches);
+			for (std::vector<size_t>::const_iterator match = matches.begin(); match != matches.end(); ++match)
+			{
+				const size_t index = set.indices[*match];
+				if (index >= first)
+					break;
+
+				if (AppliesToMe(user, &filters[index], flgs))
+					first = index;
+			}
+		}
+
+		if (matched)
+			return (first < filters.size() ? &filters[first] : NULL);
+	}
+
 	for (std::vector<FilterResult>::iterator i = filters.begin(); i != filters.end(); ++i)
 	{
 		FilterResult* filter = &*i;
@@ -773,6 +888,7 @@ bool ModuleFilter::DeleteFilter(const std::string& freeform, std::string& reason
 			reason.assign(i->reason);
 			delete i->regex;
 			filters.erase(i);
+			FreeFilterSets();
 			return true;
 		}
 	}
@@ -792,6 +908,7 @@ std::pair<bool, std::string> ModuleFilter::AddFilter(const std::string& freeform
 	try
 	{
 		filters.push_back(FilterResult(RegexEngine, freeform, reason, type, duration, flgs, config));
+		FreeFilterSets();
 	}
 	catch (ModuleException &e)
 	{
@@ -851,6 +968,7 @@ void ModuleFilter::ReadFilters()
 			removedfilters.insert(filter->freeform);
 			delete filter->regex;
 			filter = filters.erase(filter);
+			FreeFilterSets();
 			continue;
 		}
 
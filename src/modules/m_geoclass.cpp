@@ -46,7 +46,7 @@ class ModuleGeoClass
 		return Version("Provides a way to assign users to connect classes by country", VF_VENDOR);
 	}
 
-	ModResult OnSetConnectClass(LocalUser* user, ConnectClass* myclass) CXX11_OVERRIDE
+	ModResult OnCheckConnectClass(LocalUser* user, ConnectClass* myclass) CXX11_OVERRIDE
 	{
 		const std::string country = myclass->config->getString("country");
 		if (country.empty())
@@ -86,6 +86,18 @@ class HttpServerSocket : public BufferedSocket, public Timer, public insp::intru
 	bool waitingcull;
 	bool messagecomplete;
 
+	/** The generator of the document which is being streamed or NULL if there isn't one.
+	 */
+	HTTPDocumentGenerator* generator;
+
+	/** The module which the generator belongs to.
+	 */
+	Module* generatormodule;
+
+	/** More of a streamed document is generated once the sendq is smaller than this.
+	 */
+	static const size_t STREAM_LOW_WATER = 64 * 1024;
+
 	bool Tick(time_t currtime) CXX11_OVERRIDE
 	{
 		if (!messagecomplete)
@@ -217,6 +229,8 @@ class HttpServerSocket : public BufferedSocket, public Timer, public insp::intru
 		, status_code(0)
 		, waitingcull(false)
 		, messagecomplete(false)
+		, generator(NULL)
+		, generatormodule(NULL)
 	{
 		if ((!via->iohookprovs.empty()) && (via->iohookprovs.back()))
 		{
@@ -237,6 +251,7 @@ class HttpServerSocket : public BufferedSocket, public Timer, public insp::intru
 	~HttpServerSocket()
 	{
 		sockets.erase(this);
+		delete generator;
 	}
 
 	void OnError(BufferedSocketError) CXX11_OVERRIDE
@@ -254,15 +269,20 @@ class HttpServerSocket : public BufferedSocket, public Timer, public insp::intru
 		Page(data, response, &empty);
 	}
 
-	void SendHeaders(unsigned long size, unsigned int response, HTTPHeaders &rheaders)
+	void SendHeaders(unsigned long size, unsigned int response, HTTPHeaders &rheaders, bool streamed = false)
 	{
 		WriteData(InspIRCd::Format("HTTP/%u.%u %u %s\r\n", parser.http_major ? parser.http_major : 1, parser.http_major ? parser.http_minor : 1, response, http_status_str((http_status)response)));
 
 		rheaders.CreateHeader("Date", InspIRCd::TimeString(ServerInstance->Time(), "%a, %d %b %Y %H:%M:%S GMT", true));
 		rheaders.CreateHeader("Server", INSPIRCD_BRANCH);
-		rheaders.SetHeader("Content-Length", ConvToStr(size));
 
-		if (size)
+		// The length of a streamed document isn't known in advance so it ends when the connection is closed.
+		if (streamed)
+			rheaders.RemoveHeader("Content-Length");
+		else
+			rheaders.SetHeader("Content-Length", ConvToStr(size));
+
+		if (size || streamed)
 			rheaders.CreateHeader("Content-Type", "text/html");
 		else
 			rheaders.RemoveHeader("Content-Type");
@@ -278,7 +298,7 @@ class HttpServerSocket : public BufferedSocket, public Timer, public insp::intru
 
 	void OnDataReady() CXX11_OVERRIDE
 	{
-		if (parser.upgrade || HTTP_PARSER_ERRNO(&parser))
+		if (parser.upgrade || HTTP_PARSER_ERRNO(&parser) || generator)
 			return;
 		http_parser_execute(&parser, &parser_settings, recvq.data(), recvq.size());
 		if (parser.upgrade || HTTP_PARSER_ERRNO(&parser))
@@ -316,6 +336,55 @@ class HttpServerSocket : public BufferedSocket, public Timer, public insp::intru
 		Page(n->str(), response, hheaders);
 	}
 
+	void Stream(HTTPDocumentGenerator* gen, Module* mod, unsigned int response, HTTPHeaders* hheaders)
+	{
+		delete generator;
+		generator = gen;
+		generatormodule = mod;
+
+		SendHeaders(0, response, *hheaders, true);
+		ContinueStream();
+	}
+
+	/** Generates more of the streamed document until the sendq is full enough again. */
+	void ContinueStream()
+	{
+		while (generator && !waitingcull && getSendQSize() < STREAM_LOW_WATER)
+		{
+			std::string data;
+			const bool more = generator->Generate(data);
+			if (!data.empty())
+				WriteData(data);
+
+			if (!more)
+			{
+				delete generator;
+				generator = NULL;
+				generatormodule = NULL;
+				Close(true);
+			}
+		}
+	}
+
+	void OnEventHandlerWrite() CXX11_OVERRIDE
+	{
+		if (!generator)
+		{
+			BufferedSocket::OnEventHandlerWrite();
+			return;
+		}
+
+		// The socket engine tells us when the socket can be written to again, which is
+		// when the sendq has drained and the next part of the document is generated.
+		DoWrite();
+		if (!getError().empty())
+		{
+			AddToCull();
+			return;
+		}
+		ContinueStream();
+	}
+
 	void AddToCull()
 	{
 		if (waitingcull)
@@ -371,7 +440,10 @@ class HTTPdAPIImpl : public HTTPdAPIBase
 
 	void SendResponse(HTTPDocumentResponse& resp) CXX11_OVERRIDE
 	{
-		resp.src.sock->Page(resp.document, resp.responsecode, &resp.headers);
+		if (resp.generator)
+			resp.src.sock->Stream(resp.generator, resp.module, resp.responsecode, &resp.headers);
+		else
+			resp.src.sock->Page(resp.document, resp.responsecode, &resp.headers);
 	}
 };
 
@@ -419,7 +491,7 @@ class ModuleHttpServer : public Module
 		{
 			HttpServerSocket* sock = *i;
 			++i;
-			if (sock->GetModHook(mod))
+			if (sock->GetModHook(mod) || (sock->generator && sock->generatormodule == mod))
 			{
 				sock->cull();
 				delete sock;
@@ -165,41 +165,31 @@ namespace Stats
 		return data << "</modulelist>";
 	}
 
-	std::ostream& Channels(std::ostream& data)
+	std::ostream& DumpChannel(std::ostream& data, Channel* c)
 	{
-		data << "<channellist>";
-
-		const chan_hash& chans = ServerInstance->GetChans();
-		for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+		data << "<channel>";
+		data << "<usercount>" << c->GetUsers().size() << "</usercount><channelname>" << Sanitize(c->name) << "</channelname>";
+		data << "<channeltopic>";
+		data << "<topictext>" << Sanitize(c->topic) << "</topictext>";
+		data << "<setby>" << Sanitize(c->setby) << "</setby>";
+		data << "<settime>" << c->topicset << "</settime>";
+		data << "</channeltopic>";
+		data << "<channelmodes>" << Sanitize(c->ChanModes(true)) << "</channelmodes>";
+
+		const Channel::MemberMap& ulist = c->GetUsers();
+		for (Channel::MemberMap::const_iterator x = ulist.begin(); x != ulist.end(); ++x)
 		{
-			Channel* c = i->second;
-
-			data << "<channel>";
-			data << "<usercount>" << c->GetUsers().size() << "</usercount><channelname>" << Sanitize(c->name) << "</channelname>";
-			data << "<channeltopic>";
-			data << "<topictext>" << Sanitize(c->topic) << "</topictext>";
-			data << "<setby>" << Sanitize(c->setby) << "</setby>";
-			data << "<settime>" << c->topicset << "</settime>";
-			data << "</channeltopic>";
-			data << "<channelmodes>" << Sanitize(c->ChanModes(true)) << "</channelmodes>";
-
-			const Channel::MemberMap& ulist = c->GetUsers();
-			for (Channel::MemberMap::const_iterator x = ulist.begin(); x != ulist.end(); ++x)
-			{
-				Membership* memb = x->second;
-				data << "<channelmember><uid>" << memb->user->uuid << "</uid><privs>"
-					<< Sanitize(memb->GetAllPrefixChars()) << "</privs><modes>"
-					<< memb->modes << "</modes>";
-				DumpMeta(data, memb);
-				data << "</channelmember>";
-			}
-
-			DumpMeta(data, c);
-
-			data << "</channel>";
+			Membership* memb = x->second;
+			data << "<channelmember><uid>" << memb->user->uuid << "</uid><privs>"
+				<< Sanitize(memb->GetAllPrefixChars()) << "</privs><modes>"
+				<< memb->modes << "</modes>";
+			DumpMeta(data, memb);
+			data << "</channelmember>";
 		}
 
-		return data << "</channellist>";
+		DumpMeta(data, c);
+
+		return data << "</channel>";
 	}
 
 	std::ostream& DumpUser(std::ostream& data, User* u)
@@ -233,22 +223,6 @@ namespace Stats
 		return data;
 	}
 
-	std::ostream& Users(std::ostream& data)
-	{
-		data << "<userlist>";
-		const user_hash& users = ServerInstance->Users->GetUsers();
-		for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
-		{
-			User* u = i->second;
-
-			if (u->registered != REG_ALL)
-				continue;
-
-			DumpUser(data, u);
-		}
-		return data << "</userlist>";
-	}
-
 	std::ostream& Servers(std::ostream& data)
 	{
 		data << "<serverlist>";
@@ -322,13 +296,8 @@ namespace Stats
 		}
 	};
 
-	std::ostream& ListUsers(std::ostream& data, const HTTPQueryParameters& params)
+	void ListUsers(const HTTPQueryParameters& params, std::vector<std::string>& uuids)
 	{
-		if (params.empty())
-			return Users(data);
-
-		data << "<userlist>";
-
 		// Filters
 		size_t limit = params.getNum<size_t>("limit");
 		bool showunreg = params.getBool("showunreg");
@@ -383,11 +352,391 @@ namespace Stats
 
 		size_t count = 0;
 		for (NewUserList::const_iterator i = user_list.begin(); i != user_list.end() && (!limit || count < limit); ++i, ++count)
-			DumpUser(data, *i);
+			uuids.push_back((*i)->uuid);
+	}
 
-		data << "</userlist>";
-		return data;
+	/** Streams an XML stats document a section at a time. Channels and users are
+	 * written in batches and looked up again when their batch is written so the
+	 * document copes with them going away while it is being sent.
+	 */
+	class XMLDocument : public HTTPDocumentGenerator
+	{
+	 public:
+		enum Section
+		{
+			SECTION_SERVERINFO,
+			SECTION_GENERAL,
+			SECTION_XLINES,
+			SECTION_MODULES,
+			SECTION_CHANNELS,
+			SECTION_USERS,
+			SECTION_SERVERS,
+			SECTION_COMMANDS
+		};
+
+	 private:
+		/** The number of channels or users to write at a time. */
+		static const size_t BATCH_SIZE = 100;
+
+		/** The amount of the document to generate at a time. */
+		static const size_t CHUNK_SIZE = 32 * 1024;
+
+		/** The sections which have not been written yet. */
+		std::deque<Section> sections;
+
+		/** Whether the opening tag of the document has been written. */
+		bool started;
+
+		/** The names of the channels or the UUIDs of the users in the list being written. */
+		std::vector<std::string> names;
+
+		/** The index in names of the next channel or user to write. */
+		size_t position;
+
+		/** Whether the opening tag of the list being written has been written. */
+		bool inlist;
+
+		/** Whether the users to write have been chosen in advance. */
+		bool filteredusers;
+
+		/** Writes the next batch of the channel list.
+		 * @return True if the list is complete; otherwise, false.
+		 */
+		bool WriteChannels(std::ostream& data)
+		{
+			if (!inlist)
+			{
+				data << "<channellist>";
+				const chan_hash& chans = ServerInstance->GetChans();
+				names.clear();
+				names.reserve(chans.size());
+				for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+					names.push_back(i->second->name);
+				position = 0;
+				inlist = true;
+			}
+
+			for (size_t count = 0; position < names.size() && count < BATCH_SIZE; ++position, ++count)
+			{
+				Channel* chan = ServerInstance->FindChan(names[position]);
+				if (chan)
+					DumpChannel(data, chan);
+			}
+
+			if (position < names.size())
+				return false;
+
+			data << "</channellist>";
+			inlist = false;
+			return true;
+		}
+
+		/** Writes the next batch of the user list.
+		 * @return True if the list is complete; otherwise, false.
+		 */
+		bool WriteUsers(std::ostream& data)
+		{
+			if (!inlist)
+			{
+				data << "<userlist>";
+				if (!filteredusers)
+				{
+					const user_hash& users = ServerInstance->Users->GetUsers();
+					names.clear();
+					names.reserve(users.size());
+					for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+					{
+						if (i->second->registered == REG_ALL)
+							names.push_back(i->second->uuid);
+					}
+				}
+				position = 0;
+				inlist = true;
+			}
+
+			for (size_t count = 0; position < names.size() && count < BATCH_SIZE; ++position, ++count)
+			{
+				User* user = ServerInstance->FindUUID(names[position]);
+				if (user)
+					DumpUser(data, user);
+			}
+
+			if (position < names.size())
+				return false;
+
+			data << "</userlist>";
+			inlist = false;
+			return true;
+		}
+
+		/** Writes part of a section.
+		 * @return True if the section is complete; otherwise, false.
+		 */
+		bool WriteSection(std::ostream& data, Section section)
+		{
+			switch (section)
+			{
+				case SECTION_SERVERINFO:
+					data << ServerInfo;
+					break;
+				case SECTION_GENERAL:
+					data << General;
+					break;
+				case SECTION_XLINES:
+					data << XLines;
+					break;
+				case SECTION_MODULES:
+					data << Modules;
+					break;
+				case SECTION_CHANNELS:
+					return WriteChannels(data);
+				case SECTION_USERS:
+					return WriteUsers(data);
+				case SECTION_SERVERS:
+					data << Servers;
+					break;
+				case SECTION_COMMANDS:
+					data << Commands;
+					break;
+			}
+			return true;
+		}
+
+	 public:
+		XMLDocument()
+			: started(false)
+			, position(0)
+			, inlist(false)
+			, filteredusers(false)
+		{
+		}
+
+		/** Adds a section to the end of the document. */
+		void AddSection(Section section)
+		{
+			sections.push_back(section);
+		}
+
+		/** Adds a user list containing only the specified users to the end of the document. */
+		void AddUsers(const std::vector<std::string>& uuids)
+		{
+			names = uuids;
+			filteredusers = true;
+			sections.push_back(SECTION_USERS);
+		}
+
+		bool Generate(std::string& out) CXX11_OVERRIDE
+		{
+			std::stringstream data;
+			if (!started)
+			{
+				data << "<inspircdstats>";
+				started = true;
+			}
+
+			while (!sections.empty() && static_cast<size_t>(data.tellp()) < CHUNK_SIZE)
+			{
+				if (WriteSection(data, sections.front()))
+					sections.pop_front();
+			}
+
+			if (sections.empty())
+				data << "</inspircdstats>";
+
+			out.append(data.str());
+			return !sections.empty();
+		}
+	};
+
+	/** Escapes a Prometheus label value. */
+	std::string EscapeLabel(const std::string& str)
+	{
+		std::string ret;
+		ret.reserve(str.length());
+		for (std::string::const_iterator x = str.begin(); x != str.end(); ++x)
+		{
+			if (*x == '\\' || *x == '"')
+				ret.push_back('\\');
+			else if (*x == '\n')
+			{
+				ret.append("\\n");
+				continue;
+			}
+			ret.push_back(*x);
+		}
+		return ret;
+	}
+
+	/** Formats a number of microseconds as seconds. */
+	std::string FormatSeconds(uint64_t usecs)
+	{
+		return InspIRCd::Format("%lu.%06lu", static_cast<unsigned long>(usecs / 1000000), static_cast<unsigned long>(usecs % 1000000));
+	}
+
+	/** Writes the header of a metric family in the Prometheus text format. */
+	std::ostream& MetricHeader(std::ostream& data, const char* name, const char* type, const char* help)
+	{
+		return data << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
 	}
+
+	/** Streams the counters and gauges of the server in the Prometheus text format.
+	 * Nothing here walks channels or serializes users so it is cheap enough to be
+	 * scraped every few seconds.
+	 */
+	class MetricsDocument : public HTTPDocumentGenerator
+	{
+		/** The families of metrics in the order they are written. */
+		enum Step
+		{
+			STEP_SOCKETENGINE,
+			STEP_CLIENTS,
+			STEP_QUEUES,
+			STEP_TIMERS,
+			STEP_COMMANDS,
+			STEP_LINKS,
+			STEP_DONE
+		};
+
+		/** The next family of metrics to write. */
+		int step;
+
+		void SocketEngineMetrics(std::ostream& data)
+		{
+			const SocketEngine::Statistics& sestats = SocketEngine::GetStats();
+			MetricHeader(data, "inspircd_socketengine_events_total", "counter", "Events dispatched by the socket engine.");
+			data << "inspircd_socketengine_events_total " << sestats.TotalEvents << '\n';
+			MetricHeader(data, "inspircd_socketengine_calls_total", "counter", "Socket read and write calls.");
+			data << "inspircd_socketengine_calls_total{op=\"read\"} " << sestats.ReadEvents << '\n';
+			data << "inspircd_socketengine_calls_total{op=\"write\"} " << sestats.WriteEvents << '\n';
+			MetricHeader(data, "inspircd_socketengine_errors_total", "counter", "Socket calls which failed.");
+			data << "inspircd_socketengine_errors_total " << sestats.ErrorEvents << '\n';
+			MetricHeader(data, "inspircd_sockets", "gauge", "Sockets in the socket engine.");
+			data << "inspircd_sockets " << SocketEngine::GetUsedFds() << '\n';
+			MetricHeader(data, "inspircd_sockets_max", "gauge", "Sockets the socket engine can hold.");
+			data << "inspircd_sockets_max " << SocketEngine::GetMaxFds() << '\n';
+		}
+
+		void ClientMetrics(std::ostream& data)
+		{
+			const serverstats& stats = ServerInstance->stats;
+			MetricHeader(data, "inspircd_start_time_seconds", "gauge", "The time the server was started.");
+			data << "inspircd_start_time_seconds " << ServerInstance->startup_time << '\n';
+			MetricHeader(data, "inspircd_users", "gauge", "Users on the network.");
+			data << "inspircd_users " << ServerInstance->Users->GetUsers().size() << '\n';
+			MetricHeader(data, "inspircd_local_users", "gauge", "Users connected to this server.");
+			data << "inspircd_local_users " << ServerInstance->Users->GetLocalUsers().size() << '\n';
+			MetricHeader(data, "inspircd_opers", "gauge", "Server operators on the network.");
+			data << "inspircd_opers " << ServerInstance->Users->all_opers.size() << '\n';
+			MetricHeader(data, "inspircd_channels", "gauge", "Channels on the network.");
+			data << "inspircd_channels " << ServerInstance->GetChans().size() << '\n';
+			MetricHeader(data, "inspircd_connections_total", "counter", "Client connections which were accepted or refused.");
+			data << "inspircd_connections_total{result=\"accepted\"} " << stats.Accept << '\n';
+			data << "inspircd_connections_total{result=\"refused\"} " << stats.Refused << '\n';
+			MetricHeader(data, "inspircd_dns_lookups_total", "counter", "DNS lookups for connecting clients.");
+			data << "inspircd_dns_lookups_total{result=\"good\"} " << stats.DnsGood << '\n';
+			data << "inspircd_dns_lookups_total{result=\"bad\"} " << stats.DnsBad << '\n';
+			MetricHeader(data, "inspircd_client_bytes_total", "counter", "Bytes of lines exchanged with local users.");
+			data << "inspircd_client_bytes_total{direction=\"sent\"} " << stats.Sent << '\n';
+			data << "inspircd_client_bytes_total{direction=\"received\"} " << stats.Recv << '\n';
+		}
+
+		void QueueMetrics(std::ostream& data)
+		{
+			uint64_t sendq = 0;
+			uint64_t recvq = 0;
+			const UserManager::LocalList& list = ServerInstance->Users->GetLocalUsers();
+			for (UserManager::LocalList::const_iterator i = list.begin(); i != list.end(); ++i)
+			{
+				sendq += (*i)->eh.getSendQSize();
+				recvq += (*i)->eh.getRecvQSize();
+			}
+
+			MetricHeader(data, "inspircd_sendq_bytes", "gauge", "Bytes waiting to be sent to local users.");
+			data << "inspircd_sendq_bytes " << sendq << '\n';
+			MetricHeader(data, "inspircd_recvq_bytes", "gauge", "Bytes received from local users which have not been processed.");
+			data << "inspircd_recvq_bytes " << recvq << '\n';
+		}
+
+		void TimerMetrics(std::ostream& data)
+		{
+			MetricHeader(data, "inspircd_timers", "gauge", "Scheduled timers.");
+			data << "inspircd_timers " << ServerInstance->Timers.GetTimerCount() << '\n';
+			MetricHeader(data, "inspircd_precise_timers", "gauge", "Scheduled timers with sub-second resolution.");
+			data << "inspircd_precise_timers " << ServerInstance->Timers.GetPreciseTimerCount() << '\n';
+		}
+
+		void CommandMetrics(std::ostream& data)
+		{
+			const CommandParser::CommandMap& commands = ServerInstance->Parser.GetCommands();
+			MetricHeader(data, "inspircd_command_uses_total", "counter", "Commands executed by local users.");
+			for (CommandParser::CommandMap::const_iterator i = commands.begin(); i != commands.end(); ++i)
+				data << "inspircd_command_uses_total{command=\"" << EscapeLabel(i->second->name) << "\"} " << i->second->use_count << '\n';
+
+			MetricHeader(data, "inspircd_command_seconds_total", "counter", "Time spent executing commands for local users.");
+			for (CommandParser::CommandMap::const_iterator i = commands.begin(); i != commands.end(); ++i)
+				data << "inspircd_command_seconds_total{command=\"" << EscapeLabel(i->second->name) << "\"} " << FormatSeconds(i->second->use_time) << '\n';
+		}
+
+		void LinkMetrics(std::ostream& data)
+		{
+			ProtocolInterface::ServerList sl;
+			ServerInstance->PI->GetServerList(sl);
+
+			MetricHeader(data, "inspircd_server_users", "gauge", "Users on each server.");
+			for (ProtocolInterface::ServerList::const_iterator b = sl.begin(); b != sl.end(); ++b)
+				data << "inspircd_server_users{server=\"" << EscapeLabel(b->servername) << "\"} " << b->usercount << '\n';
+
+			MetricHeader(data, "inspircd_server_latency_seconds", "gauge", "Round trip time to each server.");
+			for (ProtocolInterface::ServerList::const_iterator b = sl.begin(); b != sl.end(); ++b)
+				data << "inspircd_server_latency_seconds{server=\"" << EscapeLabel(b->servername) << "\"} " << FormatSeconds(b->latencyms * 1000ULL) << '\n';
+
+			MetricHeader(data, "inspircd_link_bytes_total", "counter", "Bytes of lines exchanged with directly linked servers.");
+			for (ProtocolInterface::ServerList::const_iterator b = sl.begin(); b != sl.end(); ++b)
+			{
+				if (!b->sentbytes && !b->recvbytes)
+					continue;
+
+				const std::string server = EscapeLabel(b->servername);
+				data << "inspircd_link_bytes_total{server=\"" << server << "\",direction=\"sent\"} " << b->sentbytes << '\n';
+				data << "inspircd_link_bytes_total{server=\"" << server << "\",direction=\"received\"} " << b->recvbytes << '\n';
+			}
+		}
+
+	 public:
+		MetricsDocument()
+			: step(STEP_SOCKETENGINE)
+		{
+		}
+
+		bool Generate(std::string& out) CXX11_OVERRIDE
+		{
+			std::stringstream data;
+			switch (step++)
+			{
+				case STEP_SOCKETENGINE:
+					SocketEngineMetrics(data);
+					break;
+				case STEP_CLIENTS:
+					ClientMetrics(data);
+					break;
+				case STEP_QUEUES:
+					QueueMetrics(data);
+					break;
+				case STEP_TIMERS:
+					TimerMetrics(data);
+					break;
+				case STEP_COMMANDS:
+					CommandMetrics(data);
+					break;
+				case STEP_LINKS:
+					LinkMetrics(data);
+					break;
+			}
+
+			out.append(data.str());
+			return step < STEP_DONE;
+		}
+	};
 }
 
 class ModuleHttpStats : public Module, public HTTPRequestEventListener
@@ -417,6 +766,15 @@ class ModuleHttpStats : public Module, public HTTPRequestEventListener
 	{
 		std::string path = http->GetPath();
 
+		if (path == "/metrics")
+		{
+			HTTPDocumentResponse response(this, *http, new Stats::MetricsDocument, 200);
+			response.headers.SetHeader("X-Powered-By", MODNAME);
+			response.headers.SetHeader("Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+			API->SendResponse(response);
+			return MOD_RES_DENY; // Handled
+		}
+
 		if (path != "/stats" && path.substr(0, 7) != "/stats/")
 			return MOD_RES_PASSTHRU;
 
@@ -425,45 +783,49 @@ class ModuleHttpStats : public Module, public HTTPRequestEventListener
 
 		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Handling httpd event");
 
-		bool found = true;
-		std::stringstream data;
-		data << "<inspircdstats>";
-
+		// The document is generated as it is sent so large networks don't block the server.
+		Stats::XMLDocument* document = new Stats::XMLDocument;
 		if (path == "/stats")
 		{
-			data << Stats::ServerInfo << Stats::General
-				<< Stats::XLines << Stats::Modules
-				<< Stats::Channels << Stats::Users
-				<< Stats::Servers << Stats::Commands;
+			document->AddSection(Stats::XMLDocument::SECTION_SERVERINFO);
+			document->AddSection(Stats::XMLDocument::SECTION_GENERAL);
+			document->AddSection(Stats::XMLDocument::SECTION_XLINES);
+			document->AddSection(Stats::XMLDocument::SECTION_MODULES);
+			document->AddSection(Stats::XMLDocument::SECTION_CHANNELS);
+			document->AddSection(Stats::XMLDocument::SECTION_USERS);
+			document->AddSection(Stats::XMLDocument::SECTION_SERVERS);
+			document->AddSection(Stats::XMLDocument::SECTION_COMMANDS);
 		}
 		else if (path == "/stats/general")
 		{
-			data << Stats::General;
+			document->AddSection(Stats::XMLDocument::SECTION_GENERAL);
 		}
 		else if (path == "/stats/users")
 		{
-			if (enableparams)
-				Stats::ListUsers(data, http->GetParsedURI().query_params);
+			const HTTPQueryParameters& params = http->GetParsedURI().query_params;
+			if (enableparams && !params.empty())
+			{
+				std::vector<std::string> uuids;
+				Stats::ListUsers(params, uuids);
+				document->AddUsers(uuids);
+			}
 			else
-				data << Stats::Users;
-		}
-		else
-		{
-			found = false;
-		}
-
-		if (found)
-		{
-			data << "</inspircdstats>";
+				document->AddSection(Stats::XMLDocument::SECTION_USERS);
 		}
 		else
 		{
-			data.clear();
-			data.str(std::string());
+			delete document;
+
+			std::stringstream data;
+			HTTPDocumentResponse response(this, *http, &data, 404);
+			response.headers.SetHeader("X-Powered-By", MODNAME);
+			response.headers.SetHeader("Content-Type", "text/xml");
+			API->SendResponse(response);
+			return MOD_RES_DENY; // Handled
 		}
 
 		/* Send the document back to m_httpd */
-		HTTPDocumentResponse response(this, *http, &data, found ? 200 : 404);
+		HTTPDocumentResponse response(this, *http, document, 200);
 		response.headers.SetHeader("X-Powered-By", MODNAME);
 		response.headers.SetHeader("Content-Type", "text/xml");
 		API->SendResponse(response);
@@ -274,6 +274,11 @@ class C2CTags : public ClientProtocol::MessageTagProvider
 	{
 		return cap.get(user);
 	}
+
+	bool UsesTagProfile() const CXX11_OVERRIDE
+	{
+		return true;
+	}
 };
 
 class ModuleIRCv3CTCTags
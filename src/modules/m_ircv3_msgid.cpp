@@ -47,6 +47,11 @@ class MsgIdTag : public ClientProtocol::MessageTagProvider
 	{
 		return ctctagcap.get(user);
 	}
+
+	bool UsesTagProfile() const CXX11_OVERRIDE
+	{
+		return true;
+	}
 };
 
 class MsgIdGenerator
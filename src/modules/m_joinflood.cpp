@@ -139,6 +139,12 @@ class ModuleJoinFlood : public Module
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Modules->SetHookFilter(this, I_OnUserPreJoin, HookFilter().ChannelMode(&jf));
+		ServerInstance->Modules->SetHookFilter(this, I_OnUserJoin, HookFilter().ChannelMode(&jf));
+	}
+
 	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("joinflood");
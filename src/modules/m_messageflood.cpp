@@ -127,6 +127,11 @@ private:
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Modules->SetHookFilter(this, I_OnUserPreMessage, HookFilter().LocalUsers().ChannelMode(&mf));
+	}
+
 	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("messageflood");
@@ -241,6 +241,7 @@ class ModuleNationalChars : public Module
 			return;
 
 		memcpy(prev_map, national_case_insensitive_map, sizeof(prev_map));
+		national_case_insensitive_generation++;
 
 		RehashHashmap(ServerInstance->Users.clientlist);
 		RehashHashmap(ServerInstance->Users.uuidlist);
@@ -260,6 +261,7 @@ class ModuleNationalChars : public Module
 	{
 		memcpy(m_lower, rfc_case_insensitive_map, 256);
 		national_case_insensitive_map = m_lower;
+		national_case_insensitive_generation++;
 
 		ServerInstance->IsNick = &lwbNickHandler::Call;
 	}
@@ -308,6 +310,8 @@ class ModuleNationalChars : public Module
 	{
 		ServerInstance->IsNick = rememberer;
 		national_case_insensitive_map = lowermap_rememberer;
+		// Anything built with m_lower must stop using it even if the restored table is identical.
+		national_case_insensitive_generation++;
 		ServerInstance->Config->CaseMapping = casemapping_rememberer;
 		// The core rebuilds ISupport on module unload, but before the dtor.
 		ServerInstance->ISupport.Build();
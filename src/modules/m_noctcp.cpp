@@ -47,6 +47,11 @@ class ModuleNoCTCP : public Module
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Modules->SetHookFilter(this, I_OnUserPreMessage, HookFilter().LocalUsers());
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Provides user mode +T and channel mode +C to block CTCPs", VF_VENDOR);
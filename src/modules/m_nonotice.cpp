@@ -34,6 +34,12 @@ class ModuleNoNotice : public Module
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		// The extban can block notices without +T being set so only remote users can be skipped.
+		ServerInstance->Modules->SetHookFilter(this, I_OnUserPreMessage, HookFilter().LocalUsers());
+	}
+
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
 	{
 		tokens["EXTBAN"].push_back('T');
@@ -20,6 +20,7 @@
 
 #include "modules/regex.h"
 #include "inspircd.h"
+#include "wildcardset.h"
 
 class GlobRegex : public Regex
 {
@@ -34,6 +35,37 @@ public:
 	}
 };
 
+class GlobSet : public RegexSet
+{
+	std::vector<std::string> patterns;
+	insp::wildcard_set set;
+	unsigned long casemapgen;
+
+	void Compile()
+	{
+		set.compile(patterns, national_case_insensitive_map);
+		casemapgen = national_case_insensitive_generation;
+	}
+
+ public:
+	GlobSet(const std::vector<std::string>& exprs)
+		: patterns(exprs)
+	{
+		Compile();
+	}
+
+	bool Matches(const std::string& text, std::vector<size_t>& matches) CXX11_OVERRIDE
+	{
+		// The case map can be replaced or modified in place (e.g. by m_nationalchars) after the
+		// set was compiled.
+		if (casemapgen != national_case_insensitive_generation)
+			Compile();
+
+		set.match(text, matches);
+		return true;
+	}
+};
+
 class GlobFactory : public RegexFactory
 {
  public:
@@ -42,6 +74,11 @@ class GlobFactory : public RegexFactory
 		return new GlobRegex(expr);
 	}
 
+	RegexSet* CreateSet(const std::vector<std::string>& exprs) CXX11_OVERRIDE
+	{
+		return new GlobSet(exprs);
+	}
+
 	GlobFactory(Module* m) : RegexFactory(m, "regex/glob") {}
 };
 
@@ -64,8 +64,13 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 	struct RepeatItem
 	{
 		time_t ts;
+		uint64_t hash;
+		unsigned int length;
+
+		/** The (lower cased) text of the line. This is only kept when the channel matches
+		 * on edit distance, otherwise the hash is enough.
+		 */
 		std::string line;
-		RepeatItem(time_t TS, const std::string& Line) : ts(TS), line(Line) { }
 	};
 
 	typedef std::deque<RepeatItem> RepeatItemList;
@@ -84,34 +89,97 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 		unsigned int MaxBacklog;
 		unsigned int MaxDiff;
 		unsigned int MaxMessageSize;
-		ModuleSettings() : MaxLines(0), MaxSecs(0), MaxBacklog(0), MaxDiff() { }
+		ModuleSettings() : MaxLines(0), MaxSecs(0), MaxBacklog(0), MaxDiff(), MaxMessageSize(0) { }
 	};
 
-	std::vector<unsigned int> mx[2];
 	ModuleSettings ms;
+	std::vector<unsigned int> mx[2];
 
-	bool CompareLines(const std::string& message, const std::string& historyline, unsigned int trigger)
+	/** Hashes the (lower cased) first MaxMessageSize characters of a line.
+	 * @param message The line to hash.
+	 * @param item The item to store the hash and length of the line in.
+	 * @param keepline Whether to store the lower cased text of the line in the item as well.
+	 */
+	void Fingerprint(const std::string& message, RepeatItem& item, bool keepline)
 	{
-		if (message == historyline)
+		// If the message is larger than whatever size it's set to,
+		// let's pretend it isn't. If the first 512 (def. setting) match, it's probably spam.
+		const size_t length = std::min<size_t>(message.size(), ms.MaxMessageSize);
+
+		uint64_t hash = 14695981039346656037ULL;
+		item.line.clear();
+		if (keepline)
+			item.line.reserve(length);
+
+		for (size_t i = 0; i < length; ++i)
+		{
+			const unsigned char chr = ::tolower(static_cast<unsigned char>(message[i]));
+			hash = (hash ^ chr) * 1099511628211ULL;
+			if (keepline)
+				item.line.push_back(chr);
+		}
+
+		item.hash = hash;
+		item.length = length;
+	}
+
+	bool CompareLines(const RepeatItem& message, const RepeatItem& historyline, unsigned int trigger)
+	{
+		if (message.hash == historyline.hash && message.length == historyline.length)
 			return true;
-		else if (trigger)
-			return (Levenshtein(message, historyline) <= trigger);
 
-		return false;
+		// The text of the history line is missing if it was added before the channel started
+		// matching on edit distance.
+		else if (!trigger || historyline.line.length() != historyline.length)
+			return false;
+
+		return (Levenshtein(message.line, historyline.line, trigger) <= trigger);
 	}
 
-	unsigned int Levenshtein(const std::string& s1, const std::string& s2)
+	/** Calculates the edit distance between two lines if it is within a limit. Only the cells
+	 * of the matrix which are within the limit of its diagonal can hold a distance within the
+	 * limit so this takes O(length * limit) rather than O(length * length) time.
+	 * @param s1 The first line.
+	 * @param s2 The second line.
+	 * @param limit The largest distance which is of interest.
+	 * @return The edit distance between the lines or limit + 1 if it is larger than the limit.
+	 */
+	unsigned int Levenshtein(const std::string& s1, const std::string& s2, unsigned int limit)
 	{
-		unsigned int l1 = s1.size();
-		unsigned int l2 = s2.size();
+		const unsigned int l1 = s1.size();
+		const unsigned int l2 = s2.size();
+		const unsigned int over = limit + 1;
+
+		// Every edit changes the length by at most one character.
+		if (std::max(l1, l2) - std::min(l1, l2) > limit)
+			return over;
 
-		for (unsigned int i = 0; i < l2; i++)
-			mx[0][i] = i;
-		for (unsigned int i = 0; i < l1; i++)
+		mx[0].assign(l2 + 1, over);
+		mx[1].assign(l2 + 1, over);
+		for (unsigned int j = 0; j <= std::min(l2, limit); j++)
+			mx[0][j] = j;
+
+		for (unsigned int i = 1; i <= l1; i++)
 		{
-			mx[1][0] = i + 1;
-			for (unsigned int j = 0; j < l2; j++)
-				mx[1][j + 1] = std::min(std::min(mx[1][j] + 1, mx[0][j + 1] + 1), mx[0][j] + ((s1[i] == s2[j]) ? 0 : 1));
+			// The cells just outside of the band are set to the limit so that the next row
+			// does not read anything left over from an earlier one.
+			const unsigned int first = (i > limit ? i - limit : 1);
+			const unsigned int last = std::min(l2, i + limit);
+			mx[1][first - 1] = (first == 1 ? std::min(i, over) : over);
+			if (last < l2)
+				mx[1][last + 1] = over;
+
+			unsigned int best = mx[1][first - 1];
+			for (unsigned int j = first; j <= last; j++)
+			{
+				const unsigned int cost = std::min(std::min(mx[1][j - 1] + 1, mx[0][j] + 1), mx[0][j - 1] + ((s1[i - 1] == s2[j - 1]) ? 0 : 1));
+				mx[1][j] = std::min(cost, over);
+				best = std::min(best, mx[1][j]);
+			}
+
+			// Every later row is at least the minimum of this one.
+			if (best > limit)
+				return over;
 
 			mx[0].swap(mx[1]);
 		}
@@ -161,13 +229,8 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 		return MODEACTION_ALLOW;
 	}
 
-	bool MatchLine(Membership* memb, ChannelSettings* rs, std::string message)
+	bool MatchLine(Membership* memb, ChannelSettings* rs, const std::string& message)
 	{
-		// If the message is larger than whatever size it's set to,
-		// let's pretend it isn't. If the first 512 (def. setting) match, it's probably spam.
-		if (message.size() > ms.MaxMessageSize)
-			message.erase(ms.MaxMessageSize);
-
 		MemberInfo* rp = MemberInfoExt.get(memb);
 		if (!rp)
 		{
@@ -180,12 +243,14 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 			matches = rp->Counter;
 
 		RepeatItemList& items = rp->ItemList;
-		const unsigned int trigger = (message.size() * rs->Diff / 100);
 		const time_t now = ServerInstance->Time();
 
-		std::transform(message.begin(), message.end(), message.begin(), ::tolower);
+		RepeatItem item;
+		Fingerprint(message, item, (rs->Diff != 0));
+		item.ts = now + rs->Seconds;
 
-		for (std::deque<RepeatItem>::iterator it = items.begin(); it != items.end(); ++it)
+		const unsigned int trigger = (item.length * rs->Diff / 100);
+		for (RepeatItemList::iterator it = items.begin(); it != items.end(); ++it)
 		{
 			if (it->ts < now)
 			{
@@ -194,7 +259,7 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 				break;
 			}
 
-			if (CompareLines(message, it->line, trigger))
+			if (CompareLines(item, *it, trigger))
 			{
 				if (++matches >= rs->Lines)
 				{
@@ -215,21 +280,11 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 		if (items.size() >= max_items)
 			items.pop_back();
 
-		items.push_front(RepeatItem(now + rs->Seconds, message));
+		items.push_front(item);
 		rp->Counter = matches;
 		return false;
 	}
 
-	void Resize(size_t size)
-	{
-		size_t newsize = size+1;
-		if (newsize <= mx[0].size())
-			return;
-		ms.MaxMessageSize = size;
-		mx[0].resize(newsize);
-		mx[1].resize(newsize);
-	}
-
 	void ReadConfig()
 	{
 		ConfigTag* conf = ServerInstance->Config->ConfValue("repeat");
@@ -244,7 +299,7 @@ class RepeatMode : public ParamMode<RepeatMode, SimpleExtItem<ChannelSettings> >
 		unsigned int newsize = conf->getUInt("size", 512);
 		if (newsize > ServerInstance->Config->Limits.MaxLine)
 			newsize = ServerInstance->Config->Limits.MaxLine;
-		Resize(newsize);
+		ms.MaxMessageSize = newsize;
 	}
 
 	std::string GetModuleSettings() const
@@ -358,6 +413,11 @@ class RepeatModule : public Module
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		ServerInstance->Modules->SetHookFilter(this, I_OnUserPreMessage, HookFilter().LocalUsers().ChannelMode(&rm));
+	}
+
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
 	{
 		rm.ReadConfig();
@@ -0,0 +1,70 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+#include "channelroutes.h"
+#include "treeserver.h"
+
+ChannelRoutes::ChannelRoutes(Module* mod)
+	: ext("channelroutes", ExtensionItem::EXT_CHANNEL, mod)
+{
+}
+
+void ChannelRoutes::Add(Membership* memb)
+{
+	if (IS_LOCAL(memb->user))
+		return;
+
+	RouteMap* routes = ext.get(memb->chan);
+	if (!routes)
+	{
+		routes = new RouteMap;
+		ext.set(memb->chan, routes);
+	}
+	(*routes)[TreeServer::Get(memb->user)->GetSocket()]++;
+}
+
+void ChannelRoutes::Remove(Membership* memb)
+{
+	if (IS_LOCAL(memb->user))
+		return;
+
+	RouteMap* routes = ext.get(memb->chan);
+	if (!routes)
+		return;
+
+	RouteMap::iterator it = routes->find(TreeServer::Get(memb->user)->GetSocket());
+	if (it == routes->end())
+		return;
+
+	if (--it->second)
+		return;
+
+	routes->erase(it);
+	if (routes->empty())
+		ext.unset(memb->chan);
+}
+
+void ChannelRoutes::Rebuild(Channel* chan)
+{
+	ext.unset(chan);
+
+	const Channel::MemberMap& users = chan->GetUsers();
+	for (Channel::MemberMap::const_iterator i = users.begin(); i != users.end(); ++i)
+		Add(i->second);
+}
@@ -0,0 +1,62 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+class TreeSocket;
+
+/** Keeps count of how many remote members of each channel are reachable via each of the
+ * servers directly linked to us. This allows channel messages to be routed without
+ * walking the member list of the channel for every message.
+ *
+ * Counts are kept for every channel which has remote members and are updated as users
+ * join, part, get kicked, and quit (including when their server splits).
+ */
+class ChannelRoutes
+{
+ public:
+	/** Maps the socket of a directly linked server to the number of channel members behind it. */
+	typedef insp::flat_map<TreeSocket*, unsigned int> RouteMap;
+
+ private:
+	/** Holds the route counts of a channel. */
+	SimpleExtItem<RouteMap> ext;
+
+ public:
+	ChannelRoutes(Module* mod);
+
+	/** Adds a member to the route counts of their channel. Local members are ignored.
+	 * @param memb The membership which has been created.
+	 */
+	void Add(Membership* memb);
+
+	/** Removes a member from the route counts of their channel. Local members are ignored.
+	 * @param memb The membership which is about to be removed.
+	 */
+	void Remove(Membership* memb);
+
+	/** Recalculates the route counts of a channel from its member list.
+	 * @param chan The channel to recalculate the route counts of.
+	 */
+	void Rebuild(Channel* chan);
+
+	/** Retrieves the route counts of a channel.
+	 * @param chan The channel to retrieve the route counts of.
+	 * @return The route counts of the channel or NULL if it has no remote members.
+	 */
+	const RouteMap* Get(Channel* chan) const { return ext.get(chan); }
+};
@@ -29,6 +29,7 @@ void TreeSocket::WriteLineNoCompat(const std::string& line)
 	ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] O %s", this->GetFd(), line.c_str());
 	this->WriteData(line);
 	this->WriteData(newline);
+	sentbytes += line.length() + newline.length();
 }
 
 void TreeSocket::WriteLine(const std::string& original_line)
@@ -22,6 +22,7 @@
 
 #include "inspircd.h"
 #include "commands.h"
+#include "main.h"
 #include "treeserver.h"
 #include "treesocket.h"
 
@@ -294,6 +295,9 @@ void CommandFJoin::LowerTS(Channel* chan, time_t TS, const std::string& newname)
 	// Unset all extensions
 	chan->FreeAllExtItems();
 
+	// The route counts were also unset above but the members are still there
+	Utils->Creator->routes.Rebuild(chan);
+
 	// Clear the topic
 	chan->SetTopic(ServerInstance->FakeClient, std::string(), 0);
 	chan->setby.clear();
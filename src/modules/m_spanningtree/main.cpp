@@ -52,6 +52,7 @@ ModuleSpanningTree::ModuleSpanningTree()
 	, servicetag(this)
 	, DNS(this, "DNS")
 	, tagevprov(this)
+	, routes(this)
 	, loopCall(false)
 {
 }
@@ -497,6 +498,8 @@ void ModuleSpanningTree::OnUserConnect(LocalUser* user)
 
 void ModuleSpanningTree::OnUserJoin(Membership* memb, bool sync, bool created_by_local, CUList& excepts)
 {
+	routes.Add(memb);
+
 	// Only do this for local users
 	if (!IS_LOCAL(memb->user))
 		return;
@@ -551,6 +554,8 @@ void ModuleSpanningTree::OnChangeIdent(User* user, const std::string &ident)
 
 void ModuleSpanningTree::OnUserPart(Membership* memb, std::string &partmessage, CUList& excepts)
 {
+	routes.Remove(memb);
+
 	if (IS_LOCAL(memb->user))
 	{
 		CmdBuilder params(memb->user, "PART");
@@ -586,6 +591,10 @@ void ModuleSpanningTree::OnUserQuit(User* user, const std::string &reason, const
 
 	// Regardless, update the UserCount
 	TreeServer::Get(user)->UserCount--;
+
+	// The memberships of the user are removed without a part event for each channel.
+	for (User::ChanList::iterator i = user->chans.begin(); i != user->chans.end(); ++i)
+		routes.Remove(*i);
 }
 
 void ModuleSpanningTree::OnUserPostNick(User* user, const std::string &oldnick)
@@ -606,6 +615,8 @@ void ModuleSpanningTree::OnUserPostNick(User* user, const std::string &oldnick)
 
 void ModuleSpanningTree::OnUserKick(User* source, Membership* memb, const std::string &reason, CUList& excepts)
 {
+	routes.Remove(memb);
+
 	if ((!IS_LOCAL(source)) && (source != ServerInstance->FakeClient))
 		return;
 
@@ -34,6 +34,7 @@
 #include "commands.h"
 #include "protocolinterface.h"
 #include "tags.h"
+#include "channelroutes.h"
 
 /** An enumeration of all known protocol versions.
  *
@@ -119,6 +120,9 @@ class ModuleSpanningTree
 	/** Event provider for message tags. */
 	ClientProtocol::MessageTagEvent tagevprov;
 
+	/** Counts of the remote members of each channel by the route they are reachable via. */
+	ChannelRoutes routes;
+
 	ServerCommandManager CmdManager;
 
 	/** Set to true if inside a spanningtree call, to prevent sending
@@ -40,6 +40,11 @@ void SpanningTreeProtocolInterface::GetServerList(ServerList& sl)
 		ps.opercount = i->second->OperCount;
 		ps.description = i->second->GetDesc();
 		ps.latencyms = i->second->rtt;
+
+		// Only servers which are linked to us directly have their own link.
+		TreeSocket* sock = i->second->IsLocal() ? i->second->GetSocket() : NULL;
+		ps.sentbytes = sock ? sock->sentbytes : 0;
+		ps.recvbytes = sock ? sock->recvbytes : 0;
 		sl.push_back(ps);
 	}
 }
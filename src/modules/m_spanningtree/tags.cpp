@@ -36,3 +36,8 @@ bool ServiceTag::ShouldSendTag(LocalUser* user, const ClientProtocol::MessageTag
 {
 	return ctctagcap.get(user);
 }
+
+bool ServiceTag::UsesTagProfile() const
+{
+	return true;
+}
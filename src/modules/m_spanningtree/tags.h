@@ -30,4 +30,5 @@ class ServiceTag : public ClientProtocol::MessageTagProvider
 	ServiceTag(Module* mod);
 	void OnPopulateTags(ClientProtocol::Message& msg) CXX11_OVERRIDE;
 	bool ShouldSendTag(LocalUser* user, const ClientProtocol::MessageTagData& tagdata) CXX11_OVERRIDE;
+	bool UsesTagProfile() const CXX11_OVERRIDE;
 };
@@ -159,6 +159,14 @@ class TreeSocket : public BufferedSocket
  public:
 	const time_t age;
 
+	/** The number of bytes of lines which have been sent to the server on this link.
+	 */
+	uint64_t sentbytes;
+
+	/** The number of bytes of lines which have been received from the server on this link.
+	 */
+	uint64_t recvbytes;
+
 	/** Because most of the I/O gubbins are encapsulated within
 	 * BufferedSocket, we just call the superclass constructor for
 	 * most of the action, and append a few of our own values
@@ -37,7 +37,7 @@
  */
 TreeSocket::TreeSocket(Link* link, Autoconnect* myac, const irc::sockets::sockaddrs& dest)
 	: linkID(link->Name), LinkState(CONNECTING), MyRoot(NULL), proto_version(0)
-	, burstsent(false), age(ServerInstance->Time())
+	, burstsent(false), age(ServerInstance->Time()), sentbytes(0), recvbytes(0)
 {
 	capab = new CapabData;
 	capab->link = link;
@@ -74,7 +74,7 @@ TreeSocket::TreeSocket(Link* link, Autoconnect* myac, const irc::sockets::sockad
 TreeSocket::TreeSocket(int newfd, ListenSocket* via, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server)
 	: BufferedSocket(newfd)
 	, linkID("inbound from " + client->addr()), LinkState(WAIT_AUTH_1), MyRoot(NULL), proto_version(0)
-	, burstsent(false), age(ServerInstance->Time())
+	, burstsent(false), age(ServerInstance->Time()), sentbytes(0), recvbytes(0)
 {
 	capab = new CapabData;
 	capab->capab_phase = 0;
@@ -200,6 +200,7 @@ void TreeSocket::OnDataReady()
 	std::string line;
 	while (GetNextLine(line))
 	{
+		recvbytes += line.length() + 1;
 		std::string::size_type rline = line.find('\r');
 		if (rline != std::string::npos)
 			line.erase(rline);
@@ -134,7 +134,7 @@ SpanningTreeUtilities::~SpanningTreeUtilities()
 }
 
 // Returns a list of DIRECT servers for a specific channel
-void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet& list, char status, const CUList& exempt_list)
+void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketList& list, char status, const CUList& exempt_list)
 {
 	unsigned int minrank = 0;
 	if (status)
@@ -144,35 +144,61 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet
 			minrank = mh->GetPrefixRank();
 	}
 
-	TreeServer::ChildServers children = TreeRoot->GetChildren();
-	const Channel::MemberMap& ulist = c->GetUsers();
-	for (Channel::MemberMap::const_iterator i = ulist.begin(); i != ulist.end(); ++i)
+	if (!minrank)
 	{
-		if (IS_LOCAL(i->first))
-			continue;
-
-		if (minrank && i->second->getRank() < minrank)
-			continue;
-
-		if (exempt_list.find(i->first) == exempt_list.end())
+		// Every remote member can receive the message so the route counts of the channel can be
+		// used. A route only has to be skipped if all of the members behind it are exempt.
+		const ChannelRoutes::RouteMap* routes = Creator->routes.Get(c);
+		if (routes)
 		{
-			TreeServer* best = TreeServer::Get(i->first);
-			list.insert(best->GetSocket());
+			for (ChannelRoutes::RouteMap::const_iterator i = routes->begin(); i != routes->end(); ++i)
+			{
+				unsigned int members = i->second;
+				for (CUList::const_iterator j = exempt_list.begin(); members && j != exempt_list.end(); ++j)
+				{
+					User* const exempt = *j;
+					if (!IS_LOCAL(exempt) && TreeServer::Get(exempt)->GetSocket() == i->first && c->HasUser(exempt))
+						members--;
+				}
+
+				if (members)
+					list.push_back(i->first);
+			}
+		}
+	}
+	else
+	{
+		const Channel::MemberMap& ulist = c->GetUsers();
+		for (Channel::MemberMap::const_iterator i = ulist.begin(); i != ulist.end(); ++i)
+		{
+			if (IS_LOCAL(i->first))
+				continue;
 
-			TreeServer::ChildServers::iterator citer = std::find(children.begin(), children.end(), best);
-			if (citer != children.end())
-				children.erase(citer);
+			if (i->second->getRank() < minrank)
+				continue;
+
+			if (exempt_list.find(i->first) == exempt_list.end())
+			{
+				TreeSocket* sock = TreeServer::Get(i->first)->GetSocket();
+				if (std::find(list.begin(), list.end(), sock) == list.end())
+					list.push_back(sock);
+			}
 		}
 	}
 
 	// Check whether the servers which do not have users in the channel might need this message. This
 	// is used to keep the chanhistory module synchronised between servers.
+	const TreeServer::ChildServers& children = TreeRoot->GetChildren();
 	for (TreeServer::ChildServers::const_iterator i = children.begin(); i != children.end(); ++i)
 	{
+		TreeSocket* sock = (*i)->GetSocket();
+		if (std::find(list.begin(), list.end(), sock) != list.end())
+			continue;
+
 		ModResult result;
 		FIRST_MOD_RESULT_CUSTOM(Creator->GetBroadcastEventProvider(), ServerProtocol::BroadcastEventListener, OnBroadcastMessage, result, (c, *i));
 		if (result == MOD_RES_ALLOW)
-			list.insert((*i)->GetSocket());
+			list.push_back(sock);
 	}
 }
 
@@ -361,12 +387,17 @@ void SpanningTreeUtilities::SendChannelMessage(User* source, Channel* target, co
 	if (!text.empty())
 		msg.push_last(text);
 
-	TreeSocketSet list;
+	// Reuse the buffer of the last message to avoid allocating. It is taken out of the
+	// member while it is in use in case a module sends another channel message.
+	TreeSocketList list;
+	list.swap(channelroutes);
 	this->GetListOfServersForChannel(target, list, status, exempt_list);
-	for (TreeSocketSet::iterator i = list.begin(); i != list.end(); ++i)
+	for (TreeSocketList::iterator i = list.begin(); i != list.end(); ++i)
 	{
 		TreeSocket* Sock = *i;
 		if (Sock != omit)
 			Sock->WriteLine(msg);
 	}
+	list.clear();
+	list.swap(channelroutes);
 }
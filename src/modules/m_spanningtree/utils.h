@@ -46,8 +46,11 @@ class SpanningTreeUtilities : public classbase
 {
 	CacheRefreshTimer RefreshTimer;
 
+	/** Buffer used by SendChannelMessage() to hold the servers a message is sent to. */
+	std::vector<TreeSocket*> channelroutes;
+
  public:
- 	typedef std::set<TreeSocket*> TreeSocketSet;
+ 	typedef std::vector<TreeSocket*> TreeSocketList;
 	typedef std::map<TreeSocket*, std::pair<std::string, unsigned int> > TimeoutList;
 
 	/** Creator module
@@ -141,9 +144,10 @@ class SpanningTreeUtilities : public classbase
 	 */
 	bool DoCollision(User* u, TreeServer* server, time_t remotets, const std::string& remoteident, const std::string& remoteip, const std::string& remoteuid, const char* collidecmd);
 
-	/** Compile a list of servers which contain members of channel c
+	/** Compile a list of servers which contain members of channel c. The route counts of the
+	 * channel are used unless the message is only for members with a certain status.
 	 */
-	void GetListOfServersForChannel(Channel* c, TreeSocketSet& list, char status, const CUList& exempt_list);
+	void GetListOfServersForChannel(Channel* c, TreeSocketList& list, char status, const CUList& exempt_list);
 
 	/** Find a server by name or SID
 	 */
@@ -301,7 +301,7 @@ class ModuleSSLInfo
 		}
 	}
 
-	ModResult OnSetConnectClass(LocalUser* user, ConnectClass* myclass) CXX11_OVERRIDE
+	ModResult OnCheckConnectClass(LocalUser* user, ConnectClass* myclass) CXX11_OVERRIDE
 	{
 		ssl_cert* cert = cmd.sslapi.GetCertificate(user);
 		bool ok = true;
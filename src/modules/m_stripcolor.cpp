@@ -36,6 +36,12 @@ class ModuleStripColor : public Module
 	{
 	}
 
+	void init() CXX11_OVERRIDE
+	{
+		// The extban can strip colours without +S being set so only remote users can be skipped.
+		ServerInstance->Modules->SetHookFilter(this, I_OnUserPreMessage, HookFilter().LocalUsers());
+	}
+
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
 	{
 		tokens["EXTBAN"].push_back('S');
@@ -18,13 +18,28 @@
 
 /// $CompilerFlags: -Ivendor_directory("utfcpp")
 
+/// $CompilerFlags: require_version("zlib") -DINSPIRCD_WEBSOCKET_DEFLATE find_compiler_flags("zlib")
+/// $LinkerFlags: require_version("zlib") find_linker_flags("zlib")
+
 
 #include "inspircd.h"
 #include "iohook.h"
 #include "modules/hash.h"
+#include "modules/stats.h"
 
 #include <utf8.h>
 
+// The permessage-deflate extension is only available when zlib was found at build time.
+#ifdef INSPIRCD_WEBSOCKET_DEFLATE
+# include <zlib.h>
+#endif
+
+// SSE2 is part of the x86-64 baseline so it can always be used for unmasking there.
+#if defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define INSPIRCD_WEBSOCKET_SSE2
+#endif
+
 static const char MagicGUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 static const char whitespace[] = " \t\r\n";
 static dynamic_reference_nocheck<HashProvider>* sha1;
@@ -42,15 +57,329 @@ struct WebSocketConfig
 
 	// Whether to send as UTF-8 text instead of binary data.
 	bool sendastext;
+
+	// Whether clients can negotiate the permessage-deflate extension.
+	bool compress;
+
+	// The zlib compression level for outgoing messages.
+	int compresslevel;
+
+	// The zlib memory level for outgoing messages.
+	int compressmemlevel;
+
+	// The largest window for compressing outgoing messages in bits.
+	unsigned int compresswindowbits;
+
+	// The largest window which clients can use for compressing their messages in bits.
+	unsigned int decompresswindowbits;
+
+	// Whether every message is compressed on its own so that connections do not need their own zlib streams.
+	bool nocontexttakeover;
+
+	// Outgoing messages which are shorter than this are not compressed.
+	size_t compressminsize;
+};
+
+/** Remembers the frames which were made for recently sent lines.
+ *
+ * Server frames are not masked so a line which is sent to many clients, such as
+ * a channel message, only has to be framed once. Lines are recognised by the
+ * buffer that they are shared in. Each entry keeps a reference to the line so the
+ * buffer can not be freed and reused for a different line while it is cached.
+ */
+class WebSocketFrameCache
+{
+	struct Entry
+	{
+		/** The line which the frame was made for. */
+		StreamSocket::SendQueue::Element line;
+
+		/** The frame containing the line. */
+		StreamSocket::SendQueue::Element frame;
+	};
+
+	/** The number of entries in the cache. Must be a power of two. */
+	static const size_t CACHE_SIZE = 256;
+
+	Entry entries[CACHE_SIZE];
+
+ public:
+	/** Finds the cached frame for a line.
+	 * @param line The line to find the frame of.
+	 * @return The cached frame or NULL if the line is not in the cache.
+	 */
+	const StreamSocket::SendQueue::Element* Find(const StreamSocket::SendQueue::Element& line) const
+	{
+		const Entry& entry = entries[Slot(line)];
+		if ((entry.line.data() != line.data()) || (entry.line.length() != line.length()))
+			return NULL;
+		return &entry.frame;
+	}
+
+	/** Adds the frame for a line to the cache, replacing the entry it collides with.
+	 * @return The cached copy of the frame.
+	 */
+	const StreamSocket::SendQueue::Element& Add(const StreamSocket::SendQueue::Element& line, const StreamSocket::SendQueue::Element& frame)
+	{
+		Entry& entry = entries[Slot(line)];
+		entry.line = line;
+		entry.frame = frame;
+		return entry.frame;
+	}
+
+	/** Removes all entries from the cache. */
+	void Clear()
+	{
+		for (size_t i = 0; i < CACHE_SIZE; ++i)
+		{
+			entries[i].line = StreamSocket::SendQueue::Element();
+			entries[i].frame = StreamSocket::SendQueue::Element();
+		}
+	}
+
+ private:
+	static size_t Slot(const StreamSocket::SendQueue::Element& line)
+	{
+		// Allocations are aligned so the lowest bits of the address are always the same.
+		const size_t address = reinterpret_cast<size_t>(line.data());
+		return ((address >> 4) ^ (address >> 12)) & (CACHE_SIZE - 1);
+	}
+};
+
+#ifdef INSPIRCD_WEBSOCKET_DEFLATE
+/** A raw deflate stream which compresses messages for the permessage-deflate extension. */
+class WebSocketDeflater
+{
+	z_stream stream;
+
+ public:
+	WebSocketDeflater(int level, unsigned int windowbits, int memlevel)
+	{
+		memset(&stream, 0, sizeof(stream));
+		if (deflateInit2(&stream, level, Z_DEFLATED, -static_cast<int>(windowbits), memlevel, Z_DEFAULT_STRATEGY) != Z_OK)
+			throw ModuleException("Unable to create a zlib deflate stream");
+	}
+
+	~WebSocketDeflater()
+	{
+		deflateEnd(&stream);
+	}
+
+	/** Compresses a message.
+	 * @param data The message to compress.
+	 * @param len The length of the message.
+	 * @param out The string to append the compressed message to.
+	 * @param reset Whether to forget the message afterwards so the next message is compressed on its own.
+	 * @return True if the message was compressed; otherwise, false.
+	 */
+	bool Compress(const char* data, size_t len, std::string& out, bool reset)
+	{
+		stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		stream.avail_in = len;
+
+		const std::string::size_type start = out.length();
+		size_t used = 0;
+		size_t space = deflateBound(&stream, len) + 16;
+		do
+		{
+			out.resize(start + used + space);
+			stream.next_out = reinterpret_cast<Bytef*>(&out[start + used]);
+			stream.avail_out = space;
+
+			const int ret = deflate(&stream, Z_SYNC_FLUSH);
+			if ((ret != Z_OK) && (ret != Z_BUF_ERROR))
+			{
+				// Output which does not refer to earlier messages is always safe to send after this.
+				deflateReset(&stream);
+				out.resize(start);
+				return false;
+			}
+
+			used += space - stream.avail_out;
+			space = 1024;
+		}
+		while (stream.avail_out == 0);
+
+		// A sync flush ends with an empty stored block which the receiver adds back.
+		if (used >= 4)
+			used -= 4;
+		out.resize(start + used);
+
+		if (reset)
+			deflateReset(&stream);
+		return true;
+	}
+};
+
+/** A raw deflate stream which decompresses messages for the permessage-deflate extension. */
+class WebSocketInflater
+{
+	z_stream stream;
+
+ public:
+	WebSocketInflater(unsigned int windowbits)
+	{
+		memset(&stream, 0, sizeof(stream));
+		if (inflateInit2(&stream, -static_cast<int>(windowbits)) != Z_OK)
+			throw ModuleException("Unable to create a zlib inflate stream");
+	}
+
+	~WebSocketInflater()
+	{
+		inflateEnd(&stream);
+	}
+
+	/** Decompresses a message.
+	 * @param data The compressed message without the trailing empty stored block.
+	 * @param len The length of the compressed message.
+	 * @param out The string to append the message to.
+	 * @param limit The maximum length of the message.
+	 * @param reset Whether to forget the message afterwards because the peer compresses every message on its own.
+	 * @return True if the message was decompressed; false if it is invalid or too long.
+	 */
+	bool Decompress(const char* data, size_t len, std::string& out, size_t limit, bool reset)
+	{
+		static const unsigned char tail[] = { 0x00, 0x00, 0xFF, 0xFF };
+
+		const std::string::size_type start = out.length();
+		bool ok = Inflate(reinterpret_cast<const unsigned char*>(data), len, out, start + limit)
+			&& Inflate(tail, sizeof(tail), out, start + limit);
+
+		// The stream can not be used for later messages after an error.
+		if (reset || !ok)
+			inflateReset(&stream);
+		return ok;
+	}
+
+ private:
+	bool Inflate(const unsigned char* data, size_t len, std::string& out, size_t limit)
+	{
+		stream.next_in = const_cast<Bytef*>(data);
+		stream.avail_in = len;
+		while (stream.avail_in)
+		{
+			const std::string::size_type start = out.length();
+			const size_t space = 4096;
+			out.resize(start + space);
+			stream.next_out = reinterpret_cast<Bytef*>(&out[start]);
+			stream.avail_out = space;
+
+			const int ret = inflate(&stream, Z_SYNC_FLUSH);
+			out.resize(start + space - stream.avail_out);
+			if (out.length() > limit)
+				return false;
+
+			// A peer which ends a message with a final block starts a new stream for the next one.
+			if (ret == Z_STREAM_END)
+				inflateReset(&stream);
+			else if (ret != Z_OK)
+				return false;
+		}
+		return true;
+	}
+};
+#endif
+
+/** Counters for the permessage-deflate extension. */
+struct WebSocketDeflateStats
+{
+	/** The number of connections which negotiated the extension. */
+	unsigned long Connections;
+
+	/** The number of bytes which were given to the compressor. */
+	uint64_t DeflateIn;
+
+	/** The number of bytes which came out of the compressor. */
+	uint64_t DeflateOut;
+
+	/** The number of bytes which were given to the decompressor. */
+	uint64_t InflateIn;
+
+	/** The number of bytes which came out of the decompressor. */
+	uint64_t InflateOut;
+
+	/** The time spent compressing in microseconds. */
+	uint64_t DeflateTime;
+
+	/** The time spent decompressing in microseconds. */
+	uint64_t InflateTime;
+
+	WebSocketDeflateStats()
+		: Connections(0)
+		, DeflateIn(0)
+		, DeflateOut(0)
+		, InflateIn(0)
+		, InflateOut(0)
+		, DeflateTime(0)
+		, InflateTime(0)
+	{
+	}
 };
 
 class WebSocketHookProvider : public IOHookProvider
 {
  public:
 	WebSocketConfig config;
+	WebSocketFrameCache frames;
+
+	/** Frames for connections which use the shared compressor with the configured window. */
+	WebSocketFrameCache deflateframes;
+
+	/** Counters for the permessage-deflate extension. */
+	WebSocketDeflateStats deflatestats;
+
+#ifdef INSPIRCD_WEBSOCKET_DEFLATE
+ private:
+	/** The shared compressors for connections without context takeover, indexed by window bits. */
+	WebSocketDeflater* shareddeflaters[MAX_WBITS + 1];
+
+	/** The shared decompressor for connections without context takeover. */
+	WebSocketInflater* sharedinflater;
+
+ public:
+	/** Retrieves the shared compressor for a window size, creating it if necessary. */
+	WebSocketDeflater& GetSharedDeflater(unsigned int windowbits)
+	{
+		WebSocketDeflater*& deflater = shareddeflaters[windowbits];
+		if (!deflater)
+			deflater = new WebSocketDeflater(config.compresslevel, windowbits, config.compressmemlevel);
+		return *deflater;
+	}
+
+	/** Retrieves the shared decompressor, creating it if necessary. */
+	WebSocketInflater& GetSharedInflater()
+	{
+		if (!sharedinflater)
+			sharedinflater = new WebSocketInflater(MAX_WBITS);
+		return *sharedinflater;
+	}
+
+	/** Destroys the shared zlib streams so they are recreated with the current config. */
+	void ResetShared()
+	{
+		for (size_t i = 0; i <= MAX_WBITS; ++i)
+		{
+			delete shareddeflaters[i];
+			shareddeflaters[i] = NULL;
+		}
+		delete sharedinflater;
+		sharedinflater = NULL;
+	}
+
+	~WebSocketHookProvider()
+	{
+		ResetShared();
+	}
+#endif
+
 	WebSocketHookProvider(Module* mod)
 		: IOHookProvider(mod, "websocket", IOHookProvider::IOH_UNKNOWN, true)
 	{
+#ifdef INSPIRCD_WEBSOCKET_DEFLATE
+		for (size_t i = 0; i <= MAX_WBITS; ++i)
+			shareddeflaters[i] = NULL;
+		sharedinflater = NULL;
+#endif
 	}
 
 	void OnAccept(StreamSocket* sock, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server) CXX11_OVERRIDE;
@@ -90,6 +419,12 @@ class WebSocketHook : public IOHookMiddle
 		{
 			return std::string(req, bpos, len);
 		}
+
+		std::string ExtractLine(const std::string& req) const
+		{
+			const std::string::size_type epos = req.find_first_of("\r\n", bpos, 2);
+			return std::string(req, bpos, epos - bpos);
+		}
 	};
 
 	enum OpCode
@@ -110,6 +445,7 @@ class WebSocketHook : public IOHookMiddle
 
 	static const unsigned char WS_MASKBIT = (1 << 7);
 	static const unsigned char WS_FINBIT = (1 << 7);
+	static const unsigned char WS_RSV1BIT = (1 << 6);
 	static const unsigned char WS_PAYLOAD_LENGTH_MAGIC_LARGE = 126;
 	static const unsigned char WS_PAYLOAD_LENGTH_MAGIC_HUGE = 127;
 	static const size_t WS_MAX_PAYLOAD_LENGTH_SMALL = 125;
@@ -119,14 +455,42 @@ class WebSocketHook : public IOHookMiddle
 	// Clients sending ping or pong frames faster than this are killed
 	static const time_t MINPINGPONGDELAY = 10;
 
+	// Compressed messages which are longer than this before or after decompression are rejected
+	static const size_t MAXCOMPRESSEDMESSAGE = 65536;
+
 	State state;
 	time_t lastpingpong;
 	WebSocketConfig& config;
 
-	static size_t FillHeader(unsigned char* outbuf, size_t sendlength, OpCode opcode)
+	/** Whether the permessage-deflate extension was negotiated. */
+	bool deflate;
+
+	/** The window size in bits which outgoing messages are compressed with. */
+	unsigned int deflatebits;
+
+	/** Whether the message which is currently being received is compressed. */
+	bool inflating;
+
+	/** The compressed fragments of the message which is currently being received. */
+	std::string compressedmessage;
+
+#ifdef INSPIRCD_WEBSOCKET_DEFLATE
+	/** The compressor for this connection or NULL if the shared compressors are used. */
+	WebSocketDeflater* deflater;
+
+	/** The decompressor for this connection or NULL if the shared decompressor is used. */
+	WebSocketInflater* inflater;
+#endif
+
+	WebSocketHookProvider* GetProvider() const
+	{
+		return static_cast<WebSocketHookProvider*>(static_cast<IOHookProvider*>(prov));
+	}
+
+	static size_t FillHeader(unsigned char* outbuf, size_t sendlength, OpCode opcode, bool compressed = false)
 	{
 		size_t pos = 0;
-		outbuf[pos++] = WS_FINBIT | opcode;
+		outbuf[pos++] = WS_FINBIT | (compressed ? WS_RSV1BIT : 0) | opcode;
 
 		if (sendlength <= WS_MAX_PAYLOAD_LENGTH_SMALL)
 		{
@@ -149,12 +513,156 @@ class WebSocketHook : public IOHookMiddle
 		return pos;
 	}
 
-	static StreamSocket::SendQueue::Element PrepareSendQElem(size_t size, OpCode opcode)
+	static std::string PrepareSendQElem(size_t size, OpCode opcode, bool compressed = false)
 	{
 		unsigned char header[MAXHEADERSIZE];
-		const size_t n = FillHeader(header, size, opcode);
+		const size_t n = FillHeader(header, size, opcode, compressed);
+
+		return std::string(reinterpret_cast<const char*>(header), n);
+	}
+
+	/** Makes a frame containing a line.
+	 * @param line The line to send without the line terminator.
+	 * @param length The length of the line.
+	 * @return The header and payload of the frame.
+	 */
+	StreamSocket::SendQueue::Element MakeFrame(const char* line, size_t length)
+	{
+		const OpCode opcode = config.sendastext ? OP_TEXT : OP_BINARY;
+
+		// If we send messages as text then we need to ensure they are valid UTF-8.
+		std::string encoded;
+		if ((config.sendastext) && (!utf8::is_valid(line, line + length)))
+		{
+			utf8::replace_invalid(line, line + length, std::back_inserter(encoded));
+			line = encoded.data();
+			length = encoded.length();
+		}
+
+		std::string frame;
+		if ((deflate) && (length >= config.compressminsize) && (Compress(line, length, frame)))
+			return StreamSocket::SendQueue::Element(frame);
+
+		frame = PrepareSendQElem(length, opcode);
+		frame.append(line, length);
+		return StreamSocket::SendQueue::Element(frame);
+	}
+
+	/** Makes a compressed frame containing a line.
+	 * @param line The line to send without the line terminator.
+	 * @param length The length of the line.
+	 * @param frame The string to store the header and payload of the frame in.
+	 * @return True if the line was compressed; otherwise, false.
+	 */
+	bool Compress(const char* line, size_t length, std::string& frame)
+	{
+#ifdef INSPIRCD_WEBSOCKET_DEFLATE
+		WebSocketHookProvider* wsprov = GetProvider();
+		WebSocketDeflater& compressor = deflater ? *deflater : wsprov->GetSharedDeflater(deflatebits);
+
+		const uint64_t start = InspIRCd::GetMicroseconds();
+		std::string payload;
+		const bool compressed = compressor.Compress(line, length, payload, !deflater);
+		wsprov->deflatestats.DeflateTime += InspIRCd::GetMicroseconds() - start;
+		if (!compressed)
+			return false;
+
+		wsprov->deflatestats.DeflateIn += length;
+		wsprov->deflatestats.DeflateOut += payload.length();
+
+		frame = PrepareSendQElem(payload.length(), config.sendastext ? OP_TEXT : OP_BINARY, true);
+		frame.append(payload);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	/** Decompresses a message which was received from the client.
+	 * @param in The compressed message.
+	 * @param out The string to append the message to.
+	 * @return True if the message was decompressed; otherwise, false.
+	 */
+	bool Decompress(const std::string& in, std::string& out)
+	{
+#ifdef INSPIRCD_WEBSOCKET_DEFLATE
+		WebSocketHookProvider* wsprov = GetProvider();
+		WebSocketInflater& decompressor = inflater ? *inflater : wsprov->GetSharedInflater();
+
+		const uint64_t start = InspIRCd::GetMicroseconds();
+		const bool decompressed = decompressor.Decompress(in.data(), in.length(), out, MAXCOMPRESSEDMESSAGE, !inflater);
+		wsprov->deflatestats.InflateTime += InspIRCd::GetMicroseconds() - start;
+		if (!decompressed)
+			return false;
+
+		wsprov->deflatestats.InflateIn += in.length();
+		wsprov->deflatestats.InflateOut += out.length();
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	/** Determines whether a send queue element contains exactly one line. */
+	static bool IsSingleLine(const StreamSocket::SendQueue::Element& elem)
+	{
+		if ((elem.empty()) || (elem[elem.length() - 1] != '\n'))
+			return false;
+
+		return !memchr(elem.data(), '\n', elem.length() - 1);
+	}
+
+	/** Appends part of a line to a buffer without any CR characters. */
+	static void AppendWithoutCR(std::string& out, const char* first, const char* last)
+	{
+		while (first != last)
+		{
+			const char* cr = static_cast<const char*>(memchr(first, '\r', last - first));
+			if (!cr)
+			{
+				out.append(first, last);
+				return;
+			}
+
+			out.append(first, cr);
+			first = cr + 1;
+		}
+	}
+
+	/** XORs the payload of a frame with its masking key.
+	 * @param data The payload to unmask in place.
+	 * @param len The length of the payload.
+	 * @param maskkey The four byte masking key of the frame.
+	 */
+	static void Unmask(unsigned char* data, size_t len, const unsigned char* maskkey)
+	{
+		// The key repeats every four bytes so it can be applied a vector or a word at a time.
+		unsigned char widekey[16];
+		for (size_t i = 0; i < sizeof(widekey); ++i)
+			widekey[i] = maskkey[i % 4];
+
+		size_t pos = 0;
+#ifdef INSPIRCD_WEBSOCKET_SSE2
+		const __m128i vectorkey = _mm_loadu_si128(reinterpret_cast<const __m128i*>(widekey));
+		for (; pos + 16 <= len; pos += 16)
+		{
+			__m128i* chunk = reinterpret_cast<__m128i*>(data + pos);
+			_mm_storeu_si128(chunk, _mm_xor_si128(_mm_loadu_si128(chunk), vectorkey));
+		}
+#endif
+
+		uint64_t wordkey;
+		memcpy(&wordkey, widekey, sizeof(wordkey));
+		for (; pos + sizeof(wordkey) <= len; pos += sizeof(wordkey))
+		{
+			uint64_t word;
+			memcpy(&word, data + pos, sizeof(word));
+			word ^= wordkey;
+			memcpy(data + pos, &word, sizeof(word));
+		}
 
-		return StreamSocket::SendQueue::Element(reinterpret_cast<const char*>(header), n);
+		for (; pos < len; ++pos)
+			data[pos] ^= maskkey[pos % 4];
 	}
 
 	int HandleAppData(StreamSocket* sock, std::string& appdataout, bool allowlarge)
@@ -215,16 +723,12 @@ class WebSocketHook : public IOHookMiddle
 		if (myrecvq.length() < payloadstartoffset + len)
 			return 0;
 
-		unsigned int maskkeypos = 0;
-		const std::string::iterator endit = myrecvq.begin() + payloadstartoffset + len;
-		for (std::string::const_iterator i = myrecvq.begin() + payloadstartoffset; i != endit; ++i)
-		{
-			const unsigned char c = (unsigned char)*i;
-			appdataout.push_back(c ^ maskkey[maskkeypos++]);
-			maskkeypos %= 4;
-		}
+		const std::string::size_type appdatastart = appdataout.length();
+		appdataout.append(myrecvq, payloadstartoffset, len);
+		if (len)
+			Unmask(reinterpret_cast<unsigned char*>(&appdataout[appdatastart]), len, maskkey);
 
-		myrecvq.erase(myrecvq.begin(), endit);
+		myrecvq.erase(0, payloadstartoffset + len);
 		return 1;
 	}
 
@@ -244,7 +748,7 @@ class WebSocketHook : public IOHookMiddle
 		if ((result <= 0) || (!isping))
 			return result;
 
-		StreamSocket::SendQueue::Element elem = PrepareSendQElem(appdata.length(), OP_PONG);
+		std::string elem = PrepareSendQElem(appdata.length(), OP_PONG);
 		elem.append(appdata);
 		GetSendQ().push_back(elem);
 
@@ -258,22 +762,66 @@ class WebSocketHook : public IOHookMiddle
 			return 0;
 
 		unsigned char opcode = (unsigned char)GetRecvQ().c_str()[0];
-		switch (opcode & ~WS_FINBIT)
+		const unsigned char type = opcode & ~(WS_FINBIT | WS_RSV1BIT);
+
+		// The RSV1 bit marks the first frame of a compressed message and is not valid on anything else.
+		if ((opcode & WS_RSV1BIT) && ((!deflate) || ((type != OP_TEXT) && (type != OP_BINARY))))
+		{
+			sock->SetError("WebSocket protocol violation: unexpected RSV1 bit");
+			return -1;
+		}
+
+		switch (type)
 		{
 			case OP_CONTINUATION:
 			case OP_TEXT:
 			case OP_BINARY:
 			{
+				const bool first = (type != OP_CONTINUATION);
 				std::string appdata;
 				const int result = HandleAppData(sock, appdata, true);
 				if (result != 1)
 					return result;
 
+				if (first)
+					inflating = (opcode & WS_RSV1BIT);
+
+				if (inflating)
+				{
+					// Compressed messages can only be decompressed once all of their frames have arrived.
+					compressedmessage.append(appdata);
+					if (compressedmessage.length() > MAXCOMPRESSEDMESSAGE)
+					{
+						sock->SetError("WebSocket: Compressed message too long");
+						return -1;
+					}
+
+					if (!(opcode & WS_FINBIT))
+						return 1;
+
+					appdata.clear();
+					const bool decompressed = Decompress(compressedmessage, appdata);
+					compressedmessage.clear();
+					if (!decompressed)
+					{
+						sock->SetError("WebSocket: Invalid compressed message");
+						return -1;
+					}
+				}
+
 				// Strip out any CR+LF which may have been erroneously sent.
-				for (std::string::const_iterator iter = appdata.begin(); iter != appdata.end(); ++iter)
+				std::string::size_type start = 0;
+				while (start < appdata.length())
 				{
-					if (*iter != '\r' && *iter != '\n')
-						destrecvq.push_back(*iter);
+					const std::string::size_type end = appdata.find_first_of("\r\n", start, 2);
+					if (end == std::string::npos)
+					{
+						destrecvq.append(appdata, start, std::string::npos);
+						break;
+					}
+
+					destrecvq.append(appdata, start, end - start);
+					start = end + 1;
 				}
 
 				// If we are on the final message of this block append a line terminator.
@@ -309,6 +857,150 @@ class WebSocketHook : public IOHookMiddle
 		}
 	}
 
+	/** Removes whitespace from both ends of a token. */
+	static std::string TrimToken(const std::string& token)
+	{
+		const std::string::size_type first = token.find_first_not_of(whitespace, 0, sizeof(whitespace)-1);
+		if (first == std::string::npos)
+			return std::string();
+
+		const std::string::size_type last = token.find_last_not_of(whitespace, std::string::npos, sizeof(whitespace)-1);
+		return token.substr(first, last - first + 1);
+	}
+
+	/** Parses the value of a window size parameter of the permessage-deflate extension.
+	 * @param value The value of the parameter which may be quoted.
+	 * @return The window size in bits or 0 if the value is invalid.
+	 */
+	static unsigned int ParseWindowBits(std::string value)
+	{
+		if ((value.length() >= 2) && (value[0] == '"') && (value[value.length() - 1] == '"'))
+			value = value.substr(1, value.length() - 2);
+
+		if ((value.empty()) || (value.length() > 2) || (value.find_first_not_of("0123456789") != std::string::npos))
+			return 0;
+
+		const unsigned int bits = ConvToNum<unsigned int>(value);
+		return ((bits >= 8) && (bits <= 15)) ? bits : 0;
+	}
+
+	/** Accepts the first permessage-deflate offer from the client which we support.
+	 * @param offers The value of the Sec-WebSocket-Extensions header sent by the client.
+	 * @param response The string to store the extension response in.
+	 * @return True if an offer was accepted; otherwise, false.
+	 */
+	bool NegotiateDeflate(const std::string& offers, std::string& response)
+	{
+#ifdef INSPIRCD_WEBSOCKET_DEFLATE
+		irc::sepstream offerstream(offers, ',');
+		for (std::string offer; offerstream.GetToken(offer); )
+		{
+			irc::sepstream paramstream(offer, ';');
+			std::string name;
+			if ((!paramstream.GetToken(name)) || (!stdalgo::string::equalsci(TrimToken(name), "permessage-deflate")))
+				continue;
+
+			bool valid = true;
+			bool servernocontext = false;
+			bool clientnocontext = false;
+			bool clientbitsoffered = false;
+			unsigned int serverbits = 0;
+			unsigned int clientbits = 0;
+			std::set<std::string> seen;
+			for (std::string param; (valid) && (paramstream.GetToken(param)); )
+			{
+				std::string value;
+				const std::string::size_type eq = param.find('=');
+				if (eq != std::string::npos)
+				{
+					value = TrimToken(param.substr(eq + 1));
+					param.erase(eq);
+				}
+
+				// Offers which repeat or contain parameters we don't understand must be declined.
+				param = TrimToken(param);
+				if (!seen.insert(param).second)
+					valid = false;
+				else if (param == "server_no_context_takeover")
+					valid = servernocontext = (eq == std::string::npos);
+				else if (param == "client_no_context_takeover")
+					valid = clientnocontext = (eq == std::string::npos);
+				else if (param == "server_max_window_bits")
+					valid = (serverbits = ParseWindowBits(value)) != 0;
+				else if (param == "client_max_window_bits")
+				{
+					clientbitsoffered = true;
+					valid = (eq == std::string::npos) || ((clientbits = ParseWindowBits(value)) != 0);
+				}
+				else
+					valid = false;
+			}
+
+			// zlib can not compress with a window smaller than 512 bytes.
+			if ((!valid) || ((serverbits) && (serverbits < 9)))
+				continue;
+
+			deflatebits = std::min(config.compresswindowbits, serverbits ? serverbits : MAX_WBITS);
+			const bool shareddeflate = (config.nocontexttakeover || servernocontext);
+
+			// The client can only be told to use a smaller window if it offered to. Otherwise it
+			// has to compress every message on its own so the shared decompressor can be used.
+			unsigned int inflatebits = MAX_WBITS;
+			bool sharedinflate = (config.nocontexttakeover || clientnocontext);
+			if ((!sharedinflate) && (clientbitsoffered))
+				inflatebits = std::min(config.decompresswindowbits, clientbits ? clientbits : MAX_WBITS);
+			else if (config.decompresswindowbits < MAX_WBITS)
+				sharedinflate = true;
+
+			try
+			{
+				if (!shareddeflate)
+					deflater = new WebSocketDeflater(config.compresslevel, deflatebits, config.compressmemlevel);
+				if (!sharedinflate)
+					inflater = new WebSocketInflater(inflatebits);
+			}
+			catch (ModuleException& ex)
+			{
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to enable WebSocket compression: %s", ex.GetReason().c_str());
+				delete deflater;
+				deflater = NULL;
+				return false;
+			}
+
+			response = "permessage-deflate";
+			if (shareddeflate)
+				response.append("; server_no_context_takeover");
+			if (deflatebits < MAX_WBITS)
+				response.append("; server_max_window_bits=").append(ConvToStr(deflatebits));
+			if (sharedinflate)
+				response.append("; client_no_context_takeover");
+			else if (clientbitsoffered)
+				response.append("; client_max_window_bits=").append(ConvToStr(inflatebits));
+
+			deflate = true;
+			GetProvider()->deflatestats.Connections++;
+			return true;
+		}
+#endif
+		return false;
+	}
+
+	/** Frees the compression state of the connection. */
+	void FreeDeflate()
+	{
+		if (!deflate)
+			return;
+
+		deflate = false;
+		GetProvider()->deflatestats.Connections--;
+#ifdef INSPIRCD_WEBSOCKET_DEFLATE
+		delete deflater;
+		deflater = NULL;
+		delete inflater;
+		inflater = NULL;
+#endif
+	}
+
 	void FailHandshake(StreamSocket* sock, const char* httpreply, const char* sockerror)
 	{
 		GetSendQ().push_back(StreamSocket::SendQueue::Element(httpreply));
@@ -393,7 +1085,17 @@ class WebSocketHook : public IOHookMiddle
 		key.append(MagicGUID);
 
 		std::string reply = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
-		reply.append(BinToBase64((*sha1)->GenerateRaw(key), NULL, '=')).append("\r\n\r\n");
+		reply.append(BinToBase64((*sha1)->GenerateRaw(key), NULL, '=')).append("\r\n");
+
+		HTTPHeaderFinder extensionsheader;
+		std::string extensions;
+		if ((config.compress) && (extensionsheader.Find(recvq, "Sec-WebSocket-Extensions:", 25, reqend))
+			&& (NegotiateDeflate(extensionsheader.ExtractLine(recvq), extensions)))
+		{
+			reply.append("Sec-WebSocket-Extensions: ").append(extensions).append("\r\n");
+		}
+
+		reply.append("\r\n");
 		GetSendQ().push_back(StreamSocket::SendQueue::Element(reply));
 
 		SocketEngine::ChangeEventMask(sock, FD_ADD_TRIAL_WRITE);
@@ -409,10 +1111,22 @@ class WebSocketHook : public IOHookMiddle
 		, state(STATE_HTTPREQ)
 		, lastpingpong(0)
 		, config(cfg)
+		, deflate(false)
+		, deflatebits(0)
+		, inflating(false)
+#ifdef INSPIRCD_WEBSOCKET_DEFLATE
+		, deflater(NULL)
+		, inflater(NULL)
+#endif
 	{
 		sock->AddIOHook(this);
 	}
 
+	~WebSocketHook()
+	{
+		FreeDeflate();
+	}
+
 	int OnStreamSocketWrite(StreamSocket* sock, StreamSocket::SendQueue& uppersendq) CXX11_OVERRIDE
 	{
 		StreamSocket::SendQueue& mysendq = GetSendQ();
@@ -421,35 +1135,51 @@ class WebSocketHook : public IOHookMiddle
 		if (state != STATE_ESTABLISHED)
 			return (mysendq.empty() ? 0 : 1);
 
+		// Connections which share a compressor with the configured window make the same
+		// compressed frames as each other so they can share a cache of their own.
+		WebSocketHookProvider* wsprov = GetProvider();
+		WebSocketFrameCache* frames = &wsprov->frames;
+#ifdef INSPIRCD_WEBSOCKET_DEFLATE
+		if (deflate)
+			frames = (!deflater && deflatebits == config.compresswindowbits) ? &wsprov->deflateframes : NULL;
+#endif
+
 		std::string message;
 		for (StreamSocket::SendQueue::const_iterator elem = uppersendq.begin(); elem != uppersendq.end(); ++elem)
 		{
-			for (StreamSocket::SendQueue::Element::const_iterator chr = elem->begin(); chr != elem->end(); ++chr)
+			const char* pos = elem->data();
+			const char* const end = pos + elem->length();
+
+			// Lines which are shared with other clients are usually queued whole so
+			// the frame made for the first client can be reused for the others.
+			if ((frames) && (message.empty()) && (elem->use_count() > 1) && (IsSingleLine(*elem)))
 			{
-				if (*chr == '\n')
+				const StreamSocket::SendQueue::Element* frame = frames->Find(*elem);
+				if (!frame)
 				{
-					// We have found an entire message. Send it in its own frame.
-					if (config.sendastext)
-					{
-						// If we send messages as text then we need to ensure they are valid UTF-8.
-						std::string encoded;
-						utf8::replace_invalid(message.begin(), message.end(), std::back_inserter(encoded));
-
-						mysendq.push_back(PrepareSendQElem(encoded.length(), OP_TEXT));
-						mysendq.push_back(encoded);
-					}
-					else
-					{
-						// Otherwise, send the raw message as a binary frame.
-						mysendq.push_back(PrepareSendQElem(message.length(), OP_BINARY));
-						mysendq.push_back(message);
-					}
+					AppendWithoutCR(message, pos, end - 1);
+					frame = &frames->Add(*elem, MakeFrame(message.data(), message.length()));
 					message.clear();
 				}
-				else if (*chr != '\r')
+
+				mysendq.push_back(*frame);
+				continue;
+			}
+
+			while (pos != end)
+			{
+				const char* const nl = static_cast<const char*>(memchr(pos, '\n', end - pos));
+				if (!nl)
 				{
-					message.push_back(*chr);
+					AppendWithoutCR(message, pos, end);
+					break;
 				}
+
+				// We have found an entire message. Send it in its own frame.
+				AppendWithoutCR(message, pos, nl);
+				mysendq.push_back(MakeFrame(message.data(), message.length()));
+				message.clear();
+				pos = nl + 1;
 			}
 		}
 
@@ -485,6 +1215,7 @@ class WebSocketHook : public IOHookMiddle
 
 	void OnStreamSocketClose(StreamSocket* sock) CXX11_OVERRIDE
 	{
+		FreeDeflate();
 	}
 };
 
@@ -493,14 +1224,15 @@ void WebSocketHookProvider::OnAccept(StreamSocket* sock, irc::sockets::sockaddrs
 	new WebSocketHook(this, sock, config);
 }
 
-class ModuleWebSocket : public Module
+class ModuleWebSocket : public Module, public Stats::EventListener
 {
 	dynamic_reference_nocheck<HashProvider> hash;
 	reference<WebSocketHookProvider> hookprov;
 
  public:
 	ModuleWebSocket()
-		: hash(this, "hash/sha1")
+		: Stats::EventListener(this)
+		, hash(this, "hash/sha1")
 		, hookprov(new WebSocketHookProvider(this))
 	{
 		sha1 = &hash;
@@ -532,8 +1264,45 @@ class ModuleWebSocket : public Module
 		for (std::string proxyrange; proxyranges.GetToken(proxyrange); )
 			config.proxyranges.push_back(proxyrange);
 
+		config.compress = tag->getBool("compress");
+		config.compresslevel = tag->getInt("compresslevel", 6, 1, 9);
+		config.compressmemlevel = tag->getInt("compressmemlevel", 8, 1, 9);
+		config.compresswindowbits = tag->getUInt("compresswindowbits", 15, 9, 15);
+		config.decompresswindowbits = tag->getUInt("decompresswindowbits", 15, 9, 15);
+		config.nocontexttakeover = tag->getBool("nocontexttakeover");
+		config.compressminsize = tag->getUInt("compressminsize", 64);
+
+#ifndef INSPIRCD_WEBSOCKET_DEFLATE
+		if (config.compress)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "WARNING: <websocket:compress> is enabled but the websocket module was built without zlib; compression will not be offered");
+			config.compress = false;
+		}
+#endif
+
 		// Everything is okay; apply the new config.
 		hookprov->config = config;
+		hookprov->frames.Clear();
+		hookprov->deflateframes.Clear();
+#ifdef INSPIRCD_WEBSOCKET_DEFLATE
+		hookprov->ResetShared();
+#endif
+	}
+
+	ModResult OnStats(Stats::Context& stats) CXX11_OVERRIDE
+	{
+		if (stats.GetSymbol() != 'W')
+			return MOD_RES_PASSTHRU;
+
+		const WebSocketDeflateStats& ds = hookprov->deflatestats;
+		stats.AddRow(249, "Compressed connections: " + ConvToStr(ds.Connections));
+		stats.AddRow(249, "Compressed: " + ConvToStr(ds.DeflateIn) + " bytes to " + ConvToStr(ds.DeflateOut) + " bytes in " + ConvToStr(ds.DeflateTime) + " microseconds");
+		stats.AddRow(249, "Decompressed: " + ConvToStr(ds.InflateIn) + " bytes to " + ConvToStr(ds.InflateOut) + " bytes in " + ConvToStr(ds.InflateTime) + " microseconds");
+		if (ds.DeflateIn)
+			stats.AddRow(249, "Outgoing compression ratio: " + ConvToStr(ds.DeflateOut * 100 / ds.DeflateIn) + "%");
+		if (ds.InflateOut)
+			stats.AddRow(249, "Incoming compression ratio: " + ConvToStr(ds.InflateIn * 100 / ds.InflateOut) + "%");
+		return MOD_RES_PASSTHRU;
 	}
 
 	void OnCleanup(ExtensionItem::ExtensibleType type, Extensible* item) CXX11_OVERRIDE
@@ -240,6 +240,8 @@ int SocketEngine::RecvFrom(EventHandler* fd, void *buf, size_t len, int flags, s
 	return nbRecvd;
 }
 
+// Socket engines which perform socket I/O themselves provide their own versions of these.
+#ifndef HAS_SOCKETENGINE_IO
 int SocketEngine::Send(EventHandler* fd, const void *buf, size_t len, int flags)
 {
 	int nbSent = send(fd->GetFd(), (const char*)buf, len, flags);
@@ -253,6 +255,7 @@ int SocketEngine::Recv(EventHandler* fd, void *buf, size_t len, int flags)
 	stats.UpdateReadCounters(nbRecvd);
 	return nbRecvd;
 }
+#endif
 
 int SocketEngine::SendTo(EventHandler* fd, const void* buf, size_t len, int flags, const irc::sockets::sockaddrs& address)
 {
@@ -261,6 +264,7 @@ int SocketEngine::SendTo(EventHandler* fd, const void* buf, size_t len, int flag
 	return nbSent;
 }
 
+#ifndef HAS_SOCKETENGINE_IO
 int SocketEngine::WriteV(EventHandler* fd, const IOVector* iovec, int count)
 {
 	int sent = writev(fd->GetFd(), iovec, count);
@@ -268,6 +272,24 @@ int SocketEngine::WriteV(EventHandler* fd, const IOVector* iovec, int count)
 	return sent;
 }
 
+int SocketEngine::WriteBuffers(EventHandler* fd, BufferIterator begin, BufferIterator end)
+{
+	IOVector iovecs[128];
+	int count = 0;
+	for (; begin != end && count < 128; ++begin, ++count)
+	{
+		iovecs[count].iov_base = const_cast<char*>(begin->data());
+		iovecs[count].iov_len = begin->length();
+	}
+	return WriteV(fd, iovecs, count);
+}
+
+size_t SocketEngine::GetQueuedBytes(const EventHandler* fd)
+{
+	return 0;
+}
+#endif
+
 #ifdef _WIN32
 int SocketEngine::WriteV(EventHandler* fd, const iovec* iovec, int count)
 {
@@ -297,11 +319,18 @@ int SocketEngine::Connect(EventHandler* fd, const irc::sockets::sockaddrs& addre
 	return ret;
 }
 
+#ifndef HAS_SOCKETENGINE_IO
 int SocketEngine::Shutdown(EventHandler* fd, int how)
 {
 	return shutdown(fd->GetFd(), how);
 }
 
+SocketEngine::ReleaseResult SocketEngine::ReleaseIO(EventHandler* fd)
+{
+	return RELEASE_DONE;
+}
+#endif
+
 int SocketEngine::Bind(int fd, const irc::sockets::sockaddrs& addr)
 {
 	return bind(fd, &addr.sa, addr.sa_size());
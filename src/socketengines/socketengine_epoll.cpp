@@ -153,7 +153,7 @@ void SocketEngine::DelFd(EventHandler* eh)
 
 int SocketEngine::DispatchEvents()
 {
-	int i = epoll_wait(EngineHandle, &events[0], events.size(), 1000);
+	int i = epoll_wait(EngineHandle, &events[0], events.size(), ServerInstance->Timers.GetWaitTime());
 	ServerInstance->UpdateTime();
 
 	stats.TotalEvents += i;
@@ -0,0 +1,1999 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+#include <iostream>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/** A specialisation of the SocketEngine class, designed to use Linux io_uring.
+ *
+ * Interest changes are queued as poll requests in the submission ring and are
+ * handed to the kernel in the same io_uring_enter() call that waits for events
+ * so changing the event mask of a socket never costs a system call of its own.
+ * Edge-triggered masks use multishot polls which stay armed between events and
+ * polling masks use one-shot polls which are rearmed after every event.
+ *
+ * Once a stream socket has transferred data the engine also performs its I/O.
+ * A receive request which reads into a shared pool of buffers is kept in flight
+ * for the socket and the buffers of its send queue are sent by send requests
+ * which are submitted along with the next wait. The engine holds a reference to
+ * the buffers instead of copying them and releases it once they have been sent.
+ * Reads and writes on a busy socket therefore cost no system calls of their own
+ * and the polls for it only watch for errors.
+ *
+ * If the running kernel does not support multishot polls or extended wait
+ * arguments then this engine falls back to using epoll. If it does not support
+ * provided buffers then this engine only polls and sockets are read from and
+ * written to directly. If it supports multishot receive requests then one is
+ * used for each socket instead of submitting a new request after every read.
+ *
+ * Multishot accept requests are not used as listening sockets accept all of the
+ * pending connections when they become readable which already batches them.
+ */
+namespace
+{
+	/** The user data used for requests whose completions should be ignored. */
+	const __u64 IgnoreData = ~0ULL;
+
+	/** The number of entries in the submission ring. */
+	const unsigned int RingSize = 4096;
+
+	/** Per-descriptor state of the poll request for that descriptor. */
+	struct PollState
+	{
+		/** Incremented whenever the poll request for the fd is replaced so stale completions can be ignored. */
+		__u32 generation;
+
+		/** The poll events and mode of the currently armed request. */
+		unsigned int key;
+
+		/** Whether a poll request is currently armed. */
+		bool armed;
+
+		/** The submission round in which a request which refers to the fd by its number was last queued. */
+		unsigned long round;
+
+		PollState() : generation(0), key(0), armed(false), round(0) { }
+	};
+
+	/** Set in poll keys when the request should be multishot. */
+	const unsigned int MultishotKey = 0x80000000;
+
+	/** Set in the user data of poll requests. */
+	const __u64 PollData = 1;
+
+	/** Set in the user data of queued readiness notifications. */
+	const __u64 ReadyData = 2;
+
+	/** The size of each buffer in the pool which received data is read into. */
+	const unsigned int BufferSize = 16384;
+
+	/** The number of buffers in the pool which received data is read into. */
+	const unsigned int BufferCount = 512;
+
+	/** The buffer group which the pool is registered as. */
+	const __u16 BufferGroup = 1;
+
+	/** The maximum amount of received data to hold for a socket which is not being read from. */
+	const size_t MaxReadAhead = BufferSize * 4;
+
+	/** The maximum amount of written data to hold for a socket before writes to it block. */
+	const size_t MaxWriteAhead = 262144;
+
+	/** The maximum number of send queue buffers to hold for a socket. This is the most a single sendmsg() accepts. */
+	const size_t MaxWriteBuffers = 1024;
+
+	/** The number of seconds to keep sending the data which was written to a socket after it was closed. */
+	const time_t SendLinger = 10;
+
+	/** A receive or send request for a socket. The address of the transfer is used as the
+	 * user data of the request so it always has the low bits clear.
+	 */
+	struct Transfer
+	{
+		/** The file descriptor the request is for. */
+		int fd;
+
+		/** The session of the file descriptor when the request was submitted. */
+		__u32 session;
+
+		/** Whether this is a send request. */
+		bool write;
+
+		/** Whether the request has been asked to stop. */
+		bool cancelled;
+
+		/** Whether the socket was closed while this send request was in flight. */
+		bool orphaned;
+
+		/** The send queue buffers which are being sent. Buffers which have been partially sent are trimmed to the rest of their data. */
+		std::vector<insp::shared_string> buffers;
+
+		/** The vectors describing the buffers. */
+		std::vector<iovec> iov;
+
+		/** The index of the first buffer which has not been completely sent. */
+		size_t current;
+
+		/** The number of bytes which have not been sent yet. */
+		size_t remaining;
+
+		/** The message header which is passed to sendmsg(). */
+		msghdr msg;
+
+		Transfer(int FD, __u32 Session, bool Write)
+			: fd(FD)
+			, session(Session)
+			, write(Write)
+			, cancelled(false)
+			, orphaned(false)
+			, current(0)
+			, remaining(0)
+		{
+			memset(&msg, 0, sizeof(msg));
+		}
+	};
+
+	/** Data which was still being sent when its socket was closed. */
+	struct Orphan
+	{
+		/** The time at which the send request is cancelled if it has not finished. */
+		time_t deadline;
+
+		/** Buffers which are sent once the send request in flight has finished. */
+		std::deque<insp::shared_string> pending;
+	};
+
+	/** Whether the engine may perform I/O on a file descriptor. */
+	enum IOMode
+	{
+		/** The type of the socket has not been checked yet. */
+		IO_UNKNOWN,
+
+		/** The socket is a stream socket which the engine may perform I/O on. */
+		IO_STREAM,
+
+		/** The engine must never perform I/O on the file descriptor. */
+		IO_NEVER
+	};
+
+	/** Per-descriptor state of the I/O which is performed by the engine. */
+	struct IOState
+	{
+		/** Incremented whenever the engine stops performing I/O on the fd so stale transfers can be recognised. */
+		__u32 session;
+
+		/** Whether the engine may perform I/O on the fd. */
+		IOMode mode;
+
+		/** Whether the engine is performing I/O on the fd. */
+		bool owned;
+
+		/** Whether the fd is in the list of sockets with a readiness notification queued. */
+		bool ready;
+
+		/** Whether the fd is in the list of sockets with written data to send. */
+		bool flushing;
+
+		/** Whether the peer has closed the connection. */
+		bool eof;
+
+		/** The error which a receive request failed with or 0 if none has failed. */
+		int readerror;
+
+		/** The error which a send request failed with or 0 if none has failed. */
+		int writeerror;
+
+		/** The receive request which is in flight or NULL if there is none. */
+		Transfer* recv;
+
+		/** The send request which is in flight or NULL if there is none. */
+		Transfer* send;
+
+		/** Data which has been received but not read yet. */
+		std::string received;
+
+		/** Send queue buffers which have been written but not submitted to the kernel yet. */
+		std::deque<insp::shared_string> pending;
+
+		/** The number of bytes in the pending buffers. */
+		size_t pendingbytes;
+
+		/** Whether the engine is waiting for the transfers in flight to finish before it releases the fd. */
+		bool releasing;
+
+		/** Whether the engine refused to release the fd because it held data for it. */
+		bool refused;
+
+		IOState()
+			: session(0)
+			, mode(IO_UNKNOWN)
+			, owned(false)
+			, ready(false)
+			, flushing(false)
+			, eof(false)
+			, readerror(0)
+			, writeerror(0)
+			, recv(NULL)
+			, send(NULL)
+			, pendingbytes(0)
+			, releasing(false)
+			, refused(false)
+		{
+		}
+	};
+
+	/** Whether we fell back to using epoll. */
+	bool UseEpoll = false;
+
+	/** Whether the engine performs I/O on stream sockets. */
+	bool HandleIO = false;
+
+	/** Whether receive requests are multishot. */
+	bool UseMultishotRecv = false;
+
+	int EngineHandle = -1;
+
+	/** Poll request state indexed by file descriptor. */
+	std::vector<PollState> polls;
+
+	/** I/O state indexed by file descriptor. */
+	std::vector<IOState> io;
+
+	/** The memory of the buffers which received data is read into. */
+	char* pool = NULL;
+
+	/** File descriptors which have a readiness notification queued. */
+	std::vector<int> readylist;
+
+	/** File descriptors which have written data to send. */
+	std::vector<int> flushlist;
+
+	/** Send requests which were in flight when their socket was closed. */
+	std::map<Transfer*, Orphan> orphans;
+
+	/** These are used by epoll() to hold socket events when using the fallback. */
+	std::vector<struct epoll_event> events(16);
+
+	/** Completions copied out of the completion ring before being dispatched. */
+	std::vector<io_uring_cqe> completions;
+
+	/** Completions reaped while submitting which will be dispatched by the next DispatchEvents() call. */
+	std::vector<io_uring_cqe> reaped;
+
+	/** Submissions which did not fit into the submission ring, in the order they were made. */
+	std::vector<io_uring_sqe> backlog;
+
+	/** Incremented whenever the kernel has taken every submission in the ring. */
+	unsigned long submitround = 1;
+
+	/** The maximum number of times to retry a submission which the kernel refused to accept. */
+	const unsigned int MaxSubmitRetries = 16;
+
+	/** Memory mapped rings. */
+	struct Ring
+	{
+		void* sqptr;
+		size_t sqsize;
+		void* cqptr;
+		size_t cqsize;
+		io_uring_sqe* sqes;
+		size_t sqessize;
+
+		unsigned* sqhead;
+		unsigned* sqtail;
+		unsigned* sqmask;
+		unsigned* sqentries;
+		unsigned* cqhead;
+		unsigned* cqtail;
+		unsigned* cqmask;
+		io_uring_cqe* cqes;
+
+		/** The tail of the submission ring including entries we have not published yet. */
+		unsigned localtail;
+	} ring;
+
+	inline unsigned LoadAcquire(const unsigned* ptr)
+	{
+		return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+	}
+
+	inline void StoreRelease(unsigned* ptr, unsigned value)
+	{
+		__atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+	}
+
+	int SetupRing(unsigned entries, io_uring_params* params)
+	{
+		return syscall(__NR_io_uring_setup, entries, params);
+	}
+
+	int EnterRing(unsigned submit, unsigned wait, unsigned flags, const void* arg, size_t argsize)
+	{
+		int ret = syscall(__NR_io_uring_enter, EngineHandle, submit, wait, flags, arg, argsize);
+		if (LoadAcquire(ring.sqhead) == ring.localtail)
+			submitround++;
+		return ret;
+	}
+
+	void UnmapRing()
+	{
+		if (ring.sqes)
+			munmap(ring.sqes, ring.sqessize);
+		if (ring.cqptr && ring.cqptr != ring.sqptr)
+			munmap(ring.cqptr, ring.cqsize);
+		if (ring.sqptr)
+			munmap(ring.sqptr, ring.sqsize);
+		memset(&ring, 0, sizeof(ring));
+	}
+
+	bool MapRing(const io_uring_params& params)
+	{
+		ring.sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		ring.cqsize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			ring.sqsize = ring.cqsize = std::max(ring.sqsize, ring.cqsize);
+
+		ring.sqptr = mmap(NULL, ring.sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_SQ_RING);
+		if (ring.sqptr == MAP_FAILED)
+		{
+			ring.sqptr = NULL;
+			return false;
+		}
+
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			ring.cqptr = ring.sqptr;
+		else
+		{
+			ring.cqptr = mmap(NULL, ring.cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_CQ_RING);
+			if (ring.cqptr == MAP_FAILED)
+			{
+				ring.cqptr = NULL;
+				return false;
+			}
+		}
+
+		ring.sqessize = params.sq_entries * sizeof(io_uring_sqe);
+		void* sqes = mmap(NULL, ring.sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+			return false;
+		ring.sqes = static_cast<io_uring_sqe*>(sqes);
+
+		char* sq = static_cast<char*>(ring.sqptr);
+		ring.sqhead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+		ring.sqtail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		ring.sqmask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		ring.sqentries = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_entries);
+
+		// We always submit entries in order so the index array can be an identity mapping.
+		unsigned* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+		for (unsigned i = 0; i < params.sq_entries; ++i)
+			array[i] = i;
+
+		char* cq = static_cast<char*>(ring.cqptr);
+		ring.cqhead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		ring.cqtail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		ring.cqmask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		ring.cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+		ring.localtail = *ring.sqtail;
+		return true;
+	}
+
+	/** Moves all completions out of the completion ring and into the specified list. */
+	void ReapCompletions(std::vector<io_uring_cqe>& list)
+	{
+		unsigned head = *ring.cqhead;
+		const unsigned tail = LoadAcquire(ring.cqtail);
+		for (; head != tail; ++head)
+		{
+			const io_uring_cqe& cqe = ring.cqes[head & *ring.cqmask];
+			if (cqe.user_data != IgnoreData)
+				list.push_back(cqe);
+		}
+		StoreRelease(ring.cqhead, head);
+	}
+
+	/** Hands all queued submissions to the kernel without waiting for any completions. */
+	void FlushSubmissions()
+	{
+		StoreRelease(ring.sqtail, ring.localtail);
+		unsigned pending = ring.localtail - LoadAcquire(ring.sqhead);
+		unsigned int retries = 0;
+		while (pending)
+		{
+			int ret = EnterRing(pending, 0, 0, NULL, 0);
+			if (ret < 0)
+			{
+				if ((errno != EINTR && errno != EAGAIN && errno != EBUSY) || ++retries > MaxSubmitRetries)
+				{
+					ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "io_uring_enter failed to submit: %s", strerror(errno));
+					return;
+				}
+
+				// The kernel refuses new submissions while the completion ring is
+				// full so make room by moving the completions out of the ring. They
+				// will be dispatched by the next call to DispatchEvents.
+				if (errno == EBUSY)
+					ReapCompletions(reaped);
+				continue;
+			}
+			pending = ring.localtail - LoadAcquire(ring.sqhead);
+		}
+	}
+
+	/** Determines whether the submission ring has a free entry. */
+	inline bool HasRoom()
+	{
+		return ring.localtail - LoadAcquire(ring.sqhead) < *ring.sqentries;
+	}
+
+	/** Copies a submission into the submission ring, flushing the ring to the kernel if it is full.
+	 * @return True if the submission was queued or false if the ring is still full.
+	 */
+	bool PutSubmission(const io_uring_sqe& sqe)
+	{
+		if (!HasRoom())
+		{
+			FlushSubmissions();
+			if (!HasRoom())
+				return false;
+		}
+
+		ring.sqes[ring.localtail & *ring.sqmask] = sqe;
+		ring.localtail++;
+		return true;
+	}
+
+	/** Queues a submission. If the kernel is not accepting submissions then it is kept in the backlog
+	 * and queued once there is room for it. Entries in the ring are never overwritten.
+	 */
+	void Submit(const io_uring_sqe& sqe)
+	{
+		// Submissions have to reach the kernel in the order they were made.
+		if (!backlog.empty() || !PutSubmission(sqe))
+			backlog.push_back(sqe);
+	}
+
+	/** Moves as much of the backlog into the submission ring as fits. */
+	void DrainBacklog()
+	{
+		std::vector<io_uring_sqe>::iterator i = backlog.begin();
+		for (; i != backlog.end(); ++i)
+		{
+			if (!PutSubmission(*i))
+				break;
+		}
+		backlog.erase(backlog.begin(), i);
+	}
+
+	inline __u64 MakeUserData(int fd, __u32 generation, __u64 type)
+	{
+		return (static_cast<__u64>(generation) << 32) | (static_cast<__u64>(fd) << 2) | type;
+	}
+
+	/** Retrieves the transfer which the user data of a completion refers to or NULL if it is not a transfer. */
+	inline Transfer* GetTransfer(__u64 data)
+	{
+		if (data == IgnoreData || (data & (PollData | ReadyData)))
+			return NULL;
+		return reinterpret_cast<Transfer*>(data);
+	}
+
+	/** Records that a request which refers to the specified fd by its number has been queued. */
+	inline void NoteSubmission(int fd)
+	{
+		if (fd >= 0 && static_cast<size_t>(fd) < polls.size())
+			polls[fd].round = submitround;
+	}
+
+	/** Determines whether a request which refers to the specified fd by its number may not have reached the kernel yet. */
+	inline bool HasUnsubmitted(int fd)
+	{
+		return static_cast<size_t>(fd) < polls.size() && polls[fd].round == submitround;
+	}
+
+	void PrepPollAdd(int fd, __u32 generation, unsigned int key)
+	{
+		io_uring_sqe sqe;
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_POLL_ADD;
+		sqe.fd = fd;
+		NoteSubmission(fd);
+		sqe.user_data = MakeUserData(fd, generation, PollData);
+		if (key & MultishotKey)
+			sqe.len = IORING_POLL_ADD_MULTI;
+
+		__u32 pollmask = key & ~MultishotKey;
+#if __BYTE_ORDER == __BIG_ENDIAN
+		pollmask = (pollmask << 16) | (pollmask >> 16);
+#endif
+		sqe.poll32_events = pollmask;
+		Submit(sqe);
+	}
+
+	/** Removes a poll request. This uses a cancellation rather than IORING_OP_POLL_REMOVE as
+	 * the latter fails with EALREADY if the kernel is handling an event for a multishot
+	 * request at the time, which would leave the request (and its socket) alive forever.
+	 */
+	void PrepPollRemove(__u64 target)
+	{
+		io_uring_sqe sqe;
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_ASYNC_CANCEL;
+		sqe.fd = -1;
+		sqe.addr = target;
+		sqe.user_data = IgnoreData;
+		Submit(sqe);
+	}
+
+	void PrepProvideBuffers(unsigned int first, unsigned int count)
+	{
+		io_uring_sqe sqe;
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_PROVIDE_BUFFERS;
+		sqe.fd = count;
+		sqe.addr = reinterpret_cast<__u64>(pool + first * BufferSize);
+		sqe.len = BufferSize;
+		sqe.off = first;
+		sqe.buf_group = BufferGroup;
+		sqe.user_data = IgnoreData;
+		Submit(sqe);
+	}
+
+	void PrepRecv(Transfer* transfer)
+	{
+		io_uring_sqe sqe;
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_RECV;
+		sqe.fd = transfer->fd;
+		NoteSubmission(transfer->fd);
+		sqe.len = BufferSize;
+		sqe.flags = IOSQE_BUFFER_SELECT;
+		sqe.buf_group = BufferGroup;
+		sqe.user_data = reinterpret_cast<__u64>(transfer);
+#ifdef IORING_RECV_MULTISHOT
+		if (UseMultishotRecv)
+			sqe.ioprio = IORING_RECV_MULTISHOT;
+#endif
+		Submit(sqe);
+	}
+
+	void PrepSend(Transfer* transfer)
+	{
+		transfer->msg.msg_iov = &transfer->iov[transfer->current];
+		transfer->msg.msg_iovlen = transfer->iov.size() - transfer->current;
+
+		io_uring_sqe sqe;
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_SENDMSG;
+		sqe.fd = transfer->fd;
+		NoteSubmission(transfer->fd);
+		sqe.addr = reinterpret_cast<__u64>(&transfer->msg);
+		sqe.len = 1;
+		sqe.msg_flags = MSG_NOSIGNAL;
+		sqe.user_data = reinterpret_cast<__u64>(transfer);
+		Submit(sqe);
+	}
+
+	void PrepCancel(Transfer* transfer)
+	{
+		transfer->cancelled = true;
+
+		io_uring_sqe sqe;
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_ASYNC_CANCEL;
+		sqe.fd = -1;
+		sqe.addr = reinterpret_cast<__u64>(transfer);
+		sqe.user_data = IgnoreData;
+		Submit(sqe);
+	}
+
+	/** Submits everything which is queued and waits up to the specified number of milliseconds
+	 * for a completion. The completions are moved to the list of reaped completions.
+	 */
+	void WaitCompletions(long timeout)
+	{
+		DrainBacklog();
+		StoreRelease(ring.sqtail, ring.localtail);
+		const unsigned pending = ring.localtail - LoadAcquire(ring.sqhead);
+
+		__kernel_timespec ts = { timeout / 1000, (timeout % 1000) * 1000000 };
+		io_uring_getevents_arg arg;
+		memset(&arg, 0, sizeof(arg));
+		arg.sigmask_sz = _NSIG / 8;
+		arg.ts = reinterpret_cast<__u64>(&ts);
+		EnterRing(pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		ReapCompletions(reaped);
+	}
+
+	/** Checks that the kernel supports the features we need by running a multishot poll on a pipe. */
+	bool CheckMultishot()
+	{
+		int pipes[2];
+		if (pipe(pipes) == -1)
+			return false;
+
+		bool supported = false;
+		if (write(pipes[1], "", 1) == 1)
+		{
+			PrepPollAdd(pipes[0], 0, POLLIN | MultishotKey);
+			StoreRelease(ring.sqtail, ring.localtail);
+
+			__kernel_timespec timeout = { 1, 0 };
+			io_uring_getevents_arg arg;
+			memset(&arg, 0, sizeof(arg));
+			arg.sigmask_sz = _NSIG / 8;
+			arg.ts = reinterpret_cast<__u64>(&timeout);
+			if (EnterRing(1, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) >= 0)
+			{
+				unsigned head = *ring.cqhead;
+				if (head != LoadAcquire(ring.cqtail))
+				{
+					const io_uring_cqe& cqe = ring.cqes[head & *ring.cqmask];
+					supported = (cqe.res > 0 && (cqe.flags & IORING_CQE_F_MORE));
+					StoreRelease(ring.cqhead, head + 1);
+				}
+			}
+
+			PrepPollRemove(MakeUserData(pipes[0], 0, PollData));
+			FlushSubmissions();
+		}
+
+		close(pipes[0]);
+		close(pipes[1]);
+		return supported;
+	}
+
+	/** Hands the pool of buffers which received data is read into to the kernel. */
+	bool ProvideBufferPool()
+	{
+		if (!pool)
+			pool = new char[BufferSize * BufferCount];
+
+		PrepProvideBuffers(0, BufferCount);
+		StoreRelease(ring.sqtail, ring.localtail);
+		if (EnterRing(1, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+			return false;
+
+		bool supported = false;
+		unsigned head = *ring.cqhead;
+		if (head != LoadAcquire(ring.cqtail))
+		{
+			supported = (ring.cqes[head & *ring.cqmask].res >= 0);
+			StoreRelease(ring.cqhead, head + 1);
+		}
+		return supported;
+	}
+
+#ifdef IORING_RECV_MULTISHOT
+	/** Checks whether the kernel supports multishot receive requests by running one on a socket pair. */
+	bool CheckMultishotRecv()
+	{
+		int sockets[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1)
+			return false;
+
+		bool supported = false;
+		if (write(sockets[1], "", 1) == 1)
+		{
+			// Closing the other end makes the request finish once it has read the data.
+			close(sockets[1]);
+			sockets[1] = -1;
+
+			Transfer* probe = new Transfer(sockets[0], 0, false);
+			UseMultishotRecv = true;
+			PrepRecv(probe);
+			UseMultishotRecv = false;
+
+			bool first = true;
+			bool finished = false;
+			for (unsigned int attempt = 0; attempt < 3 && !finished; ++attempt)
+			{
+				if (attempt == 1)
+					PrepCancel(probe);
+
+				WaitCompletions(1000);
+				for (std::vector<io_uring_cqe>::iterator i = reaped.begin(); i != reaped.end(); ++i)
+				{
+					if (GetTransfer(i->user_data) != probe)
+						continue;
+
+					if (first)
+						supported = (i->res > 0 && (i->flags & IORING_CQE_F_MORE));
+					if (i->flags & IORING_CQE_F_BUFFER)
+						PrepProvideBuffers(i->flags >> IORING_CQE_BUFFER_SHIFT, 1);
+					if (!(i->flags & IORING_CQE_F_MORE))
+						finished = true;
+
+					first = false;
+					i->user_data = IgnoreData;
+				}
+			}
+
+			// If the request never finished then the kernel may still write to it.
+			if (finished)
+				delete probe;
+			FlushSubmissions();
+		}
+
+		close(sockets[0]);
+		if (sockets[1] != -1)
+			close(sockets[1]);
+		return supported;
+	}
+#endif
+
+	bool InitRing()
+	{
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = RingSize * 4;
+
+		EngineHandle = SetupRing(RingSize, &params);
+		if (EngineHandle == -1)
+			return false;
+
+		const unsigned int required = IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+		if ((params.features & required) != required || !MapRing(params) || !CheckMultishot())
+		{
+			UnmapRing();
+			close(EngineHandle);
+			EngineHandle = -1;
+			return false;
+		}
+
+		// Without fast poll receive and send requests for sockets which are not
+		// ready would block a kernel worker thread each.
+		HandleIO = (params.features & IORING_FEAT_FAST_POLL) && ProvideBufferPool();
+#ifdef IORING_RECV_MULTISHOT
+		UseMultishotRecv = HandleIO && CheckMultishotRecv();
+#endif
+		return true;
+	}
+
+	void DeinitRing()
+	{
+		UnmapRing();
+		if (EngineHandle != -1)
+			close(EngineHandle);
+		EngineHandle = -1;
+	}
+
+	unsigned int mask_to_poll(int event_mask)
+	{
+		unsigned int rv = 0;
+		if (event_mask & (FD_WANT_POLL_READ | FD_WANT_POLL_WRITE | FD_WANT_SINGLE_WRITE))
+		{
+			// We need to use standard polling on this FD so use a one-shot request
+			// which gets rearmed after every event.
+			if (event_mask & (FD_WANT_POLL_READ | FD_WANT_FAST_READ))
+				rv |= POLLIN;
+			if (event_mask & (FD_WANT_POLL_WRITE | FD_WANT_FAST_WRITE | FD_WANT_SINGLE_WRITE))
+				rv |= POLLOUT;
+		}
+		else
+		{
+			// We can use edge-triggered polling on this FD so use a multishot request
+			// which stays armed until it is removed.
+			rv = MultishotKey;
+			if (event_mask & (FD_WANT_FAST_READ | FD_WANT_EDGE_READ))
+				rv |= POLLIN;
+			if (event_mask & (FD_WANT_FAST_WRITE | FD_WANT_EDGE_WRITE))
+				rv |= POLLOUT;
+		}
+		return rv;
+	}
+
+	unsigned mask_to_epoll(int event_mask)
+	{
+		unsigned rv = 0;
+		if (event_mask & (FD_WANT_POLL_READ | FD_WANT_POLL_WRITE | FD_WANT_SINGLE_WRITE))
+		{
+			// we need to use standard polling on this FD
+			if (event_mask & (FD_WANT_POLL_READ | FD_WANT_FAST_READ))
+				rv |= EPOLLIN;
+			if (event_mask & (FD_WANT_POLL_WRITE | FD_WANT_FAST_WRITE | FD_WANT_SINGLE_WRITE))
+				rv |= EPOLLOUT;
+		}
+		else
+		{
+			// we can use edge-triggered polling on this FD
+			rv = EPOLLET;
+			if (event_mask & (FD_WANT_FAST_READ | FD_WANT_EDGE_READ))
+				rv |= EPOLLIN;
+			if (event_mask & (FD_WANT_FAST_WRITE | FD_WANT_EDGE_WRITE))
+				rv |= EPOLLOUT;
+		}
+		return rv;
+	}
+
+	/** Replaces the poll request for the specified fd with one for the specified key. */
+	void ArmPoll(int fd, unsigned int key)
+	{
+		if (static_cast<size_t>(fd) >= polls.size())
+			polls.resize(std::max<size_t>(fd + 1, polls.size() * 2));
+
+		PollState& state = polls[fd];
+		if (state.armed)
+			PrepPollRemove(MakeUserData(fd, state.generation, PollData));
+
+		state.generation++;
+		state.key = key;
+		state.armed = true;
+		PrepPollAdd(fd, state.generation, key);
+	}
+
+	void DisarmPoll(int fd)
+	{
+		if (static_cast<size_t>(fd) >= polls.size())
+			return;
+
+		PollState& state = polls[fd];
+		if (state.armed)
+			PrepPollRemove(MakeUserData(fd, state.generation, PollData));
+
+		state.generation++;
+		state.armed = false;
+	}
+
+	/** Retrieves the I/O state for the specified fd, creating it if needed. */
+	IOState& GetIO(int fd)
+	{
+		if (static_cast<size_t>(fd) >= io.size())
+			io.resize(std::max<size_t>(fd + 1, io.size() * 2));
+		return io[fd];
+	}
+
+	/** Determines whether the engine is performing I/O on the specified fd. */
+	inline bool IsOwned(int fd)
+	{
+		return fd >= 0 && static_cast<size_t>(fd) < io.size() && io[fd].owned;
+	}
+
+	inline bool WantsRead(int event_mask)
+	{
+		return event_mask & (FD_WANT_POLL_READ | FD_WANT_FAST_READ | FD_WANT_EDGE_READ);
+	}
+
+	inline bool WantsWrite(int event_mask)
+	{
+		return event_mask & (FD_WANT_POLL_WRITE | FD_WANT_FAST_WRITE | FD_WANT_EDGE_WRITE | FD_WANT_SINGLE_WRITE);
+	}
+
+	/** Determines whether a socket has written data which the engine has not finished sending. */
+	inline bool IsSending(const IOState& state)
+	{
+		return state.send || !state.pending.empty();
+	}
+
+	/** Retrieves the poll key which the specified fd should be polled with. */
+	unsigned int GetPollKey(int fd, int event_mask)
+	{
+		if (!IsOwned(fd))
+			return mask_to_poll(event_mask);
+
+		// Reads and writes on sockets which the engine performs I/O on are reported
+		// by their transfers so the poll only has to watch for errors and for space
+		// on sockets which were written to directly and blocked.
+		if ((event_mask & FD_WRITE_WILL_BLOCK) && WantsWrite(event_mask) && !IsSending(io[fd]))
+			return MultishotKey | POLLOUT;
+		return MultishotKey;
+	}
+
+	/** Rearms the poll request for the specified fd unless it already waits for the right events. */
+	void UpdatePoll(int fd, int event_mask)
+	{
+		const unsigned int key = GetPollKey(fd, event_mask);
+		if (static_cast<size_t>(fd) < polls.size() && polls[fd].armed && polls[fd].key == key)
+			return;
+
+		ArmPoll(fd, key);
+	}
+
+	/** Retrieves the amount of data written to a socket which has not been sent yet. */
+	size_t GetQueuedSize(const IOState& state)
+	{
+		size_t queued = state.pendingbytes;
+		if (state.send)
+			queued += state.send->remaining;
+		return queued;
+	}
+
+	/** Determines whether the engine accepts more written data for a socket. */
+	bool CanWrite(const IOState& state)
+	{
+		size_t buffers = state.pending.size();
+		if (state.send)
+			buffers += state.send->iov.size() - state.send->current;
+		return !state.writeerror && buffers < MaxWriteBuffers && GetQueuedSize(state) < MaxWriteAhead;
+	}
+
+	/** Determines which events are ready on a socket which the engine performs I/O on. */
+	unsigned int GetReadyEvents(const IOState& state, int event_mask)
+	{
+		unsigned int ready = 0;
+		if (WantsRead(event_mask) && (!state.received.empty() || state.eof || state.readerror))
+			ready |= POLLIN;
+
+		if (CanWrite(state))
+		{
+			// Edge-triggered writers are only told about space once they have run out of it.
+			if ((event_mask & (FD_WANT_POLL_WRITE | FD_WANT_SINGLE_WRITE))
+				|| ((event_mask & (FD_WANT_FAST_WRITE | FD_WANT_EDGE_WRITE)) && (event_mask & FD_WRITE_WILL_BLOCK)))
+				ready |= POLLOUT;
+		}
+		return ready;
+	}
+
+	/** Queues a notification for the specified fd which will be dispatched by the next call to DispatchEvents. */
+	void QueueReady(int fd)
+	{
+		IOState& state = io[fd];
+		if (state.ready)
+			return;
+
+		state.ready = true;
+		readylist.push_back(fd);
+	}
+
+	/** Submits a receive request for the specified fd unless it has one or has enough data waiting already. */
+	void StartRecv(int fd)
+	{
+		IOState& state = io[fd];
+		if (!state.owned || state.mode != IO_STREAM || state.recv || state.eof || state.readerror || state.received.size() >= MaxReadAhead)
+			return;
+
+		state.recv = new Transfer(fd, state.session, false);
+		PrepRecv(state.recv);
+	}
+
+	/** Moves buffers into a send request which has nothing left to send. */
+	void FillSend(Transfer* transfer, std::deque<insp::shared_string>& buffers)
+	{
+		transfer->buffers.assign(buffers.begin(), buffers.end());
+		buffers.clear();
+
+		transfer->iov.resize(transfer->buffers.size());
+		transfer->current = 0;
+		transfer->remaining = 0;
+		for (size_t i = 0; i < transfer->buffers.size(); ++i)
+		{
+			const insp::shared_string& buffer = transfer->buffers[i];
+			transfer->iov[i].iov_base = const_cast<char*>(buffer.data());
+			transfer->iov[i].iov_len = buffer.length();
+			transfer->remaining += buffer.length();
+		}
+	}
+
+	/** Accounts for data which has been sent by a send request, releasing the buffers which have been sent completely. */
+	void AdvanceSend(Transfer* transfer, size_t sent)
+	{
+		transfer->remaining -= sent;
+		while (sent)
+		{
+			iovec& vec = transfer->iov[transfer->current];
+			if (sent >= vec.iov_len)
+			{
+				sent -= vec.iov_len;
+				insp::shared_string().swap(transfer->buffers[transfer->current]);
+				transfer->current++;
+			}
+			else
+			{
+				vec.iov_base = static_cast<char*>(vec.iov_base) + sent;
+				vec.iov_len -= sent;
+				transfer->buffers[transfer->current].erase_front(sent);
+				sent = 0;
+			}
+		}
+	}
+
+	/** Submits a send request for the buffers written to the specified fd unless one is already in flight. */
+	void StartSend(int fd)
+	{
+		IOState& state = io[fd];
+		if (state.send || state.pending.empty())
+			return;
+
+		state.send = new Transfer(fd, state.session, true);
+		FillSend(state.send, state.pending);
+		state.pendingbytes = 0;
+		PrepSend(state.send);
+	}
+
+	/** Forgets about the I/O on an fd. Transfers which are still in flight belong to
+	 * the previous session and are freed when they complete.
+	 */
+	void ResetIO(IOState& state)
+	{
+		state.session++;
+		state.owned = false;
+		state.eof = false;
+		state.readerror = 0;
+		state.writeerror = 0;
+		state.recv = NULL;
+		state.send = NULL;
+		std::string().swap(state.received);
+		std::deque<insp::shared_string>().swap(state.pending);
+		state.pendingbytes = 0;
+		state.releasing = false;
+		state.refused = false;
+	}
+
+	/** Moves the buffers of a send request which will never complete back to the front of the
+	 * pending buffers of its socket so they are sent by the next request.
+	 */
+	void RequeueSend(IOState& state)
+	{
+		Transfer* const transfer = state.send;
+		for (size_t i = transfer->buffers.size(); i > transfer->current; --i)
+		{
+			const insp::shared_string& buffer = transfer->buffers[i - 1];
+			state.pending.push_front(buffer);
+			state.pendingbytes += buffer.length();
+		}
+		delete transfer;
+		state.send = NULL;
+	}
+
+	/** Starts performing the I/O on the socket of the specified event handler. */
+	void TakeIO(EventHandler* eh)
+	{
+		const int fd = eh->GetFd();
+		if (SocketEngine::GetRef(fd) != eh)
+			return;
+
+		IOState& state = GetIO(fd);
+		if (state.mode == IO_UNKNOWN)
+		{
+			int type;
+			socklen_t typesize = sizeof(type);
+			if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &typesize) == 0 && type == SOCK_STREAM)
+				state.mode = IO_STREAM;
+			else
+				state.mode = IO_NEVER;
+		}
+
+		if (state.mode != IO_STREAM || state.owned)
+			return;
+
+		state.owned = true;
+		const int mask = eh->GetEventMask();
+		UpdatePoll(fd, mask);
+		if (WantsRead(mask))
+			StartRecv(fd);
+	}
+
+	/** Removes the submissions for the specified fd which have not reached the kernel
+	 * from the backlog so they are not made once the descriptor has been reused.
+	 */
+	void PurgeBacklog(int fd)
+	{
+		IOState* const state = static_cast<size_t>(fd) < io.size() ? &io[fd] : NULL;
+		std::vector<io_uring_sqe>::iterator kept = backlog.begin();
+		for (std::vector<io_uring_sqe>::iterator i = backlog.begin(); i != backlog.end(); ++i)
+		{
+			if (i->fd != fd || (i->opcode != IORING_OP_POLL_ADD && i->opcode != IORING_OP_RECV && i->opcode != IORING_OP_SENDMSG))
+			{
+				*kept++ = *i;
+				continue;
+			}
+
+			Transfer* const transfer = GetTransfer(i->user_data);
+			if (!transfer)
+				continue;
+
+			// The data of a send request which never reached the kernel is sent by the next one.
+			if (state && state->send == transfer)
+			{
+				RequeueSend(*state);
+				continue;
+			}
+
+			if (state && state->recv == transfer)
+				state->recv = NULL;
+			delete transfer;
+		}
+		backlog.erase(kept, backlog.end());
+	}
+
+	/** Keeps sending the data written to a socket which is being closed. The sending
+	 * continues on a duplicate of the descriptor as the original one may be reused.
+	 */
+	void OrphanSend(int fd, IOState& state)
+	{
+		Transfer* transfer = state.send;
+		state.send = NULL;
+		if (!transfer)
+			transfer = new Transfer(-1, state.session, true);
+
+		transfer->orphaned = true;
+		transfer->fd = dup(fd);
+		if (transfer->fd == -1)
+		{
+			ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Unable to keep sending data written to fd %d after it is closed: %s", fd, strerror(errno));
+			if (!transfer->remaining)
+			{
+				// Nothing is in flight so there is no completion to clean up after.
+				delete transfer;
+				return;
+			}
+		}
+
+		Orphan& orphan = orphans[transfer];
+		orphan.deadline = ServerInstance->Time() + SendLinger;
+		orphan.pending.swap(state.pending);
+		state.pendingbytes = 0;
+
+		if (!transfer->remaining)
+		{
+			FillSend(transfer, orphan.pending);
+			PrepSend(transfer);
+		}
+	}
+
+	/** Handles the completion of a send request whose socket has been closed. */
+	void CompleteOrphan(Transfer* transfer, const io_uring_cqe& cqe)
+	{
+		std::map<Transfer*, Orphan>::iterator orphan = orphans.find(transfer);
+		if (cqe.res > 0 && transfer->fd != -1 && !transfer->cancelled)
+		{
+			AdvanceSend(transfer, cqe.res);
+			if (!transfer->remaining && orphan != orphans.end())
+				FillSend(transfer, orphan->second.pending);
+
+			if (transfer->remaining)
+			{
+				PrepSend(transfer);
+				return;
+			}
+		}
+
+		if (transfer->fd != -1)
+			close(transfer->fd);
+		if (orphan != orphans.end())
+			orphans.erase(orphan);
+		delete transfer;
+	}
+
+	/** Cancels the send requests of closed sockets which have not finished in time. */
+	void CancelExpiredOrphans()
+	{
+		for (std::map<Transfer*, Orphan>::iterator i = orphans.begin(); i != orphans.end(); ++i)
+		{
+			if (!i->first->cancelled && i->second.deadline <= ServerInstance->Time())
+				PrepCancel(i->first);
+		}
+	}
+
+	/** Finishes releasing an fd once the transfers for it have finished.
+	 * @return True if the fd has been released or false if the engine holds data for it and
+	 * keeps performing the I/O on it.
+	 */
+	bool FinishRelease(int fd)
+	{
+		IOState& state = io[fd];
+		state.releasing = false;
+		EventHandler* const eh = SocketEngine::GetRef(fd);
+		if (IsSending(state) || !state.received.empty() || state.eof || state.readerror || state.writeerror)
+		{
+			ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Not releasing fd %d as the engine still has data for it", fd);
+			state.refused = true;
+			state.mode = IO_STREAM;
+			if (eh && WantsRead(eh->GetEventMask()))
+				StartRecv(fd);
+			return false;
+		}
+
+		ResetIO(state);
+		if (eh)
+			UpdatePoll(fd, eh->GetEventMask());
+		return true;
+	}
+
+	/** Finishes releasing an fd if nothing is in flight for it anymore.
+	 * @return The events to dispatch to the handler of the fd.
+	 */
+	int CheckRelease(int fd, IOState& state)
+	{
+		if (state.recv || state.send)
+			return 0;
+
+		// The handler is told with a read event so it can find out how the release went.
+		FinishRelease(fd);
+		return POLLIN;
+	}
+
+	/** Handles the completion of a transfer.
+	 * @return The events to dispatch to the handler of the socket, a negated error code to
+	 * dispatch as an error, or 0 if there is nothing to dispatch.
+	 */
+	int CompleteTransfer(Transfer* transfer, const io_uring_cqe& cqe)
+	{
+		const int fd = transfer->fd;
+		IOState* state = NULL;
+		if (!transfer->orphaned && static_cast<size_t>(fd) < io.size() && io[fd].session == transfer->session)
+			state = &io[fd];
+
+		if (!transfer->write)
+		{
+			if (cqe.flags & IORING_CQE_F_BUFFER)
+			{
+				// Copy the data out so the buffer can be given straight back to the kernel.
+				const unsigned int buffer = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+				if (state && cqe.res > 0)
+					state->received.append(pool + buffer * BufferSize, cqe.res);
+				PrepProvideBuffers(buffer, 1);
+			}
+
+			// Multishot requests stay in flight until a completion without the more flag.
+			if (cqe.flags & IORING_CQE_F_MORE)
+			{
+				if (!transfer->cancelled && (!state || state->mode != IO_STREAM || state->received.size() >= MaxReadAhead))
+					PrepCancel(transfer);
+			}
+			else
+			{
+				if (state)
+					state->recv = NULL;
+				delete transfer;
+			}
+
+			if (!state)
+				return 0;
+
+			if (cqe.res == 0)
+			{
+				state->eof = true;
+			}
+			else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED && cqe.res != -EINTR && cqe.res != -EAGAIN)
+			{
+				state->readerror = -cqe.res;
+				return cqe.res;
+			}
+
+			if (state->releasing)
+				return CheckRelease(fd, *state);
+
+			// If the pool ran out of buffers then the retried request will be handed to
+			// the kernel after the buffers which were given back while dispatching.
+			EventHandler* const eh = SocketEngine::GetRef(fd);
+			if (!eh)
+				return 0;
+
+			const int mask = eh->GetEventMask();
+			if (WantsRead(mask))
+				StartRecv(fd);
+			return GetReadyEvents(*state, mask) & POLLIN;
+		}
+
+		if (transfer->orphaned)
+		{
+			CompleteOrphan(transfer, cqe);
+			return 0;
+		}
+
+		if (!state)
+		{
+			delete transfer;
+			return 0;
+		}
+
+		if (cqe.res > 0 || cqe.res == -ECANCELED || cqe.res == -EINTR || cqe.res == -EAGAIN)
+		{
+			if (cqe.res > 0)
+				AdvanceSend(transfer, cqe.res);
+
+			if (transfer->remaining)
+			{
+				// Send the rest of the data.
+				PrepSend(transfer);
+				return 0;
+			}
+		}
+		else
+		{
+			state->writeerror = cqe.res ? -cqe.res : EPIPE;
+			std::deque<insp::shared_string>().swap(state->pending);
+			state->pendingbytes = 0;
+		}
+
+		state->send = NULL;
+		delete transfer;
+		if (state->writeerror)
+			return -state->writeerror;
+
+		StartSend(fd);
+		if (state->releasing)
+			return CheckRelease(fd, *state);
+
+		EventHandler* const eh = SocketEngine::GetRef(fd);
+		if (!eh)
+			return 0;
+
+		// Handlers are told whenever data has been sent so they can write more or
+		// find out that their send queue has drained.
+		const int mask = eh->GetEventMask();
+		return (CanWrite(*state) && WantsWrite(mask)) ? POLLOUT : 0;
+	}
+}
+
+void SocketEngine::Init()
+{
+	LookupMaxFds();
+
+	if (InitRing())
+		return;
+
+	std::cout << con_bright << "Warning:" << con_reset << " io_uring is not supported by this kernel, falling back to epoll." << std::endl;
+	UseEpoll = true;
+
+	// 128 is not a maximum, just a hint at the eventual number of sockets that may be polled,
+	// and it is completely ignored by 2.6.8 and later kernels, except it must be larger than zero.
+	EngineHandle = epoll_create(128);
+	if (EngineHandle == -1)
+		InitError();
+}
+
+void SocketEngine::RecoverFromFork()
+{
+	if (UseEpoll)
+		return;
+
+	// Requests are owned by the task which submitted them and are cancelled when
+	// it exits so recreate the ring in the child and rearm everything. Transfers in
+	// the backlog are also referenced by the I/O state and are handled below.
+	backlog.clear();
+	DeinitRing();
+	if (!InitRing())
+		InitError();
+
+	for (size_t fd = 0; fd < polls.size(); ++fd)
+	{
+		polls[fd].armed = false;
+		EventHandler* eh = GetRef(fd);
+		if (eh)
+			ArmPoll(fd, GetPollKey(fd, eh->GetEventMask()));
+	}
+
+	for (std::map<Transfer*, Orphan>::iterator i = orphans.begin(); i != orphans.end(); ++i)
+	{
+		if (i->first->fd != -1)
+			close(i->first->fd);
+		delete i->first;
+	}
+	orphans.clear();
+
+	for (size_t fd = 0; fd < io.size(); ++fd)
+	{
+		// Transfers which were in flight will never complete so resubmit them.
+		IOState& state = io[fd];
+		delete state.recv;
+		state.recv = NULL;
+		if (state.send)
+			RequeueSend(state);
+
+		EventHandler* eh = GetRef(fd);
+		if (state.owned && eh)
+		{
+			StartSend(fd);
+			if (WantsRead(eh->GetEventMask()))
+				StartRecv(fd);
+			if (state.releasing && !state.send)
+				FinishRelease(fd);
+		}
+	}
+}
+
+void SocketEngine::Deinit()
+{
+	if (UseEpoll)
+		Close(EngineHandle);
+	else
+		DeinitRing();
+
+	delete[] pool;
+	pool = NULL;
+}
+
+bool SocketEngine::AddFd(EventHandler* eh, int event_mask)
+{
+	int fd = eh->GetFd();
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "AddFd out of range: (fd: %d)", fd);
+		return false;
+	}
+
+	if (!SocketEngine::AddFdRef(eh))
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to add duplicate fd: %d", fd);
+		return false;
+	}
+
+	if (UseEpoll)
+	{
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = mask_to_epoll(event_mask);
+		ev.data.ptr = static_cast<void*>(eh);
+		int i = epoll_ctl(EngineHandle, EPOLL_CTL_ADD, fd, &ev);
+		if (i < 0)
+		{
+			ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Error adding fd: %d to socketengine: %s", fd, strerror(errno));
+			return false;
+		}
+		ResizeDouble(events);
+	}
+	else
+	{
+		if (HandleIO)
+		{
+			IOState& state = GetIO(fd);
+			ResetIO(state);
+			state.mode = IO_UNKNOWN;
+		}
+		ArmPoll(fd, mask_to_poll(event_mask));
+	}
+
+	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "New file descriptor: %d", fd);
+
+	eh->SetEventMask(event_mask);
+	return true;
+}
+
+void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
+{
+	if (UseEpoll)
+	{
+		unsigned old_events = mask_to_epoll(old_mask);
+		unsigned new_events = mask_to_epoll(new_mask);
+		if (old_events != new_events)
+		{
+			// ok, we actually have something to tell the kernel about
+			struct epoll_event ev;
+			memset(&ev, 0, sizeof(ev));
+			ev.events = new_events;
+			ev.data.ptr = static_cast<void*>(eh);
+			epoll_ctl(EngineHandle, EPOLL_CTL_MOD, eh->GetFd(), &ev);
+		}
+		return;
+	}
+
+	const int fd = eh->GetFd();
+	if (fd < 0 || static_cast<size_t>(fd) >= polls.size())
+		return;
+
+	if (IsOwned(fd))
+	{
+		// Events which became ready while the handler was not interested in them
+		// would never be reported by a transfer so queue a notification for them.
+		if (WantsRead(new_mask))
+			StartRecv(fd);
+		if (GetReadyEvents(io[fd], new_mask))
+			QueueReady(fd);
+	}
+
+	// If the currently armed request already waits for the right events then
+	// there is nothing to do. This is the common case for edge-triggered sockets.
+	UpdatePoll(fd, new_mask);
+}
+
+void SocketEngine::DelFd(EventHandler* eh)
+{
+	int fd = eh->GetFd();
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "DelFd out of range: (fd: %d)", fd);
+		return;
+	}
+
+	if (UseEpoll)
+	{
+		struct epoll_event ev;
+		int i = epoll_ctl(EngineHandle, EPOLL_CTL_DEL, fd, &ev);
+		if (i < 0)
+			ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "epoll_ctl can't remove socket: %s", strerror(errno));
+	}
+	else
+	{
+		// The removal is submitted along with the next wait so closing lots of
+		// sockets at once does not cost a system call each.
+		DisarmPoll(fd);
+
+		if (IsOwned(fd))
+		{
+			// Stop receiving and keep sending the data which has been written on a
+			// duplicate of the descriptor (which keeps the socket open until it has
+			// been sent) so the last data written to the socket, like an ERROR line,
+			// is not lost. Cancellations refer to requests rather than descriptors so
+			// they are submitted along with the next wait too.
+			IOState& state = io[fd];
+			DrainBacklog();
+			PurgeBacklog(fd);
+			if (state.recv && !state.recv->cancelled)
+				PrepCancel(state.recv);
+			if (IsSending(state))
+				OrphanSend(fd, state);
+		}
+
+		// Requests which refer to the descriptor by its number have to reach the
+		// kernel before it is closed and possibly reused.
+		if (HasUnsubmitted(fd))
+			FlushSubmissions();
+
+		if (static_cast<size_t>(fd) < io.size())
+		{
+			ResetIO(io[fd]);
+			io[fd].mode = IO_UNKNOWN;
+		}
+	}
+
+	SocketEngine::DelFdRef(eh);
+
+	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Remove file descriptor: %d", fd);
+}
+
+int SocketEngine::DispatchEvents()
+{
+	if (UseEpoll)
+	{
+		int i = epoll_wait(EngineHandle, &events[0], events.size(), ServerInstance->Timers.GetWaitTime());
+		ServerInstance->UpdateTime();
+
+		stats.TotalEvents += i;
+
+		for (int j = 0; j < i; j++)
+		{
+			// Copy these in case the vector gets resized and ev invalidated
+			const epoll_event ev = events[j];
+
+			EventHandler* const eh = static_cast<EventHandler*>(ev.data.ptr);
+			const int fd = eh->GetFd();
+			if (fd < 0)
+				continue;
+
+			if (ev.events & EPOLLHUP)
+			{
+				stats.ErrorEvents++;
+				eh->OnEventHandlerError(0);
+				continue;
+			}
+
+			if (ev.events & EPOLLERR)
+			{
+				stats.ErrorEvents++;
+				/* Get error number */
+				socklen_t codesize = sizeof(int);
+				int errcode;
+				if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &errcode, &codesize) < 0)
+					errcode = errno;
+				eh->OnEventHandlerError(errcode);
+				continue;
+			}
+
+			int mask = eh->GetEventMask();
+			if (ev.events & EPOLLIN)
+				mask &= ~FD_READ_WILL_BLOCK;
+			if (ev.events & EPOLLOUT)
+			{
+				mask &= ~FD_WRITE_WILL_BLOCK;
+				if (mask & FD_WANT_SINGLE_WRITE)
+				{
+					int nm = mask & ~FD_WANT_SINGLE_WRITE;
+					OnSetEvent(eh, mask, nm);
+					mask = nm;
+				}
+			}
+			eh->SetEventMask(mask);
+			if (ev.events & EPOLLIN)
+			{
+				eh->OnEventHandlerRead();
+				if (eh != GetRef(fd))
+					// whoa! we got deleted, better not give out the write event
+					continue;
+			}
+			if (ev.events & EPOLLOUT)
+			{
+				eh->OnEventHandlerWrite();
+			}
+		}
+
+		return i;
+	}
+
+	// Send the data which has been written since the last call along with the wait.
+	for (std::vector<int>::const_iterator i = flushlist.begin(); i != flushlist.end(); ++i)
+	{
+		io[*i].flushing = false;
+		StartSend(*i);
+	}
+	flushlist.clear();
+
+	if (!orphans.empty())
+		CancelExpiredOrphans();
+	DrainBacklog();
+
+	// Submit all of the pending interest changes and wait for events in one system call.
+	StoreRelease(ring.sqtail, ring.localtail);
+	unsigned pending = ring.localtail - LoadAcquire(ring.sqhead);
+
+	const int waittime = ServerInstance->Timers.GetWaitTime();
+	__kernel_timespec timeout = { waittime / 1000, (waittime % 1000) * 1000000 };
+	io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	arg.ts = reinterpret_cast<__u64>(&timeout);
+
+	// If completions were reaped while submitting or notifications are queued
+	// then they are ready to be dispatched so don't block waiting for any more.
+	// The same goes for a backlog which has to be moved into the ring.
+	const unsigned int wait = (reaped.empty() && readylist.empty() && backlog.empty()) ? 1 : 0;
+	if (EnterRing(pending, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0 && errno != ETIME && errno != EINTR)
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "io_uring_enter failed: %s", strerror(errno));
+	ServerInstance->UpdateTime();
+
+	// Copy the completions out of the ring first so handlers are free to queue
+	// new submissions (which may need to enter the kernel) while we dispatch.
+	// Completions which were reaped while submitting come first as they are older.
+	completions.clear();
+	completions.swap(reaped);
+	ReapCompletions(completions);
+
+	// Queued notifications are dispatched in the same way as completions.
+	for (std::vector<int>::const_iterator i = readylist.begin(); i != readylist.end(); ++i)
+	{
+		io[*i].ready = false;
+		io_uring_cqe cqe;
+		memset(&cqe, 0, sizeof(cqe));
+		cqe.user_data = MakeUserData(*i, 0, ReadyData);
+		completions.push_back(cqe);
+	}
+	readylist.clear();
+
+	int dispatched = 0;
+	for (size_t index = 0; index < completions.size(); ++index)
+	{
+		// Completions which have been handled already are marked as ignored.
+		const io_uring_cqe cqe = completions[index];
+		if (cqe.user_data == IgnoreData)
+			continue;
+
+		int fd;
+		int result;
+		if (!(cqe.user_data & (PollData | ReadyData)))
+		{
+			Transfer* const transfer = reinterpret_cast<Transfer*>(cqe.user_data);
+			fd = transfer->fd;
+			result = CompleteTransfer(transfer, cqe);
+			if (!result)
+				continue;
+		}
+		else if (cqe.user_data & ReadyData)
+		{
+			fd = static_cast<int>((cqe.user_data & 0xFFFFFFFF) >> 2);
+			EventHandler* const eh = GetRef(fd);
+			if (!eh || !IsOwned(fd))
+				continue;
+
+			result = GetReadyEvents(io[fd], eh->GetEventMask());
+			if (!result)
+				continue;
+		}
+		else
+		{
+			fd = static_cast<int>((cqe.user_data & 0xFFFFFFFF) >> 2);
+			const __u32 generation = static_cast<__u32>(cqe.user_data >> 32);
+			if (static_cast<size_t>(fd) >= polls.size() || polls[fd].generation != generation)
+			{
+				// The request has been replaced since this completion was posted. If it is
+				// still armed then the removal raced with it so try again.
+				if (cqe.flags & IORING_CQE_F_MORE)
+					PrepPollRemove(cqe.user_data);
+				continue;
+			}
+
+			if (!GetRef(fd))
+				continue;
+
+			if (!(cqe.flags & IORING_CQE_F_MORE))
+				polls[fd].armed = false;
+
+			if (cqe.res == -ECANCELED)
+			{
+				// The kernel terminated the request (e.g. because the completion ring
+				// overflowed) without us asking it to so just rearm it.
+				ArmPoll(fd, polls[fd].key);
+				continue;
+			}
+			result = cqe.res;
+		}
+
+		EventHandler* const eh = GetRef(fd);
+		if (!eh)
+			continue;
+
+		dispatched++;
+		if (result < 0)
+		{
+			stats.ErrorEvents++;
+			eh->OnEventHandlerError(-result);
+			continue;
+		}
+
+		const unsigned res = result;
+		if (res & POLLHUP)
+		{
+			stats.ErrorEvents++;
+			eh->OnEventHandlerError(0);
+			continue;
+		}
+
+		if (res & POLLERR)
+		{
+			stats.ErrorEvents++;
+			/* Get error number */
+			socklen_t codesize = sizeof(int);
+			int errcode;
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &errcode, &codesize) < 0)
+				errcode = errno;
+			eh->OnEventHandlerError(errcode);
+			continue;
+		}
+
+		int mask = eh->GetEventMask();
+		if (res & POLLIN)
+			mask &= ~FD_READ_WILL_BLOCK;
+		if (res & POLLOUT)
+		{
+			mask &= ~FD_WRITE_WILL_BLOCK;
+			if (mask & FD_WANT_SINGLE_WRITE)
+			{
+				int nm = mask & ~FD_WANT_SINGLE_WRITE;
+				OnSetEvent(eh, mask, nm);
+				mask = nm;
+			}
+		}
+		eh->SetEventMask(mask);
+		if (res & POLLIN)
+		{
+			eh->OnEventHandlerRead();
+			if (eh != GetRef(fd))
+				// whoa! we got deleted, better not give out the write event
+				continue;
+		}
+		if (res & POLLOUT)
+		{
+			eh->OnEventHandlerWrite();
+		}
+
+		if (GetRef(fd) != eh)
+			continue;
+
+		// One-shot requests need to be rearmed if the handler did not change its
+		// event mask (which would have rearmed it already).
+		if (!polls[fd].armed)
+			ArmPoll(fd, GetPollKey(fd, eh->GetEventMask()));
+
+		// Level-triggered handlers have to be told again about events which are
+		// still ready on sockets which the engine performs I/O on.
+		mask = eh->GetEventMask();
+		if (IsOwned(fd) && (mask & (FD_WANT_POLL_READ | FD_WANT_POLL_WRITE | FD_WANT_SINGLE_WRITE)) && GetReadyEvents(io[fd], mask))
+			QueueReady(fd);
+	}
+
+	stats.TotalEvents += dispatched;
+	return dispatched;
+}
+
+int SocketEngine::Recv(EventHandler* eh, void* buf, size_t len, int flags)
+{
+	const int fd = eh->GetFd();
+	if (!IsOwned(fd))
+	{
+		int nbRecvd = recv(fd, (char*)buf, len, flags);
+
+		// Data has been received so the socket is connected and the engine can
+		// take over reading from it.
+		if (nbRecvd > 0 && !flags && HandleIO)
+			TakeIO(eh);
+
+		stats.UpdateReadCounters(nbRecvd);
+		return nbRecvd;
+	}
+
+	IOState& state = io[fd];
+	int nbRecvd;
+	if (!state.received.empty())
+	{
+		nbRecvd = static_cast<int>(std::min(len, state.received.size()));
+		memcpy(buf, state.received.data(), nbRecvd);
+		if (static_cast<size_t>(nbRecvd) == state.received.size())
+			std::string().swap(state.received);
+		else
+			state.received.erase(0, nbRecvd);
+	}
+	else if (state.readerror)
+	{
+		errno = state.readerror;
+		nbRecvd = -1;
+	}
+	else if (state.eof)
+	{
+		nbRecvd = 0;
+	}
+	else
+	{
+		errno = EAGAIN;
+		nbRecvd = -1;
+	}
+
+	StartRecv(fd);
+	stats.UpdateReadCounters(nbRecvd);
+	return nbRecvd;
+}
+
+int SocketEngine::Send(EventHandler* eh, const void* buf, size_t len, int flags)
+{
+	const int fd = eh->GetFd();
+	int nbSent;
+	if (IsOwned(fd) && IsSending(io[fd]))
+	{
+		// Writing directly now would overtake the data which the engine is sending.
+		errno = io[fd].writeerror ? io[fd].writeerror : EAGAIN;
+		nbSent = -1;
+	}
+	else
+	{
+		nbSent = send(fd, (const char*)buf, len, flags);
+		if (nbSent > 0 && !flags && HandleIO)
+			TakeIO(eh);
+	}
+
+	stats.UpdateWriteCounters(nbSent);
+	return nbSent;
+}
+
+int SocketEngine::WriteV(EventHandler* eh, const IOVector* iovec, int count)
+{
+	const int fd = eh->GetFd();
+	int sent;
+	if (IsOwned(fd) && IsSending(io[fd]))
+	{
+		// Writing directly now would overtake the data which the engine is sending.
+		errno = io[fd].writeerror ? io[fd].writeerror : EAGAIN;
+		sent = -1;
+	}
+	else
+	{
+		sent = writev(fd, iovec, count);
+		if (sent > 0 && HandleIO)
+			TakeIO(eh);
+	}
+
+	stats.UpdateWriteCounters(sent);
+	return sent;
+}
+
+int SocketEngine::WriteBuffers(EventHandler* eh, BufferIterator begin, BufferIterator end)
+{
+	const int fd = eh->GetFd();
+	if (!IsOwned(fd))
+	{
+		IOVector iovecs[128];
+		int count = 0;
+		for (; begin != end && count < 128; ++begin, ++count)
+		{
+			iovecs[count].iov_base = const_cast<char*>(begin->data());
+			iovecs[count].iov_len = begin->length();
+		}
+		return WriteV(eh, iovecs, count);
+	}
+
+	// Keep a reference to the buffers and send them along with the next wait.
+	IOState& state = io[fd];
+	int accepted = 0;
+	for (; begin != end && CanWrite(state); ++begin)
+	{
+		if (begin->empty())
+			continue;
+
+		state.pending.push_back(*begin);
+		state.pendingbytes += begin->length();
+		accepted += begin->length();
+	}
+
+	if (!accepted)
+	{
+		errno = state.writeerror ? state.writeerror : EAGAIN;
+		accepted = -1;
+	}
+	else if (!state.flushing)
+	{
+		state.flushing = true;
+		flushlist.push_back(fd);
+	}
+
+	stats.UpdateWriteCounters(accepted);
+	return accepted;
+}
+
+size_t SocketEngine::GetQueuedBytes(const EventHandler* eh)
+{
+	const int fd = eh->GetFd();
+	return IsOwned(fd) ? GetQueuedSize(io[fd]) : 0;
+}
+
+int SocketEngine::Shutdown(EventHandler* eh, int how)
+{
+	const int fd = eh->GetFd();
+	if (IsOwned(fd) && IsSending(io[fd]))
+	{
+		// The data which has been written has to reach the socket before it is
+		// shut down for writing. The connection is closed once the data has been
+		// sent and the descriptor has been closed.
+		if (how == SHUT_WR)
+			return 0;
+		if (how == SHUT_RDWR)
+			how = SHUT_RD;
+	}
+	return shutdown(fd, how);
+}
+
+SocketEngine::ReleaseResult SocketEngine::ReleaseIO(EventHandler* eh)
+{
+	const int fd = eh->GetFd();
+	if (!HandleIO || fd < 0)
+		return RELEASE_DONE;
+
+	IOState& state = GetIO(fd);
+	if (!state.owned)
+	{
+		state.mode = IO_NEVER;
+		return RELEASE_DONE;
+	}
+
+	if (state.refused)
+		return RELEASE_REFUSED;
+
+	if (!state.releasing)
+	{
+		// Stop receiving. Once the transfers in flight have finished the engine knows
+		// whether it holds data which the new owner would never see and the handler is
+		// sent a read event so it can call this again to find out.
+		state.releasing = true;
+		state.mode = IO_NEVER;
+		StartSend(fd);
+		if (state.recv && !state.recv->cancelled)
+			PrepCancel(state.recv);
+	}
+
+	if (state.recv || state.send)
+		return RELEASE_PENDING;
+
+	return FinishRelease(fd) ? RELEASE_DONE : RELEASE_REFUSED;
+}
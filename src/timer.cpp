@@ -22,18 +22,41 @@
 
 #include "inspircd.h"
 
+namespace
+{
+	/** Retrieves the current time in milliseconds. */
+	uint64_t NowMS()
+	{
+		return static_cast<uint64_t>(ServerInstance->Time()) * 1000 + ServerInstance->Time_ns() / 1000000;
+	}
+}
+
 void Timer::SetInterval(unsigned int newinterval)
 {
 	ServerInstance->Timers.DelTimer(this);
 	secs = newinterval;
+	msecs = 0;
 	SetTrigger(ServerInstance->Time() + newinterval);
 	ServerInstance->Timers.AddTimer(this);
 }
 
+void Timer::SetIntervalMS(unsigned int newinterval)
+{
+	ServerInstance->Timers.DelTimer(this);
+	secs = newinterval / 1000;
+	msecs = newinterval;
+	expiry = NowMS() + newinterval;
+	trigger = expiry / 1000;
+	ServerInstance->Timers.AddTimer(this);
+}
+
 Timer::Timer(unsigned int secs_from_now, bool repeating)
 	: trigger(ServerInstance->Time() + secs_from_now)
 	, secs(secs_from_now)
+	, msecs(0)
 	, repeat(repeating)
+	, expiry(static_cast<uint64_t>(trigger) * 1000)
+	, slot(NULL)
 {
 }
 
@@ -42,42 +65,268 @@ Timer::~Timer()
 	ServerInstance->Timers.DelTimer(this);
 }
 
-void TimerManager::TickTimers(time_t TIME)
+TimerManager::TimerManager()
+	: nearcount(0)
+	, total(0)
+	, precise(0)
+	, current(0)
 {
-	for (TimerMap::iterator i = Timers.begin(); i != Timers.end(); )
+}
+
+bool TimerManager::IsNear(const TimerList* list) const
+{
+	std::less<const TimerList*> before;
+	return !before(list, nearwheel) && before(list, nearwheel + (1 << NearBits));
+}
+
+void TimerManager::Schedule(Timer* t)
+{
+	// Timers which are already due go into the next slot to be processed.
+	uint64_t expiry = std::max(t->expiry, current);
+	uint64_t delta = expiry - current;
+
+	TimerList* list;
+	if (delta < (1 << NearBits))
 	{
-		Timer* t = i->second;
-		if (t->GetTrigger() > TIME)
-			break;
+		list = &nearwheel[expiry & ((1 << NearBits) - 1)];
+		nearcount++;
+	}
+	else
+	{
+		// Timers due further away than the wheels reach are put in the last slot and
+		// rescheduled when it is reached.
+		const uint64_t maxdelta = static_cast<uint64_t>(1) << (NearBits + FarBits * FarLevels);
+		if (delta >= maxdelta)
+		{
+			delta = maxdelta - 1;
+			expiry = current + delta;
+		}
 
-		Timers.erase(i++);
+		unsigned int level = 0;
+		while (delta >= (static_cast<uint64_t>(1) << (NearBits + FarBits * (level + 1))))
+			level++;
+
+		list = &farwheels[level][(expiry >> (NearBits + FarBits * level)) & ((1 << FarBits) - 1)];
+	}
+
+	list->push_back(t);
+	t->slot = list;
+}
+
+void TimerManager::Cascade(unsigned int level, unsigned int index)
+{
+	TimerList& list = farwheels[level][index];
+	while (!list.empty())
+	{
+		Timer* t = list.front();
+		list.pop_front();
+		Schedule(t);
+	}
+}
+
+void TimerManager::Expire(TimerList& list, uint64_t tick, time_t TIME)
+{
+	// Move the timers out of the slot first so that timers which are added
+	// while ticking are left for the next slot instead of being processed now.
+	TimerList due;
+	while (!list.empty())
+	{
+		Timer* t = list.front();
+		list.pop_front();
+		due.push_back(t);
+		t->slot = &due;
+		nearcount--;
+	}
+
+	while (!due.empty())
+	{
+		Timer* t = due.front();
+		due.pop_front();
+		t->slot = NULL;
+		total--;
+		if (t->msecs)
+			precise--;
+
+		// The timer is not due yet if it was put in a far away slot or its trigger has
+		// been moved with SetTrigger() since it was added.
+		if (t->expiry > tick)
+		{
+			AddTimer(t);
+			continue;
+		}
 
 		if (!t->Tick(TIME))
 			continue;
 
-		if (t->GetRepeat())
+		// Skip timers which have added themselves again (e.g. by calling SetInterval()).
+		if (t->GetRepeat() && !t->slot)
 		{
-			t->SetTrigger(TIME + t->GetInterval());
+			if (t->msecs)
+			{
+				t->expiry = tick + t->msecs;
+				t->trigger = t->expiry / 1000;
+			}
+			else
+			{
+				t->SetTrigger(TIME + t->GetInterval());
+			}
 			AddTimer(t);
 		}
 	}
 }
 
-void TimerManager::DelTimer(Timer* t)
+void TimerManager::Rebase(uint64_t now)
+{
+	// Take every timer out of the wheels before scheduling any of them again as
+	// they may go into slots which have not been emptied yet.
+	TimerList all;
+	for (unsigned int i = 0; i < (1 << NearBits); ++i)
+	{
+		while (!nearwheel[i].empty())
+		{
+			Timer* t = nearwheel[i].front();
+			nearwheel[i].pop_front();
+			all.push_back(t);
+			t->slot = &all;
+		}
+	}
+
+	for (unsigned int level = 0; level < FarLevels; ++level)
+	{
+		for (unsigned int i = 0; i < (1 << FarBits); ++i)
+		{
+			while (!farwheels[level][i].empty())
+			{
+				Timer* t = farwheels[level][i].front();
+				farwheels[level][i].pop_front();
+				all.push_back(t);
+				t->slot = &all;
+			}
+		}
+	}
+
+	// Move every timer back by as much as the clock so they are still due after
+	// the same delay instead of waiting for the clock to catch up again.
+	const uint64_t shift = current - now;
+	current = now;
+	nearcount = 0;
+	while (!all.empty())
+	{
+		Timer* t = all.front();
+		all.pop_front();
+		if (t->msecs)
+		{
+			t->expiry = t->expiry > shift ? t->expiry - shift : 0;
+			t->trigger = t->expiry / 1000;
+		}
+		else
+		{
+			t->SetTrigger(t->trigger - static_cast<time_t>(shift / 1000));
+		}
+		Schedule(t);
+	}
+}
+
+void TimerManager::TickTimers(time_t TIME)
 {
-	std::pair<TimerMap::iterator, TimerMap::iterator> itpair = Timers.equal_range(t->GetTrigger());
+	const uint64_t now = static_cast<uint64_t>(TIME) * 1000 + ServerInstance->Time_ns() / 1000000;
+
+	// Nothing would be due until the clock caught up again if it has jumped backwards.
+	if (now + 1 < current)
+		Rebase(now);
 
-	for (TimerMap::iterator i = itpair.first; i != itpair.second; ++i)
+	while (current <= now)
 	{
-		if (i->second == t)
+		if (!total)
 		{
-			Timers.erase(i);
+			current = now + 1;
 			break;
 		}
+
+		const unsigned int index = current & ((1 << NearBits) - 1);
+		if (!index)
+		{
+			// The near wheel has wrapped around so move the timers which are due
+			// in the next rotation down from the far wheels.
+			for (unsigned int level = 0; level < FarLevels; ++level)
+			{
+				const unsigned int farindex = (current >> (NearBits + FarBits * level)) & ((1 << FarBits) - 1);
+				Cascade(level, farindex);
+				if (farindex)
+					break;
+			}
+		}
+		else if (!nearcount)
+		{
+			// Nothing can become due until the near wheel wraps around.
+			current = std::min(current - index + (1 << NearBits), now + 1);
+			continue;
+		}
+
+		const uint64_t tick = current++;
+		if (!nearwheel[index].empty())
+			Expire(nearwheel[index], tick, TIME);
 	}
 }
 
+void TimerManager::DelTimer(Timer* t)
+{
+	if (!t->slot)
+		return;
+
+	if (IsNear(t->slot))
+		nearcount--;
+
+	t->slot->erase(t);
+	t->slot = NULL;
+	total--;
+	if (t->msecs)
+		precise--;
+}
+
 void TimerManager::AddTimer(Timer* t)
 {
-	Timers.insert(std::make_pair(t->GetTrigger(), t));
+	// Adding a timer which is already scheduled reschedules it.
+	DelTimer(t);
+
+	// Nothing has been processed while there were no timers so start from now. If
+	// the clock has jumped backwards then the timer would be treated as already due.
+	const uint64_t now = NowMS();
+	if (!total)
+		current = now;
+	else if (now + 1 < current)
+		Rebase(now);
+
+	Schedule(t);
+	total++;
+	if (t->msecs)
+		precise++;
+}
+
+int TimerManager::GetWaitTime() const
+{
+	if (!precise)
+		return 1000;
+
+	// Find the next slot of the near wheel with timers in it. If there is none then
+	// the wheel needs to be woken up to move timers down when it wraps around.
+	const unsigned int index = current & ((1 << NearBits) - 1);
+	uint64_t next = current - index + (1 << NearBits);
+	if (nearcount)
+	{
+		for (unsigned int i = index; i < (1 << NearBits); ++i)
+		{
+			if (!nearwheel[i].empty())
+			{
+				next = current - index + i;
+				break;
+			}
+		}
+	}
+
+	const uint64_t now = NowMS();
+	if (next <= now)
+		return 0;
+
+	return static_cast<int>(std::min<uint64_t>(next - now, 1000));
 }
@@ -111,6 +111,7 @@ namespace
 
 UserManager::UserManager()
 	: already_sent_id(0)
+	, lastbackground(0)
 	, unregistered_count(0)
 	, uline_count(0)
 {
@@ -136,6 +137,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 	this->clientlist[New->nick] = New;
 	this->AddClone(New);
 	this->local_users.push_front(New);
+	this->ScheduleBackground(New, ServerInstance->Time() + 1);
 	FOREACH_MOD(OnUserInit, (New));
 
 	if (!SocketEngine::AddFd(eh, FD_WANT_FAST_READ | FD_WANT_EDGE_WRITE))
@@ -301,6 +303,12 @@ void UserManager::QuitUser(User* user, const std::string& quitmessage, const std
 		if (lu->registered == REG_ALL)
 			ServerInstance->SNO->WriteToSnoMask('q',"Client exiting: %s (%s) [%s]", user->GetFullRealHost().c_str(), user->GetIPString().c_str(), operquitmsg.c_str());
 		local_users.erase(lu);
+
+		if (lu->checkslot)
+		{
+			lu->checkslot->erase(lu);
+			lu->checkslot = NULL;
+		}
 	}
 
 	if (!clientlist.erase(user->nick))
@@ -375,17 +383,85 @@ void UserManager::ServerNoticeAll(const char* text, ...)
 
 /**
  * This function is called once a second from the mainloop.
- * It is intended to do background checking on all the users, e.g. do
- * ping checks, registration timeouts, etc.
+ * It is intended to do background checking on the users, e.g. do
+ * ping checks, registration timeouts, etc. Only users whose checks
+ * are due are visited.
  */
 void UserManager::DoBackgroundUserStuff()
 {
-	for (LocalList::iterator i = local_users.begin(); i != local_users.end(); )
+	const uint64_t start = InspIRCd::GetMicroseconds();
+	const time_t now = ServerInstance->Time();
+	unsigned long visited = 0;
+
+	if (now < lastbackground)
 	{
-		// It's possible that we quit the user below due to ping timeout etc. and QuitUser() removes it from the list
-		LocalUser* curr = *i;
-		++i;
+		// The clock has jumped backwards so the times at which the users are due are
+		// meaningless. Check everyone now and let them be rescheduled from the new time.
+		BackgroundList all;
+		for (unsigned int i = 0; i < BackgroundSlots; ++i)
+		{
+			while (!background[i].empty())
+			{
+				LocalUser* user = background[i].front();
+				background[i].pop_front();
+				all.push_front(user);
+				user->checkslot = &all;
+			}
+		}
+
+		lastbackground = now;
+		visited = ProcessBackground(all, now, true);
+	}
+	else
+	{
+		// Run the checks for every second since the last pass. If the clock has jumped
+		// forwards further than the schedule covers then every slot is only run once.
+		const time_t first = std::max(lastbackground + 1, now - static_cast<time_t>(BackgroundSlots) + 1);
+		for (time_t second = first; second <= now; ++second)
+		{
+			lastbackground = second;
+			visited += ProcessBackground(background[second % BackgroundSlots], now, false);
+		}
+	}
+
+	const unsigned long elapsed = InspIRCd::GetMicroseconds() - start;
+	ServerInstance->stats.BackgroundUsers = visited;
+	ServerInstance->stats.BackgroundTime = elapsed;
+	ServerInstance->stats.BackgroundTimeMax = std::max(ServerInstance->stats.BackgroundTimeMax, elapsed);
+}
+
+unsigned long UserManager::ProcessBackground(BackgroundList& list, time_t now, bool force)
+{
+	// Move the users out of the slot first so that users which are rescheduled into
+	// it while their checks run are not checked again in this pass.
+	BackgroundList due;
+	while (!list.empty())
+	{
+		LocalUser* user = list.front();
+		list.pop_front();
+		due.push_front(user);
+		user->checkslot = &due;
+	}
 
+	unsigned long visited = 0;
+	while (!due.empty())
+	{
+		// It's possible that we quit a user below due to ping timeout etc. and QuitUser() removes them from the list
+		LocalUser* curr = due.front();
+		due.pop_front();
+		curr->checkslot = NULL;
+
+		const time_t when = curr->nextcheck;
+		curr->nextcheck = 0;
+
+		// This user is waiting in the slot for a later rotation of the schedule.
+		if (!force && when > now)
+		{
+			ScheduleBackground(curr, when);
+			continue;
+		}
+
+		visited++;
 		if (curr->CommandFloodPenalty || curr->eh.getSendQSize())
 		{
 			unsigned int rate = curr->MyClass->GetCommandRate();
@@ -410,7 +486,36 @@ void UserManager::DoBackgroundUserStuff()
 				CheckRegistrationTimeout(curr);
 				break;
 		}
+
+		if (curr->quitting)
+			continue;
+
+		// Registered users only need to be checked again when it is time to ping them but
+		// unregistered users are checked every second until they finish registering.
+		if (curr->registered == REG_ALL)
+			ScheduleBackground(curr, curr->nextping);
+		else
+			ScheduleBackground(curr, now + 1);
+	}
+	return visited;
+}
+
+void UserManager::ScheduleBackground(LocalUser* user, time_t when)
+{
+	// The checks can not be run in a second which has already been processed.
+	when = std::max(when, lastbackground + 1);
+
+	if (user->checkslot)
+	{
+		if (user->nextcheck <= when)
+			return;
+
+		user->checkslot->erase(user);
 	}
+
+	user->nextcheck = when;
+	user->checkslot = &background[when % BackgroundSlots];
+	user->checkslot->push_front(user);
 }
 
 already_sent_t UserManager::NextAlreadySentId()
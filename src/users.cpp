@@ -66,7 +66,8 @@ std::string User::GetModeLetters(bool includeparams) const
 }
 
 User::User(const std::string& uid, Server* srv, UserType type)
-	: age(ServerInstance->Time())
+	: cachegeneration(0)
+	, age(ServerInstance->Time())
 	, signon(0)
 	, uuid(uid)
 	, server(srv)
@@ -91,8 +92,11 @@ User::User(const std::string& uid, Server* srv, UserType type)
 
 LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* servaddr)
 	: User(ServerInstance->UIDGen.GetUID(), ServerInstance->FakeClient->server, USERTYPE_LOCAL)
+	, nextcheck(0)
+	, checkslot(NULL)
 	, eh(this)
 	, serializer(NULL)
+	, tagprofile(0)
 	, bytes_in(0)
 	, bytes_out(0)
 	, cmds_in(0)
@@ -117,7 +121,10 @@ LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::so
 
 LocalUser::LocalUser(int myfd, const std::string& uid, Serializable::Data& data)
 	: User(uid, ServerInstance->FakeClient->server, USERTYPE_LOCAL)
+	, nextcheck(0)
+	, checkslot(NULL)
 	, eh(this)
+	, tagprofile(0)
 	, already_sent(0)
 {
 	eh.SetFd(myfd);
@@ -247,6 +254,11 @@ void UserIOHandler::OnDataReady()
 	// The position within the recvq of the current character.
 	std::string::size_type qpos;
 
+	// The position within the recvq of the first character of the current line. Lines
+	// are removed from the recvq all at once when we are done as erasing every line
+	// individually would move the rest of the recvq once per line.
+	std::string::size_type start = 0;
+
 	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax)
 	{
 		// Check the newly received data for an EOL.
@@ -254,12 +266,12 @@ void UserIOHandler::OnDataReady()
 		if (eolpos == std::string::npos)
 		{
 			checked_until = recvq.length();
-			return;
+			break;
 		}
 
 		// We've found a line! Clean it up and move it to the line buffer.
-		line.reserve(eolpos);
-		for (qpos = 0; qpos < eolpos; ++qpos)
+		line.reserve(eolpos - start);
+		for (qpos = start; qpos < eolpos; ++qpos)
 		{
 			char c = recvq[qpos];
 			switch (c)
@@ -274,28 +286,53 @@ void UserIOHandler::OnDataReady()
 			line.push_back(c);
 		}
 
-		// just found a newline. Terminate the string, and pull it out of recvq
-		recvq.erase(0, eolpos + 1);
-		checked_until = 0;
+		// just found a newline. Skip past it, it is erased from the recvq later
+		const std::string::size_type linelen = eolpos - start;
+		start = eolpos + 1;
+		checked_until = start;
 
 		// TODO should this be moved to when it was inserted in recvq?
-		ServerInstance->stats.Recv += qpos;
-		user->bytes_in += qpos;
+		ServerInstance->stats.Recv += linelen;
+		user->bytes_in += linelen;
 		user->cmds_in++;
 
 		ServerInstance->Parser.ProcessBuffer(user, line);
 		if (user->quitting)
-			return;
+			break;
 
 		// clear() does not reclaim memory associated with the string, so our .reserve() call is safe
 		line.clear();
 	}
 
+	recvq.erase(0, start);
+	checked_until -= start;
+
+	if (user->quitting)
+		return;
+
 	if (user->CommandFloodPenalty >= penaltymax && !user->MyClass->fakelag)
+	{
 		ServerInstance->Users->QuitUser(user, "Excess Flood");
+		return;
+	}
+
+	// The penalty of the user has to be reduced and any lines which have been held
+	// back because of it have to be processed in the next background pass.
+	if (user->CommandFloodPenalty || checked_until < recvq.length())
+		ServerInstance->Users->ScheduleBackground(user, ServerInstance->Time() + 1);
 }
 
-void UserIOHandler::AddWriteBuf(const std::string &data)
+void UserIOHandler::OnEventHandlerWrite()
+{
+	StreamSocket::OnEventHandlerWrite();
+
+	// Lines which were held back because the sendq was full can be processed as soon
+	// as some of it has been sent instead of waiting for the next background pass.
+	if (!user->quitting && getError().empty() && checked_until < recvq.length())
+		OnDataReady();
+}
+
+void UserIOHandler::AddWriteBuf(const StreamSocket::SendQueue::Element& data)
 {
 	if (user->quitting_sendq)
 		return;
@@ -525,6 +562,9 @@ void LocalUser::CheckClass(bool clone_count)
 	}
 
 	this->nextping = ServerInstance->Time() + a->GetPingTime();
+
+	// The ping time of the new class may be shorter than the one of the old class.
+	ServerInstance->Users->ScheduleBackground(this, nextping);
 }
 
 bool LocalUser::CheckLines(bool doZline)
@@ -596,6 +636,7 @@ void User::InvalidateCache()
 	cached_hostip.clear();
 	cached_makehost.clear();
 	cached_fullrealhost.clear();
+	cachegeneration++;
 }
 
 bool User::ChangeNick(const std::string& newnick, time_t newts)
@@ -786,11 +827,9 @@ void LocalUser::Write(const ClientProtocol::SerializedMessage& text)
 		if (text.empty())
 			return;
 
-		std::string::size_type nlpos = text.find_first_of("\r\n", 0, 2);
-		if (nlpos == std::string::npos)
-			nlpos = text.length(); // TODO is this ok, test it
-
-		ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int) nlpos, text.c_str());
+		static const char newline[] = "\r\n";
+		const char* nlpos = std::find_first_of(text.begin(), text.end(), newline, newline + 2);
+		ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int) (nlpos - text.begin()), text.data());
 	}
 
 	eh.AddWriteBuf(text);
@@ -987,8 +1026,9 @@ bool User::ChangeRealName(const std::string& real)
 		FIRST_MOD_RESULT(OnPreChangeRealName, MOD_RESULT, (IS_LOCAL(this), real));
 		if (MOD_RESULT == MOD_RES_DENY)
 			return false;
-		FOREACH_MOD(OnChangeRealName, (this, real));
 	}
+
+	FOREACH_MOD(OnChangeRealName, (this, real));
 	this->realname.assign(real, 0, ServerInstance->Config->Limits.MaxReal);
 
 	return true;
@@ -1073,31 +1113,59 @@ bool User::ChangeIdent(const std::string& newident)
 void LocalUser::SetClass(const std::string &explicit_name)
 {
 	ConnectClass *found = NULL;
+	const uint64_t start = InspIRCd::GetMicroseconds();
 
 	ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "Setting connect class for UID %s", this->uuid.c_str());
 
 	if (!explicit_name.empty())
 	{
-		for (ServerConfig::ClassVector::const_iterator i = ServerInstance->Config->Classes.begin(); i != ServerInstance->Config->Classes.end(); ++i)
-		{
-			ConnectClass* c = *i;
-
-			if (explicit_name == c->name)
-			{
-				ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "Explicitly set to %s", explicit_name.c_str());
-				found = c;
-			}
-		}
+		found = ServerInstance->Config->ClassIndex.Find(explicit_name, ServerInstance->Config->Classes);
+		if (found)
+			ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "Explicitly set to %s", explicit_name.c_str());
 	}
 	else
 	{
-		for (ServerConfig::ClassVector::const_iterator i = ServerInstance->Config->Classes.begin(); i != ServerInstance->Config->Classes.end(); ++i)
+		// The candidates are the classes which allow the host and port of the user.
+		std::vector<ConnectClass*> candidates;
+		ServerInstance->Config->ClassIndex.Find(this, ServerInstance->Config->Classes, candidates);
+
+		// Modules which implement OnForceConnectClass can force any class (including named
+		// classes and ones which the user is not allowed into) so if one is loaded every
+		// class is offered to them. Otherwise only the candidates need to be checked.
+		std::vector<ConnectClass*> classes;
+		const bool checkall = !ServerInstance->Modules->EventHandlers[I_OnForceConnectClass].empty();
+		if (checkall)
+			classes.assign(ServerInstance->Config->Classes.begin(), ServerInstance->Config->Classes.end());
+		else
+			classes.swap(candidates);
+
+		// Both lists are in configuration order so they can be walked side by side.
+		std::vector<ConnectClass*>::const_iterator candidate = candidates.begin();
+		for (std::vector<ConnectClass*>::const_iterator i = classes.begin(); i != classes.end(); ++i)
 		{
 			ConnectClass* c = *i;
 			ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "Checking %s", c->GetName().c_str());
 
 			ModResult MOD_RESULT;
-			FIRST_MOD_RESULT(OnSetConnectClass, MOD_RESULT, (this,c));
+			if (checkall)
+			{
+				FIRST_MOD_RESULT(OnForceConnectClass, MOD_RESULT, (this,c));
+				if (MOD_RESULT == MOD_RES_ALLOW)
+				{
+					ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "Class forced by module to %s", c->GetName().c_str());
+					found = c;
+					break;
+				}
+
+				if ((candidate == candidates.end()) || (*candidate != c))
+				{
+					ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "No host or port match (for %s)", c->GetHost().c_str());
+					continue;
+				}
+				++candidate;
+			}
+
+			FIRST_MOD_RESULT(OnCheckConnectClass, MOD_RESULT, (this,c));
 			if (MOD_RESULT == MOD_RES_DENY)
 				continue;
 			if (MOD_RESULT == MOD_RES_ALLOW)
@@ -1107,21 +1175,10 @@ void LocalUser::SetClass(const std::string &explicit_name)
 				break;
 			}
 
-			if (c->type == CC_NAMED)
-				continue;
-
 			bool regdone = (registered != REG_NONE);
 			if (c->config->getBool("registered", regdone) != regdone)
 				continue;
 
-			/* check if host matches.. */
-			if (!InspIRCd::MatchCIDR(this->GetIPString(), c->GetHost(), NULL) &&
-			    !InspIRCd::MatchCIDR(this->GetRealHost(), c->GetHost(), NULL))
-			{
-				ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "No host match (for %s)", c->GetHost().c_str());
-				continue;
-			}
-
 			/*
 			 * deny change if change will take class over the limit check it HERE, not after we found a matching class,
 			 * because we should attempt to find another class if this one doesn't match us. -- w00t
@@ -1132,17 +1189,6 @@ void LocalUser::SetClass(const std::string &explicit_name)
 				continue;
 			}
 
-			/* if it requires a port ... */
-			if (!c->ports.empty())
-			{
-				/* and our port doesn't match, fail. */
-				if (!c->ports.count(this->server_sa.port()))
-				{
-					ServerInstance->Logs->Log("CONNECTCLASS", LOG_DEBUG, "Requires a different port, skipping");
-					continue;
-				}
-			}
-
 			if (regdone && !c->config->getString("password").empty())
 			{
 				if (!ServerInstance->PassCompare(this, c->config->getString("password"), password, c->config->getString("hash")))
@@ -1158,6 +1204,12 @@ void LocalUser::SetClass(const std::string &explicit_name)
 		}
 	}
 
+	const unsigned long elapsed = InspIRCd::GetMicroseconds() - start;
+	ServerInstance->stats.ClassSelections++;
+	ServerInstance->stats.ClassSelectionTime += elapsed;
+	if (elapsed > ServerInstance->stats.ClassSelectionTimeMax)
+		ServerInstance->stats.ClassSelectionTimeMax = elapsed;
+
 	/*
 	 * Okay, assuming we found a class that matches.. switch us into that class, keeping refcounts up to date.
 	 */
@@ -20,55 +20,11 @@
 
 
 #include "inspircd.h"
+#include "wildcard.h"
 
 static bool MatchInternal(const unsigned char* str, const unsigned char* mask, unsigned const char* map)
 {
-	unsigned char* cp = NULL;
-	unsigned char* mp = NULL;
-	unsigned char* string = (unsigned char*)str;
-	unsigned char* wild = (unsigned char*)mask;
-
-	while ((*string) && (*wild != '*'))
-	{
-		if ((map[*wild] != map[*string]) && (*wild != '?'))
-		{
-			return 0;
-		}
-		wild++;
-		string++;
-	}
-
-	while (*string)
-	{
-		if (*wild == '*')
-		{
-			if (!*++wild)
-			{
-				return 1;
-			}
-			mp = wild;
-			cp = string+1;
-		}
-		else
-			if ((map[*wild] == map[*string]) || (*wild == '?'))
-			{
-				wild++;
-				string++;
-			}
-			else
-			{
-				wild = mp;
-				string = cp++;
-			}
-
-	}
-
-	while (*wild == '*')
-	{
-		wild++;
-	}
-
-	return !*wild;
+	return insp::wildcard_mask::match_reference(str, mask, map);
 }
 
 // Below here is all wrappers around MatchInternal
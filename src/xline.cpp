@@ -136,6 +136,151 @@ class ZLineFactory : public XLineFactory
  *  bans. :)
  */
 
+namespace
+{
+	/** Folds a host mask into the form it is stored in the index with. */
+	std::string FoldHost(const std::string& host)
+	{
+		std::string folded(host);
+		for (std::string::iterator i = folded.begin(); i != folded.end(); ++i)
+			*i = ascii_case_insensitive_map[static_cast<unsigned char>(*i)];
+		return folded;
+	}
+
+	/** Finds the first line in a range of lines which matches a user.
+	 * @param first The start of the range of lines to search.
+	 * @param last The end of the range of lines to search.
+	 * @param user The user to match against.
+	 * @param expired If non-NULL then the masks of expired lines are added to this.
+	 * @return The matching line or NULL if there is no match.
+	 */
+	template <typename Iterator>
+	XLine* FindMatch(Iterator first, Iterator last, User* user, std::vector<std::string>* expired)
+	{
+		const time_t current = ServerInstance->Time();
+		for (; first != last; ++first)
+		{
+			XLine* line = first->second;
+			if (line->duration && current > line->expiry)
+			{
+				if (expired)
+					expired->push_back(line->Displayable());
+				continue;
+			}
+
+			if (line->Matches(user))
+				return line;
+		}
+		return NULL;
+	}
+
+	/** The sequence number to give to the next line which is added to an index. This
+	 * is shared between all indexes so lines of different types can be ordered too.
+	 */
+	unsigned long nextsequence = 0;
+}
+
+void XLineIndex::Add(XLine* line)
+{
+	const Entry entry(nextsequence++, line);
+	sequences[line] = entry.first;
+
+	const std::string* mask = line->GetHostMask();
+	if (mask && mask->find_first_of("*?") == std::string::npos)
+	{
+		if (!irc::sockets::IsCIDRMask(*mask))
+		{
+			hosts.insert(std::make_pair(FoldHost(*mask), entry));
+			return;
+		}
+
+		if (ranges.add(irc::sockets::cidr_mask(*mask), entry))
+			return;
+	}
+
+	unindexed.insert(entry);
+}
+
+void XLineIndex::Remove(XLine* line)
+{
+	SequenceMap::iterator sequence = sequences.find(line);
+	if (sequence == sequences.end())
+		return;
+
+	const Entry entry(sequence->second, line);
+	sequences.erase(sequence);
+
+	const std::string* mask = line->GetHostMask();
+	if (mask && mask->find_first_of("*?") == std::string::npos)
+	{
+		if (!irc::sockets::IsCIDRMask(*mask))
+		{
+			std::pair<HostMap::iterator, HostMap::iterator> entries = hosts.equal_range(FoldHost(*mask));
+			for (HostMap::iterator i = entries.first; i != entries.second; ++i)
+			{
+				if (i->second == entry)
+				{
+					hosts.erase(i);
+					return;
+				}
+			}
+		}
+		else if (ranges.remove(irc::sockets::cidr_mask(*mask), entry))
+			return;
+	}
+
+	unindexed.erase(entry);
+}
+
+void XLineIndex::Find(User* user, EntryList& lines) const
+{
+	const std::string& realhost = user->GetRealHost();
+	const std::string& ipaddr = user->GetIPString();
+	const bool hostisip = (realhost == ipaddr);
+
+	EntryList found;
+	if (!hosts.empty())
+	{
+		std::pair<HostMap::const_iterator, HostMap::const_iterator> entries = hosts.equal_range(FoldHost(realhost));
+		for (HostMap::const_iterator i = entries.first; i != entries.second; ++i)
+			found.push_back(i->second);
+
+		if (!hostisip)
+		{
+			entries = hosts.equal_range(FoldHost(ipaddr));
+			for (HostMap::const_iterator i = entries.first; i != entries.second; ++i)
+				found.push_back(i->second);
+		}
+	}
+
+	if (!ranges.empty())
+	{
+		ranges.find(user->client_sa, found);
+
+		// The real hostname is also matched against ranges if it is an IP address.
+		irc::sockets::sockaddrs addr;
+		if (!hostisip && irc::sockets::aptosa(realhost, 0, addr))
+			ranges.find(addr, found);
+	}
+
+	// A line can be found twice if it matches both the IP address and the hostname.
+	std::sort(found.begin(), found.end());
+	found.erase(std::unique(found.begin(), found.end()), found.end());
+
+	// Interleave the indexed lines with the unindexed ones so that the lines are
+	// checked in the same order as if every line was checked one by one.
+	const size_t size = lines.size();
+	lines.resize(size + found.size() + unindexed.size());
+	std::merge(found.begin(), found.end(), unindexed.begin(), unindexed.end(), lines.begin() + size);
+}
+
+XLine* XLineManager::FindLine(const XLineIndex& index, User* user, std::vector<std::string>* expired)
+{
+	XLineIndex::EntryList lines;
+	index.Find(user, lines);
+	return FindMatch(lines.begin(), lines.end(), user, expired);
+}
+
 bool XLine::Matches(User *u)
 {
 	return false;
@@ -156,26 +301,13 @@ void XLineManager::CheckELines()
 	if (ELines.empty())
 		return;
 
+	// This does not expire lines as it is called when an E-line is unset.
+	const XLineIndex& index = line_indexes["E"];
 	const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
 	for (UserManager::LocalList::const_iterator u2 = list.begin(); u2 != list.end(); u2++)
 	{
 		LocalUser* u = *u2;
-		u->exempt = false;
-
-		/* This uses safe iteration to ensure that if a line expires here, it doenst trash the iterator */
-		LookupIter safei;
-
-		for (LookupIter i = ELines.begin(); i != ELines.end(); )
-		{
-			safei = i;
-			safei++;
-
-			XLine *e = i->second;
-			if ((!e->duration || ServerInstance->Time() < e->expiry) && e->Matches(u))
-				u->exempt = true;
-
-			i = safei;
-		}
+		u->exempt = (FindLine(index, u, NULL) != NULL);
 	}
 }
 
@@ -304,6 +436,7 @@ bool XLineManager::AddLine(XLine* line, User* user)
 		pending_lines.push_back(line);
 
 	lookup_lines[line->type][line->Displayable()] = line;
+	line_indexes[line->type].Add(line);
 	line->OnAdd();
 
 	FOREACH_MOD(OnAddLine, (user, line));
@@ -334,6 +467,7 @@ bool XLineManager::DelLine(const char* hostmask, const std::string& type, std::s
 
 	FOREACH_MOD(OnDelLine, (user, y->second));
 
+	line_indexes[type].Remove(y->second);
 	y->second->Unset();
 
 	stdalgo::erase(pending_lines, y->second);
@@ -359,31 +493,20 @@ XLine* XLineManager::MatchesLine(const std::string &type, User* user)
 	if (x == lookup_lines.end())
 		return NULL;
 
-	const time_t current = ServerInstance->Time();
-
-	LookupIter safei;
+	std::vector<std::string> expired;
+	XLine* line = FindLine(line_indexes[type], user, &expired);
 
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
+	// Expiring a line can expire others (e.g. via CheckELines) so they are
+	// looked up again by their mask instead of being expired while searching.
+	const time_t current = ServerInstance->Time();
+	for (std::vector<std::string>::const_iterator i = expired.begin(); i != expired.end(); ++i)
 	{
-		safei = i;
-		safei++;
-
-		if (i->second->duration && current > i->second->expiry)
-		{
-			/* Expire the line, proceed to next one */
-			ExpireLine(x, i);
-			i = safei;
-			continue;
-		}
-
-		if (i->second->Matches(user))
-		{
-			return i->second;
-		}
-
-		i = safei;
+		LookupIter item = x->second.find(*i);
+		if (item != x->second.end() && item->second->duration && current > item->second->expiry)
+			ExpireLine(x, item);
 	}
-	return NULL;
+
+	return line;
 }
 
 XLine* XLineManager::MatchesLine(const std::string &type, const std::string &pattern)
@@ -429,6 +552,7 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item, bool sil
 	if (!silent)
 		item->second->DisplayExpiry();
 
+	line_indexes[container->first].Remove(item->second);
 	item->second->Unset();
 
 	/* TODO: Can we skip this loop by having a 'pending' field in the XLine class, which is set when a line
@@ -445,6 +569,15 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item, bool sil
 // applies lines, removing clients and changing nicks etc as applicable
 void XLineManager::ApplyLines()
 {
+	if (pending_lines.empty())
+		return;
+
+	// Index the pending lines so that users are only checked against the ones which can match them.
+	std::map<std::string, XLineIndex> indexes;
+	for (std::vector<XLine*>::const_iterator i = pending_lines.begin(); i != pending_lines.end(); ++i)
+		indexes[(*i)->type].Add(*i);
+
+	XLineIndex::EntryList lines;
 	const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
 	for (UserManager::LocalList::const_iterator j = list.begin(); j != list.end(); )
 	{
@@ -454,9 +587,18 @@ void XLineManager::ApplyLines()
 		if (u->exempt)
 			continue;
 
-		for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
+		lines.clear();
+		for (std::map<std::string, XLineIndex>::const_iterator i = indexes.begin(); i != indexes.end(); ++i)
+		{
+			const size_t middle = lines.size();
+			i->second.Find(u, lines);
+			std::inplace_merge(lines.begin(), lines.begin() + middle, lines.end());
+		}
+
+		// The lines are applied in the order they were added in.
+		for (XLineIndex::EntryList::const_iterator i = lines.begin(); i != lines.end(); ++i)
 		{
-			XLine *x = *i;
+			XLine *x = i->second;
 			if (x->Matches(u))
 			{
 				x->Apply(u);
@@ -0,0 +1,297 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/* Compares matching a generated list of filters one at a time with matching them
+ * all at once using a wildcard_set on a generated corpus of messages and checks
+ * that they always agree. Build it from the main source directory with:
+ *
+ *   c++ -O2 -Iinclude -o filter-benchmark tools/filter-benchmark.cpp
+ *
+ * Add -DINSP_BENCHMARK_RE2 -std=c++11 -lre2 to also compare the same filters as
+ * regexes matched with RE2 one at a time and with an RE2::Set and a FilteredRE2
+ * whose atoms are found with a literal_set.
+ */
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include "wildcardset.h"
+
+#ifdef INSP_BENCHMARK_RE2
+# include <re2/re2.h>
+# include <re2/filtered_re2.h>
+# include <re2/set.h>
+#endif
+
+namespace
+{
+	unsigned char ascii_map[256];
+
+	const char* const words[] = {
+		"the", "a", "channel", "server", "hello", "anyone", "know", "how", "to", "fix",
+		"this", "error", "when", "compiling", "module", "config", "thanks", "please",
+		"help", "link", "network", "nick", "why", "does", "it", "not", "work", "lol",
+		"yes", "no", "maybe", "tomorrow", "today", "release", "version", "build"
+	};
+
+	const char* const spamwords[] = {
+		"cheap", "free", "casino", "crypto", "pills", "offer", "winner", "bonus",
+		"prize", "download", "click", "join", "discount", "investment", "giveaway"
+	};
+
+	const size_t wordcount = sizeof(words) / sizeof(*words);
+	const size_t spamcount = sizeof(spamwords) / sizeof(*spamwords);
+
+	std::string Number(unsigned int value)
+	{
+		char buffer[16];
+		snprintf(buffer, sizeof(buffer), "%u", value);
+		return buffer;
+	}
+
+	std::string SpamWord()
+	{
+		return spamwords[rand() % spamcount] + Number(rand() % 200);
+	}
+
+	/** Generates a filter in one of the shapes commonly found in filter lists. */
+	std::string RandomFilter()
+	{
+		switch (rand() % 6)
+		{
+			case 0:
+				return "*" + SpamWord() + "*";
+			case 1:
+				return "*" + SpamWord() + " " + SpamWord() + "*";
+			case 2:
+				return "*http*://*" + SpamWord() + ".example/*";
+			case 3:
+				return SpamWord() + " *";
+			case 4:
+				return "*" + SpamWord() + "??" + Number(rand() % 10) + "*";
+			default:
+				return "*" + std::string(words[rand() % wordcount]) + "*" + SpamWord() + "*";
+		}
+	}
+
+	/** Generates a message which occasionally contains something that looks like spam. */
+	std::string RandomMessage()
+	{
+		std::string message;
+		const unsigned int length = 3 + rand() % 20;
+		for (unsigned int i = 0; i < length; ++i)
+		{
+			if (i)
+				message.push_back(' ');
+
+			if (rand() % 40 == 0)
+				message.append(SpamWord());
+			else
+				message.append(words[rand() % wordcount]);
+		}
+
+		if (rand() % 20 == 0)
+			message.append(" http://" + SpamWord() + ".example/landing");
+
+		message[0] = toupper(message[0]);
+		return message;
+	}
+
+#ifdef INSP_BENCHMARK_RE2
+	/** Converts a glob into an equivalent case insensitive regex. */
+	std::string GlobToRegex(const std::string& glob)
+	{
+		std::string regex = "(?is)";
+		for (std::string::const_iterator c = glob.begin(); c != glob.end(); ++c)
+		{
+			if (*c == '*')
+				regex.append(".*");
+			else if (*c == '?')
+				regex.push_back('.');
+			else
+				regex.append(RE2::QuoteMeta(std::string(1, *c)));
+		}
+		return regex;
+	}
+
+	struct AtomVisitor
+	{
+		std::vector<int>& found;
+		AtomVisitor(std::vector<int>& Found) : found(Found) { }
+		void operator()(size_t atom) { found.push_back(atom); }
+	};
+#endif
+
+	double Elapsed(clock_t start)
+	{
+		return static_cast<double>(clock() - start) / CLOCKS_PER_SEC;
+	}
+
+	void Report(const char* name, double seconds, size_t messages, unsigned long matches)
+	{
+		printf("%-14s %.3fs (%.2f us/message), %lu matches\n", name, seconds, seconds * 1e6 / messages, matches);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const unsigned int filtercount = argc > 1 ? atoi(argv[1]) : 3000;
+	const unsigned int messagecount = argc > 2 ? atoi(argv[2]) : 20000;
+	srand(42);
+
+	for (unsigned int chr = 0; chr < 256; ++chr)
+		ascii_map[chr] = tolower(chr);
+
+	std::vector<std::string> filters;
+	for (unsigned int i = 0; i < filtercount; ++i)
+		filters.push_back(RandomFilter());
+
+	std::vector<std::string> messages;
+	for (unsigned int i = 0; i < messagecount; ++i)
+		messages.push_back(RandomMessage());
+
+	printf("%u filters, %u messages\n", filtercount, messagecount);
+
+	std::vector<std::vector<size_t> > expected(messages.size());
+	unsigned long referencematches = 0;
+	clock_t start = clock();
+	for (size_t message = 0; message < messages.size(); ++message)
+	{
+		const unsigned char* str = reinterpret_cast<const unsigned char*>(messages[message].c_str());
+		for (size_t filter = 0; filter < filters.size(); ++filter)
+		{
+			if (insp::wildcard_mask::match_reference(str, reinterpret_cast<const unsigned char*>(filters[filter].c_str()), ascii_map))
+			{
+				expected[message].push_back(filter);
+				referencematches++;
+			}
+		}
+	}
+	Report("reference:", Elapsed(start), messages.size(), referencematches);
+
+	start = clock();
+	insp::wildcard_set set;
+	set.compile(filters, ascii_map);
+	const double compiletime = Elapsed(start);
+
+	std::vector<size_t> matches;
+	unsigned long setmatches = 0;
+	start = clock();
+	for (size_t message = 0; message < messages.size(); ++message)
+	{
+		matches.clear();
+		set.match(messages[message], matches);
+		setmatches += matches.size();
+		if (matches != expected[message])
+		{
+			fprintf(stderr, "Mismatch on \"%s\"\n", messages[message].c_str());
+			return 1;
+		}
+	}
+	Report("glob set:", Elapsed(start), messages.size(), setmatches);
+	printf("glob set compiled in %.3fms\n", compiletime * 1e3);
+
+#ifdef INSP_BENCHMARK_RE2
+	std::vector<RE2*> regexes;
+	RE2::Set regexset(RE2::Quiet, RE2::ANCHOR_BOTH);
+	re2::FilteredRE2 filtered(3);
+	for (std::vector<std::string>::const_iterator filter = filters.begin(); filter != filters.end(); ++filter)
+	{
+		const std::string regex = GlobToRegex(*filter);
+		regexes.push_back(new RE2(regex, RE2::Quiet));
+		regexset.Add(regex, NULL);
+
+		int id;
+		filtered.Add(regex, RE2::Quiet, &id);
+	}
+
+	unsigned long regexmatches = 0;
+	start = clock();
+	for (size_t message = 0; message < messages.size(); ++message)
+	{
+		for (size_t filter = 0; filter < regexes.size(); ++filter)
+		{
+			if (RE2::FullMatch(messages[message], *regexes[filter]))
+				regexmatches++;
+		}
+	}
+	Report("re2:", Elapsed(start), messages.size(), regexmatches);
+
+	start = clock();
+	if (!regexset.Compile())
+	{
+		fprintf(stderr, "Unable to compile the RE2 set\n");
+		return 1;
+	}
+	const double regexsetcompiletime = Elapsed(start);
+
+	std::vector<int> found;
+	unsigned long regexsetmatches = 0;
+	start = clock();
+	for (size_t message = 0; message < messages.size(); ++message)
+	{
+		found.clear();
+		regexset.Match(messages[message], &found);
+		regexsetmatches += found.size();
+	}
+	Report("re2 set:", Elapsed(start), messages.size(), regexsetmatches);
+	printf("re2 set compiled in %.3fms\n", regexsetcompiletime * 1e3);
+
+	start = clock();
+	std::vector<std::string> atomlist;
+	filtered.Compile(&atomlist);
+	insp::literal_set atoms;
+	atoms.compile(atomlist, ascii_map);
+	const double filteredcompiletime = Elapsed(start);
+
+	std::vector<int> potentials;
+	unsigned long filteredmatches = 0;
+	start = clock();
+	for (size_t message = 0; message < messages.size(); ++message)
+	{
+		found.clear();
+		AtomVisitor visitor(found);
+		atoms.find(messages[message].data(), messages[message].length(), visitor);
+		std::sort(found.begin(), found.end());
+		found.erase(std::unique(found.begin(), found.end()), found.end());
+
+		potentials.clear();
+		filtered.AllPotentials(found, &potentials);
+		for (std::vector<int>::const_iterator potential = potentials.begin(); potential != potentials.end(); ++potential)
+		{
+			if (RE2::FullMatch(messages[message], filtered.GetRE2(*potential)))
+				filteredmatches++;
+		}
+	}
+	Report("re2 filtered:", Elapsed(start), messages.size(), filteredmatches);
+	printf("re2 filtered compiled in %.3fms\n", filteredcompiletime * 1e3);
+
+	for (std::vector<RE2*>::iterator regex = regexes.begin(); regex != regexes.end(); ++regex)
+		delete *regex;
+
+	if (regexmatches != referencematches || regexsetmatches != referencematches || filteredmatches != referencematches)
+	{
+		fprintf(stderr, "The matchers disagree!\n");
+		return 1;
+	}
+#endif
+
+	return 0;
+}
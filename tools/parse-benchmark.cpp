@@ -0,0 +1,277 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/* Compares splitting client lines by copying them into a tokenstream and looking
+ * the command up in a case insensitive map with splitting them in place with a
+ * line_tokenizer into reused storage and looking the command up in a
+ * perfect_hash_map, and checks that they always agree. Build it from the main
+ * source directory with:
+ *
+ *   c++ -O2 -Iinclude -o parse-benchmark tools/parse-benchmark.cpp
+ *
+ * If a file is given it is read as captured client traffic with one line per
+ * message; otherwise a corpus of typical client lines is generated.
+ */
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <map>
+
+#include "linetokenizer.h"
+#include "perfecthash.h"
+
+namespace
+{
+	const char* const commands[] = {
+		"ADMIN", "AWAY", "CAP", "COMMANDS", "CONNECT", "DIE", "ELINE", "GLINE",
+		"INFO", "INVITE", "ISON", "JOIN", "KICK", "KILL", "KLINE", "LINKS", "LIST",
+		"LOADMODULE", "LUSERS", "MAP", "MODE", "MODULES", "MOTD", "NAMES", "NICK",
+		"NOTICE", "OPER", "PART", "PASS", "PING", "PONG", "PRIVMSG", "QLINE", "QUIT",
+		"REHASH", "RESTART", "SERVLIST", "SQUERY", "SQUIT", "STATS", "TIME", "TOPIC",
+		"UNLOADMODULE", "USER", "USERHOST", "VERSION", "WALLOPS", "WHO", "WHOIS",
+		"WHOWAS", "ZLINE", "ACCEPT", "CHGHOST", "CYCLE", "KNOCK", "MONITOR",
+		"SAJOIN", "SAMODE", "SANICK", "SAPART", "SETNAME", "SILENCE", "TAGMSG", "WATCH"
+	};
+
+	const char* const words[] = {
+		"the", "a", "channel", "server", "hello", "anyone", "know", "how", "to", "fix",
+		"this", "error", "when", "compiling", "module", "config", "thanks", "please"
+	};
+
+	const size_t commandcount = sizeof(commands) / sizeof(*commands);
+	const size_t wordcount = sizeof(words) / sizeof(*words);
+
+	/** Compares strings in the same way as irc::insensitive_swo. */
+	struct InsensitiveLess
+	{
+		bool operator()(const std::string& lhs, const std::string& rhs) const
+		{
+			const size_t length = std::min(lhs.length(), rhs.length());
+			for (size_t i = 0; i < length; ++i)
+			{
+				const int diff = toupper(static_cast<unsigned char>(lhs[i])) - toupper(static_cast<unsigned char>(rhs[i]));
+				if (diff)
+					return diff < 0;
+			}
+			return lhs.length() < rhs.length();
+		}
+	};
+
+	struct Parsed
+	{
+		std::string cmd;
+		std::vector<std::string> params;
+		size_t handler;
+	};
+
+	/** Generates a line in one of the shapes most commonly sent by clients. */
+	std::string RandomLine()
+	{
+		std::string channel = "#";
+		channel.append(words[rand() % wordcount]);
+
+		std::string text;
+		const unsigned int length = 1 + rand() % 15;
+		for (unsigned int i = 0; i < length; ++i)
+		{
+			if (i)
+				text.push_back(' ');
+			text.append(words[rand() % wordcount]);
+		}
+
+		switch (rand() % 10)
+		{
+			case 0:
+				return "PING :irc.example.com";
+			case 1:
+				return "MODE " + channel + " +b";
+			case 2:
+				return "@+typing=active TAGMSG " + channel;
+			case 3:
+				return std::string(commands[rand() % commandcount]) + " " + channel + " " + words[rand() % wordcount];
+			case 4:
+				return "notice " + channel + " :" + text;
+			default:
+				return "PRIVMSG " + channel + " :" + text;
+		}
+	}
+
+	/** Splits a line by copying it in the same way as irc::tokenstream. */
+	void ReferenceParse(const std::string& line, Parsed& out)
+	{
+		const std::string message(line);
+		size_t position = 0;
+		std::vector<std::string> tokens;
+		while (position < message.length())
+		{
+			if (!tokens.empty() && message[position] == ':')
+			{
+				tokens.push_back(message.substr(position + 1));
+				break;
+			}
+
+			const size_t separator = message.find(' ', position);
+			if (separator == std::string::npos)
+			{
+				tokens.push_back(message.substr(position));
+				break;
+			}
+
+			tokens.push_back(message.substr(position, separator - position));
+			position = message.find_first_not_of(' ', separator);
+		}
+
+		size_t first = 0;
+		if (first < tokens.size() && tokens[first][0] == '@')
+			first++;
+		out.cmd = first < tokens.size() ? tokens[first] : std::string();
+		out.params.assign(tokens.begin() + std::min(first + 1, tokens.size()), tokens.end());
+	}
+
+	/** Splits a line in place into storage which is reused between lines. */
+	void FastParse(const std::string& line, Parsed& out)
+	{
+		insp::line_tokenizer tokens(line.data(), line.length());
+		const char* token;
+		size_t length;
+
+		out.cmd.clear();
+		if (!tokens.get_middle(token, length))
+		{
+			out.params.clear();
+			return;
+		}
+
+		if (token[0] == '@' && !tokens.get_middle(token, length))
+		{
+			out.params.clear();
+			return;
+		}
+
+		out.cmd.assign(token, length);
+
+		size_t count = 0;
+		while (tokens.get_trailing(token, length))
+		{
+			if (count < out.params.size())
+				out.params[count].assign(token, length);
+			else
+				out.params.push_back(std::string(token, length));
+			count++;
+		}
+		out.params.erase(out.params.begin() + count, out.params.end());
+	}
+
+	double Elapsed(clock_t start)
+	{
+		return static_cast<double>(clock() - start) / CLOCKS_PER_SEC;
+	}
+
+	void Report(const char* name, double seconds, size_t lines, unsigned long found)
+	{
+		printf("%-10s %.3fs (%.3f us/line), %lu handlers found\n", name, seconds, seconds * 1e6 / lines, found);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	srand(42);
+
+	std::vector<std::string> lines;
+	if (argc > 1)
+	{
+		std::ifstream stream(argv[1]);
+		if (!stream)
+		{
+			fprintf(stderr, "Unable to open %s\n", argv[1]);
+			return 1;
+		}
+
+		std::string line;
+		while (std::getline(stream, line))
+		{
+			if (!line.empty() && line[line.length() - 1] == '\r')
+				line.erase(line.length() - 1);
+			if (line.find_first_not_of(' ') != std::string::npos)
+				lines.push_back(line.substr(line.find_first_not_of(' ')));
+		}
+	}
+	else
+	{
+		for (unsigned int i = 0; i < 200000; ++i)
+			lines.push_back(RandomLine());
+	}
+
+	std::map<std::string, size_t, InsensitiveLess> cmdlist;
+	std::vector<std::pair<std::string, size_t> > fastitems;
+	for (size_t i = 0; i < commandcount; ++i)
+	{
+		cmdlist[commands[i]] = i + 1;
+		fastitems.push_back(std::make_pair(commands[i], i + 1));
+	}
+
+	clock_t start = clock();
+	insp::perfect_hash_map<size_t> fastcmdlist;
+	fastcmdlist.build(fastitems);
+	const double buildtime = Elapsed(start);
+
+	printf("%lu lines, %lu commands\n", static_cast<unsigned long>(lines.size()), static_cast<unsigned long>(commandcount));
+
+	std::vector<Parsed> expected(lines.size());
+	unsigned long referencefound = 0;
+	start = clock();
+	for (size_t i = 0; i < lines.size(); ++i)
+	{
+		Parsed& out = expected[i];
+		ReferenceParse(lines[i], out);
+		std::map<std::string, size_t, InsensitiveLess>::const_iterator handler = cmdlist.find(out.cmd);
+		out.handler = handler != cmdlist.end() ? handler->second : 0;
+		if (out.handler)
+			referencefound++;
+	}
+	Report("copying:", Elapsed(start), lines.size(), referencefound);
+
+	Parsed out;
+	unsigned long fastfound = 0;
+	start = clock();
+	for (size_t i = 0; i < lines.size(); ++i)
+	{
+		FastParse(lines[i], out);
+		for (std::string::iterator c = out.cmd.begin(); c != out.cmd.end(); ++c)
+			*c = toupper(static_cast<unsigned char>(*c));
+
+		const size_t* handler = fastcmdlist.find(out.cmd);
+		out.handler = handler ? *handler : 0;
+		if (out.handler)
+			fastfound++;
+
+		const Parsed& reference = expected[i];
+		if (out.params != reference.params || out.handler != reference.handler)
+		{
+			fprintf(stderr, "Mismatch on \"%s\"\n", lines[i].c_str());
+			return 1;
+		}
+	}
+	Report("in place:", Elapsed(start), lines.size(), fastfound);
+	printf("perfect hash built in %.3fms\n", buildtime * 1e3);
+
+	return 0;
+}
@@ -0,0 +1,208 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Compares the scalar reference wildcard matcher with compiled wildcard masks
+ * on a generated ban list and checks that they always agree. Build it from the
+ * main source directory with:
+ *
+ *   c++ -O2 -Iinclude -o wildcard-benchmark tools/wildcard-benchmark.cpp
+ *
+ * Add -mavx2 (or -march=native) to benchmark the AVX2 kernel.
+ */
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include "wildcard.h"
+
+namespace
+{
+	unsigned char rfc_map[256];
+
+	const char* const words[] = {
+		"alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+		"india", "juliett", "kilo", "lima", "mike", "november", "oscar", "papa"
+	};
+
+	const char* const domains[] = {
+		"example.com", "example.net", "users.irc.example.org", "dynamic.isp.example",
+		"cloud.provider.example", "res.broadband.example.co.uk"
+	};
+
+	const size_t wordcount = sizeof(words) / sizeof(*words);
+	const size_t domaincount = sizeof(domains) / sizeof(*domains);
+
+	std::string Number(unsigned int value)
+	{
+		char buffer[16];
+		snprintf(buffer, sizeof(buffer), "%u", value);
+		return buffer;
+	}
+
+	std::string RandomWord()
+	{
+		return words[rand() % wordcount];
+	}
+
+	std::string RandomIP()
+	{
+		return Number(rand() % 256) + "." + Number(rand() % 256) + "." + Number(rand() % 256) + "." + Number(rand() % 256);
+	}
+
+	std::string RandomHost()
+	{
+		if (rand() % 3 == 0)
+			return RandomIP();
+
+		return RandomWord() + "-" + Number(rand() % 10000) + "." + domains[rand() % domaincount];
+	}
+
+	/** Generates a nick!user@host string like the ones matched against bans. */
+	std::string RandomUser()
+	{
+		std::string nick = RandomWord();
+		nick[0] = toupper(nick[0]);
+		return nick + Number(rand() % 100) + "!~" + RandomWord() + "@" + RandomHost();
+	}
+
+	/** Generates a mask in one of the shapes commonly found in ban lists. */
+	std::string RandomBan()
+	{
+		switch (rand() % 6)
+		{
+			case 0:
+				return "*!*@*." + std::string(domains[rand() % domaincount]);
+			case 1:
+				return RandomWord() + "*!*@*";
+			case 2:
+				return "*!~" + RandomWord() + "@*";
+			case 3:
+				return "*!*@" + Number(rand() % 256) + "." + Number(rand() % 256) + ".*";
+			case 4:
+				return "*!*@" + RandomWord() + "-????." + domains[rand() % domaincount];
+			default:
+				return "*" + RandomWord().substr(1, 3) + "*!*" + RandomWord().substr(0, 2) + "*@*";
+		}
+	}
+
+	/** Generates a short random string from a small alphabet for differential testing. */
+	std::string RandomString(const char* alphabet, size_t maxlength)
+	{
+		std::string str;
+		const size_t length = rand() % (maxlength + 1);
+		const size_t alphabetlength = strlen(alphabet);
+		for (size_t i = 0; i < length; ++i)
+			str.push_back(alphabet[rand() % alphabetlength]);
+		return str;
+	}
+
+	double Elapsed(clock_t start)
+	{
+		return static_cast<double>(clock() - start) / CLOCKS_PER_SEC;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const unsigned int rounds = argc > 1 ? atoi(argv[1]) : 20;
+	srand(42);
+
+	for (unsigned int chr = 0; chr < 256; ++chr)
+		rfc_map[chr] = chr;
+	for (unsigned int chr = 'A'; chr <= '^'; ++chr)
+		rfc_map[chr] = chr + 32;
+
+	// Check that the compiled masks agree with the reference matcher on random input
+	// which is much more likely to hit edge cases than the benchmark data.
+	for (unsigned int i = 0; i < 500000; ++i)
+	{
+		const std::string mask = RandomString("aAb?*[{", 8);
+		const std::string str = RandomString("aAbB[{", 12 + (i % 3) * 20);
+		const insp::wildcard_mask compiled(mask, rfc_map);
+		const bool expected = insp::wildcard_mask::match_reference((const unsigned char*)str.c_str(), (const unsigned char*)mask.c_str(), rfc_map);
+		if (compiled.match(str) != expected)
+		{
+			fprintf(stderr, "Mismatch: \"%s\" against \"%s\" should be %s\n", str.c_str(), mask.c_str(), expected ? "true" : "false");
+			return 1;
+		}
+	}
+
+	std::vector<std::string> bans;
+	for (unsigned int i = 0; i < 500; ++i)
+		bans.push_back(RandomBan());
+
+	std::vector<std::string> users;
+	for (unsigned int i = 0; i < 2000; ++i)
+		users.push_back(RandomUser());
+
+	std::vector<insp::wildcard_mask> compiled;
+	clock_t start = clock();
+	for (std::vector<std::string>::const_iterator i = bans.begin(); i != bans.end(); ++i)
+		compiled.push_back(insp::wildcard_mask(*i, rfc_map));
+	const double compiletime = Elapsed(start);
+
+	unsigned long referencematches = 0;
+	start = clock();
+	for (unsigned int round = 0; round < rounds; ++round)
+	{
+		for (std::vector<std::string>::const_iterator user = users.begin(); user != users.end(); ++user)
+		{
+			for (std::vector<std::string>::const_iterator ban = bans.begin(); ban != bans.end(); ++ban)
+			{
+				if (insp::wildcard_mask::match_reference((const unsigned char*)user->c_str(), (const unsigned char*)ban->c_str(), rfc_map))
+					referencematches++;
+			}
+		}
+	}
+	const double referencetime = Elapsed(start);
+
+	unsigned long compiledmatches = 0;
+	start = clock();
+	for (unsigned int round = 0; round < rounds; ++round)
+	{
+		for (std::vector<std::string>::const_iterator user = users.begin(); user != users.end(); ++user)
+		{
+			for (std::vector<insp::wildcard_mask>::const_iterator ban = compiled.begin(); ban != compiled.end(); ++ban)
+			{
+				if (ban->match(*user))
+					compiledmatches++;
+			}
+		}
+	}
+	const double compiledtime = Elapsed(start);
+
+	const char* kernel = "scalar";
+#if defined INSP_WILDCARD_AVX2
+	kernel = "AVX2";
+#elif defined INSP_WILDCARD_SSE2
+	kernel = "SSE2";
+#endif
+
+	const double comparisons = static_cast<double>(rounds) * users.size() * bans.size();
+	printf("%lu bans, %lu users, %u rounds, %s kernel\n", (unsigned long)bans.size(), (unsigned long)users.size(), rounds, kernel);
+	printf("reference: %.3fs (%.1f ns/match), %lu matches\n", referencetime, referencetime * 1e9 / comparisons, referencematches);
+	printf("compiled:  %.3fs (%.1f ns/match), %lu matches, %.3fms to compile\n", compiledtime, compiledtime * 1e9 / comparisons, compiledmatches, compiletime * 1e3);
+
+	if (referencematches != compiledmatches)
+	{
+		fprintf(stderr, "The matchers disagree!\n");
+		return 1;
+	}
+	return 0;
+}